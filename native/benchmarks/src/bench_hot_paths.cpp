@@ -0,0 +1,250 @@
+// Microbenchmarks of the functions that dominate the profiles of the SDK, see harness.hpp for what is measured.
+//
+//  track:        Mixpanel::track() with 0, 10 and 50 properties, with and without 10 super properties. The network is
+//                unreachable, so the worker only persists the events, and the oldest ones are dropped once the queue is full.
+//  merge:        the merge() of the properties of an event, the super properties and the automatic properties
+//  persistence:  Persistence::enqueue(), dequeue() and drop_front() of single events, at a backlog of 1 KB, 100 KB and 5 MB
+//  json:         Json::FastWriter and Json::Reader on a batch of 50 events
+//  base64:       base64_encode() of that batch
+//  form:         the application/x-www-form-urlencoded body of a nanowww::Request with the encoded batch
+//
+// usage: bench_hot_paths [--filter TEXT] [--samples N] [--storage DIRECTORY] [--json]
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/base64.hpp>
+#include <mixpanel/detail/merge.hpp>
+#include <mixpanel/detail/persistence.hpp>
+#include "../../source/dependencies/nano/include/nanowww/nanowww.h"
+
+#include "harness.hpp"
+
+using namespace mixpanel;
+
+namespace
+{
+    Value make_properties(unsigned count, const std::string& prefix)
+    {
+        Value properties(detail::Json::objectValue);
+        for (unsigned i = 0; i != count; ++i)
+        {
+            properties[prefix + std::to_string(i)] = (i % 2) ? Value("value " + std::to_string(i)) : Value(i * 7);
+        }
+        return properties;
+    }
+
+    // an event the way track() stores it, with the automatic properties of a desktop
+    Value make_event(unsigned i)
+    {
+        Value event;
+        event["event"] = "level_complete";
+        auto& properties = event["properties"];
+        properties = make_properties(10, "property_");
+        properties["token"] = "c530a1e90cfe01783793dab2bf1580b5";
+        properties["distinct_id"] = "4d1b9c3e-2a7f-4a1e-9f0e-6d0c3b1a2f5e";
+        properties["time"] = 1500000000 + i;
+        properties["mp_lib"] = "unity";
+        properties["$lib_version"] = "v1.3.1";
+        properties["$os"] = "Linux";
+        properties["$wifi"] = true;
+        return event;
+    }
+
+    Value make_batch()
+    {
+        Value batch(detail::Json::arrayValue);
+        for (unsigned i = 0; i != 50; ++i)
+        {
+            batch.append(make_event(i));
+        }
+        return batch;
+    }
+
+    void bench_track(harness::Runner& runner, const std::string& storage_directory)
+    {
+        Mixpanel mp("bench_hot_paths", std::string("bench_user"), storage_directory);
+        mp.set_minimum_log_level(Mixpanel::LogEntry::LL_ERROR);
+        mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+        mp.set_overflow_policy("track", Mixpanel::OverflowPolicy::DropOldest);
+
+        auto super_properties = make_properties(10, "super_");
+        mp.register_properties(super_properties);
+        for (auto with_super_properties : {true, false})
+        {
+            if (!with_super_properties)
+            {
+                Value names(detail::Json::arrayValue);
+                for (const auto& name : super_properties.getMemberNames()) names.append(name);
+                mp.unregister_properties(names);
+            }
+
+            for (auto count : {0u, 10u, 50u})
+            {
+                auto properties = make_properties(count, "property_");
+                runner.run("track/" + std::to_string(count) + " properties" + (with_super_properties ? " +super" : ""), [&](std::uint64_t iterations) {
+                    for (std::uint64_t i = 0; i != iterations; ++i)
+                    {
+                        mp.track("level_complete", properties);
+                    }
+                });
+            }
+        }
+    }
+
+    void bench_merge(harness::Runner& runner)
+    {
+        auto properties = make_properties(10, "property_");
+        auto super_properties = make_properties(10, "super_");
+        auto automatic_properties = make_event(0)["properties"];
+
+        runner.run("merge/event properties", [&](std::uint64_t iterations) {
+            for (std::uint64_t i = 0; i != iterations; ++i)
+            {
+                Value data(detail::Json::objectValue);
+                detail::merge(data, properties, true);
+                detail::merge(data, super_properties, false);
+                detail::merge(data, automatic_properties, false);
+                harness::do_not_optimize(data);
+            }
+        });
+    }
+
+    void bench_serialization(harness::Runner& runner)
+    {
+        auto batch = make_batch();
+        detail::Json::FastWriter writer;
+        auto json = writer.write(batch);
+        auto encoded = detail::base64_encode(json);
+
+        runner.run("json/FastWriter batch of 50", [&](std::uint64_t iterations) {
+            for (std::uint64_t i = 0; i != iterations; ++i)
+            {
+                harness::do_not_optimize(writer.write(batch));
+            }
+        });
+
+        runner.run("json/Reader batch of 50", [&](std::uint64_t iterations) {
+            detail::Json::Reader reader;
+            for (std::uint64_t i = 0; i != iterations; ++i)
+            {
+                Value parsed;
+                reader.parse(json, parsed, false);
+                harness::do_not_optimize(parsed);
+            }
+        });
+
+        runner.run("base64/batch of 50", [&](std::uint64_t iterations) {
+            for (std::uint64_t i = 0; i != iterations; ++i)
+            {
+                harness::do_not_optimize(detail::base64_encode(json));
+            }
+        });
+
+        runner.run("form/Request batch of 50", [&](std::uint64_t iterations) {
+            for (std::uint64_t i = 0; i != iterations; ++i)
+            {
+                std::map<std::string, std::string> post;
+                post["data"] = encoded;
+                nanowww::Request request("POST", "https://api.mixpanel.com/track/?ip=1", post);
+                harness::do_not_optimize(request);
+            }
+        });
+    }
+}
+
+// a friend of Persistence, for its queue functions
+class PersistenceBenchmark
+{
+    public:
+        static void run(harness::Runner& runner, const std::string& storage_directory)
+        {
+            detail::Persistence persistence(storage_directory);
+            auto event = make_event(0);
+
+            const std::pair<const char*, std::size_t> backlogs[] = {{"1 KB", 1024}, {"100 KB", 100 * 1024}, {"5 MB", 5 * 1024 * 1024}};
+            for (const auto& backlog : backlogs)
+            {
+                const std::string name = "bench_hot_paths";
+                persistence.drop_front(name, persistence.get_queue_count(name));
+                while (persistence.get_queue_size(name) < backlog.second)
+                {
+                    persistence.enqueue(name, event);
+                }
+                auto count = persistence.get_queue_count(name);
+                auto suffix = std::string(" at ") + backlog.first;
+
+                runner.run("persistence/enqueue" + suffix, [&](std::uint64_t iterations) {
+                    for (std::uint64_t i = 0; i != iterations; ++i)
+                    {
+                        persistence.enqueue(name, event);
+                    }
+                }, [&](std::uint64_t iterations) {
+                    persistence.drop_front(name, iterations);
+                });
+
+                runner.run("persistence/dequeue 50" + suffix, [&](std::uint64_t iterations) {
+                    for (std::uint64_t i = 0; i != iterations; ++i)
+                    {
+                        harness::do_not_optimize(persistence.dequeue(name, 50));
+                    }
+                });
+
+                runner.run("persistence/drop_front" + suffix, [&](std::uint64_t iterations) {
+                    for (std::uint64_t i = 0; i != iterations; ++i)
+                    {
+                        persistence.drop_front(name, 1);
+                    }
+                }, [&](std::uint64_t iterations) {
+                    for (std::uint64_t i = 0; i != iterations; ++i)
+                    {
+                        persistence.enqueue(name, event);
+                    }
+                }, count);
+
+                persistence.drop_front(name, persistence.get_queue_count(name));
+            }
+        }
+};
+
+int main(int argc, char* argv[])
+{
+    harness::Runner runner;
+    std::string storage_directory = ".";
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        if (option == "--json")
+        {
+            runner.json = true;
+        }
+        else if (option == "--filter" && i + 1 < argc)
+        {
+            runner.filter = argv[++i];
+        }
+        else if (option == "--samples" && i + 1 < argc)
+        {
+            runner.samples = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        }
+        else if (option == "--storage" && i + 1 < argc)
+        {
+            storage_directory = argv[++i];
+        }
+        else
+        {
+            std::cerr << "usage: bench_hot_paths [--filter TEXT] [--samples N] [--storage DIRECTORY] [--json]" << std::endl;
+            return 1;
+        }
+    }
+
+    bench_track(runner, storage_directory);
+    bench_merge(runner);
+    PersistenceBenchmark::run(runner, storage_directory);
+    bench_serialization(runner);
+    runner.finish();
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Throughput of the persistence layer for every available io engine.
+//
+//  append:   records/s written to the queue log in batches
+//  drain:    records/s read and dropped from the front in batches of 50, like the worker does
+//  pipeline: simulates the worker loop. Every iteration appends the events that came in while the
+//            last batch was sent, reads the next batch and "sends" it (sleeps for the network latency).
+//            With an asynchronous engine the disk writes overlap with the sleep.
+//
+// Note that the io_uring engine syncs every append to stable storage, the portable engine does not.
+//
+// usage: bench_persistence [directory] [records] [network latency in ms]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mixpanel/detail/io_engine.hpp>
+#include <mixpanel/detail/queue_log.hpp>
+
+using namespace mixpanel::detail;
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::string make_record(int i)
+{
+    // roughly the size of a typical track() call with a couple of automatic properties
+    std::string record = "{\"event\":\"level_complete\",\"properties\":{\"distinct_id\":\"4d1b9c3e-2a7f-4a1e-9f0e-6d0c3b1a2f5e\",";
+    record += "\"token\":\"c530a1e90cfe01783793dab2bf1580b5\",\"time\":1500000000,\"$os\":\"Linux\",\"$lib_version\":\"v1.3.1\",";
+    record += "\"level\":" + std::to_string(i) + ",\"score\":" + std::to_string(i * 7 % 1000) + "}}\n";
+    return record;
+}
+
+static void report(const char* engine, const char* what, std::size_t records, std::size_t bytes, double seconds)
+{
+    std::cout << std::left << std::setw(10) << engine << std::setw(10) << what
+              << std::right << std::setw(12) << std::fixed << std::setprecision(0) << records / seconds << " records/s"
+              << std::setw(10) << std::setprecision(1) << bytes / seconds / (1024 * 1024) << " MB/s"
+              << std::setw(10) << std::setprecision(3) << seconds << " s" << std::endl;
+}
+
+static void run(IOEngine& io, const std::string& directory, int count, int latency_ms)
+{
+    const int batch = 50;
+
+    QueueLog(io, directory, "bench").clear();
+    QueueLog queue(io, directory, "bench");
+
+    std::size_t bytes = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < count; i += batch)
+    {
+        std::string data;
+        for (int j = i; j != i + batch; ++j) data += make_record(j);
+        queue.append(data, batch);
+        bytes += data.size();
+    }
+    report(io.name(), "append", count, bytes, seconds_since(start));
+
+    start = Clock::now();
+    while (!queue.empty())
+    {
+        auto records = queue.front(batch);
+        queue.drop_front(records.size());
+    }
+    report(io.name(), "drain", count, bytes, seconds_since(start));
+
+    // a backlog of a couple of batches, and every time a batch is sent, another one comes in
+    const int iterations = std::max(1, count / batch / 20);
+    for (int i = 0; i != 4 * batch; ++i)
+    {
+        queue.append(make_record(i), 1);
+    }
+
+    start = Clock::now();
+    for (int i = 0; i != iterations; ++i)
+    {
+        std::string data;
+        for (int j = 0; j != batch; ++j) data += make_record(j);
+        queue.append(data, batch);
+
+        auto records = queue.front(batch);
+        std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+        queue.drop_front(records.size());
+    }
+    auto seconds = seconds_since(start);
+    report(io.name(), "pipeline", iterations * batch, iterations * bytes / (count / batch), seconds);
+    std::cout << std::setw(20) << "" << "disk overhead per batch: " << std::setprecision(3)
+              << (seconds / iterations * 1000.0 - latency_ms) << " ms" << std::endl;
+
+    queue.clear();
+}
+
+int main(int argc, const char* argv[])
+{
+    std::string directory = argc > 1 ? argv[1] : ".";
+    int count = argc > 2 ? std::atoi(argv[2]) : 100000;
+    int latency_ms = argc > 3 ? std::atoi(argv[3]) : 20;
+
+    std::vector<std::unique_ptr<IOEngine>> engines;
+    engines.push_back(std::unique_ptr<IOEngine>(new PortableIOEngine()));
+    #if defined(MIXPANEL_USE_IO_URING)
+    if (auto engine = create_io_uring_engine())
+    {
+        engines.push_back(std::move(engine));
+    }
+    else
+    {
+        std::cout << "io_uring is not available, only running the portable engine" << std::endl;
+    }
+    #endif
+
+    for (auto& engine : engines)
+    {
+        run(*engine, directory, count, latency_ms);
+    }
+
+    return 0;
+}
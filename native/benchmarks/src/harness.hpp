@@ -0,0 +1,219 @@
+// A small harness for microbenchmarks.
+//
+// Every benchmark is run until it has warmed up (warm_up_time), which also sizes a batch of iterations to take about
+// sample_time. It then times *samples* batches and reports the time per iteration (median, mean, minimum and the
+// relative standard deviation over the samples) and the heap allocations per iteration.
+//
+// Allocations are counted by replacing the global operator new, on the benchmarking thread only, so the threads of a
+// Mixpanel instance don't count. Include this header in a single translation unit per executable.
+
+#ifndef MIXPANEL_BENCHMARK_HARNESS_HPP
+#define MIXPANEL_BENCHMARK_HARNESS_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <mixpanel/value.hpp>
+
+namespace harness
+{
+    struct AllocationCounter
+    {
+        std::uint64_t count;
+        std::uint64_t bytes;
+    };
+
+    inline AllocationCounter& allocations()
+    {
+        static thread_local AllocationCounter counter = {0, 0};
+        return counter;
+    }
+
+    // keeps the compiler from optimizing a result away
+    template<typename T> inline void do_not_optimize(const T& value)
+    {
+        #if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+        #else
+        static volatile const T* sink;
+        sink = &value;
+        #endif
+    }
+
+    struct Result
+    {
+        std::string name;
+        std::uint64_t iterations;      // in all samples
+        double median_ns;
+        double mean_ns;
+        double min_ns;
+        double stddev_percent;          // of the mean
+        double allocations;             // per iteration
+        double allocated_bytes;         // per iteration
+    };
+
+    class Runner
+    {
+        public:
+            typedef std::chrono::steady_clock Clock;
+
+            Runner() : warm_up_time(std::chrono::milliseconds(100)), sample_time(std::chrono::milliseconds(10)), samples(20), json(false) {}
+
+            std::chrono::nanoseconds warm_up_time;
+            std::chrono::nanoseconds sample_time;
+            unsigned samples;
+            std::string filter;     // only runs the benchmarks whose name contains it
+            bool json;              // finish() prints the results as one JSON object, instead of a line per benchmark
+
+            // *body* runs the operation *iterations* times. *after_sample* runs between the samples without being timed,
+            // to undo what the samples did, e.g. to keep a queue at its size. A sample runs at most *max_batch* iterations.
+            void run(const std::string& name, std::function<void(std::uint64_t iterations)> body,
+                     std::function<void(std::uint64_t iterations)> after_sample=nullptr,
+                     std::uint64_t max_batch=std::numeric_limits<std::uint64_t>::max())
+            {
+                if (name.find(filter) == std::string::npos)
+                {
+                    return;
+                }
+
+                // warm up, doubling the batch until it takes a measurable time
+                std::uint64_t batch = 1;
+                std::chrono::nanoseconds elapsed(0);
+                auto warm_up_end = Clock::now() + warm_up_time;
+                for (;;)
+                {
+                    auto start = Clock::now();
+                    body(batch);
+                    elapsed = Clock::now() - start;
+                    if (after_sample) after_sample(batch);
+                    if (Clock::now() >= warm_up_end && (elapsed >= sample_time / 2 || batch == max_batch))
+                    {
+                        break;
+                    }
+                    if (elapsed < sample_time)
+                    {
+                        batch = std::min(batch * 2, max_batch);
+                    }
+                }
+                if (elapsed.count() != 0)
+                {
+                    batch = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(static_cast<double>(batch) * sample_time.count() / elapsed.count()));
+                    batch = std::min(batch, max_batch);
+                }
+
+                std::vector<double> times;
+                auto& counter = allocations();
+                auto allocations_before = counter;
+                for (unsigned i = 0; i != samples; ++i)
+                {
+                    auto start = Clock::now();
+                    body(batch);
+                    auto end = Clock::now();
+                    times.push_back(std::chrono::duration<double, std::nano>(end - start).count() / batch);
+                    if (after_sample)
+                    {
+                        // not counted either
+                        auto paused = counter;
+                        after_sample(batch);
+                        counter = paused;
+                    }
+                }
+
+                Result result;
+                result.name = name;
+                result.iterations = batch * samples;
+                result.allocations = static_cast<double>(counter.count - allocations_before.count) / result.iterations;
+                result.allocated_bytes = static_cast<double>(counter.bytes - allocations_before.bytes) / result.iterations;
+
+                std::sort(times.begin(), times.end());
+                result.min_ns = times.front();
+                result.median_ns = times[times.size() / 2];
+                result.mean_ns = 0;
+                for (auto time : times) result.mean_ns += time / times.size();
+                double variance = 0;
+                for (auto time : times) variance += (time - result.mean_ns) * (time - result.mean_ns) / times.size();
+                result.stddev_percent = result.mean_ns > 0 ? 100.0 * std::sqrt(variance) / result.mean_ns : 0;
+
+                results.push_back(result);
+                if (!json)
+                {
+                    print(result);
+                }
+            }
+
+            void finish()
+            {
+                if (!json)
+                {
+                    return;
+                }
+                mixpanel::Value benchmarks(mixpanel::detail::Json::objectValue);
+                for (const auto& result : results)
+                {
+                    auto& benchmark = benchmarks[result.name];
+                    benchmark["iterations"] = static_cast<mixpanel::detail::Json::UInt64>(result.iterations);
+                    benchmark["median_ns"] = result.median_ns;
+                    benchmark["mean_ns"] = result.mean_ns;
+                    benchmark["min_ns"] = result.min_ns;
+                    benchmark["stddev_percent"] = result.stddev_percent;
+                    benchmark["allocations"] = result.allocations;
+                    benchmark["allocated_bytes"] = result.allocated_bytes;
+                }
+                mixpanel::detail::Json::FastWriter writer;
+                std::cout << writer.write(benchmarks);
+            }
+
+        private:
+            static void print(const Result& result)
+            {
+                std::cout << std::left << std::setw(40) << result.name << std::right << std::fixed
+                          << std::setw(12) << std::setprecision(1) << result.median_ns << " ns"
+                          << std::setw(12) << result.mean_ns << " ns mean"
+                          << std::setw(12) << result.min_ns << " ns min"
+                          << std::setw(7) << result.stddev_percent << " %"
+                          << std::setw(9) << result.allocations << " allocs"
+                          << std::setw(11) << std::setprecision(0) << result.allocated_bytes << " bytes" << std::endl;
+            }
+
+            std::vector<Result> results;
+    };
+} // namespace harness
+
+void* operator new(std::size_t size)
+{
+    auto& counter = harness::allocations();
+    ++counter.count;
+    counter.bytes += size;
+    if (auto p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+
+#endif //MIXPANEL_BENCHMARK_HARNESS_HPP
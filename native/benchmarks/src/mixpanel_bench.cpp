@@ -0,0 +1,414 @@
+// End-to-end load generator: producer threads drive a Mixpanel instance, which sends to a stand-in for the ingestion
+// API on 127.0.0.1 (the FakeServer of the tests), to --api-host, or with --loopback to a transport that answers in the
+// process, which leaves out the network and HTTP. Measures
+//
+//  enqueue latency:  percentiles of the time a track() or people call takes on the producer thread
+//  delivered:        events the API acknowledged per second, from the first event until the last one was delivered
+//  wire bytes:       the payload of the requests, and what the stand-in received including the HTTP headers
+//  worker CPU:       CPU time of the process minus the producers and the stand-in server
+//  peak RSS:         the maximum resident set size of the process
+//  queue depth:      events produced but not delivered yet, sampled over time
+//
+// Instead of generated events, it can replay queue files (mp_track.json, mp_engage.json, or the segments
+// mp_<name>.<n>.log of newer versions): every line holds a track event or a profile update.
+//
+// usage: mixpanel_bench [--threads N] [--events N] [--rate EVENTS_PER_SECOND_PER_THREAD] [--properties N]
+//                       [--value-bytes N] [--people-ratio 0..1] [--flush-interval SECONDS] [--sample-ms N]
+//                       [--replay FILE]... [--api-host URL] [--storage DIRECTORY] [--max-queue-mb N] [--timeout SECONDS]
+//                       [--loopback] [--json]
+//
+// --json prints a single JSON object, to compare releases. Exits with 1, if not every event that was queued was
+// delivered in time. Events the full queues rejected are reported, but not waited for.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/loopback_transport.hpp>
+#include "fake_server.hpp"
+
+using namespace mixpanel;
+
+typedef std::chrono::steady_clock Clock;
+
+namespace
+{
+    struct Options
+    {
+        Options()
+        : threads(4), events(100000), rate(0), properties(10), value_bytes(16), people_ratio(0), flush_interval(1)
+        , sample_ms(250), storage_directory("."), max_queue_mb(256), timeout(120), loopback(false), json(false)
+        {
+        }
+
+        unsigned threads;
+        unsigned events;            // in total, without --replay
+        double rate;                // per thread, 0 is as fast as possible
+        unsigned properties;
+        unsigned value_bytes;
+        double people_ratio;        // the share of people.set() calls among the generated events
+        unsigned flush_interval;
+        unsigned sample_ms;
+        std::vector<std::string> replay;
+        std::string api_host;
+        std::string storage_directory;
+        unsigned max_queue_mb;
+        unsigned timeout;
+        bool loopback;
+        bool json;
+    };
+
+    bool parse_options(int argc, char* argv[], Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string option = argv[i];
+            if (option == "--json" || option == "--loopback")
+            {
+                (option == "--json" ? options.json : options.loopback) = true;
+                continue;
+            }
+            if (i + 1 == argc)
+            {
+                std::cerr << "mixpanel_bench: " << option << " needs a value" << std::endl;
+                return false;
+            }
+            std::string value = argv[++i];
+            if (option == "--threads") options.threads = std::max(1, std::atoi(value.c_str()));
+            else if (option == "--events") options.events = static_cast<unsigned>(std::atol(value.c_str()));
+            else if (option == "--rate") options.rate = std::atof(value.c_str());
+            else if (option == "--properties") options.properties = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (option == "--value-bytes") options.value_bytes = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (option == "--people-ratio") options.people_ratio = std::atof(value.c_str());
+            else if (option == "--flush-interval") options.flush_interval = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (option == "--sample-ms") options.sample_ms = std::max(1, std::atoi(value.c_str()));
+            else if (option == "--replay") options.replay.push_back(value);
+            else if (option == "--api-host") options.api_host = value;
+            else if (option == "--storage") options.storage_directory = value;
+            else if (option == "--max-queue-mb") options.max_queue_mb = static_cast<unsigned>(std::atoi(value.c_str()));
+            else if (option == "--timeout") options.timeout = static_cast<unsigned>(std::atoi(value.c_str()));
+            else
+            {
+                std::cerr << "mixpanel_bench: unknown option " << option << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::chrono::nanoseconds cpu_time(clockid_t clock)
+    {
+        timespec time = {};
+        clock_gettime(clock, &time);
+        return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+    }
+
+    long peak_rss_kb()
+    {
+        rusage usage = {};
+        getrusage(RUSAGE_SELF, &usage);
+        #ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+        #else
+        return usage.ru_maxrss;
+        #endif
+    }
+
+    // the json body of every line, without the record header of newer versions ("p1 t1500000000 {...}")
+    std::vector<std::string> read_records(const std::vector<std::string>& paths)
+    {
+        std::vector<std::string> records;
+        for (const auto& path : paths)
+        {
+            std::ifstream file(path.c_str(), std::ios::binary);
+            if (!file)
+            {
+                std::cerr << "mixpanel_bench: can't open " << path << std::endl;
+                continue;
+            }
+            std::string line;
+            while (std::getline(file, line))
+            {
+                auto start = line.find('{');
+                if (start != std::string::npos)
+                {
+                    records.push_back(line.substr(start));
+                }
+            }
+        }
+        return records;
+    }
+
+    // a profile update of a queue file, applied with the people calls of the instance
+    void replay_engage(Mixpanel& mp, const Value& update)
+    {
+        if (update.isMember("$set")) mp.people.set_properties(update["$set"]);
+        if (update.isMember("$set_once")) mp.people.set_once_properties(update["$set_once"]);
+        if (update.isMember("$add")) mp.people.increment_properties(update["$add"]);
+        if (update.isMember("$append")) mp.people.append_properties(update["$append"]);
+        if (update.isMember("$union")) mp.people.union_properties(update["$union"]);
+        if (update.isMember("$unset")) mp.people.unset_properties(update["$unset"]);
+    }
+
+    struct Producer
+    {
+        Producer() : produced(0), cpu_time(0) {}
+
+        std::vector<float> latencies;   // microseconds
+        std::atomic<std::size_t> produced;
+        std::chrono::nanoseconds cpu_time;
+    };
+
+    void produce(Mixpanel& mp, const Options& options, const std::vector<std::string>& records, unsigned thread, Producer& producer)
+    {
+        Value properties;
+        for (unsigned i = 0; i != options.properties; ++i)
+        {
+            properties["property_" + std::to_string(i)] = std::string(options.value_bytes, 'a' + i % 26);
+        }
+
+        // the records or the generated events of this thread
+        std::size_t first, count;
+        auto total = records.empty() ? options.events : records.size();
+        first = total / options.threads * thread + std::min<std::size_t>(thread, total % options.threads);
+        count = total / options.threads + (thread < total % options.threads ? 1 : 0);
+        producer.latencies.reserve(count);
+
+        const auto people_every = options.people_ratio > 0 ? static_cast<std::size_t>(1 / options.people_ratio) : 0;
+        detail::Json::Reader reader;
+        auto start = Clock::now();
+        for (std::size_t i = 0; i != count; ++i)
+        {
+            if (options.rate > 0)
+            {
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(i / options.rate)));
+            }
+
+            auto before = Clock::now();
+            if (!records.empty())
+            {
+                const auto& record = records[first + i];
+                Value update;
+                if (record.find("\"event\"") != std::string::npos)
+                {
+                    mp.track_json(record);
+                }
+                else if (reader.parse(record, update, false))
+                {
+                    replay_engage(mp, update);
+                }
+            }
+            else if (people_every != 0 && i % people_every == 0)
+            {
+                mp.people.set("level", static_cast<detail::Json::UInt64>(first + i));
+            }
+            else
+            {
+                properties["sequence"] = static_cast<detail::Json::UInt64>(first + i);
+                mp.track("bench_event", properties);
+            }
+            producer.latencies.push_back(std::chrono::duration<float, std::micro>(Clock::now() - before).count());
+            ++producer.produced;
+        }
+        producer.cpu_time = cpu_time(CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    float percentile(const std::vector<float>& sorted, double p)
+    {
+        if (sorted.empty()) return 0;
+        return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        return 2;
+    }
+
+    std::unique_ptr<FakeServer> server;
+    if (options.api_host.empty() && !options.loopback)
+    {
+        server.reset(new FakeServer());
+        server->set_keep_events(false);
+        options.api_host = server->api_host();
+    }
+
+    auto records = read_records(options.replay);
+    if (!options.replay.empty() && records.empty())
+    {
+        std::cerr << "mixpanel_bench: nothing to replay" << std::endl;
+        return 2;
+    }
+
+    Mixpanel mp("mixpanel_bench", std::string("bench_user"), options.storage_directory);
+    mp.set_minimum_log_level(Mixpanel::LogEntry::LL_ERROR);
+    std::shared_ptr<detail::LoopbackTransport> loopback;
+    if (options.loopback)
+    {
+        loopback = std::make_shared<detail::LoopbackTransport>();
+        mp.set_transport(loopback);
+    }
+    else
+    {
+        mp.set_api_host(options.api_host);
+    }
+    mp.set_flush_interval(options.flush_interval);
+    mp.set_maximum_queue_size(static_cast<std::size_t>(options.max_queue_mb) * 1024 * 1024);
+
+    std::atomic<std::size_t> delivered(0);
+    std::atomic<std::size_t> payload_bytes(0);
+    std::atomic<std::size_t> failed_requests(0);
+    std::atomic<std::int64_t> last_delivery(0);
+    auto start = Clock::now();
+    mp.set_delivery_callback([&](const Mixpanel::BatchDelivery& delivery) {
+        payload_bytes += delivery.bytes;
+        if (!delivery.delivered)
+        {
+            ++failed_requests;
+            return;
+        }
+        delivered += delivery.events;
+        last_delivery = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    });
+
+    // the events produced so far, for the queue depth
+    std::atomic<bool> producing(true);
+    std::vector<Producer> producers(options.threads);
+    std::vector<std::pair<double, long>> depth;
+    std::thread sampler([&] {
+        while (producing)
+        {
+            std::size_t produced = 0;
+            for (const auto& producer : producers) produced += producer.produced;
+            auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            depth.push_back(std::make_pair(seconds, static_cast<long>(produced) - static_cast<long>(delivered.load())));
+            std::this_thread::sleep_for(std::chrono::milliseconds(options.sample_ms));
+        }
+    });
+
+    auto process_cpu_before = cpu_time(CLOCK_PROCESS_CPUTIME_ID);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i != options.threads; ++i)
+    {
+        threads.emplace_back(produce, std::ref(mp), std::cref(options), std::cref(records), i, std::ref(producers[i]));
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    auto produce_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::size_t produced = 0;
+    std::vector<float> latencies;
+    auto producer_cpu = std::chrono::nanoseconds::zero();
+    for (const auto& producer : producers)
+    {
+        produced += producer.produced;
+        latencies.insert(latencies.end(), producer.latencies.begin(), producer.latencies.end());
+        producer_cpu += producer.cpu_time;
+    }
+
+    std::size_t rejected = 0;
+    for (auto queue : {"track", "track_high", "engage"})
+    {
+        rejected += mp.get_queue_stats(queue).rejected;
+    }
+    auto queued = produced - std::min(rejected, produced);
+
+    auto deadline = Clock::now() + std::chrono::seconds(options.timeout);
+    while (delivered < queued && Clock::now() < deadline)
+    {
+        mp.flush_async(static_cast<unsigned>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count())).wait();
+        if (delivered < queued)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    producing = false;
+    sampler.join();
+
+    auto server_cpu = server ? server->get_cpu_time() : std::chrono::nanoseconds::zero();
+    auto worker_cpu = cpu_time(CLOCK_PROCESS_CPUTIME_ID) - process_cpu_before - producer_cpu - server_cpu;
+    auto delivery_seconds = std::chrono::duration<double>(std::chrono::nanoseconds(last_delivery.load())).count();
+    auto network = mp.get_network_usage();
+    std::sort(latencies.begin(), latencies.end());
+
+    Value result;
+    result["threads"] = options.threads;
+    result["produced"] = static_cast<detail::Json::UInt64>(produced);
+    result["rejected"] = static_cast<detail::Json::UInt64>(rejected);
+    result["delivered"] = static_cast<detail::Json::UInt64>(delivered.load());
+    result["failed_requests"] = static_cast<detail::Json::UInt64>(failed_requests.load());
+    result["produce_seconds"] = produce_seconds;
+    result["delivery_seconds"] = delivery_seconds;
+    result["produced_per_second"] = produce_seconds > 0 ? produced / produce_seconds : 0;
+    result["delivered_per_second"] = delivery_seconds > 0 ? delivered / delivery_seconds : 0;
+    result["enqueue_us"]["p50"] = percentile(latencies, 0.5);
+    result["enqueue_us"]["p90"] = percentile(latencies, 0.9);
+    result["enqueue_us"]["p99"] = percentile(latencies, 0.99);
+    result["enqueue_us"]["p999"] = percentile(latencies, 0.999);
+    result["enqueue_us"]["max"] = latencies.empty() ? 0 : latencies.back();
+    result["payload_bytes"] = static_cast<detail::Json::UInt64>(payload_bytes.load());
+    result["sent_bytes"] = static_cast<detail::Json::UInt64>(network.local_area_network_bytes + network.cellular_bytes);
+    if (server)
+    {
+        result["wire_bytes"] = static_cast<detail::Json::UInt64>(server->bytes_received.load());
+        result["requests"] = server->requests.load();
+    }
+    if (loopback)
+    {
+        result["requests"] = static_cast<detail::Json::UInt64>(loopback->get_request_count());
+    }
+    result["worker_cpu_seconds"] = std::chrono::duration<double>(worker_cpu).count();
+    result["producer_cpu_seconds"] = std::chrono::duration<double>(producer_cpu).count();
+    result["peak_rss_kb"] = static_cast<detail::Json::Int64>(peak_rss_kb());
+    for (const auto& sample : depth)
+    {
+        Value point(detail::Json::arrayValue);
+        point.append(sample.first);
+        point.append(static_cast<detail::Json::Int64>(sample.second));
+        result["queue_depth"].append(point);
+    }
+
+    if (options.json)
+    {
+        detail::Json::FastWriter writer;
+        std::cout << writer.write(result);
+    }
+    else
+    {
+        std::size_t max_depth = 0;
+        for (const auto& sample : depth) max_depth = std::max<std::size_t>(max_depth, std::max(0L, sample.second));
+        std::cout << std::fixed << std::setprecision(0)
+                  << produced << " events from " << options.threads << " threads in " << std::setprecision(3) << produce_seconds << " s, "
+                  << std::setprecision(0) << result["produced_per_second"].asDouble() << " events/s, " << rejected << " rejected by full queues\n"
+                  << "enqueue latency: p50 " << std::setprecision(1) << result["enqueue_us"]["p50"].asDouble()
+                  << " us, p99 " << result["enqueue_us"]["p99"].asDouble() << " us, p99.9 " << result["enqueue_us"]["p999"].asDouble()
+                  << " us, max " << result["enqueue_us"]["max"].asDouble() << " us\n"
+                  << "delivered: " << delivered << " events in " << std::setprecision(3) << delivery_seconds << " s, "
+                  << std::setprecision(0) << result["delivered_per_second"].asDouble() << " events/s, " << failed_requests << " failed requests\n"
+                  << "bytes: " << payload_bytes << " payload" << (server ? ", " + std::to_string(server->bytes_received.load()) + " on the wire" : "") << "\n"
+                  << "worker CPU: " << std::setprecision(3) << result["worker_cpu_seconds"].asDouble() << " s, producers "
+                  << result["producer_cpu_seconds"].asDouble() << " s\n"
+                  << "peak RSS: " << peak_rss_kb() / 1024 << " MB, max queue depth " << max_depth << " events" << std::endl;
+    }
+
+    return delivered >= queued ? 0 : 1;
+}
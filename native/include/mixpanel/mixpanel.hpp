@@ -7,12 +7,16 @@
 #define _MIXPANEL_HPP_
 
 #include <string>
-#include <queue>
+#include <map>
 #include <mutex>
 #include <ctime>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <stdexcept>
 #include <memory>
+#include <future>
 #include "./value.hpp"
 #include "../../tests/gtest/include/gtest/gtest_prod.h"
 
@@ -20,26 +24,107 @@
 #    pragma warning( disable : 4290 )
 #endif
 
-class MixpanelNetwork_RetryAfter_Test;
-class MixpanelNetwork_BackOffTime_Test;
-class MixpanelNetwork_FailureRecovery_Test;
+class MixpanelNetwork_IdleWakeups_Test;
+class MixpanelNetwork_FlushAsync_Test;
+class MixpanelNetwork_CircuitBreaker_Test;
+class MixpanelNetwork_PriorityLanes_Test;
+class MixpanelNetwork_CellularBudget_Test;
+class MixpanelNetwork_FakeServer_Test;
+class GDPR;
 
 namespace mixpanel
 {
+    class Mixpanel;
     namespace detail
     {
+        class Persistence;
+    }
+}
+
+// gives the test suite access to the persistence of an instance
+std::shared_ptr<mixpanel::detail::Persistence> testsuite_get_persistence(const mixpanel::Mixpanel& mixpanel);
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        class EventStamper;
+        class Importer;
+        class Metrics;
+        class LogRing;
+        class Persistence;
+        class SenderThread;
+        class Simulation;
         class Worker;
     }
 
+    /*!
+        A background thread that sends the data of Mixpanel instances, together with its http connections.
+
+        By default every Mixpanel instance has its own. If you create several instances (e.g. for several projects), pass the
+        same SenderPool to all of them, so they share one thread and one set of connections.
+        The SenderPool object itself may be destroyed before the instances that use it.
+    */
+    class SenderPool
+    {
+        public:
+            SenderPool();
+            ~SenderPool();
+        private:
+            friend class Mixpanel;
+            std::shared_ptr<detail::SenderThread> sender_thread;
+    };
+
+    #ifndef SWIG
+    /*!
+        The HTTP client a Mixpanel instance sends its queues with, see Mixpanel::set_transport().
+
+        The built-in one sends over the kept-alive connections of the SenderPool, https through mbedTLS. Implement it to send
+        through the HTTP stack of the engine instead, e.g. to share its pooled connections and proxy settings.
+    */
+    class Transport
+    {
+        public:
+            struct Request
+            {
+                std::string url;        ///< the API host, the endpoint and the query, e.g. "https://api.mixpanel.com/track/?ip=1"
+                std::string body;       ///< the batch, as the body of an application/x-www-form-urlencoded POST
+            };
+
+            struct Response
+            {
+                Response() : status(0), retry_after(0), handshakes(0) {}
+
+                int status;             ///< the HTTP status code, 0 if the request failed before a response was received
+                std::string body;
+                int retry_after;        ///< the seconds of the Retry-After header, 0 if there was none
+                std::string error;      ///< why the request failed, if status is 0
+                unsigned handshakes;    ///< the connections the request opened, for Mixpanel::Stats. 0 if it reused one
+            };
+
+            virtual ~Transport() {}
+
+            /// POSTs the request and waits for the response. It is called on the sending thread, for several requests at a time
+            /// while the queues have a backlog (see Mixpanel::set_max_requests_in_flight()), so it has to be thread safe.
+            virtual Response send(const Request& request) = 0;
+
+            /// called when Mixpanel::shutdown() reaches its deadline: interrupt the requests in flight and fail the ones that
+            /// follow right away. Does nothing by default, shutdown() then waits for the requests in flight.
+            virtual void cancel() {}
+    };
+    #endif
+
     /*!
         This is the entry point into the SDK. Create an instance of this class somewhere and start using the tracking functions.
 
-        Only one instance of this class should be created in your application.
+        You can create several instances, e.g. one per project (token). Each instance stores its data in its own subdirectory
+        of the storage directory, so instances with the same token and storage directory must not exist at the same time.
 
         Internally it creates a background worker that takes care of the sending so the calls do not block the caller.
 
-        When the instance is destroyed, sending out the last 50 events is attempted one more time (if there are any) and the worker
-        is terminated. Only after that the destructor returns.
+        When the instance is destroyed, the events in memory are written to disk and sending the queues is attempted one more time
+        (if there are any), for 2 seconds at most. What hasn't been sent by then is sent after the next launch. Call shutdown() to
+        choose the time yourself.
 
         Creating a global (or static) instance is untested, so be careful. If you need global access consider using a unique_ptr or
         shared_ptr and reset it via std::atexit()
@@ -50,7 +135,7 @@ namespace mixpanel
             /// construct a Mixpanel instance where most parameters are determined automatically
             Mixpanel(
                 const std::string& token,              ///< the token you get from the mixpanel dashboard
-                /// note that the queue will hold at most 100 entries. So make sure to get_next_log_entry() frequently enough.
+                /// note that the queue will hold at most 256 entries. So make sure to get_next_log_entry() frequently enough.
                 const bool enable_log_queue = false,    ///< if true, don't print to std::clog, but queue the log entries for retrieval via get_next_log_entry()
                 const bool opt_out = false              ///< if true, the device should be opted out from tracking by default
             );
@@ -64,6 +149,16 @@ namespace mixpanel
                 const bool opt_out = false              ///< if true, the device should be opted out from tracking by default
             );
 
+            /// like the constructor above, but the instance sends its data on the thread of *sender_pool*
+            Mixpanel(
+                const std::string& token,              ///< the token you get from the mixpanel dashboard
+                const std::string& distinct_id,        ///< if empty, we're going to get the device id on Android, iOS and OSX and a random UUID on Windows
+                const std::string& storage_directory,  ///< a writable directory to persist the data to
+                const SenderPool& sender_pool,         ///< shared with other instances
+                const bool enable_log_queue = false,    ///< if true, don't print to std::clog, but queue the log entries for retrieval via get_next_log_entry()
+                const bool opt_out = false              ///< if true, the device should be opted out from tracking by default
+            );
+
             virtual ~Mixpanel();
 
             /// sets the distinct_id
@@ -123,6 +218,19 @@ namespace mixpanel
             /// track a named *event* with optional *properties*.
             void track(const std::string event, const Value& properties=Value());
 
+            /// track *event* for the user *distinct_id* instead of the identified one. Meant for servers that track for many users in one
+            /// process: the distinct_id of the instance is neither changed nor persisted, so this can be called from many threads at once.
+            /// Super properties and automatic properties are added like in track(), timed events are not.
+            void track_as(const std::string& distinct_id, const std::string& event, const Value& properties=Value()) throw(std::invalid_argument);
+
+            #ifndef SWIG
+            /// track an event that has already been serialized to json, e.g. by another process: {"event":"...","properties":{...}}.
+            /// token, distinct_id, time, super properties and automatic properties are added to its properties, unless it has them already.
+            /// The event is only scanned, not parsed, which makes this a lot faster than track().
+            /// returns false if *event* is not a json object with a string "event" member.
+            bool track_json(const std::string& event);
+            #endif
+
             bool has_tracked_integration();
             void set_tracked_integration();
 
@@ -188,13 +296,18 @@ namespace mixpanel
                     void set_phone(const std::string& to);
                 private:
                     friend class Mixpanel;
-                    People(class Mixpanel *mixpanel);
+                    People(class Mixpanel *mixpanel, const std::string& distinct_id="");
                     class Mixpanel *mixpanel;
+                    std::string distinct_id;    ///< empty for the identified user
             };
 
             /// accessor for profile related tracking functionality
             People people;
 
+            /// profile updates for the user *distinct_id* instead of the identified one, see track_as(). The returned object can be
+            /// used as long as this instance exists.
+            People people_as(const std::string& distinct_id) throw(std::invalid_argument);
+
             struct LogEntry
             {
                 enum Level
@@ -212,6 +325,7 @@ namespace mixpanel
             };
 
             /// sets the minimum log level you're interested in (inclusive). The default is LL_WARNING. To completely silence logs pass LL_NONE
+            /// The LL_TRACE and LL_DEBUG messages are only compiled into DEBUG builds, unless MIXPANEL_LOG_COMPILED_LEVEL is defined to 0.
             void set_minimum_log_level(LogEntry::Level level);
 
             /// if enable_log_queue is true, this receives the next log entry from the queue and returns true. returns false if there are no more items.
@@ -220,6 +334,10 @@ namespace mixpanel
             typedef unsigned Seconds;
             typedef unsigned Days;
 
+            /// events older than *days* are removed from the queue (*queue_name* is "track", "track_high" or "engage") instead of being sent.
+            /// They are dropped a segment or batch at a time, so a few of them may still be sent. The default is 0, events never expire.
+            void set_max_event_age(const std::string& queue_name, Days days);
+
             /// returns now() in UTC as iso formatted string
             static std::string utc_now();
 
@@ -233,22 +351,311 @@ namespace mixpanel
             /// call this when the reachability of the device changes (if you happen to have that information). Used to restrict data sending
             void on_reachability_changed(NetworkReachability network_reachability);
 
+            /// sets a daily budget in bytes for sending via carrier data networks. Once the requests of a UTC day have used it up,
+            /// nothing is sent via carrier data networks until the next day. The requests in flight may exceed it a little.
+            /// The default is 0, no budget.
+            /// On carrier data networks, the "track" and "engage" queues are only sent in full batches or on every fourth flush,
+            /// high priority events go out as usual. Whatever was held back is sent as soon as the device is on WiFi.
+            void set_cellular_daily_budget(std::size_t bytes);
+
+            struct NetworkUsage
+            {
+                NetworkUsage() : local_area_network_bytes(0), cellular_bytes(0), cellular_bytes_today(0), cellular_daily_budget(0) {}
+
+                std::size_t local_area_network_bytes;   ///< bytes sent via WiFi or cable
+                std::size_t cellular_bytes;             ///< bytes sent via carrier data networks
+                std::size_t cellular_bytes_today;       ///< bytes sent via carrier data networks in the current UTC day
+                std::size_t cellular_daily_budget;      ///< see set_cellular_daily_budget()
+            };
+
+            /// returns the bytes of event data sent per network type since the start of the application
+            NetworkUsage get_network_usage();
+
             /// sets the maximum size of the outgoing queues (track, engage) in bytes. The default is 5 MB.
-            /// if this size is exceeded no new data will be appended until the size is below this threshold.
+            /// what happens when this size is exceeded depends on the overflow policy of the queue, see set_overflow_policy().
             void set_maximum_queue_size(std::size_t maximum_size);
 
+            /// what to do, when a queue exceeds its maximum size
+            enum class OverflowPolicy
+            {
+                RejectNew,          ///< don't append new data until the size is below the maximum (the default)
+                DropOldest,         ///< drop the oldest data
+                Sample,             ///< thin out the queued data by removing every other event, spread evenly over the queue
+                EvictByPriority     ///< drop the oldest data of the lowest priority class first, see set_event_priority()
+            };
+
+            /// sets the overflow policy of a queue (*queue_name* is "track", "track_high" or "engage").
+            /// Except for RejectNew, events are evicted in the background when they are written to disk,
+            /// so the queues may exceed their maximum size by the memory budget for a while.
+            void set_overflow_policy(const std::string& queue_name, OverflowPolicy policy);
+
+            enum class EventPriority
+            {
+                Low,
+                Normal,
+                High
+            };
+
+            /// sets the priority class of all events named *event_name*. Events have normal priority by default, and so do engage calls.
+            /// High priority events go into a queue of their own, "track_high", which is sent shortly after they are tracked (see
+            /// set_high_priority_flush_delay()) and before the other queues on every flush. The other queues still get a batch on
+            /// every flush, so a steady stream of high priority events doesn't hold them back.
+            void set_event_priority(const std::string& event_name, EventPriority priority);
+
+            /// track a named *event* with *properties*, with the given priority instead of the one set for its name.
+            void track(const std::string event, const Value& properties, EventPriority priority);
+
+            /// sets the delay in milliseconds between tracking a high priority event and sending it, so events tracked together
+            /// go in one request. The default is 1000, 0 sends right away. Independent of the flush interval, but like all
+            /// sending, not while the flush interval is 0.
+            void set_high_priority_flush_delay(unsigned milliseconds);
+
+            struct QueueStats
+            {
+                QueueStats() : rejected(0), evicted(0), expired(0), dead_lettered(0), dead_letters_dropped(0) {}
+
+                std::size_t rejected;   ///< events that were not queued, because the queue was full (RejectNew)
+                std::size_t evicted;    ///< events that were removed from the queue to make room for new ones
+                std::size_t expired;    ///< events that were removed from the queue, because they exceeded the maximum event age
+                std::size_t dead_lettered;          ///< events the API refused for good, see get_dead_letters()
+                std::size_t dead_letters_dropped;   ///< of those, the ones that didn't fit into the dead letter file anymore
+            };
+
+            /// returns the overflow statistics of a queue since the start of the application
+            QueueStats get_queue_stats(const std::string& queue_name);
+
+            /// returns the events of a queue that the API refused for good, e.g. because they are malformed. Instead of being sent
+            /// again and again, they are set aside, one {"error":"...","time":...,"record":{...}} per line. The other events of their
+            /// batch are delivered. At most 1 MB is kept, clear_dead_letters() makes room again.
+            std::string get_dead_letters(const std::string& queue_name);
+            void clear_dead_letters(const std::string& queue_name);
+
+            /// sets the maximum number of bytes of events that are buffered in memory. The default is 1 MB.
+            /// events are kept in memory until the next flush. If they exceed this budget, they are written to disk in the background
+            /// without waiting for the flush interval.
+            void set_memory_budget(std::size_t bytes);
+
+            #ifndef SWIG
+            /// *callback* is called with the size of the memory buffer in bytes, when the buffer crosses the memory budget.
+            /// It is called on the thread that tracked the event, so keep it short.
+            void set_memory_high_water_callback(std::function<void(std::size_t)> callback);
+            #endif
+
+            /// enable this, if several processes use the same token and storage directory at the same time, e.g. a game and its
+            /// crash reporter. Every process can track, the queues on disk are locked against each other. Only one of the processes,
+            /// the one holding the uploader lease (mp_uploader.lock), sends the queues. The others write their events to disk on every
+            /// flush, so the uploader picks them up. When the uploader exits, another process takes over within a second.
+            /// Disabled by default. All processes using the storage directory need to enable it.
+            void set_multi_process(bool enabled);
+
+            /// sets the URL the track and engage requests go to, e.g. a proxy or a test server. The default is
+            /// "https://api.mixpanel.com/". A missing '/' at the end is added, e.g. "http://127.0.0.1:8080/relay" sends the events
+            /// to "http://127.0.0.1:8080/relay/track/".
+            void set_api_host(const std::string& api_host);
+
+            #ifndef SWIG
+            /// sends the queues with *transport* instead of the built-in HTTP client. Call it before tracking, nullptr switches
+            /// back to the built-in client.
+            void set_transport(std::shared_ptr<Transport> transport);
+            #endif
+
             /// set the interval at which the contents of the queue are tried to be flushed. The default is 60 seconds.
-            /// Setting a flush interval of 0 will turn off the flush timer.
+            /// Setting a flush interval of 0 will turn off the flush timer. Turns off the adaptive flush.
             void set_flush_interval(unsigned seconds);
 
+            /// flush when the traffic asks for it, instead of at a fixed interval. Light traffic is flushed less and less often,
+            /// every max_interval seconds at most, so the radio doesn't wake up for every few events. Once flush_bytes have been
+            /// queued, the queues are flushed right away, but not more often than every min_interval seconds. On carrier data
+            /// networks, the batches are larger and rarer: flush_bytes and min_interval are four times larger there.
+            /// set_flush_interval() switches back to a fixed interval.
+            void set_adaptive_flush(unsigned min_interval=10, unsigned max_interval=600, std::size_t flush_bytes=64 * 1024);
+
             /// attempt to flush the queue now. This call is non-blocking.
             void flush_queue();
+
+            #ifndef SWIG
+            /// flushes the queues like flush_queue() and tells when the events and profile updates queued before the call have been
+            /// sent. The future becomes true once they have been acknowledged by the API, false if that didn't happen within
+            /// timeout_ms milliseconds, or the instance was opted out or shut down first. Events that are evicted or expire
+            /// from the queue in the meantime (see QueueStats) aren't waited for. Nothing is sent while the flush interval is 0.
+            std::future<bool> flush_async(unsigned timeout_ms);
+
+            /// like flush_async(unsigned), but calls *callback* with the result instead. It is called on the sending thread
+            /// (or right away if the queues are empty), so keep it short.
+            void flush_async(unsigned timeout_ms, std::function<void(bool)> callback);
+
+            struct BatchDelivery
+            {
+                BatchDelivery() : events(0), bytes(0), latency(0), delivered(false), rejected(0), attempt(1) {}
+
+                std::string queue;                  ///< "track", "track_high" or "engage"
+                std::size_t events;                 ///< events or profile updates in the batch
+                std::size_t bytes;                  ///< size of the encoded payload
+                std::chrono::milliseconds latency;  ///< round trip time of the request, 0 if there was no response
+                bool delivered;                     ///< the batch was acknowledged and removed from the queue, otherwise it is sent again later
+                std::size_t rejected;               ///< events of a delivered batch that the API refused, see get_dead_letters()
+                unsigned attempt;                   ///< 1 for the first attempt to send the front of the queue, counts up while it fails
+                std::string error;                  ///< why the request failed or the API rejected (some of) the batch, empty if it didn't
+            };
+
+            /// *callback* is called for every batch that was sent, successfully or not, one batch at a time. It is called on the
+            /// sending thread, so keep it short. A batch with events the API refused is delivered, but has an error.
+            void set_delivery_callback(std::function<void(const BatchDelivery&)> callback);
+            #endif
+
+            /// shuts the instance down within timeout_ms milliseconds, e.g. when the app exits. The events in memory are written to
+            /// disk right away, the remaining time is spent on sending the queues. Requests that are still in flight at the deadline
+            /// are interrupted, what hasn't been sent stays on disk for the next launch. Returns true, if the queues have been sent
+            /// completely. Nothing is sent after this, events tracked later are only written to disk by the destructor.
+            /// A DNS lookup or connection attempt that is underway at the deadline can't be interrupted, shutdown() waits for it.
+            bool shutdown(unsigned timeout_ms);
+
+            /// sets the maximum number of requests that are sent at the same time per queue, when there is a backlog. The default is 4.
+            /// The actual number adapts to the round trip time and the error rate, starting at 1. Events are never dropped from
+            /// the queue before all the ones queued before them have been delivered.
+            void set_max_requests_in_flight(unsigned count);
+
+            #ifndef SWIG
+            /// The health of the endpoint of a queue. Each endpoint backs off on its own, so a failing endpoint doesn't hold back
+            /// the other one. A server error opens the circuit of the endpoint: it gets no requests for the Retry-After time of the
+            /// response and, from the second error in a row on, an exponential back off of 60 s to 10 min. Then the circuit is half
+            /// open: a single request with a small batch probes the endpoint, success closes the circuit. Transitions are logged.
+            struct EndpointStats
+            {
+                enum class State
+                {
+                    Closed,     ///< requests flow normally
+                    Open,       ///< no requests until blocked_until
+                    HalfOpen    ///< the next request probes the endpoint
+                };
+
+                EndpointStats() : state(State::Closed), consecutive_failures(0), opened(0), probes(0), blocked_until(0) {}
+
+                State state;
+                unsigned consecutive_failures;  ///< server errors in a row
+                std::size_t opened;             ///< how often the circuit has been opened since the start of the application
+                std::size_t probes;             ///< requests sent while the circuit was half open
+                std::time_t blocked_until;      ///< when the circuit is open until, 0 if it isn't
+            };
+
+            /// returns the health of the endpoint of a queue (*queue_name* is "track", "track_high" or "engage"). "track_high" shares the endpoint of "track"
+            EndpointStats get_endpoint_stats(const std::string& queue_name);
+
+            /// A distribution of durations in microseconds. The percentiles are estimated from buckets that double in width,
+            /// they are within a factor of two of the actual values.
+            struct LatencyStats
+            {
+                LatencyStats() : count(0), mean(0), p50(0), p90(0), p99(0), max(0) {}
+
+                std::uint64_t count;
+                double mean;
+                std::uint64_t p50;
+                std::uint64_t p90;
+                std::uint64_t p99;
+                std::uint64_t max;
+            };
+
+            /// What the instance has done since it was created, and the state of its queues. The counters are updated with a
+            /// few atomic additions each, a snapshot may be a few records behind.
+            struct Stats
+            {
+                Stats() : events_enqueued(0), events_rejected(0), queue_bytes(0), queue_records(0), memory_buffer_bytes(0),
+                          batches_sent(0), batches_failed(0), bytes_sent(0), handshakes(0), retries(0), back_off_seconds(0),
+                          persistence_bytes_read(0), persistence_bytes_written(0) {}
+
+                std::uint64_t events_enqueued;      ///< events and profile updates that were queued
+                std::uint64_t events_rejected;      ///< events and profile updates that full queues rejected, see QueueStats
+                LatencyStats enqueue_latency;       ///< of track(), the people functions and the like, on the calling thread
+
+                std::size_t queue_bytes;            ///< the size of all queues, in memory and on disk
+                std::size_t queue_records;
+                std::size_t memory_buffer_bytes;    ///< the part of the queues that hasn't been written to disk yet
+
+                std::uint64_t batches_sent;         ///< requests, including the ones that failed
+                std::uint64_t batches_failed;       ///< requests whose batch stays queued
+                std::uint64_t bytes_sent;           ///< the payload of the requests
+                LatencyStats round_trip;            ///< of the requests that got a response
+                std::uint64_t handshakes;           ///< connections opened, each with a TCP and, for https, a TLS handshake
+                std::uint64_t retries;              ///< requests that sent the front of a queue again, after it failed before
+                std::uint64_t back_off_seconds;     ///< the time the endpoints backed off, counted when a back off starts
+
+                std::uint64_t persistence_bytes_read;
+                std::uint64_t persistence_bytes_written;
+                LatencyStats persistence_read_latency;
+                LatencyStats persistence_write_latency;
+            };
+
+            Stats get_stats();
+
+            /// calls *callback* with get_stats() every interval_seconds, on the sending thread. An interval of 0 stops the export.
+            void set_stats_export(unsigned interval_seconds, std::function<void(const Stats&)> callback);
+
+            /// appends get_stats() to the file at *path* every interval_seconds, as a line of JSON with the time (seconds since
+            /// the epoch) in "time". An interval of 0 stops the export.
+            void set_stats_export(unsigned interval_seconds, const std::string& path);
+            #endif
+
+            #ifndef SWIG
+            struct ImportStats
+            {
+                ImportStats() : imported(0), rejected(0), failed(0), requests(0), retries(0), bytes(0), seconds(0), source_exhausted(false) {}
+
+                std::uint64_t imported;     ///< events the endpoint accepted
+                std::uint64_t rejected;     ///< events the endpoint refused, e.g. because of a missing $insert_id. They are not retried
+                std::uint64_t failed;       ///< events that could not be delivered within max_attempts
+                std::uint64_t requests;     ///< requests sent, including retries
+                std::uint64_t retries;      ///< requests that were repeated
+                std::uint64_t bytes;        ///< payload bytes sent, including retries
+                double seconds;             ///< time since the start of the import
+                std::string error;          ///< set, if the import was aborted, e.g. because the API secret is wrong
+                bool source_exhausted;      ///< true once the source returned false. An aborted import stops reading it, the events it didn't read are not counted
+
+                double events_per_second() const { return seconds > 0 ? imported / seconds : 0; }
+            };
+
+            struct ImportOptions
+            {
+                ImportOptions();
+
+                std::string api_secret;             ///< the API secret of the project, required
+                std::string project_id;             ///< optional, sent along with the requests
+                std::string api_host;               ///< "https://api.mixpanel.com/" by default
+                std::size_t max_batch_events;       ///< events per request, 2000 by default, which is the maximum of the endpoint
+                std::size_t max_batch_bytes;        ///< uncompressed bytes per request, 10 MB by default, which is the maximum of the endpoint
+                unsigned connections;               ///< requests in flight at the same time, 8 by default
+                unsigned max_attempts;              ///< attempts per batch before its events are given up on, 5 by default
+                unsigned first_retry_delay_ms;      ///< doubles with every attempt, up to a minute. 1000 by default. A Retry-After header takes precedence
+
+                /// called with the statistics so far, at most once per second, from one of the sending threads
+                std::function<void(const ImportStats&)> on_progress;
+                /// called for every event that was not imported, from one of the sending threads
+                std::function<void(const std::string& event, const std::string& error)> on_failed_event;
+            };
+
+            /// imports historical events through the /import endpoint, e.g. for a backfill. Unlike track(), the events are sent
+            /// right away, bypassing the queues, over several connections at once and in batches as large as the endpoint allows.
+            /// Only failed requests are repeated, events that were imported are never sent twice.
+            ///
+            /// *source* is called for the next event until it returns false. Events are complete json objects, like
+            /// {"event":"purchase","properties":{"time":1500000000,"distinct_id":"user","$insert_id":"...","price":10}}
+            /// Blocks until all events have been imported or given up on.
+            ImportStats import_events(const std::function<bool(std::string& event)>& source, const ImportOptions& options);
+
+            /// imports the events in a file with one json object per line, see import_events()
+            ImportStats import_file(const std::string& path, const ImportOptions& options);
+            #endif
         private:
             friend class People;
             friend class mixpanel::detail::Worker;
-            FRIEND_TEST(::MixpanelNetwork, RetryAfter);
-            FRIEND_TEST(::MixpanelNetwork, BackOffTime);
-            FRIEND_TEST(::MixpanelNetwork, FailureRecovery);
+            friend class mixpanel::detail::Importer;
+            friend class mixpanel::detail::Simulation;
+            FRIEND_TEST(::MixpanelNetwork, IdleWakeups);
+            FRIEND_TEST(::MixpanelNetwork, FlushAsync);
+            FRIEND_TEST(::MixpanelNetwork, CircuitBreaker);
+            FRIEND_TEST(::MixpanelNetwork, PriorityLanes);
+            FRIEND_TEST(::MixpanelNetwork, CellularBudget);
+            FRIEND_TEST(::MixpanelNetwork, FakeServer);
+            friend class ::GDPR;
 
             enum Op
             {
@@ -264,8 +671,9 @@ namespace mixpanel
             /// clears out the send queues.
             void clear_send_queues();
 
-            void engage(Op op, const Value& value);
-            void track_charge(double amount, const Value& properties);
+            // an empty *distinct_id* stands for the identified user
+            void engage(Op op, const Value& value, const std::string& distinct_id="");
+            void track_charge(double amount, const Value& properties, const std::string& distinct_id="");
 
             /// iso-format a time in UTC
             static std::string utc_iso_format(time_t time);
@@ -274,6 +682,10 @@ namespace mixpanel
             std::string get_distinct_id() const;
             std::string get_alias() const;
 
+            // writes the super properties to disk and hands them to event_stamper
+            void save_super_properties();
+            void update_base_properties();
+
             std::string token;
             Value state;
             Value super_properties;
@@ -281,18 +693,43 @@ namespace mixpanel
             Value automatic_people_properties;
             Value timed_events;
 
+            std::map<std::string, EventPriority> event_priorities;
+            std::mutex event_priorities_mutex;
+
+            EventPriority get_event_priority(const std::string& event_name);
+
+            std::shared_ptr<detail::EventStamper> event_stamper;
+
+            // a copy of the super properties, replaced as a whole when they change. The _as() functions use it, so they
+            // don't race with register_() and friends
+            std::shared_ptr<const Value> super_properties_snapshot;
+
+            // mirrors state["opted_out"], readable from any thread
+            std::atomic<bool> opted_out;
+
             static Value collect_automatic_properties();
             static Value collect_automatic_people_properties();
 
-            void log(LogEntry::Level level, const std::string& message);
+            // logs unconditionally built messages, MIXPANEL_LOG checks the level before it builds the message
+            void log(LogEntry::Level level, std::string message);
+            bool is_logged(LogEntry::Level level) const { return level >= min_log_level.load(std::memory_order_relaxed); }
+            // writes the queued entries to std::clog, unless another thread is at it already
+            void write_log();
             bool enable_log_queue;
             std::atomic<NetworkReachability> network_reachability;
 
-            LogEntry::Level min_log_level;
-            std::queue<LogEntry> log_entries;
-            std::mutex log_queue_mutex;
+            std::atomic<LogEntry::Level> min_log_level;
+            std::shared_ptr<detail::LogRing> log_ring;
+            std::atomic<bool> writing_log;
+
+            // counted into by the persistence and the worker, too
+            std::shared_ptr<detail::Metrics> metrics;
+
+            // the worker uses persistence, so it is declared (and thereby destroyed) after it
+            std::shared_ptr<detail::Persistence> persistence;
+            std::shared_ptr<detail::Worker> worker;
 
-            static std::shared_ptr<detail::Worker> worker;
+            friend std::shared_ptr<detail::Persistence> (::testsuite_get_persistence)(const Mixpanel& mixpanel);
     };
 }
 
@@ -0,0 +1,106 @@
+// A daemon that tracks the events of local processes that can't link the SDK themselves, e.g. scripts and servers.
+// Events are read as newline delimited json from a unix domain socket, see sidecar_server.hpp, stamped with the token,
+// the distinct_id, the time and the base properties, persisted and sent in batches like any other tracked event.
+//
+// usage: mixpanel_sidecar --token <token> [--socket <path>] [--storage <directory>] [--distinct-id <id>]
+//                         [--socket-mode <octal>] [--flush-interval <seconds>] [--property <key>=<value>]...
+//
+//   echo '{"event":"deploy","properties":{"service":"api"}}' | nc -U $XDG_RUNTIME_DIR/mixpanel.sock
+//
+// The socket is created in $XDG_RUNTIME_DIR, which only the user may access, or in /tmp if that isn't set. Only the user
+// may connect to it unless --socket-mode says otherwise, e.g. 0660 for the members of the group.
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <mixpanel/mixpanel.hpp>
+#include "./sidecar_server.hpp"
+
+using namespace mixpanel;
+
+static sidecar::SidecarServer* server = nullptr;
+
+static void on_signal(int)
+{
+    if (server) server->stop();
+}
+
+static int usage()
+{
+    std::cerr << "usage: mixpanel_sidecar --token <token> [--socket <path>] [--storage <directory>] [--distinct-id <id>]" << std::endl
+              << "                        [--socket-mode <octal>] [--flush-interval <seconds>] [--property <key>=<value>]..." << std::endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string token;
+    const char* runtime_directory = std::getenv("XDG_RUNTIME_DIR");
+    std::string socket_path = std::string(runtime_directory && *runtime_directory ? runtime_directory : "/tmp") + "/mixpanel.sock";
+    unsigned socket_mode = 0600;
+    std::string storage_directory = ".";
+    std::string distinct_id;
+    unsigned flush_interval = 10;
+    Value properties(detail::Json::objectValue);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 == argc) return usage();
+        std::string value = argv[++i];
+
+        if (arg == "--token") token = value;
+        else if (arg == "--socket") socket_path = value;
+        else if (arg == "--socket-mode") socket_mode = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 8)) & 0777;
+        else if (arg == "--storage") storage_directory = value;
+        else if (arg == "--distinct-id") distinct_id = value;
+        else if (arg == "--flush-interval") flush_interval = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10));
+        else if (arg == "--property")
+        {
+            auto separator = value.find('=');
+            if (separator == std::string::npos) return usage();
+            properties[value.substr(0, separator)] = value.substr(separator + 1);
+        }
+        else return usage();
+    }
+
+    if (token.empty()) return usage();
+
+    try
+    {
+        Mixpanel mp(token, distinct_id, storage_directory);
+        mp.set_flush_interval(flush_interval);
+        if (!properties.empty()) mp.register_properties(properties);
+
+        sidecar::SidecarServer sidecar_server(mp, socket_path, socket_mode);
+        std::string error;
+        if (!sidecar_server.start(error))
+        {
+            std::cerr << "mixpanel_sidecar: " << error << std::endl;
+            return 1;
+        }
+
+        server = &sidecar_server;
+        std::signal(SIGINT, on_signal);
+        std::signal(SIGTERM, on_signal);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::clog << "mixpanel_sidecar: listening on " << socket_path << std::endl;
+        sidecar_server.run();
+        server = nullptr;
+
+        std::clog << "mixpanel_sidecar: " << sidecar_server.get_events() << " events from "
+                  << sidecar_server.get_connections() << " connections, "
+                  << sidecar_server.get_rejected() << " rejected" << std::endl;
+
+        // the destructor of mp sends what it can and persists the rest for the next start
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "mixpanel_sidecar: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
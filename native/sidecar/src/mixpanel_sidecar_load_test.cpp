@@ -0,0 +1,140 @@
+// Measures the intake throughput of the sidecar on this machine: the time from the first event written to the socket
+// until the server has stamped and queued the last one. The server runs on one thread, sending is disabled
+// (the network is reported as unreachable), so this is the work the daemon does per event.
+//
+// usage: mixpanel_sidecar_load_test [events] [client threads] [storage directory]
+//
+// exits with 1, if the throughput is below the target of 100000 events/s.
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <mixpanel/mixpanel.hpp>
+#include "./sidecar_server.hpp"
+
+using namespace mixpanel;
+
+typedef std::chrono::steady_clock Clock;
+
+static const double target_events_per_second = 100000;
+
+static int connect_to(const std::string& socket_path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static void produce(const std::string& socket_path, int client, int count)
+{
+    int fd = connect_to(socket_path);
+    if (fd == -1)
+    {
+        std::cerr << "client " << client << ": can't connect to " << socket_path << std::endl;
+        std::exit(1);
+    }
+
+    // the events are written in chunks of ~64 KB, like a busy client would
+    std::string chunk;
+    for (int i = 0; i != count; ++i)
+    {
+        chunk += "{\"event\":\"level_complete\",\"properties\":{\"client\":" + std::to_string(client)
+               + ",\"level\":" + std::to_string(i) + ",\"score\":" + std::to_string(i * 7 % 1000)
+               + ",\"mode\":\"campaign\"}}\n";
+
+        if (chunk.size() >= 64 * 1024 || i + 1 == count)
+        {
+            const char* p = chunk.data();
+            std::size_t remaining = chunk.size();
+            while (remaining)
+            {
+                auto written = write(fd, p, remaining);
+                if (written <= 0)
+                {
+                    std::cerr << "client " << client << ": write failed" << std::endl;
+                    std::exit(1);
+                }
+                p += written;
+                remaining -= written;
+            }
+            chunk.clear();
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+    const int events = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    const int clients = argc > 2 ? std::atoi(argv[2]) : 4;
+    const std::string storage_directory = argc > 3 ? argv[3] : ".";
+    const std::string socket_path = storage_directory + "/mixpanel_sidecar_load_test.sock";
+
+    Mixpanel mp("sidecar_load_test", std::string("load_test_user"), storage_directory);
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    mp.set_flush_interval(60);
+    mp.set_memory_budget(64 * 1024 * 1024);
+    mp.set_maximum_queue_size(256 * 1024 * 1024);
+    mp.register_("app_version", "1.0.0");
+
+    sidecar::SidecarServer server(mp, socket_path);
+    std::string error;
+    if (!server.start(error))
+    {
+        std::cerr << "mixpanel_sidecar_load_test: " << error << std::endl;
+        return 1;
+    }
+    std::thread server_thread([&server]() { server.run(); });
+
+    auto start = Clock::now();
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i != clients; ++i)
+    {
+        producers.emplace_back(produce, socket_path, i, events / clients + (i < events % clients ? 1 : 0));
+    }
+    for (auto& producer : producers)
+    {
+        producer.join();
+    }
+
+    while (server.get_events() + server.get_rejected() < static_cast<std::uint64_t>(events))
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    server.stop();
+    server_thread.join();
+
+    auto events_per_second = events / seconds;
+    std::cout << std::fixed << std::setprecision(0)
+              << events << " events from " << clients << " clients in " << std::setprecision(3) << seconds << " s: "
+              << std::setprecision(0) << events_per_second << " events/s ("
+              << server.get_rejected() << " rejected)" << std::endl;
+
+    if (server.get_rejected() != 0 || events_per_second < target_events_per_second)
+    {
+        std::cout << "FAILED: the target is " << target_events_per_second << " events/s" << std::endl;
+        return 1;
+    }
+    return 0;
+}
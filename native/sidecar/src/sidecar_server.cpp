@@ -0,0 +1,247 @@
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "./sidecar_server.hpp"
+
+namespace mixpanel
+{
+    namespace sidecar
+    {
+        // lines longer than this are not events, the client gets disconnected
+        static const std::size_t max_line_length = 1024 * 1024;
+        static const std::size_t read_size = 64 * 1024;
+
+        struct SidecarServer::Client
+        {
+            explicit Client(int fd) : fd(fd) {}
+            ~Client() { close(fd); }
+
+            int fd;
+            std::string buffer;
+        };
+
+        static void set_non_blocking(int fd)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+
+        // true if a server accepts connections on the socket at *address*
+        static bool is_listening(const sockaddr_un& address)
+        {
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (probe == -1)
+            {
+                return false;
+            }
+            bool listening = connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+            close(probe);
+            return listening;
+        }
+
+        SidecarServer::SidecarServer(Mixpanel& mixpanel, const std::string& socket_path, unsigned socket_mode)
+        : mixpanel(mixpanel)
+        , socket_path(socket_path)
+        , socket_mode(socket_mode)
+        , listener(-1)
+        , events(0)
+        , rejected(0)
+        , connections(0)
+        {
+            stop_pipe[0] = stop_pipe[1] = -1;
+        }
+
+        SidecarServer::~SidecarServer()
+        {
+            if (listener != -1)
+            {
+                close(listener);
+                unlink(socket_path.c_str());
+            }
+            for (auto fd : stop_pipe)
+            {
+                if (fd != -1) close(fd);
+            }
+        }
+
+        bool SidecarServer::start(std::string& error)
+        {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (socket_path.size() >= sizeof(address.sun_path))
+            {
+                error = "socket path too long: " + socket_path;
+                return false;
+            }
+            std::strcpy(address.sun_path, socket_path.c_str());
+
+            // a socket left behind by a crashed daemon would make bind() fail, one of a running daemon is not taken over
+            struct stat st;
+            if (lstat(socket_path.c_str(), &st) == 0)
+            {
+                if (!S_ISSOCK(st.st_mode))
+                {
+                    error = socket_path + " exists and is not a socket";
+                    return false;
+                }
+                if (is_listening(address))
+                {
+                    error = socket_path + ": another daemon is listening on it";
+                    return false;
+                }
+                unlink(socket_path.c_str());
+            }
+
+            if (pipe(stop_pipe) == -1)
+            {
+                error = std::string("pipe: ") + std::strerror(errno);
+                return false;
+            }
+            set_non_blocking(stop_pipe[0]);
+            set_non_blocking(stop_pipe[1]);
+
+            listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener == -1)
+            {
+                error = std::string("socket: ") + std::strerror(errno);
+                return false;
+            }
+            set_non_blocking(listener);
+
+            if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1)
+            {
+                error = socket_path + ": " + std::strerror(errno);
+                close(listener);
+                listener = -1;
+                return false;
+            }
+            // nobody can connect before listen(), so the permissions are in place before the first client is
+            if (chmod(socket_path.c_str(), static_cast<mode_t>(socket_mode)) == -1 || listen(listener, SOMAXCONN) == -1)
+            {
+                error = socket_path + ": " + std::strerror(errno);
+                close(listener);
+                listener = -1;
+                unlink(socket_path.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        void SidecarServer::stop()
+        {
+            char c = 0;
+            if (write(stop_pipe[1], &c, 1) == -1)
+            {
+                // the pipe is full, so run() is going to wake up anyway
+            }
+        }
+
+        bool SidecarServer::process(Client& client)
+        {
+            std::size_t begin = 0;
+            for (;;)
+            {
+                auto end = client.buffer.find('\n', begin);
+                if (end == std::string::npos)
+                {
+                    break;
+                }
+
+                if (end != begin)
+                {
+                    if (mixpanel.track_json(client.buffer.substr(begin, end - begin)))
+                        ++events;
+                    else
+                        ++rejected;
+                }
+                begin = end + 1;
+            }
+            client.buffer.erase(0, begin);
+            return client.buffer.size() <= max_line_length;
+        }
+
+        void SidecarServer::run()
+        {
+            std::vector<std::unique_ptr<Client>> clients;
+            std::vector<pollfd> fds;
+            std::vector<char> chunk(read_size);
+
+            for (;;)
+            {
+                fds.clear();
+                fds.push_back({stop_pipe[0], POLLIN, 0});
+                fds.push_back({listener, POLLIN, 0});
+                for (const auto& client : clients)
+                {
+                    fds.push_back({client->fd, POLLIN, 0});
+                }
+
+                if (poll(fds.data(), fds.size(), -1) == -1)
+                {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+
+                if (fds[0].revents)
+                {
+                    break;
+                }
+
+                // read the clients before accepting new ones, fds and clients are in sync up to here
+                std::size_t remaining = 0;
+                for (std::size_t i = 0; i != clients.size(); ++i)
+                {
+                    auto& client = *clients[i];
+                    bool keep = true;
+                    if (fds[i + 2].revents)
+                    {
+                        auto size = read(client.fd, chunk.data(), chunk.size());
+                        if (size > 0)
+                        {
+                            client.buffer.append(chunk.data(), size);
+                            keep = process(client);
+                            if (!keep) ++rejected;
+                        }
+                        else
+                        {
+                            keep = (size == -1 && (errno == EAGAIN || errno == EINTR));
+                            if (!keep && !client.buffer.empty())
+                            {
+                                // the last line of a client that hung up does not need a newline
+                                client.buffer += '\n';
+                                process(client);
+                            }
+                        }
+                    }
+
+                    if (keep)
+                    {
+                        clients[remaining++].swap(clients[i]);
+                    }
+                }
+                clients.resize(remaining);
+
+                if (fds[1].revents)
+                {
+                    int fd;
+                    while ((fd = accept(listener, nullptr, nullptr)) != -1)
+                    {
+                        set_non_blocking(fd);
+                        clients.emplace_back(new Client(fd));
+                        ++connections;
+                    }
+                }
+            }
+        }
+    } // namespace sidecar
+} // namespace mixpanel
@@ -0,0 +1,65 @@
+#ifndef _MIXPANEL_SIDECAR_SERVER_HPP_
+#define _MIXPANEL_SIDECAR_SERVER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <mixpanel/mixpanel.hpp>
+
+namespace mixpanel
+{
+    namespace sidecar
+    {
+        // Accepts events on a unix domain socket and tracks them with a Mixpanel instance.
+        //
+        // Clients write newline delimited json, one event per line:
+        //
+        //   {"event":"purchase","properties":{"price":10}}
+        //
+        // The server never answers. Malformed lines are counted and dropped. All clients are served by the thread that
+        // calls run(), the events are stamped and queued by Mixpanel::track_json(); sending happens on the instance's
+        // own thread.
+        class SidecarServer
+        {
+            public:
+                // only the owner may connect to the socket by default, *socket_mode* are its permission bits
+                SidecarServer(Mixpanel& mixpanel, const std::string& socket_path, unsigned socket_mode=0600);
+                ~SidecarServer();
+
+                SidecarServer(const SidecarServer&) = delete;
+                SidecarServer& operator=(const SidecarServer&) = delete;
+
+                // creates the socket (replacing a stale one) and starts listening. Returns false and sets *error* on failure,
+                // also if another server is listening on the socket already
+                bool start(std::string& error);
+
+                // serves the clients until stop() is called
+                void run();
+
+                // makes run() return. Can be called from any thread and from signal handlers
+                void stop();
+
+                std::uint64_t get_events() const { return events; }
+                std::uint64_t get_rejected() const { return rejected; }
+                std::uint64_t get_connections() const { return connections; }
+            private:
+                struct Client;
+
+                // tracks the complete lines in the buffer of *client* and keeps the rest. Returns false if the client
+                // exceeded the maximum line length
+                bool process(Client& client);
+
+                Mixpanel& mixpanel;
+                const std::string socket_path;
+                const unsigned socket_mode;
+                int listener;
+                int stop_pipe[2];
+
+                std::atomic<std::uint64_t> events;
+                std::atomic<std::uint64_t> rejected;
+                std::atomic<std::uint64_t> connections;
+        };
+    } // namespace sidecar
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_SIDECAR_SERVER_HPP_ */
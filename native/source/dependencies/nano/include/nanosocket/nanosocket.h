@@ -171,7 +171,10 @@ namespace nanosocket {
          * return latest error message.
          */
         std::string errstr() { return errstr_; }
-        //int fd() { return fd_; }
+        /**
+         * the underlying socket, e.g. to shutdown() it from another thread.
+         */
+        virtual SOCKET fd() { return fd_; }
         //int fileno() { return fd_; }
 #if defined(AF_UNIX) && !defined(WIN32)
         bool bind_unix(const std::string &path) {
@@ -474,6 +477,11 @@ class MBEDTLSSocket : public Socket
             return ret;
         }
 
+        virtual SOCKET fd() override
+        {
+            return static_cast<SOCKET>(net.fd);
+        }
+
         virtual int close() override
         {
             //mixpanel_mbedtls_debug_set_threshold(1000);
@@ -0,0 +1,62 @@
+#include "./bandwidth_budget.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        static const std::time_t seconds_per_day = 24 * 60 * 60;
+
+        BandwidthBudget::BandwidthBudget()
+        : daily_budget(0)
+        , day(0)
+        , cellular_bytes_today(0)
+        , cellular_bytes(0)
+        , local_area_network_bytes(0)
+        {
+        }
+
+        void BandwidthBudget::set_daily_budget(std::size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            daily_budget = bytes;
+        }
+
+        bool BandwidthBudget::on_sent(Mixpanel::NetworkReachability network, std::size_t bytes, std::time_t now)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (network != Mixpanel::NetworkReachability::ReachableViaCarrierDataNetwork)
+            {
+                local_area_network_bytes += bytes;
+                return false;
+            }
+
+            cellular_bytes += bytes;
+            auto before = get_cellular_bytes_today(now);
+            day = now / seconds_per_day;
+            cellular_bytes_today = before + bytes;
+            return daily_budget != 0 && before < daily_budget && cellular_bytes_today >= daily_budget;
+        }
+
+        bool BandwidthBudget::allows(std::time_t now) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return daily_budget == 0 || get_cellular_bytes_today(now) < daily_budget;
+        }
+
+        Mixpanel::NetworkUsage BandwidthBudget::get_usage(std::time_t now) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Mixpanel::NetworkUsage usage;
+            usage.local_area_network_bytes = local_area_network_bytes;
+            usage.cellular_bytes = cellular_bytes;
+            usage.cellular_bytes_today = get_cellular_bytes_today(now);
+            usage.cellular_daily_budget = daily_budget;
+            return usage;
+        }
+
+        std::size_t BandwidthBudget::get_cellular_bytes_today(std::time_t now) const
+        {
+            return (now / seconds_per_day == day) ? cellular_bytes_today : 0;
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,45 @@
+#ifndef _MIXPANEL_BANDWIDTH_BUDGET_HPP_
+#define _MIXPANEL_BANDWIDTH_BUDGET_HPP_
+
+#include <ctime>
+#include <cstddef>
+#include <mutex>
+#include <mixpanel/mixpanel.hpp>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // Counts the bytes sent per network type and keeps the daily budget for carrier data networks, see
+        // Mixpanel::set_cellular_daily_budget(). The day is the UTC day, the budget of a day starts at 0 bytes at midnight.
+        //
+        // Thread safe.
+        class BandwidthBudget
+        {
+            public:
+                BandwidthBudget();
+
+                // 0 means no budget
+                void set_daily_budget(std::size_t bytes);
+
+                // a request of *bytes* went out via *network* at *now*. Returns true, if it used up the budget of the day.
+                bool on_sent(Mixpanel::NetworkReachability network, std::size_t bytes, std::time_t now);
+
+                // false, once the requests via carrier data networks have used up the budget of the day
+                bool allows(std::time_t now) const;
+
+                Mixpanel::NetworkUsage get_usage(std::time_t now) const;
+            private:
+                std::size_t get_cellular_bytes_today(std::time_t now) const;
+
+                mutable std::mutex mutex;
+                std::size_t daily_budget;
+                std::time_t day;                // the day of cellular_bytes_today, in days since the epoch
+                std::size_t cellular_bytes_today;
+                std::size_t cellular_bytes;
+                std::size_t local_area_network_bytes;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_BANDWIDTH_BUDGET_HPP_ */
@@ -7,7 +7,7 @@
  *
  * modifications:
  *  - put into mixpanel::detail namespace
- *  - only exposed base64_encode in header
+ *  - only exposed base64_encode and base64_decode in header
  *  - fixed warning by adding static_cast<unsigned char>
 
    base64.cpp and base64.h
@@ -95,5 +95,46 @@ namespace mixpanel
         {
             return base64_encode(reinterpret_cast<const unsigned char*>(s.data()), s.size());
         }
+
+        std::string base64_decode(std::string const& encoded_string) {
+          size_t in_len = encoded_string.size();
+          int i = 0;
+          int j = 0;
+          int in_ = 0;
+          unsigned char char_array_4[4], char_array_3[3];
+          std::string ret;
+
+          while (in_len-- && ( encoded_string[in_] != '=') && is_base64(static_cast<unsigned char>(encoded_string[in_]))) {
+            char_array_4[i++] = static_cast<unsigned char>(encoded_string[in_]); in_++;
+            if (i ==4) {
+              for (i = 0; i <4; i++)
+                char_array_4[i] = static_cast<unsigned char>(base64_chars.find(static_cast<char>(char_array_4[i])));
+
+              char_array_3[0] = static_cast<unsigned char>((char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4));
+              char_array_3[1] = static_cast<unsigned char>(((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2));
+              char_array_3[2] = static_cast<unsigned char>(((char_array_4[2] & 0x3) << 6) + char_array_4[3]);
+
+              for (i = 0; (i < 3); i++)
+                ret += static_cast<char>(char_array_3[i]);
+              i = 0;
+            }
+          }
+
+          if (i) {
+            for (j = i; j <4; j++)
+              char_array_4[j] = 0;
+
+            for (j = 0; j <4; j++)
+              char_array_4[j] = static_cast<unsigned char>(base64_chars.find(static_cast<char>(char_array_4[j])));
+
+            char_array_3[0] = static_cast<unsigned char>((char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4));
+            char_array_3[1] = static_cast<unsigned char>(((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2));
+            char_array_3[2] = static_cast<unsigned char>(((char_array_4[2] & 0x3) << 6) + char_array_4[3]);
+
+            for (j = 0; (j < i - 1); j++) ret += static_cast<char>(char_array_3[j]);
+          }
+
+          return ret;
+        }
     } // namespace detail
 } // namespace mixpanel
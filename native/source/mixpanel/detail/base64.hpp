@@ -10,6 +10,7 @@ namespace mixpanel
     namespace detail
     {
         std::string base64_encode(const std::string& s);
+        std::string base64_decode(const std::string& s);
     }
 }
 
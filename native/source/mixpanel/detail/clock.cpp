@@ -0,0 +1,62 @@
+#include "./clock.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        namespace
+        {
+            class SystemClock : public Clock
+            {
+                public:
+                    time_point now() const override
+                    {
+                        return std::chrono::steady_clock::now();
+                    }
+
+                    std::time_t time() const override
+                    {
+                        return std::time(nullptr);
+                    }
+            };
+        }
+
+        std::shared_ptr<Clock> Clock::system()
+        {
+            static const std::shared_ptr<Clock> clock = std::make_shared<SystemClock>();
+            return clock;
+        }
+
+        VirtualClock::VirtualClock()
+        : start(std::chrono::steady_clock::now())
+        , start_time(std::time(nullptr))
+        , elapsed(0)
+        {
+        }
+
+        VirtualClock::time_point VirtualClock::now() const
+        {
+            return start + duration(elapsed.load());
+        }
+
+        std::time_t VirtualClock::time() const
+        {
+            return start_time + static_cast<std::time_t>(std::chrono::duration_cast<std::chrono::seconds>(duration(elapsed.load())).count());
+        }
+
+        void VirtualClock::advance(duration duration)
+        {
+            if (duration.count() > 0)
+            {
+                elapsed += duration.count();
+            }
+        }
+
+        void VirtualClock::advance_to(time_point t)
+        {
+            auto target = (t - start).count();
+            auto current = elapsed.load();
+            while (target > current && !elapsed.compare_exchange_weak(current, target)) {}
+        }
+    } // namespace detail
+} // namespace mixpanel
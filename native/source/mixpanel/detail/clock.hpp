@@ -0,0 +1,56 @@
+#ifndef _MIXPANEL_CLOCK_HPP_
+#define _MIXPANEL_CLOCK_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <memory>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // The time as a worker sees it: the monotonic time of its timers and deadlines, and the wall clock time of back
+        // offs and daily budgets.
+        class Clock
+        {
+            public:
+                typedef std::chrono::steady_clock::time_point time_point;
+                typedef std::chrono::steady_clock::duration duration;
+
+                virtual ~Clock() {}
+
+                virtual time_point now() const = 0;
+
+                // seconds since the epoch
+                virtual std::time_t time() const = 0;
+
+                // std::chrono::steady_clock and time()
+                static std::shared_ptr<Clock> system();
+        };
+
+        // A clock that only moves when it is told to, see Simulation. It starts at the time of the system clock. The wall
+        // clock time moves along with the monotonic time.
+        //
+        // Thread safe.
+        class VirtualClock : public Clock
+        {
+            public:
+                VirtualClock();
+
+                time_point now() const override;
+                std::time_t time() const override;
+
+                void advance(duration duration);
+
+                // moves the clock forward to *t*, it never goes back
+                void advance_to(time_point t);
+            private:
+                const time_point start;
+                const std::time_t start_time;
+                std::atomic<duration::rep> elapsed;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_CLOCK_HPP_ */
@@ -0,0 +1,57 @@
+#include <algorithm>
+#include "./concurrency_limit.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        const unsigned ConcurrencyLimit::default_maximum;
+
+        ConcurrencyLimit::ConcurrencyLimit(unsigned maximum)
+        : maximum(std::max(maximum, 1u))
+        , limit(1)
+        , base_rtt(0)
+        {
+        }
+
+        void ConcurrencyLimit::set_maximum(unsigned maximum)
+        {
+            this->maximum = std::max(maximum, 1u);
+            if (limit > this->maximum)
+            {
+                limit = this->maximum.load();
+            }
+        }
+
+        void ConcurrencyLimit::update(unsigned requests, unsigned failures, std::chrono::steady_clock::duration rtt)
+        {
+            auto current = limit.load();
+            if (failures != 0)
+            {
+                current = current / 2;
+            }
+            else if (base_rtt.count() != 0 && rtt > 2 * base_rtt)
+            {
+                current = current - 1;
+            }
+            else if (requests >= current)
+            {
+                current = current + 1;
+            }
+            limit = std::min(std::max(current, 1u), maximum.load());
+
+            // the base follows a slower network, so the limit doesn't shrink forever after the route changed
+            if (rtt.count() > 0)
+            {
+                if (base_rtt.count() == 0 || rtt < base_rtt)
+                {
+                    base_rtt = rtt;
+                }
+                else
+                {
+                    base_rtt += (rtt - base_rtt) / 16;
+                }
+            }
+        }
+    } // namespace detail
+} // namespace mixpanel
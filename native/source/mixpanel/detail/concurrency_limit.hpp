@@ -0,0 +1,36 @@
+#ifndef _MIXPANEL_CONCURRENCY_LIMIT_HPP_
+#define _MIXPANEL_CONCURRENCY_LIMIT_HPP_
+
+#include <atomic>
+#include <chrono>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // The number of requests one endpoint gets at the same time. Adapts like TCP congestion control (AIMD): it grows by
+        // one after every round that used the whole limit, halves on errors and shrinks by one, when the round trip time
+        // rises well above the best one seen recently, which means the requests queue up somewhere on the way.
+        //
+        // update() must be called from one thread at a time, get() and set_maximum() from any thread.
+        class ConcurrencyLimit
+        {
+            public:
+                explicit ConcurrencyLimit(unsigned maximum=default_maximum);
+
+                void set_maximum(unsigned maximum);
+                unsigned get() const { return limit; }
+
+                // feeds back the outcome of a round of *requests* requests sent at once. *rtt* is the slowest of them.
+                void update(unsigned requests, unsigned failures, std::chrono::steady_clock::duration rtt);
+
+                static const unsigned default_maximum = 4;
+            private:
+                std::atomic<unsigned> maximum;
+                std::atomic<unsigned> limit;
+                std::chrono::steady_clock::duration base_rtt;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_CONCURRENCY_LIMIT_HPP_ */
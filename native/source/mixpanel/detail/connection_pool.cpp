@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include "./connection_pool.hpp"
+
+#ifdef WIN32
+#define SHUT_RDWR SD_BOTH
+#endif
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        const std::chrono::seconds ConnectionPool::max_idle_time(15);
+
+        static bool equals_ignore_case(const char* a, std::size_t a_len, const char* b)
+        {
+            std::size_t i = 0;
+            for (; i != a_len && b[i]; ++i)
+            {
+                if (std::tolower((unsigned char) a[i]) != std::tolower((unsigned char) b[i]))
+                {
+                    return false;
+                }
+            }
+            return i == a_len && !b[i];
+        }
+
+        namespace
+        {
+            // nanosocket's destructor is not virtual, so the connections are created and deleted as these final types.
+            // TLS sockets only release their state in close().
+            class PlainSocket final : public nanosocket::Socket
+            {
+            };
+
+            #if defined(HAVE_SSL)
+            class TlsSocket final : public nanosocket::SSLSocket
+            {
+            };
+            #elif defined(HAVE_MBEDTLS)
+            class TlsSocket final : public nanosocket::MBEDTLSSocket
+            {
+            };
+            #endif
+
+            void delete_socket(nanosocket::Socket* socket)
+            {
+                delete static_cast<PlainSocket*>(socket);
+            }
+
+            #if defined(HAVE_SSL) || defined(HAVE_MBEDTLS)
+            void delete_tls_socket(nanosocket::Socket* socket)
+            {
+                socket->close();
+                delete static_cast<TlsSocket*>(socket);
+            }
+            #endif
+        }
+
+        ConnectionPool::Cancellation::Cancellation()
+        : cancelled(false)
+        {
+        }
+
+        void ConnectionPool::Cancellation::cancel()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cancelled = true;
+            for (auto connection : connections)
+            {
+                ::shutdown(connection->fd(), SHUT_RDWR);
+            }
+        }
+
+        bool ConnectionPool::Cancellation::is_cancelled()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return cancelled;
+        }
+
+        bool ConnectionPool::Cancellation::add(nanosocket::Socket* connection)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cancelled)
+            {
+                return false;
+            }
+            connections.insert(connection);
+            return true;
+        }
+
+        bool ConnectionPool::Cancellation::remove(nanosocket::Socket* connection)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.erase(connection);
+            return !cancelled;
+        }
+
+        ConnectionPool::ConnectionPool(std::size_t max_idle_connections)
+        : max_idle_connections(max_idle_connections)
+        {
+        }
+
+        ConnectionPool::~ConnectionPool()
+        {
+        }
+
+        ConnectionPool::Connection ConnectionPool::connect(nanouri::Uri& uri, std::string& error)
+        {
+            Connection connection(nullptr, delete_socket);
+            if (uri.scheme() == "http")
+            {
+                connection = Connection(new PlainSocket(), delete_socket);
+            }
+            else
+            {
+                #if defined(HAVE_SSL) || defined(HAVE_MBEDTLS)
+                connection = Connection(new TlsSocket(), delete_tls_socket);
+                #else
+                error = "your binary doesn't support SSL";
+                return connection;
+                #endif
+            }
+
+            short port = uri.port() == 0 ? (uri.scheme() == "https" ? 443 : 80) : uri.port();
+            if (!connection->connect(uri.host().c_str(), port))
+            {
+                error = connection->errstr();
+                return Connection(nullptr, delete_socket);
+            }
+
+            int opt = 1;
+            connection->setsockopt(IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+            return connection;
+        }
+
+        ConnectionPool::Connection ConnectionPool::take_idle(const std::string& key)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = std::chrono::steady_clock::now();
+            auto range = idle.equal_range(key);
+            for (auto it = range.first; it != range.second;)
+            {
+                if (now - it->second.since < max_idle_time)
+                {
+                    auto connection = std::move(it->second.connection);
+                    idle.erase(it);
+                    return connection;
+                }
+                it = idle.erase(it);
+            }
+            return Connection(nullptr, delete_socket);
+        }
+
+        void ConnectionPool::put_idle(const std::string& key, Connection connection)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (idle.size() < max_idle_connections)
+            {
+                idle.insert(std::make_pair(key, Idle_connection{std::move(connection), std::chrono::steady_clock::now()}));
+            }
+        }
+
+        bool ConnectionPool::exchange(nanosocket::Socket& connection, nanowww::Request& request, nanowww::Response& response, bool& keep_alive, bool& received_anything, std::string& error)
+        {
+            keep_alive = false;
+            received_anything = false;
+
+            if (!request.write_header(connection, false) || !request.write_content(connection))
+            {
+                error = "error in writing request: " + connection.errstr();
+                return false;
+            }
+
+            std::string buf;
+            char read_buf[NANOWWW_READ_BUFFER_SIZE];
+            std::size_t content_length = 0;
+            bool has_content_length = false;
+
+            // read the header
+            while (true)
+            {
+                int nread = connection.recv(read_buf, sizeof(read_buf));
+                if (nread <= 0)
+                {
+                    error = nread == 0 ? "EOF" : connection.errstr();
+                    return false;
+                }
+                received_anything = true;
+                buf.append(read_buf, nread);
+
+                int minor_version;
+                int status;
+                const char* msg;
+                std::size_t msg_len;
+                struct phr_header headers[NANOWWW_MAX_HEADERS];
+                std::size_t num_headers = sizeof(headers) / sizeof(headers[0]);
+                int ret = phr_parse_response(buf.c_str(), buf.size(), &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0);
+                if (ret == -1)
+                {
+                    error = "http response parse error";
+                    return false;
+                }
+                if (ret == -2)
+                {
+                    continue;
+                }
+
+                // HTTP/1.1 keeps connections open by default, HTTP/1.0 only if the server says so
+                keep_alive = (minor_version == 1);
+                response.set_status(status);
+                response.set_message(msg, msg_len);
+                for (std::size_t i = 0; i != num_headers; ++i)
+                {
+                    std::string value(headers[i].value, headers[i].value_len);
+                    if (equals_ignore_case(headers[i].name, headers[i].name_len, "Content-Length"))
+                    {
+                        content_length = std::strtoul(value.c_str(), nullptr, 10);
+                        has_content_length = true;
+                    }
+                    else if (equals_ignore_case(headers[i].name, headers[i].name_len, "Connection"))
+                    {
+                        keep_alive = equals_ignore_case(value.data(), value.size(), "keep-alive");
+                    }
+                    response.push_header(std::string(headers[i].name, headers[i].name_len), value);
+                }
+                response.add_content(buf.substr(ret));
+                break;
+            }
+
+            // read the body. Without a content length, it ends when the server closes the connection.
+            keep_alive = keep_alive && has_content_length;
+            while (!has_content_length || response.content().size() < content_length)
+            {
+                int nread = connection.recv(read_buf, sizeof(read_buf));
+                if (nread == 0 && !has_content_length)
+                {
+                    break;
+                }
+                if (nread <= 0)
+                {
+                    error = nread == 0 ? "EOF" : connection.errstr();
+                    return false;
+                }
+                response.add_content(read_buf, nread);
+            }
+
+            return true;
+        }
+
+        bool ConnectionPool::send_request(nanowww::Request& request, nanowww::Response& response, std::string& error, Cancellation* cancellation, unsigned* handshakes)
+        {
+            auto& uri = *request.uri();
+            auto key = uri.scheme() + "://" + uri.host() + ":" + std::to_string(uri.port());
+            request.set_header("Connection", "keep-alive");
+
+            // an idle connection might have been closed by the server in the meantime, in that case we retry with a new one
+            for (int attempt = 0; attempt != 2; ++attempt)
+            {
+                if (cancellation && cancellation->is_cancelled())
+                {
+                    error = "cancelled";
+                    return false;
+                }
+
+                auto connection = (attempt == 0) ? take_idle(key) : Connection(nullptr, delete_socket);
+                bool reused = !!connection;
+                if (!connection)
+                {
+                    connection = connect(uri, error);
+                    if (!connection)
+                    {
+                        return false;
+                    }
+                    if (handshakes)
+                    {
+                        ++*handshakes;
+                    }
+                }
+
+                if (cancellation && !cancellation->add(connection.get()))
+                {
+                    error = "cancelled";
+                    return false;
+                }
+
+                nanowww::Response attempt_response;
+                bool keep_alive = false;
+                bool received_anything = false;
+                bool exchanged = exchange(*connection, request, attempt_response, keep_alive, received_anything, error);
+
+                // a cancelled connection has been shut down, it can't be used again
+                bool cancelled = cancellation && !cancellation->remove(connection.get());
+                if (exchanged)
+                {
+                    response = attempt_response;
+                    if (keep_alive && !cancelled)
+                    {
+                        put_idle(key, std::move(connection));
+                    }
+                    return true;
+                }
+
+                if (cancelled)
+                {
+                    error = "cancelled: " + error;
+                    return false;
+                }
+
+                if (!reused || received_anything)
+                {
+                    return false;
+                }
+            }
+            return false;
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,83 @@
+#ifndef _MIXPANEL_CONNECTION_POOL_HPP_
+#define _MIXPANEL_CONNECTION_POOL_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include "../../dependencies/nano/include/nanowww/nanowww.h"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // Sends http(s) requests over kept-alive connections, so consecutive requests to the same host don't pay for
+        // a new TCP connection and TLS handshake every time.
+        //
+        // Thread safe. Every request takes an idle connection to its host or opens a new one, and puts it back
+        // afterwards if the server keeps it open. Redirects are not followed.
+        class ConnectionPool
+        {
+            public:
+                explicit ConnectionPool(std::size_t max_idle_connections=4);
+                ~ConnectionPool();
+
+                // Lets another thread interrupt the requests of one sender, which pass it to send_request().
+                class Cancellation
+                {
+                    public:
+                        Cancellation();
+
+                        // Shuts down the connections of the requests in progress, so their blocking reads and writes return
+                        // right away. The requests that follow fail without touching the network. A connection that is
+                        // being established (DNS lookup, TCP and TLS handshake) is only shut down once it is established.
+                        void cancel();
+                        bool is_cancelled();
+                    private:
+                        friend class ConnectionPool;
+
+                        // false, if cancel() has been called
+                        bool add(nanosocket::Socket* connection);
+
+                        // false, if cancel() has been called while the connection was in use
+                        bool remove(nanosocket::Socket* connection);
+
+                        std::mutex mutex;
+                        bool cancelled;
+                        std::set<nanosocket::Socket*> connections;
+                };
+
+                // returns false and sets error, if the request could not be sent or no response was received. Counts the
+                // connections it opened into *handshakes*.
+                bool send_request(nanowww::Request& request, nanowww::Response& response, std::string& error, Cancellation* cancellation=nullptr, unsigned* handshakes=nullptr);
+
+                // idle connections are not reused after this time, servers close them eventually
+                static const std::chrono::seconds max_idle_time;
+            private:
+                typedef std::unique_ptr<nanosocket::Socket, void(*)(nanosocket::Socket*)> Connection;
+
+                struct Idle_connection
+                {
+                    Connection connection;
+                    std::chrono::steady_clock::time_point since;
+                };
+
+                Connection connect(nanouri::Uri& uri, std::string& error);
+                Connection take_idle(const std::string& key);
+                void put_idle(const std::string& key, Connection connection);
+
+                // sends the request over connection and reads the response. sets keep_alive, if the connection can be reused.
+                static bool exchange(nanosocket::Socket& connection, nanowww::Request& request, nanowww::Response& response, bool& keep_alive, bool& received_anything, std::string& error);
+
+                std::mutex mutex;
+                std::multimap<std::string, Idle_connection> idle;   // keyed by scheme://host:port
+                std::size_t max_idle_connections;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_CONNECTION_POOL_HPP_ */
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "./endpoint_health.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        const unsigned EndpointHealth::probe_batch_size;
+
+        EndpointHealth::EndpointHealth()
+        : random([] { return static_cast<unsigned>(rand()); })
+        , failure_count(0)
+        , blocked_until(0)
+        , opened(0)
+        , probes(0)
+        {
+        }
+
+        void EndpointHealth::set_random(std::function<unsigned()> random)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->random = random;
+        }
+
+        std::time_t EndpointHealth::on_response(int status, int retry_after, std::time_t now)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            bool failed = (500 <= status && status <= 599);
+            failure_count = failed ? failure_count + 1 : 0;
+
+            // Calculate exponential back off
+            auto back_off = std::max(retry_after, 0);
+            if (failure_count > 1)
+            {
+                back_off = std::max(back_off, calculate_back_off_time(failure_count, random()));
+            }
+
+            if (failed && back_off > 0)
+            {
+                ++opened;
+            }
+            blocked_until = now + back_off;
+            return blocked_until;
+        }
+
+        void EndpointHealth::on_probe()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++probes;
+        }
+
+        EndpointHealth::State EndpointHealth::get_state(std::time_t now) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (now < blocked_until)
+            {
+                return State::Open;
+            }
+            return failure_count == 0 ? State::Closed : State::HalfOpen;
+        }
+
+        std::time_t EndpointHealth::get_blocked_until() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return blocked_until;
+        }
+
+        int EndpointHealth::get_failure_count() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return failure_count;
+        }
+
+        Mixpanel::EndpointStats EndpointHealth::get_stats(std::time_t now) const
+        {
+            auto state = get_state(now);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            Mixpanel::EndpointStats stats;
+            stats.state = state;
+            stats.consecutive_failures = static_cast<unsigned>(failure_count);
+            stats.opened = opened;
+            stats.probes = probes;
+            stats.blocked_until = (now < blocked_until) ? blocked_until : 0;
+            return stats;
+        }
+
+        int EndpointHealth::calculate_back_off_time(int failure_count, unsigned random)
+        {
+            int back_off_time = pow(2.0, failure_count - 1) * 60.0 + random % 30;
+            return std::min(std::max(60, back_off_time), 600);
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,61 @@
+#ifndef _MIXPANEL_ENDPOINT_HEALTH_HPP_
+#define _MIXPANEL_ENDPOINT_HEALTH_HPP_
+
+#include <ctime>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <mixpanel/mixpanel.hpp>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // The back off and circuit breaker of one endpoint, so an endpoint that fails doesn't hold back the other one.
+        //
+        // The circuit is closed while the requests succeed. A server error opens it for the back off time: the Retry-After
+        // time of the response, and an exponential back off (60 s to 10 min) from the second error in a row on. While it
+        // is open, the endpoint gets no requests. After that it is half open: a single request with a small batch probes
+        // the endpoint, success closes the circuit, another error opens it again for longer. A Retry-After header on
+        // other responses holds back the requests, too, without counting as an error.
+        //
+        // Thread safe.
+        class EndpointHealth
+        {
+            public:
+                typedef Mixpanel::EndpointStats::State State;
+
+                EndpointHealth();
+
+                // the source of the jitter of the back off, rand() by default
+                void set_random(std::function<unsigned()> random);
+
+                // feeds back the HTTP status and the Retry-After seconds (0 if none) of a response. Returns the time
+                // until which the endpoint gets no requests.
+                std::time_t on_response(int status, int retry_after, std::time_t now);
+
+                // a request probes the half open endpoint
+                void on_probe();
+
+                State get_state(std::time_t now) const;
+                std::time_t get_blocked_until() const;
+                int get_failure_count() const;
+                Mixpanel::EndpointStats get_stats(std::time_t now) const;
+
+                // the records of a probe request
+                static const unsigned probe_batch_size = 5;
+
+                // *random* adds up to 29 s of jitter
+                static int calculate_back_off_time(int failure_count, unsigned random);
+            private:
+                mutable std::mutex mutex;
+                std::function<unsigned()> random;
+                int failure_count;
+                std::time_t blocked_until;
+                std::size_t opened;
+                std::size_t probes;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_ENDPOINT_HEALTH_HPP_ */
@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include "./event_stamper.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        static const char* skip_whitespace(const char* p, const char* end)
+        {
+            while (p != end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            {
+                ++p;
+            }
+            return p;
+        }
+
+        // the scanners below return the end of what they scanned or nullptr, if the input is malformed
+        static const char* skip_string(const char* p, const char* end)
+        {
+            if (p == end || *p != '"')
+            {
+                return nullptr;
+            }
+            for (++p; p != end; ++p)
+            {
+                if (*p == '\\')
+                {
+                    if (++p == end)
+                    {
+                        return nullptr;
+                    }
+                    if (*p == 'u')
+                    {
+                        for (int i = 0; i != 4; ++i)
+                        {
+                            if (++p == end || !std::isxdigit(static_cast<unsigned char>(*p)))
+                            {
+                                return nullptr;
+                            }
+                        }
+                    }
+                    else if (*p == '\0' || !std::strchr("\"\\/bfnrt", *p))
+                    {
+                        return nullptr;
+                    }
+                }
+                else if (*p == '"')
+                {
+                    return p + 1;
+                }
+                else if (static_cast<unsigned char>(*p) < 0x20)
+                {
+                    // control characters have to be escaped
+                    return nullptr;
+                }
+            }
+            return nullptr;
+        }
+
+        static const char* skip_digits(const char* p, const char* end)
+        {
+            while (p != end && *p >= '0' && *p <= '9')
+            {
+                ++p;
+            }
+            return p;
+        }
+
+        // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+        static const char* skip_number(const char* p, const char* end)
+        {
+            if (p != end && *p == '-')
+            {
+                ++p;
+            }
+            if (p == end || *p < '0' || *p > '9')
+            {
+                return nullptr;
+            }
+            p = (*p == '0') ? p + 1 : skip_digits(p, end);
+            if (p != end && *p == '.')
+            {
+                auto fraction = ++p;
+                p = skip_digits(p, end);
+                if (p == fraction)
+                {
+                    return nullptr;
+                }
+            }
+            if (p != end && (*p == 'e' || *p == 'E'))
+            {
+                if (++p != end && (*p == '+' || *p == '-'))
+                {
+                    ++p;
+                }
+                auto exponent = p;
+                p = skip_digits(p, end);
+                if (p == exponent)
+                {
+                    return nullptr;
+                }
+            }
+            return p;
+        }
+
+        static const char* skip_literal(const char* p, const char* end, const char* literal)
+        {
+            for (; *literal; ++p, ++literal)
+            {
+                if (p == end || *p != *literal)
+                {
+                    return nullptr;
+                }
+            }
+            return p;
+        }
+
+        static const char* skip_value(const char* p, const char* end, int depth=0);
+
+        // calls member(key_begin, key_end, value_begin, value_end) for every member of the object at p
+        template<typename Member>
+        static const char* scan_object(const char* p, const char* end, int depth, Member member)
+        {
+            if (p == end || *p != '{')
+            {
+                return nullptr;
+            }
+            p = skip_whitespace(p + 1, end);
+            if (p != end && *p == '}')
+            {
+                return p + 1;
+            }
+            while (p != end)
+            {
+                auto key = p;
+                p = skip_string(p, end);
+                if (!p)
+                {
+                    return nullptr;
+                }
+                auto key_end = p;
+                p = skip_whitespace(p, end);
+                if (p == end || *p != ':')
+                {
+                    return nullptr;
+                }
+                auto value = skip_whitespace(p + 1, end);
+                p = skip_value(value, end, depth + 1);
+                if (!p)
+                {
+                    return nullptr;
+                }
+                member(key, key_end, value, p);
+                p = skip_whitespace(p, end);
+                if (p != end && *p == ',')
+                {
+                    p = skip_whitespace(p + 1, end);
+                }
+                else if (p != end && *p == '}')
+                {
+                    return p + 1;
+                }
+                else
+                {
+                    return nullptr;
+                }
+            }
+            return nullptr;
+        }
+
+        static const char* skip_value(const char* p, const char* end, int depth)
+        {
+            // deeply nested input is rejected, so malicious input can't overflow the stack
+            if (p == end || depth > 64)
+            {
+                return nullptr;
+            }
+            switch (*p)
+            {
+                case '"':
+                    return skip_string(p, end);
+                case '{':
+                    return scan_object(p, end, depth, [](const char*, const char*, const char*, const char*) {});
+                case '[':
+                    p = skip_whitespace(p + 1, end);
+                    if (p != end && *p == ']')
+                    {
+                        return p + 1;
+                    }
+                    while (p)
+                    {
+                        p = skip_value(p, end, depth + 1);
+                        p = p ? skip_whitespace(p, end) : nullptr;
+                        if (!p || p == end)
+                        {
+                            return nullptr;
+                        }
+                        if (*p == ']')
+                        {
+                            return p + 1;
+                        }
+                        p = (*p == ',') ? skip_whitespace(p + 1, end) : nullptr;
+                    }
+                    return nullptr;
+                case 't':
+                    return skip_literal(p, end, "true");
+                case 'f':
+                    return skip_literal(p, end, "false");
+                case 'n':
+                    return skip_literal(p, end, "null");
+                default:
+                    return skip_number(p, end);
+            }
+        }
+
+        static bool equals(const char* begin, const char* end, const std::string& s)
+        {
+            return std::size_t(end - begin) == s.size() && std::equal(begin, end, s.begin());
+        }
+
+        static std::string encode(const Value& value)
+        {
+            Json::FastWriter writer;
+            auto ret = writer.write(value);
+            if (!ret.empty() && ret.back() == '\n')
+            {
+                ret.pop_back();
+            }
+            return ret;
+        }
+
+        EventStamper::EventStamper(const std::string& token)
+        : token_property("\"token\":" + encode(token))
+        , base_properties(std::make_shared<Properties>())
+        {
+        }
+
+        void EventStamper::set_base_properties(const Value& properties)
+        {
+            auto serialized = std::make_shared<Properties>();
+            for (const auto& name : properties.getMemberNames())
+            {
+                serialized->emplace_back(encode(name), encode(properties[name]));
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            base_properties = serialized;
+        }
+
+        bool EventStamper::stamp(const char* begin, const char* end, const std::string& distinct_id, std::time_t time,
+                                 std::string& out, std::string& event_name)
+        {
+            static const std::string event_key = "\"event\"";
+            static const std::string properties_key = "\"properties\"";
+            static const std::string token_key = "\"token\"";
+            static const std::string distinct_id_key = "\"distinct_id\"";
+            static const std::string time_key = "\"time\"";
+
+            begin = skip_whitespace(begin, end);
+            while (end != begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n'))
+            {
+                --end;
+            }
+
+            const char* event = nullptr;
+            const char* event_end = nullptr;
+            const char* properties = nullptr;
+            const char* properties_end = nullptr;
+            bool members = false;
+            auto object_end = scan_object(begin, end, 0, [&](const char* key, const char* key_end, const char* value, const char* value_end) {
+                members = true;
+                if (equals(key, key_end, event_key))
+                {
+                    event = value;
+                    event_end = value_end;
+                }
+                else if (equals(key, key_end, properties_key))
+                {
+                    properties = value;
+                    properties_end = value_end;
+                }
+            });
+
+            if (object_end != end || !event || *event != '"' || (properties && *properties != '{'))
+            {
+                return false;
+            }
+            event_name.assign(event + 1, event_end - 1);
+
+            // the properties the event already has
+            std::vector<std::pair<const char*, const char*>> present;
+            if (properties)
+            {
+                scan_object(properties, properties_end, 1, [&present](const char* key, const char* key_end, const char*, const char*) {
+                    present.emplace_back(key, key_end);
+                });
+            }
+            auto is_present = [&present](const std::string& key) {
+                for (const auto& p : present)
+                {
+                    if (equals(p.first, p.second, key))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            // the lock is only held to get the current base properties, so many threads can stamp at the same time
+            std::shared_ptr<const Properties> base_properties;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                base_properties = this->base_properties;
+            }
+
+            std::string stamps;
+            stamps.reserve(256);
+            auto add = [&stamps](const std::string& property) {
+                if (!stamps.empty()) stamps += ',';
+                stamps += property;
+            };
+            if (!is_present(token_key)) add(token_property);
+            if (!is_present(distinct_id_key)) add(distinct_id_key + ":" + Json::valueToQuotedString(distinct_id.c_str()));
+            if (!is_present(time_key)) add(time_key + ":" + std::to_string(static_cast<long long>(time)));
+            for (const auto& property : *base_properties)
+            {
+                if (!is_present(property.first))
+                {
+                    if (!stamps.empty()) stamps += ',';
+                    stamps += property.first;
+                    stamps += ':';
+                    stamps += property.second;
+                }
+            }
+
+            out.clear();
+            out.reserve((end - begin) + stamps.size() + 32);
+            if (properties)
+            {
+                // the stamps go first, the properties of the event follow
+                out.append(begin, properties + 1);
+                out += stamps;
+                if (!present.empty() && !stamps.empty())
+                {
+                    out += ',';
+                }
+                out.append(properties + 1, end);
+            }
+            else
+            {
+                out.append(begin, end - 1);
+                out += members ? ",\"properties\":{" : "\"properties\":{";
+                out += stamps;
+                out += "}}";
+            }
+            out += '\n';
+            return true;
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,49 @@
+#ifndef _MIXPANEL_EVENT_STAMPER_HPP_
+#define _MIXPANEL_EVENT_STAMPER_HPP_
+
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <mixpanel/value.hpp>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // Completes events that have already been serialized, e.g. by another process:
+        //
+        //   {"event":"purchase","properties":{"price":10}}
+        //
+        // gets the token, distinct_id, time and base properties added to its properties, unless they are present already.
+        // The event is only scanned to find the properties, it is never parsed into a Value. The base properties are
+        // serialized once, when they are set.
+        //
+        // Thread safe, stamp() can be called from many threads at once.
+        class EventStamper
+        {
+            public:
+                explicit EventStamper(const std::string& token);
+
+                void set_base_properties(const Value& properties);
+
+                // Writes the completed event in [begin, end), terminated by '\n', to out and its name (as found in the json) to
+                // event_name. Returns false if the input is not a json object with a string "event" and an optional object
+                // "properties".
+                bool stamp(const char* begin, const char* end, const std::string& distinct_id, std::time_t time,
+                           std::string& out, std::string& event_name);
+            private:
+                typedef std::vector<std::pair<std::string, std::string>> Properties;   // json encoded key and value
+
+                const std::string token_property;
+
+                // replaced as a whole by set_base_properties(), so stamp() can keep using the old ones without a lock
+                std::mutex mutex;
+                std::shared_ptr<const Properties> base_properties;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_EVENT_STAMPER_HPP_ */
@@ -0,0 +1,125 @@
+#include <string>
+#include "./file_lock.hpp"
+#include "./platform_helpers.hpp"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        #ifdef WIN32
+        FileLock::FileLock(const std::string& path)
+        : path(path)
+        , handle(INVALID_HANDLE_VALUE)
+        , locked(false)
+        {
+        }
+
+        FileLock::~FileLock()
+        {
+            unlock();
+            if (handle != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(handle);
+            }
+        }
+
+        bool FileLock::open()
+        {
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                handle = CreateFileW(PlatformHelpers::utf8_to_wstring(path).c_str(), GENERIC_READ | GENERIC_WRITE,
+                                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            }
+            return handle != INVALID_HANDLE_VALUE;
+        }
+
+        void FileLock::lock()
+        {
+            OVERLAPPED overlapped = {};
+            locked = open() && LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+        }
+
+        bool FileLock::try_lock()
+        {
+            OVERLAPPED overlapped = {};
+            locked = open() && LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped);
+            return locked;
+        }
+
+        void FileLock::unlock()
+        {
+            if (locked)
+            {
+                OVERLAPPED overlapped = {};
+                UnlockFileEx(handle, 0, 1, 0, &overlapped);
+                locked = false;
+            }
+        }
+        #else
+        FileLock::FileLock(const std::string& path)
+        : path(path)
+        , fd(-1)
+        , locked(false)
+        {
+        }
+
+        FileLock::~FileLock()
+        {
+            // closing the file releases the lock
+            if (fd != -1)
+            {
+                close(fd);
+            }
+        }
+
+        bool FileLock::open()
+        {
+            if (fd == -1)
+            {
+                fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            }
+            return fd != -1;
+        }
+
+        void FileLock::lock()
+        {
+            // if the file can't be opened, there is nothing to lock against either
+            if (!open())
+            {
+                return;
+            }
+
+            int ret;
+            do
+            {
+                ret = flock(fd, LOCK_EX);
+            } while (ret == -1 && errno == EINTR);
+            locked = (ret == 0);
+        }
+
+        bool FileLock::try_lock()
+        {
+            locked = open() && flock(fd, LOCK_EX | LOCK_NB) == 0;
+            return locked;
+        }
+
+        void FileLock::unlock()
+        {
+            if (locked)
+            {
+                flock(fd, LOCK_UN);
+                locked = false;
+            }
+        }
+        #endif
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,44 @@
+#ifndef _MIXPANEL_FILE_LOCK_HPP_
+#define _MIXPANEL_FILE_LOCK_HPP_
+
+#include <string>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // An exclusive advisory lock on a file, shared between processes (flock() on posix, LockFileEx() on Windows).
+        // The file is created if it does not exist. The operating system releases the lock when the process exits,
+        // no matter how.
+        //
+        // Two FileLocks on the same path exclude each other, even within one process. A single FileLock is not
+        // thread safe and not recursive. Meets the Lockable requirements, so it works with std::unique_lock.
+        class FileLock
+        {
+            public:
+                explicit FileLock(const std::string& path);
+                ~FileLock();
+
+                FileLock(const FileLock&) = delete;
+                FileLock& operator=(const FileLock&) = delete;
+
+                void lock();
+                bool try_lock();
+                void unlock();
+
+                bool owns_lock() const { return locked; }
+            private:
+                bool open();
+
+                std::string path;
+                #ifdef WIN32
+                void* handle;
+                #else
+                int fd;
+                #endif
+                bool locked;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_FILE_LOCK_HPP_ */
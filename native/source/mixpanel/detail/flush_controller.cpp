@@ -0,0 +1,75 @@
+#include <algorithm>
+#include "./flush_controller.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        const unsigned FlushController::cellular_factor;
+
+        FlushController::FlushController(duration min_interval, duration max_interval, std::size_t flush_bytes)
+        : min_interval(min_interval)
+        , max_interval(std::max(min_interval, max_interval))
+        , flush_bytes(std::max<std::size_t>(flush_bytes, 1))
+        , cellular(false)
+        , interval(min_interval)
+        , last_flush(time_point::min())
+        , pending_since(time_point::max())
+        {
+        }
+
+        void FlushController::set_cellular(bool cellular)
+        {
+            this->cellular = cellular;
+            interval = std::min(std::max(interval, get_min_interval()), max_interval);
+        }
+
+        std::size_t FlushController::get_flush_bytes() const
+        {
+            return cellular ? flush_bytes * cellular_factor : flush_bytes;
+        }
+
+        FlushController::duration FlushController::get_min_interval() const
+        {
+            return cellular ? std::min(min_interval * cellular_factor, max_interval) : min_interval;
+        }
+
+        FlushController::time_point FlushController::next_flush(std::size_t queued, std::size_t enqueued, time_point now)
+        {
+            if (queued == 0)
+            {
+                pending_since = time_point::max();
+                return time_point::max();
+            }
+
+            if (pending_since == time_point::max())
+            {
+                pending_since = now;
+            }
+
+            // the radio has just been up, so even a large queue waits a little
+            auto earliest = (last_flush == time_point::min()) ? now : last_flush + get_min_interval();
+            if (enqueued >= get_flush_bytes())
+            {
+                return earliest;
+            }
+            return std::max(earliest, pending_since + interval);
+        }
+
+        void FlushController::flushed(std::size_t enqueued, time_point now)
+        {
+            last_flush = now;
+            pending_since = time_point::max();
+
+            if (enqueued >= get_flush_bytes())
+            {
+                interval /= 2;
+            }
+            else if (enqueued < get_flush_bytes() / 4)
+            {
+                interval *= 2;
+            }
+            interval = std::min(std::max(interval, get_min_interval()), max_interval);
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,61 @@
+#ifndef _MIXPANEL_FLUSH_CONTROLLER_HPP_
+#define _MIXPANEL_FLUSH_CONTROLLER_HPP_
+
+#include <chrono>
+#include <cstddef>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // Decides when to flush in adaptive mode, see Mixpanel::set_adaptive_flush().
+        //
+        // The interval starts at the minimum. It doubles after every flush of light traffic (less than a quarter of
+        // flush_bytes enqueued since the last flush) and halves after every flush of heavy traffic, within [min_interval,
+        // max_interval]. Once flush_bytes have been enqueued, the queues are flushed right away, as long as the last flush
+        // is min_interval ago. On carrier data networks, flush_bytes and min_interval are cellular_factor times larger,
+        // for larger and rarer batches.
+        //
+        // Only does the arithmetic, the time is passed in. Not thread safe, the owner guards it.
+        class FlushController
+        {
+            public:
+                typedef std::chrono::steady_clock::time_point time_point;
+                typedef std::chrono::steady_clock::duration duration;
+
+                FlushController(duration min_interval, duration max_interval, std::size_t flush_bytes);
+
+                void set_cellular(bool cellular);
+
+                // when to flush, a time at or before *now* means right away. *queued* is the size of the queues,
+                // *enqueued* the part that has been enqueued since the last flush. time_point::max(), if nothing is queued.
+                //
+                // The threshold and the interval follow the traffic, not a backlog that failed to send: that is tried
+                // again once per interval.
+                time_point next_flush(std::size_t queued, std::size_t enqueued, time_point now);
+
+                // a flush of *enqueued* new bytes started at *now*
+                void flushed(std::size_t enqueued, time_point now);
+
+                duration get_interval() const { return interval; }
+                std::size_t get_flush_bytes() const;
+
+                static const unsigned cellular_factor = 4;
+            private:
+                duration get_min_interval() const;
+
+                const duration min_interval;
+                const duration max_interval;
+                const std::size_t flush_bytes;
+                bool cellular;
+
+                duration interval;
+                time_point last_flush;
+
+                // when the worker first saw the queued bytes, time_point::max() if nothing is queued
+                time_point pending_since;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_FLUSH_CONTROLLER_HPP_ */
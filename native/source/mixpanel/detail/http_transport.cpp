@@ -0,0 +1,41 @@
+#include <cstdlib>
+
+#include "./http_transport.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        HttpTransport::HttpTransport(ConnectionPool& connection_pool)
+        : connection_pool(connection_pool)
+        {
+        }
+
+        Transport::Response HttpTransport::send(const Request& request)
+        {
+            nanowww::Request http_request("POST", request.url, request.body);
+            http_request.set_header("Content-Type", "application/x-www-form-urlencoded");
+
+            Response response;
+            nanowww::Response http_response;
+            if (!connection_pool.send_request(http_request, http_response, response.error, &cancellation, &response.handshakes))
+            {
+                return response;
+            }
+
+            response.status = http_response.status();
+            response.body = http_response.content();
+            auto retry_after = http_response.get_header("Retry-After");
+            if (!retry_after.empty())
+            {
+                response.retry_after = std::atoi(retry_after.c_str());
+            }
+            return response;
+        }
+
+        void HttpTransport::cancel()
+        {
+            cancellation.cancel();
+        }
+    } // namespace detail
+} // namespace mixpanel
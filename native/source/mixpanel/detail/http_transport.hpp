@@ -0,0 +1,29 @@
+#ifndef _MIXPANEL_HTTP_TRANSPORT_HPP_
+#define _MIXPANEL_HTTP_TRANSPORT_HPP_
+
+#include <mixpanel/mixpanel.hpp>
+#include "./connection_pool.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // The built-in transport: nanowww over a connection pool, https through mbedTLS. cancel() is for good, the
+        // requests after it fail without touching the network.
+        //
+        // Thread safe. The connection pool must outlive the transport.
+        class HttpTransport : public Transport
+        {
+            public:
+                explicit HttpTransport(ConnectionPool& connection_pool);
+
+                Response send(const Request& request) override;
+                void cancel() override;
+            private:
+                ConnectionPool& connection_pool;
+                ConnectionPool::Cancellation cancellation;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_HTTP_TRANSPORT_HPP_ */
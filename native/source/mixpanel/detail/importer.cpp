@@ -0,0 +1,430 @@
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/value.hpp>
+
+#include "./importer.hpp"
+#include "../../dependencies/nano/include/nanouri/nanouri.h"
+#include "./base64.hpp"
+#include "./logging.hpp"
+
+namespace mixpanel
+{
+    Mixpanel::ImportOptions::ImportOptions()
+    : api_host("https://api.mixpanel.com/")
+    , max_batch_events(2000)
+    , max_batch_bytes(10 * 1024 * 1024)
+    , connections(8)
+    , max_attempts(5)
+    , first_retry_delay_ms(1000)
+    {
+    }
+
+    namespace detail
+    {
+        static const std::chrono::milliseconds max_retry_delay(60 * 1000);
+
+        static std::string import_url(const Mixpanel::ImportOptions& options)
+        {
+            auto url = options.api_host;
+            if (url.empty() || url.back() != '/')
+            {
+                url += '/';
+            }
+
+            // strict mode makes the endpoint validate every record and report the ones that failed
+            url += "import?strict=1";
+            if (!options.project_id.empty())
+            {
+                url += "&project_id=" + nu_escape_uri(options.project_id);
+            }
+            return url;
+        }
+
+        static void trim(std::string& s)
+        {
+            static const char* whitespace = " \t\r\n";
+            s.erase(s.find_last_not_of(whitespace) + 1);
+            s.erase(0, s.find_first_not_of(whitespace));
+        }
+
+        Importer::Importer(Mixpanel& mixpanel, const Mixpanel::ImportOptions& options)
+        : mixpanel(mixpanel)
+        , options(options)
+        , url(import_url(options))
+        , authorization("Basic " + base64_encode(options.api_secret + ":"))
+        , connection_pool(std::max(options.connections, 1u))
+        , source_done(false)
+        , source_exhausted(false)
+        , aborted(false)
+        , imported(0)
+        , rejected(0)
+        , failed(0)
+        , requests(0)
+        , retries(0)
+        , bytes(0)
+        {
+        }
+
+        Mixpanel::ImportStats Importer::run(const std::function<bool(std::string& event)>& source)
+        {
+            start = last_progress = std::chrono::steady_clock::now();
+
+            const std::size_t connections = std::max(options.connections, 1u);
+            const std::size_t max_queued_batches = 2 * connections;
+            const std::size_t max_batch_events = std::max<std::size_t>(options.max_batch_events, 1);
+
+            std::vector<std::thread> senders;
+            for (std::size_t i = 0; i != connections; ++i)
+            {
+                senders.emplace_back(&Importer::send_batches, this);
+            }
+
+            // returns false, if the import has been aborted. The batch is given up on then, like the queued ones.
+            auto push = [&](Batch& batch) {
+                std::string abort_error;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    space_available.wait(lock, [&] { return batches.size() < max_queued_batches || aborted; });
+                    if (!aborted)
+                    {
+                        batches.push_back(std::move(batch));
+                        batch_available.notify_one();
+                        batch = Batch();
+                        return true;
+                    }
+                    abort_error = "import aborted: " + error;
+                }
+                give_up(batch.events, abort_error, failed);
+                batch = Batch();
+                return false;
+            };
+
+            Batch batch;
+            std::string event;
+            bool running = true;
+            bool exhausted = false;
+            while (running)
+            {
+                if (!source(event))
+                {
+                    exhausted = true;
+                    break;
+                }
+
+                trim(event);
+                if (event.empty())
+                {
+                    continue;
+                }
+
+                if (event.size() + 2 > options.max_batch_bytes)
+                {
+                    give_up(std::vector<std::string>(1, event), "event exceeds the maximum request size", rejected);
+                    continue;
+                }
+
+                // the request body is a json array, so every event costs one more byte for the separator
+                if (!batch.events.empty() && (batch.events.size() >= max_batch_events || batch.bytes + event.size() + 1 > options.max_batch_bytes))
+                {
+                    running = push(batch);
+                }
+
+                batch.bytes += event.size() + 1;
+                batch.events.push_back(std::move(event));
+                event.clear();
+            }
+
+            // after an abort, this gives up on the event that was read last
+            if (!batch.events.empty())
+            {
+                push(batch);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                source_done = true;
+                source_exhausted = exhausted;
+            }
+            batch_available.notify_all();
+
+            for (auto& sender : senders)
+            {
+                sender.join();
+            }
+
+            report_progress(true);
+
+            auto stats = get_stats();
+            MIXPANEL_LOG(mixpanel, INFO, "import finished: " + std::to_string(stats.imported) + " events imported, " +
+                         std::to_string(stats.rejected) + " rejected, " + std::to_string(stats.failed) + " failed in " +
+                         std::to_string(stats.seconds) + " s (" + std::to_string(static_cast<std::uint64_t>(stats.events_per_second())) + " events/s)");
+            if (!stats.source_exhausted)
+            {
+                MIXPANEL_LOG(mixpanel, WARNING, "import: stopped before the end of the source, the events after the last one read are not counted");
+            }
+            return stats;
+        }
+
+        void Importer::send_batches()
+        {
+            for (;;)
+            {
+                Batch batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    batch_available.wait(lock, [this] { return !batches.empty() || source_done || aborted; });
+                    if (batches.empty())
+                    {
+                        return;
+                    }
+                    batch = std::move(batches.front());
+                    batches.pop_front();
+                }
+                space_available.notify_one();
+
+                deliver(batch);
+                report_progress(false);
+            }
+        }
+
+        void Importer::deliver(Batch& batch)
+        {
+            for (;;)
+            {
+                std::string abort_error;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    abort_error = aborted ? "import aborted: " + error : "";
+                }
+                if (!abort_error.empty())
+                {
+                    give_up(batch.events, abort_error, failed);
+                    return;
+                }
+
+                std::chrono::milliseconds retry_after(0);
+                std::string error;
+                switch (send(batch, retry_after, error))
+                {
+                    case Outcome::Imported:
+                        return;
+
+                    case Outcome::Rejected:
+                        MIXPANEL_LOG(mixpanel, WARNING, "import: " + std::to_string(batch.events.size()) + " events rejected: " + error);
+                        give_up(batch.events, error, rejected);
+                        return;
+
+                    case Outcome::TooLarge:
+                        if (batch.events.size() > 1)
+                        {
+                            // the endpoint counts the size differently than we do, try again with two halves
+                            Batch second;
+                            auto middle = batch.events.begin() + batch.events.size() / 2;
+                            second.events.assign(std::make_move_iterator(middle), std::make_move_iterator(batch.events.end()));
+                            batch.events.erase(middle, batch.events.end());
+                            for (auto* half : {&batch, &second})
+                            {
+                                half->bytes = 0;
+                                for (const auto& event : half->events) half->bytes += event.size() + 1;
+                                deliver(*half);
+                            }
+                            return;
+                        }
+                        give_up(batch.events, error, rejected);
+                        return;
+
+                    case Outcome::Unauthorized:
+                        abort(error);
+                        give_up(batch.events, error, failed);
+                        return;
+
+                    case Outcome::Transient:
+                        MIXPANEL_LOG(mixpanel, INFO, "import: request failed, retrying: " + error);
+                        if (!back_off(batch, retry_after))
+                        {
+                            MIXPANEL_LOG(mixpanel, WARNING, "import: giving up on " + std::to_string(batch.events.size()) + " events after " + std::to_string(batch.attempts) + " attempts: " + error);
+                            give_up(batch.events, error, failed);
+                            return;
+                        }
+                        break;
+                }
+            }
+        }
+
+        Importer::Outcome Importer::send(const Batch& batch, std::chrono::milliseconds& retry_after, std::string& error)
+        {
+            std::string body;
+            body.reserve(batch.bytes + 2);
+            body += '[';
+            for (const auto& event : batch.events)
+            {
+                if (body.size() > 1) body += ',';
+                body += event;
+            }
+            body += ']';
+
+            nanowww::Request request("POST", url, body);
+            request.set_header("Authorization", authorization.c_str());
+            request.set_header("Content-Type", "application/json");
+
+            ++requests;
+            bytes += body.size();
+
+            nanowww::Response response;
+            if (!connection_pool.send_request(request, response, error))
+            {
+                return Outcome::Transient;
+            }
+
+            auto retry_after_header = response.get_header("Retry-After");
+            if (!retry_after_header.empty())
+            {
+                retry_after = std::chrono::seconds(std::atoi(retry_after_header.c_str()));
+            }
+
+            const auto status = response.status();
+            const auto content = response.content();
+            if (status == 200)
+            {
+                imported += batch.events.size();
+                return Outcome::Imported;
+            }
+
+            error = "HTTP " + std::to_string(status) + ": " + content;
+            if (status == 401 || status == 403)
+            {
+                return Outcome::Unauthorized;
+            }
+            if (status == 413)
+            {
+                return Outcome::TooLarge;
+            }
+            if (status == 429 || status >= 500)
+            {
+                return Outcome::Transient;
+            }
+
+            // in strict mode, the valid records of a batch are imported and the invalid ones listed in failed_records
+            Json::Reader reader;
+            Value parsed_response;
+            if (status == 400 && reader.parse(content, parsed_response, false) && parsed_response["failed_records"].isArray() &&
+                !parsed_response["failed_records"].empty())
+            {
+                const auto& failed_records = parsed_response["failed_records"];
+
+                for (const auto& record : failed_records)
+                {
+                    auto index = record["index"].asUInt();
+                    if (index < batch.events.size())
+                    {
+                        give_up(std::vector<std::string>(1, batch.events[index]), record["field"].asString() + ": " + record["message"].asString(), rejected);
+                    }
+                }
+
+                auto count = parsed_response["num_records_imported"];
+                imported += count.isIntegral() ? count.asUInt64() : batch.events.size() - std::min<std::size_t>(failed_records.size(), batch.events.size());
+                return Outcome::Imported;
+            }
+
+            return Outcome::Rejected;
+        }
+
+        bool Importer::back_off(Batch& batch, std::chrono::milliseconds retry_after)
+        {
+            if (++batch.attempts >= std::max(options.max_attempts, 1u))
+            {
+                return false;
+            }
+
+            auto delay = retry_after;
+            if (delay.count() <= 0)
+            {
+                delay = std::chrono::milliseconds(options.first_retry_delay_ms);
+                for (unsigned i = 1; i < batch.attempts && delay < max_retry_delay; ++i)
+                {
+                    delay *= 2;
+                }
+            }
+            delay = std::min(delay, max_retry_delay);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (aborted_condition.wait_for(lock, delay, [this] { return aborted; }))
+            {
+                return false;
+            }
+
+            ++retries;
+            return true;
+        }
+
+        void Importer::give_up(const std::vector<std::string>& events, const std::string& error, std::atomic<std::uint64_t>& counter)
+        {
+            counter += events.size();
+            if (options.on_failed_event)
+            {
+                for (const auto& event : events)
+                {
+                    options.on_failed_event(event, error);
+                }
+            }
+        }
+
+        void Importer::abort(const std::string& error)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (aborted)
+                {
+                    return;
+                }
+                aborted = true;
+                this->error = error;
+            }
+
+            MIXPANEL_LOG(mixpanel, ERROR, "import aborted: " + error);
+            batch_available.notify_all();
+            space_available.notify_all();
+            aborted_condition.notify_all();
+        }
+
+        void Importer::report_progress(bool force)
+        {
+            if (!options.on_progress)
+            {
+                return;
+            }
+
+            // one report at a time, so the callback doesn't need to be thread safe
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            auto now = std::chrono::steady_clock::now();
+            if (!force && now - last_progress < std::chrono::seconds(1))
+            {
+                return;
+            }
+            last_progress = now;
+            options.on_progress(get_stats());
+        }
+
+        Mixpanel::ImportStats Importer::get_stats()
+        {
+            Mixpanel::ImportStats stats;
+            stats.imported = imported;
+            stats.rejected = rejected;
+            stats.failed = failed;
+            stats.requests = requests;
+            stats.retries = retries;
+            stats.bytes = bytes;
+            stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.error = error;
+            stats.source_exhausted = source_exhausted;
+            return stats;
+        }
+    } // namespace detail
+} // namespace mixpanel
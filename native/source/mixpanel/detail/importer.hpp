@@ -0,0 +1,94 @@
+#ifndef _MIXPANEL_IMPORTER_HPP_
+#define _MIXPANEL_IMPORTER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <mixpanel/mixpanel.hpp>
+#include "./connection_pool.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // Streams events to the /import endpoint, see Mixpanel::import_events().
+        //
+        // The calling thread reads the source and cuts it into batches, options.connections threads send them. The
+        // batch queue between them is bounded, so a fast source does not end up in memory as a whole.
+        class Importer
+        {
+            public:
+                Importer(Mixpanel& mixpanel, const Mixpanel::ImportOptions& options);
+
+                Importer(const Importer&) = delete;
+                Importer& operator=(const Importer&) = delete;
+
+                Mixpanel::ImportStats run(const std::function<bool(std::string& event)>& source);
+            private:
+                struct Batch
+                {
+                    Batch() : bytes(0), attempts(0) {}
+
+                    std::vector<std::string> events;
+                    std::size_t bytes;
+                    unsigned attempts;
+                };
+
+                enum class Outcome
+                {
+                    Imported,       // all of the batch, or all but the rejected events
+                    Rejected,       // none of the batch, retrying won't help
+                    TooLarge,
+                    Unauthorized,
+                    Transient       // none of the batch, try again later
+                };
+
+                void send_batches();
+                void deliver(Batch& batch);
+                Outcome send(const Batch& batch, std::chrono::milliseconds& retry_after, std::string& error);
+
+                // true if the batch should be tried again, after waiting for the back-off
+                bool back_off(Batch& batch, std::chrono::milliseconds retry_after);
+
+                void give_up(const std::vector<std::string>& events, const std::string& error, std::atomic<std::uint64_t>& counter);
+                void abort(const std::string& error);
+                void report_progress(bool force);
+                Mixpanel::ImportStats get_stats();
+
+                Mixpanel& mixpanel;
+                const Mixpanel::ImportOptions options;
+                const std::string url;
+                const std::string authorization;
+                ConnectionPool connection_pool;
+
+                std::mutex mutex;
+                std::condition_variable batch_available;
+                std::condition_variable space_available;
+                std::condition_variable aborted_condition;
+                std::deque<Batch> batches;
+                bool source_done;
+                bool source_exhausted;  // the source returned false, as opposed to the import being aborted before
+                bool aborted;
+                std::string error;
+
+                std::atomic<std::uint64_t> imported;
+                std::atomic<std::uint64_t> rejected;
+                std::atomic<std::uint64_t> failed;
+                std::atomic<std::uint64_t> requests;
+                std::atomic<std::uint64_t> retries;
+                std::atomic<std::uint64_t> bytes;
+
+                std::chrono::steady_clock::time_point start;
+                std::mutex progress_mutex;
+                std::chrono::steady_clock::time_point last_progress;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_IMPORTER_HPP_ */
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include "./io_engine.hpp"
+#include "./platform_helpers.hpp"
+
+#ifdef WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        #ifdef WIN32
+        static std::wstring native_path(const std::string& path)
+        {
+            return PlatformHelpers::utf8_to_wstring(path);
+        }
+        #else
+        static const std::string& native_path(const std::string& path)
+        {
+            return path;
+        }
+        #endif
+
+        std::unique_ptr<IOEngine> IOEngine::create()
+        {
+            #if defined(MIXPANEL_USE_IO_URING)
+            if (auto engine = create_io_uring_engine())
+            {
+                return engine;
+            }
+            #endif
+            return std::unique_ptr<IOEngine>(new PortableIOEngine());
+        }
+
+        bool PortableIOEngine::read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out)
+        {
+            out.clear();
+            std::ifstream ifs(native_path(path).c_str(), std::ios::binary | std::ios::ate);
+            if (!ifs.good())
+            {
+                return false;
+            }
+
+            std::size_t file_size = std::size_t(ifs.tellg());
+            if (offset >= file_size)
+            {
+                return true;
+            }
+
+            out.resize(std::min(max_bytes, file_size - offset));
+            ifs.seekg(offset);
+            ifs.read(&out[0], out.size());
+            out.resize(std::size_t(ifs.gcount()));
+            return true;
+        }
+
+        void PortableIOEngine::write(const std::string& path, const std::string& data)
+        {
+            std::ofstream ofs(native_path(path).c_str(), std::ios::binary | std::ios::trunc);
+            ofs.write(data.data(), data.size());
+        }
+
+        void PortableIOEngine::append(const std::string& path, const std::string& data)
+        {
+            std::ofstream ofs(native_path(path).c_str(), std::ios::binary | std::ios::app);
+            ofs.write(data.data(), data.size());
+        }
+
+        void PortableIOEngine::remove(const std::string& path)
+        {
+            #ifdef WIN32
+            _wremove(native_path(path).c_str());
+            #else
+            std::remove(path.c_str());
+            #endif
+        }
+
+        std::size_t PortableIOEngine::size(const std::string& path)
+        {
+            std::ifstream ifs(native_path(path).c_str(), std::ios::binary | std::ios::ate);
+            return ifs.good() ? std::size_t(ifs.tellg()) : 0;
+        }
+
+        void PortableIOEngine::sync(const std::string&)
+        {
+            // streams are flushed to the OS when they are closed. There is no portable way to fsync them.
+        }
+
+        void create_directory(const std::string& path)
+        {
+            #ifdef WIN32
+            _wmkdir(native_path(path).c_str());
+            #else
+            mkdir(path.c_str(), 0700);
+            #endif
+        }
+    } // namespace detail
+} // namespace mixpanel
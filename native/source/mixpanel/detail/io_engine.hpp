@@ -0,0 +1,71 @@
+#ifndef _MIXPANEL_IO_ENGINE_HPP_
+#define _MIXPANEL_IO_ENGINE_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // File I/O used by Persistence. Paths are utf-8 encoded.
+        //
+        // Engines may complete append() asynchronously. All other operations on a path
+        // observe the effects of the appends issued before them, so callers don't need
+        // to care about that unless they want the data to be on stable storage (sync()).
+        class IOEngine
+        {
+            public:
+                virtual ~IOEngine() {}
+
+                virtual const char* name() const = 0;
+
+                // reads up to max_bytes starting at offset into out. returns false if the file does not exist.
+                virtual bool read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out) = 0;
+
+                // replaces the contents of the file with data.
+                virtual void write(const std::string& path, const std::string& data) = 0;
+
+                // appends data at the end of the file, creating it if necessary.
+                virtual void append(const std::string& path, const std::string& data) = 0;
+
+                // removes the file. Does nothing if the file does not exist.
+                virtual void remove(const std::string& path) = 0;
+
+                // returns the size of the file or 0 if it does not exist.
+                virtual std::size_t size(const std::string& path) = 0;
+
+                // waits until everything written to path has been handed to stable storage.
+                virtual void sync(const std::string& path) = 0;
+
+                // returns the io_uring engine if it is compiled in and supported by the kernel,
+                // the portable engine otherwise.
+                static std::unique_ptr<IOEngine> create();
+        };
+
+        // std::fstream based engine that works everywhere. All operations are synchronous.
+        class PortableIOEngine : public IOEngine
+        {
+            public:
+                const char* name() const override { return "portable"; }
+
+                bool read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out) override;
+                void write(const std::string& path, const std::string& data) override;
+                void append(const std::string& path, const std::string& data) override;
+                void remove(const std::string& path) override;
+                std::size_t size(const std::string& path) override;
+                void sync(const std::string& path) override;
+        };
+
+        // creates the directory, if it does not exist yet. Parent directories must exist.
+        void create_directory(const std::string& path);
+
+        #if defined(MIXPANEL_USE_IO_URING)
+        // returns nullptr if io_uring is not available (old kernel, seccomp filter, ...)
+        std::unique_ptr<IOEngine> create_io_uring_engine();
+        #endif
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_IO_ENGINE_HPP_ */
@@ -0,0 +1,622 @@
+#include "./io_engine.hpp"
+
+#if defined(MIXPANEL_USE_IO_URING)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // io_uring based engine for Linux. Appends are copied into registered buffers and submitted as
+        // fixed writes followed by an fdatasync, without waiting for them to complete. That way the worker
+        // can go on with the network request while the kernel writes out the queue.
+        // We're talking to the kernel directly instead of linking liburing to stay dependency free.
+        class UringIOEngine : public IOEngine
+        {
+            public:
+                static std::unique_ptr<IOEngine> create();
+                ~UringIOEngine();
+
+                const char* name() const override { return "io_uring"; }
+
+                bool read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out) override;
+                void write(const std::string& path, const std::string& data) override;
+                void append(const std::string& path, const std::string& data) override;
+                void remove(const std::string& path) override;
+                std::size_t size(const std::string& path) override;
+                void sync(const std::string& path) override;
+            private:
+                static const unsigned ring_entries = 64;
+                static const unsigned buffer_count = 8;
+                static const std::size_t buffer_size = 64 * 1024;
+
+                struct File
+                {
+                    int fd;
+                    std::size_t end;    // logical size including appends that are still in flight
+                    unsigned pending;   // number of operations in flight
+                };
+
+                struct Op
+                {
+                    File* file;
+                    unsigned char opcode;
+                    int buffer;         // index into buffers or -1
+                    std::size_t offset;
+                    std::size_t length;
+                    int result;
+                    bool done;
+                };
+
+                UringIOEngine();
+                bool setup();
+
+                File* open(const std::string& path, bool create);
+                void close(const std::string& path);
+
+                unsigned submit(File* file, unsigned char opcode, int buffer, std::size_t offset, std::size_t length, unsigned char flags=0);
+                void enter(unsigned min_complete);
+                void reap();
+                void wait_for(unsigned op);
+                void wait_for_file(File* file);
+                void wait_for_writes(File* file, std::size_t begin, std::size_t end);
+                void submit_append(File* file, const std::string& data, bool durable);
+                bool has_free_buffer() const;
+                int acquire_buffer();
+                void complete(unsigned op_index, int result);
+                void release(unsigned op_index);
+
+                std::mutex mutex;
+
+                int ring_fd;
+                void* sq_ring;
+                void* cq_ring;
+                std::size_t sq_ring_size;
+                std::size_t cq_ring_size;
+                io_uring_sqe* sqes;
+
+                unsigned* sq_tail;
+                unsigned* sq_mask;
+                unsigned* sq_array;
+                unsigned* cq_head;
+                unsigned* cq_tail;
+                unsigned* cq_mask;
+                io_uring_cqe* cqes;
+
+                unsigned to_submit;
+                unsigned in_flight;
+
+                std::vector<char*> buffers;
+                std::vector<bool> buffer_busy;
+                std::vector<Op> ops;
+                std::vector<unsigned> free_ops;
+
+                std::map<std::string, File> files;
+        };
+
+        const unsigned UringIOEngine::ring_entries;
+        const unsigned UringIOEngine::buffer_count;
+        const std::size_t UringIOEngine::buffer_size;
+
+        static int io_uring_setup(unsigned entries, io_uring_params* p)
+        {
+            return (int) syscall(__NR_io_uring_setup, entries, p);
+        }
+
+        static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+        }
+
+        static int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+        {
+            return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+        }
+
+        std::unique_ptr<IOEngine> create_io_uring_engine()
+        {
+            return UringIOEngine::create();
+        }
+
+        std::unique_ptr<IOEngine> UringIOEngine::create()
+        {
+            std::unique_ptr<UringIOEngine> engine(new UringIOEngine());
+            if (!engine->setup())
+            {
+                return nullptr;
+            }
+            return std::unique_ptr<IOEngine>(engine.release());
+        }
+
+        UringIOEngine::UringIOEngine()
+        : ring_fd(-1)
+        , sq_ring(MAP_FAILED)
+        , cq_ring(MAP_FAILED)
+        , sq_ring_size(0)
+        , cq_ring_size(0)
+        , sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+        , to_submit(0)
+        , in_flight(0)
+        {
+        }
+
+        bool UringIOEngine::setup()
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+
+            ring_fd = io_uring_setup(ring_entries, &params);
+            if (ring_fd < 0)
+            {
+                return false;
+            }
+
+            sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single_mmap)
+            {
+                sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+            }
+
+            sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            if (sq_ring == MAP_FAILED)
+            {
+                return false;
+            }
+
+            if (single_mmap)
+            {
+                cq_ring = sq_ring;
+            }
+            else
+            {
+                cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+                if (cq_ring == MAP_FAILED)
+                {
+                    return false;
+                }
+            }
+
+            sqes = static_cast<io_uring_sqe*>(mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+            if (sqes == MAP_FAILED)
+            {
+                return false;
+            }
+
+            char* sq = static_cast<char*>(sq_ring);
+            char* cq = static_cast<char*>(cq_ring);
+            sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+            // register the buffers, so the kernel does not need to map them for every request
+            std::vector<iovec> iovecs;
+            for (unsigned i = 0; i != buffer_count; ++i)
+            {
+                void* buffer = nullptr;
+                if (posix_memalign(&buffer, 4096, buffer_size) != 0)
+                {
+                    return false;
+                }
+                buffers.push_back(static_cast<char*>(buffer));
+                buffer_busy.push_back(false);
+                iovecs.push_back({buffer, buffer_size});
+            }
+
+            if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned) iovecs.size()) < 0)
+            {
+                return false;
+            }
+
+            ops.resize(ring_entries);
+            for (unsigned i = 0; i != ring_entries; ++i)
+            {
+                free_ops.push_back(ring_entries - 1 - i);
+            }
+
+            return true;
+        }
+
+        UringIOEngine::~UringIOEngine()
+        {
+            if (ring_fd >= 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                while (in_flight)
+                {
+                    enter(1);
+                }
+            }
+
+            for (auto& file : files)
+            {
+                ::close(file.second.fd);
+            }
+
+            for (auto buffer : buffers)
+            {
+                free(buffer);
+            }
+
+            if (sqes != MAP_FAILED) munmap(sqes, ring_entries * sizeof(io_uring_sqe));
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+            if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+            if (ring_fd >= 0) ::close(ring_fd);
+        }
+
+        UringIOEngine::File* UringIOEngine::open(const std::string& path, bool create)
+        {
+            auto it = files.find(path);
+            if (it != files.end())
+            {
+                return &it->second;
+            }
+
+            int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+            if (fd < 0)
+            {
+                return nullptr;
+            }
+
+            struct stat st;
+            std::size_t end = (fstat(fd, &st) == 0) ? std::size_t(st.st_size) : 0;
+
+            return &(files[path] = File{fd, end, 0});
+        }
+
+        void UringIOEngine::close(const std::string& path)
+        {
+            auto it = files.find(path);
+            if (it != files.end())
+            {
+                wait_for_file(&it->second);
+                ::close(it->second.fd);
+                files.erase(it);
+            }
+        }
+
+        unsigned UringIOEngine::submit(File* file, unsigned char opcode, int buffer, std::size_t offset, std::size_t length, unsigned char flags)
+        {
+            while (free_ops.empty())
+            {
+                enter(1);
+            }
+
+            unsigned op_index = free_ops.back();
+            free_ops.pop_back();
+            ops[op_index] = Op{file, opcode, buffer, offset, length, 0, false};
+
+            unsigned tail = *sq_tail;
+            unsigned index = tail & *sq_mask;
+            io_uring_sqe* sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->flags = flags;
+            sqe->fd = file->fd;
+            sqe->off = offset;
+            sqe->user_data = op_index;
+            if (buffer >= 0)
+            {
+                sqe->addr = reinterpret_cast<unsigned long long>(buffers[buffer]);
+                sqe->len = (unsigned) length;
+                sqe->buf_index = (unsigned short) buffer;
+            }
+            if (opcode == IORING_OP_FSYNC)
+            {
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            }
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+            ++file->pending;
+            ++in_flight;
+            ++to_submit;
+
+            return op_index;
+        }
+
+        void UringIOEngine::enter(unsigned min_complete)
+        {
+            int ret = io_uring_enter(ring_fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+            if (ret >= 0)
+            {
+                to_submit -= std::min<unsigned>(to_submit, ret);
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                // the ring is unusable. Complete everything synchronously, so callers don't hang.
+                for (unsigned i = 0; i != ops.size(); ++i)
+                {
+                    if (ops[i].file && !ops[i].done)
+                    {
+                        complete(i, -errno);
+                    }
+                }
+                to_submit = 0;
+            }
+            reap();
+        }
+
+        void UringIOEngine::reap()
+        {
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                complete((unsigned) cqe.user_data, cqe.res);
+                ++head;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        void UringIOEngine::complete(unsigned op_index, int result)
+        {
+            Op& op = ops[op_index];
+            if (!op.file || op.done)
+            {
+                return;
+            }
+
+            // short or failed writes are finished synchronously, we don't want to leave holes in the queue
+            if (op.opcode == IORING_OP_WRITE_FIXED && (result < 0 || std::size_t(result) < op.length))
+            {
+                std::size_t written = std::max(result, 0);
+                while (written < op.length)
+                {
+                    auto ret = pwrite(op.file->fd, buffers[op.buffer] + written, op.length - written, op.offset + written);
+                    if (ret <= 0) break;
+                    written += ret;
+                }
+                result = (int) written;
+            }
+            else if (op.opcode == IORING_OP_FSYNC && result < 0)
+            {
+                // also if it was cancelled, because a write of its chain came up short
+                result = fdatasync(op.file->fd);
+            }
+
+            op.result = result;
+            op.done = true;
+            --op.file->pending;
+            --in_flight;
+
+            // reads are released by the reader, after it copied the data
+            if (op.opcode != IORING_OP_READ_FIXED)
+            {
+                release(op_index);
+            }
+        }
+
+        void UringIOEngine::release(unsigned op_index)
+        {
+            Op& op = ops[op_index];
+            if (op.buffer >= 0)
+            {
+                buffer_busy[op.buffer] = false;
+            }
+            op.file = nullptr;
+            free_ops.push_back(op_index);
+        }
+
+        void UringIOEngine::wait_for(unsigned op_index)
+        {
+            while (!ops[op_index].done)
+            {
+                enter(1);
+            }
+        }
+
+        void UringIOEngine::wait_for_file(File* file)
+        {
+            while (file->pending)
+            {
+                enter(1);
+            }
+        }
+
+        void UringIOEngine::wait_for_writes(File* file, std::size_t begin, std::size_t end)
+        {
+            for (unsigned i = 0; i != ops.size(); ++i)
+            {
+                const Op& op = ops[i];
+                if (op.file == file && op.opcode == IORING_OP_WRITE_FIXED && !op.done && op.offset < end && begin < op.offset + op.length)
+                {
+                    wait_for(i);
+                }
+            }
+        }
+
+        bool UringIOEngine::has_free_buffer() const
+        {
+            return std::find(buffer_busy.begin(), buffer_busy.end(), false) != buffer_busy.end();
+        }
+
+        int UringIOEngine::acquire_buffer()
+        {
+            for (;;)
+            {
+                for (unsigned i = 0; i != buffer_count; ++i)
+                {
+                    if (!buffer_busy[i])
+                    {
+                        buffer_busy[i] = true;
+                        return (int) i;
+                    }
+                }
+
+                // all buffers belong to writes in flight, wait for one of them
+                enter(1);
+            }
+        }
+
+        bool UringIOEngine::read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            out.clear();
+
+            File* file = open(path, false);
+            if (!file)
+            {
+                return false;
+            }
+
+            if (offset >= file->end)
+            {
+                return true;
+            }
+
+            // usually we're reading the front of the queue while appending to its end, so only wait for
+            // writes to the range we're interested in
+            std::size_t end = offset + std::min(max_bytes, file->end - offset);
+            wait_for_writes(file, offset, end);
+
+            while (offset < end)
+            {
+                std::size_t length = std::min(buffer_size, end - offset);
+                int buffer = acquire_buffer();
+                unsigned op = submit(file, IORING_OP_READ_FIXED, buffer, offset, length);
+                wait_for(op);
+
+                int result = ops[op].result;
+                if (result > 0)
+                {
+                    out.append(buffers[buffer], result);
+                    offset += result;
+                }
+                release(op);
+
+                if (result <= 0)
+                {
+                    break;
+                }
+            }
+
+            return true;
+        }
+
+        void UringIOEngine::submit_append(File* file, const std::string& data, bool durable)
+        {
+            // the writes are linked to the fsync after them, so it waits for them, but not for the requests on other
+            // files. A chain has to reach the kernel in one piece: before we wait for a buffer or an op, the writes
+            // chained so far get their fsync.
+            bool chained = false;
+            for (std::size_t pos = 0; pos < data.size(); pos += buffer_size)
+            {
+                if (chained && (!has_free_buffer() || free_ops.size() < 2))
+                {
+                    submit(file, IORING_OP_FSYNC, -1, 0, 0);
+                    chained = false;
+                }
+
+                std::size_t length = std::min(buffer_size, data.size() - pos);
+                int buffer = acquire_buffer();
+                // room for the write and the fsync that ends its chain
+                while (free_ops.size() < 2)
+                {
+                    enter(1);
+                }
+                std::memcpy(buffers[buffer], data.data() + pos, length);
+                submit(file, IORING_OP_WRITE_FIXED, buffer, file->end, length, durable ? IOSQE_IO_LINK : 0);
+                file->end += length;
+                chained = durable;
+            }
+
+            if (chained)
+            {
+                submit(file, IORING_OP_FSYNC, -1, 0, 0);
+            }
+
+            // hand the requests to the kernel, but don't wait for them
+            enter(0);
+        }
+
+        void UringIOEngine::append(const std::string& path, const std::string& data)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            File* file = open(path, true);
+            if (file)
+            {
+                submit_append(file, data, true);
+            }
+        }
+
+        void UringIOEngine::write(const std::string& path, const std::string& data)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            File* file = open(path, true);
+            if (!file)
+            {
+                return;
+            }
+
+            wait_for_file(file);
+            if (ftruncate(file->fd, 0) != 0)
+            {
+                return;
+            }
+            file->end = 0;
+
+            // small files (state, queue index) are rewritten often, syncing them is not worth it.
+            // A stale queue index only means that some events are sent twice after a crash.
+            submit_append(file, data, false);
+        }
+
+        void UringIOEngine::remove(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            close(path);
+            unlink(path.c_str());
+        }
+
+        std::size_t UringIOEngine::size(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto it = files.find(path);
+            if (it != files.end())
+            {
+                return it->second.end;
+            }
+
+            struct stat st;
+            return (stat(path.c_str(), &st) == 0) ? std::size_t(st.st_size) : 0;
+        }
+
+        void UringIOEngine::sync(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            auto it = files.find(path);
+            if (it != files.end())
+            {
+                // every append is followed by an fdatasync, so waiting is all we need to do
+                wait_for_file(&it->second);
+            }
+        }
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* MIXPANEL_USE_IO_URING */
@@ -0,0 +1,110 @@
+#include "./logging.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        LogRing::LogRing(std::size_t capacity)
+        : mask(0)
+        , push_position(0)
+        , pop_position(0)
+        , dropped(0)
+        {
+            std::size_t size = 1;
+            while (size < capacity) size <<= 1;
+
+            slots.reset(new Slot[size]);
+            mask = size - 1;
+            for (std::size_t i = 0; i != size; ++i)
+            {
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        bool LogRing::push(Mixpanel::LogEntry::Level level, std::string message)
+        {
+            auto position = push_position.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                auto& slot = slots[position & mask];
+                auto sequence = slot.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+                if (difference == 0)
+                {
+                    // the slot is free, claim it
+                    if (push_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        slot.entry.level = level;
+                        slot.entry.message = std::move(message);
+                        slot.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    // the slot still holds the entry of the previous lap
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                else
+                {
+                    position = push_position.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool LogRing::pop(Mixpanel::LogEntry& entry)
+        {
+            auto dropped_entries = dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped_entries)
+            {
+                entry.level = Mixpanel::LogEntry::LL_WARNING;
+                entry.message = "log queue overflow, " + std::to_string(dropped_entries) + " entries were dropped";
+                return true;
+            }
+
+            auto position = pop_position.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                auto& slot = slots[position & mask];
+                auto sequence = slot.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position + 1);
+                if (difference == 0)
+                {
+                    if (pop_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        entry.level = slot.entry.level;
+                        entry.message = std::move(slot.entry.message);
+                        slot.entry.message.clear();
+                        // free the slot for the next lap
+                        slot.sequence.store(position + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = pop_position.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool LogRing::empty() const
+        {
+            auto position = pop_position.load(std::memory_order_acquire);
+            return slots[position & mask].sequence.load(std::memory_order_acquire) != position + 1 &&
+                   dropped.load(std::memory_order_relaxed) == 0;
+        }
+
+        std::string format_log_entry(const Mixpanel::LogEntry& entry)
+        {
+            static const char *level_names[] = {
+                "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "NONE"
+            };
+            return "Mixpanel[" + std::string(level_names[entry.level]) + "]: " + entry.message;
+        }
+    } // namespace detail
+} // namespace mixpanel
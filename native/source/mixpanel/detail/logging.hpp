@@ -0,0 +1,76 @@
+#ifndef _MIXPANEL_LOGGING_HPP_
+#define _MIXPANEL_LOGGING_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <mixpanel/mixpanel.hpp>
+
+// The messages below this level are compiled out, see MIXPANEL_LOG. By default the TRACE and DEBUG messages are only
+// compiled into DEBUG builds.
+#if !defined(MIXPANEL_LOG_COMPILED_LEVEL)
+#    if defined(DEBUG)
+#        define MIXPANEL_LOG_COMPILED_LEVEL 0 // LL_TRACE
+#    else
+#        define MIXPANEL_LOG_COMPILED_LEVEL 2 // LL_INFO
+#    endif
+#endif
+
+// Logs *message* at *level* (TRACE, DEBUG, ...) through the Mixpanel instance *instance*. The message is only built when
+// the level is logged, so it may format whole batches:
+//
+//     MIXPANEL_LOG(*mixpanel, TRACE, "data: " + batch.toStyledString());
+#define MIXPANEL_LOG(instance, level, message)                                                                          \
+    do                                                                                                                  \
+    {                                                                                                                   \
+        if (static_cast<int>(::mixpanel::Mixpanel::LogEntry::LL_##level) >= MIXPANEL_LOG_COMPILED_LEVEL &&              \
+            (instance).is_logged(::mixpanel::Mixpanel::LogEntry::LL_##level))                                           \
+        {                                                                                                               \
+            (instance).log(::mixpanel::Mixpanel::LogEntry::LL_##level, (message));                                      \
+        }                                                                                                               \
+    } while (false)
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // A bounded queue of log entries, which any thread may push to and pop from without taking a lock. Each slot
+        // has a sequence number, which tells the producers and consumers whose turn it is. When the ring is full, the
+        // entries are dropped and counted; the next pop() reports them in a warning of their own.
+        //
+        // Thread safe.
+        class LogRing
+        {
+            public:
+                // *capacity* is rounded up to a power of two
+                explicit LogRing(std::size_t capacity=256);
+
+                // false if the ring is full and the entry was dropped
+                bool push(Mixpanel::LogEntry::Level level, std::string message);
+                bool pop(Mixpanel::LogEntry& entry);
+
+                bool empty() const;
+            private:
+                LogRing(const LogRing&) = delete;
+                LogRing& operator=(const LogRing&) = delete;
+
+                struct Slot
+                {
+                    std::atomic<std::size_t> sequence;
+                    Mixpanel::LogEntry entry;
+                };
+
+                std::unique_ptr<Slot[]> slots;
+                std::size_t mask;
+                std::atomic<std::size_t> push_position;
+                std::atomic<std::size_t> pop_position;
+                std::atomic<std::uint64_t> dropped;
+        };
+
+        // "Mixpanel[WARNING]: message"
+        std::string format_log_entry(const Mixpanel::LogEntry& entry);
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_LOGGING_HPP_ */
@@ -0,0 +1,81 @@
+#include <cstdlib>
+
+#include "./loopback_transport.hpp"
+#include "./base64.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // the reverse of nu_escape_uri()
+        static std::string unescape(const std::string& s)
+        {
+            std::string result;
+            result.reserve(s.size());
+            for (std::size_t i = 0; i < s.size(); ++i)
+            {
+                if (s[i] == '%' && i + 2 < s.size())
+                {
+                    result += static_cast<char>(std::strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+                    i += 2;
+                }
+                else
+                {
+                    result += (s[i] == '+') ? ' ' : s[i];
+                }
+            }
+            return result;
+        }
+
+        LoopbackTransport::LoopbackTransport(Handler handler)
+        : handler(handler)
+        , requests(0)
+        , records(0)
+        {
+        }
+
+        Transport::Response LoopbackTransport::send(const Request& request)
+        {
+            auto batch = decode(request);
+            ++requests;
+            records += batch.records.size();
+            return handler ? handler(request, batch) : accepted();
+        }
+
+        Transport::Response LoopbackTransport::accepted()
+        {
+            Response response;
+            response.status = 200;
+            response.body = "{\"status\":1,\"error\":null}";
+            return response;
+        }
+
+        LoopbackTransport::Batch LoopbackTransport::decode(const Request& request)
+        {
+            Batch batch;
+
+            // "https://api.mixpanel.com/track/?verbose=1&ip=1"
+            auto path_end = request.url.find_last_of('/');
+            if (path_end != std::string::npos && path_end != 0)
+            {
+                auto path_start = request.url.find_last_of('/', path_end - 1) + 1;
+                batch.endpoint = request.url.substr(path_start, path_end - path_start);
+            }
+
+            // "data=..."
+            const std::string field = "data=";
+            auto data = request.body.find(field);
+            if (data != std::string::npos)
+            {
+                auto end = request.body.find('&', data);
+                auto value = request.body.substr(data + field.size(), end == std::string::npos ? std::string::npos : end - data - field.size());
+                Json::Reader reader;
+                if (!reader.parse(base64_decode(unescape(value)), batch.records, false) || !batch.records.isArray())
+                {
+                    batch.records = Value();
+                }
+            }
+            return batch;
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,50 @@
+#ifndef _MIXPANEL_LOOPBACK_TRANSPORT_HPP_
+#define _MIXPANEL_LOOPBACK_TRANSPORT_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/value.hpp>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // Answers the requests in the process, without a network, for tests and benchmarks. Every batch is accepted,
+        // unless a handler answers it.
+        //
+        // Thread safe, the handler is called on the sending threads.
+        class LoopbackTransport : public Transport
+        {
+            public:
+                // the contents of a request
+                struct Batch
+                {
+                    std::string endpoint;   // "track" or "engage"
+                    Value records;          // an array, null if the body couldn't be decoded
+                };
+
+                typedef std::function<Response(const Request& request, const Batch& batch)> Handler;
+
+                explicit LoopbackTransport(Handler handler=Handler());
+
+                Response send(const Request& request) override;
+
+                // what the API answers to a batch it accepted, in its verbose form
+                static Response accepted();
+
+                static Batch decode(const Request& request);
+
+                std::size_t get_request_count() const { return requests; }
+                std::size_t get_record_count() const { return records; }
+            private:
+                const Handler handler;
+                std::atomic<std::size_t> requests;
+                std::atomic<std::size_t> records;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_LOOPBACK_TRANSPORT_HPP_ */
@@ -0,0 +1,25 @@
+#ifndef _MIXPANEL_MERGE_HPP_
+#define _MIXPANEL_MERGE_HPP_
+
+#include <mixpanel/value.hpp>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // copies the members of the object *b* into the object *a*. Members *a* already has are only replaced if
+        // *allow_overwrite* is true.
+        inline void merge(Value& a, const Value& b, bool allow_overwrite=true)
+        {
+            for (const auto& k : b.getMemberNames())
+            {
+                if (allow_overwrite || a[k].isNull())
+                {
+                    a[k] = b[k];
+                }
+            }
+        }
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_MERGE_HPP_ */
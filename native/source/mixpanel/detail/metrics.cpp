@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <utility>
+
+#include "./metrics.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        const unsigned Histogram::bucket_count;
+
+        // the number of significant bits, 0 for 0
+        static unsigned bit_length(std::uint64_t value)
+        {
+            #if defined(__GNUC__) || defined(__clang__)
+            return value ? 64 - static_cast<unsigned>(__builtin_clzll(value)) : 0;
+            #else
+            unsigned length = 0;
+            for (; value; value >>= 1) ++length;
+            return length;
+            #endif
+        }
+
+        Histogram::Histogram()
+        : sum(0)
+        , max(0)
+        {
+            for (auto& bucket : buckets)
+            {
+                bucket = 0;
+            }
+        }
+
+        void Histogram::record(std::uint64_t microseconds)
+        {
+            buckets[std::min(bit_length(microseconds), bucket_count - 1)].fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(microseconds, std::memory_order_relaxed);
+
+            auto current = max.load(std::memory_order_relaxed);
+            while (microseconds > current && !max.compare_exchange_weak(current, microseconds, std::memory_order_relaxed)) {}
+        }
+
+        Mixpanel::LatencyStats Histogram::snapshot() const
+        {
+            std::uint64_t counts[bucket_count];
+            Mixpanel::LatencyStats stats;
+            for (unsigned i = 0; i != bucket_count; ++i)
+            {
+                counts[i] = buckets[i].load(std::memory_order_relaxed);
+                stats.count += counts[i];
+            }
+            if (stats.count == 0)
+            {
+                return stats;
+            }
+            stats.max = max.load(std::memory_order_relaxed);
+            stats.mean = static_cast<double>(sum.load(std::memory_order_relaxed)) / stats.count;
+
+            // interpolates linearly within the bucket of the percentile
+            auto percentile = [&](double p) -> std::uint64_t {
+                auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(p * stats.count + 0.5));
+                std::uint64_t below = 0;
+                for (unsigned i = 0; i != bucket_count; ++i)
+                {
+                    if (below + counts[i] >= rank)
+                    {
+                        if (i == 0)
+                        {
+                            return 0;
+                        }
+                        auto low = std::uint64_t(1) << (i - 1);
+                        auto estimate = low + static_cast<std::uint64_t>(static_cast<double>(low) * (rank - below) / counts[i]);
+                        return std::min(estimate, stats.max);
+                    }
+                    below += counts[i];
+                }
+                return stats.max;
+            };
+            stats.p50 = percentile(0.5);
+            stats.p90 = percentile(0.9);
+            stats.p99 = percentile(0.99);
+            return stats;
+        }
+
+        Mixpanel::Stats Metrics::snapshot() const
+        {
+            Mixpanel::Stats stats;
+            stats.events_enqueued = events_enqueued.get();
+            stats.events_rejected = events_rejected.get();
+            stats.enqueue_latency = enqueue_latency.snapshot();
+            stats.batches_sent = batches_sent.get();
+            stats.batches_failed = batches_failed.get();
+            stats.bytes_sent = bytes_sent.get();
+            stats.round_trip = round_trip.snapshot();
+            stats.handshakes = handshakes.get();
+            stats.retries = retries.get();
+            stats.back_off_seconds = back_off_seconds.get();
+            stats.persistence_bytes_read = persistence_bytes_read.get();
+            stats.persistence_bytes_written = persistence_bytes_written.get();
+            stats.persistence_read_latency = persistence_read_latency.snapshot();
+            stats.persistence_write_latency = persistence_write_latency.snapshot();
+            return stats;
+        }
+
+        static Value to_value(const Mixpanel::LatencyStats& stats)
+        {
+            Value value;
+            value["count"] = static_cast<Json::UInt64>(stats.count);
+            value["mean"] = stats.mean;
+            value["p50"] = static_cast<Json::UInt64>(stats.p50);
+            value["p90"] = static_cast<Json::UInt64>(stats.p90);
+            value["p99"] = static_cast<Json::UInt64>(stats.p99);
+            value["max"] = static_cast<Json::UInt64>(stats.max);
+            return value;
+        }
+
+        std::string Metrics::to_json(const Mixpanel::Stats& stats, std::time_t time)
+        {
+            Value value;
+            value["time"] = static_cast<Json::Int64>(time);
+            value["events_enqueued"] = static_cast<Json::UInt64>(stats.events_enqueued);
+            value["events_rejected"] = static_cast<Json::UInt64>(stats.events_rejected);
+            value["enqueue_latency_us"] = to_value(stats.enqueue_latency);
+            value["queue_bytes"] = static_cast<Json::UInt64>(stats.queue_bytes);
+            value["queue_records"] = static_cast<Json::UInt64>(stats.queue_records);
+            value["memory_buffer_bytes"] = static_cast<Json::UInt64>(stats.memory_buffer_bytes);
+            value["batches_sent"] = static_cast<Json::UInt64>(stats.batches_sent);
+            value["batches_failed"] = static_cast<Json::UInt64>(stats.batches_failed);
+            value["bytes_sent"] = static_cast<Json::UInt64>(stats.bytes_sent);
+            value["round_trip_us"] = to_value(stats.round_trip);
+            value["handshakes"] = static_cast<Json::UInt64>(stats.handshakes);
+            value["retries"] = static_cast<Json::UInt64>(stats.retries);
+            value["back_off_seconds"] = static_cast<Json::UInt64>(stats.back_off_seconds);
+            value["persistence_bytes_read"] = static_cast<Json::UInt64>(stats.persistence_bytes_read);
+            value["persistence_bytes_written"] = static_cast<Json::UInt64>(stats.persistence_bytes_written);
+            value["persistence_read_latency_us"] = to_value(stats.persistence_read_latency);
+            value["persistence_write_latency_us"] = to_value(stats.persistence_write_latency);
+
+            // FastWriter ends the line with '\n'
+            Json::FastWriter writer;
+            return writer.write(value);
+        }
+
+        MeasuredIOEngine::MeasuredIOEngine(std::unique_ptr<IOEngine> engine, std::shared_ptr<Metrics> metrics)
+        : engine(std::move(engine))
+        , metrics(metrics)
+        {
+        }
+
+        bool MeasuredIOEngine::read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out)
+        {
+            bool found;
+            {
+                LatencyScope latency(metrics->persistence_read_latency);
+                found = engine->read(path, offset, max_bytes, out);
+            }
+            metrics->persistence_bytes_read.add(found ? out.size() : 0);
+            return found;
+        }
+
+        void MeasuredIOEngine::write(const std::string& path, const std::string& data)
+        {
+            {
+                LatencyScope latency(metrics->persistence_write_latency);
+                engine->write(path, data);
+            }
+            metrics->persistence_bytes_written.add(data.size());
+        }
+
+        void MeasuredIOEngine::append(const std::string& path, const std::string& data)
+        {
+            {
+                LatencyScope latency(metrics->persistence_write_latency);
+                engine->append(path, data);
+            }
+            metrics->persistence_bytes_written.add(data.size());
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,121 @@
+#ifndef _MIXPANEL_METRICS_HPP_
+#define _MIXPANEL_METRICS_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <mixpanel/mixpanel.hpp>
+#include "./io_engine.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // A counter that any thread may add to. The additions are relaxed, they don't order anything else.
+        class Counter
+        {
+            public:
+                Counter() : value(0) {}
+
+                void add(std::uint64_t n=1) { value.fetch_add(n, std::memory_order_relaxed); }
+                std::uint64_t get() const { return value.load(std::memory_order_relaxed); }
+            private:
+                std::atomic<std::uint64_t> value;
+        };
+
+        // A distribution of durations in microseconds, in buckets that double in width: bucket 0 holds 0, bucket i the
+        // durations in [2^(i-1), 2^i). record() is two relaxed atomic additions, plus a compare-and-swap while it raises
+        // the maximum. A snapshot taken while records come in may be off by the records in progress.
+        class Histogram
+        {
+            public:
+                Histogram();
+
+                void record(std::uint64_t microseconds);
+                void record(std::chrono::steady_clock::duration duration)
+                {
+                    auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+                    record(static_cast<std::uint64_t>(microseconds > 0 ? microseconds : 0));
+                }
+
+                Mixpanel::LatencyStats snapshot() const;
+
+                // the last bucket holds everything from 2^38 microseconds (about three days) on
+                static const unsigned bucket_count = 40;
+            private:
+                std::atomic<std::uint64_t> buckets[bucket_count];
+                std::atomic<std::uint64_t> sum;
+                std::atomic<std::uint64_t> max;
+        };
+
+        // records the time from its construction to its destruction, on the steady clock
+        class LatencyScope
+        {
+            public:
+                explicit LatencyScope(Histogram& histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+                ~LatencyScope() { histogram.record(std::chrono::steady_clock::now() - start); }
+            private:
+                LatencyScope(const LatencyScope&) = delete;
+                LatencyScope& operator=(const LatencyScope&) = delete;
+
+                Histogram& histogram;
+                const std::chrono::steady_clock::time_point start;
+        };
+
+        // The counters of a Mixpanel instance, see Mixpanel::Stats. The persistence and the worker count into them,
+        // Worker::get_stats() adds the state of the queues.
+        //
+        // Thread safe.
+        class Metrics
+        {
+            public:
+                Counter events_enqueued;
+                Counter events_rejected;
+                Histogram enqueue_latency;
+
+                Counter batches_sent;
+                Counter batches_failed;
+                Counter bytes_sent;
+                Histogram round_trip;
+                Counter handshakes;
+                Counter retries;
+                Counter back_off_seconds;
+
+                Counter persistence_bytes_read;
+                Counter persistence_bytes_written;
+                Histogram persistence_read_latency;
+                Histogram persistence_write_latency;
+
+                // the counters, without the state of the queues
+                Mixpanel::Stats snapshot() const;
+
+                // a line of JSON, for the export to a file
+                static std::string to_json(const Mixpanel::Stats& stats, std::time_t time);
+        };
+
+        // Counts the bytes an IOEngine reads and writes, and how long it takes, into the metrics. The write latency of
+        // an engine that appends asynchronously is the time it takes to submit the append.
+        class MeasuredIOEngine : public IOEngine
+        {
+            public:
+                MeasuredIOEngine(std::unique_ptr<IOEngine> engine, std::shared_ptr<Metrics> metrics);
+
+                const char* name() const override { return engine->name(); }
+
+                bool read(const std::string& path, std::size_t offset, std::size_t max_bytes, std::string& out) override;
+                void write(const std::string& path, const std::string& data) override;
+                void append(const std::string& path, const std::string& data) override;
+                void remove(const std::string& path) override { engine->remove(path); }
+                std::size_t size(const std::string& path) override { return engine->size(path); }
+                void sync(const std::string& path) override { engine->sync(path); }
+            private:
+                std::unique_ptr<IOEngine> engine;
+                std::shared_ptr<Metrics> metrics;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_METRICS_HPP_ */
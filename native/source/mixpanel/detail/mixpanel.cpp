@@ -1,6 +1,8 @@
 #include <chrono>
 #include <cmath>
 #include <ctime>
+#include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <string>
@@ -9,6 +11,12 @@
 #include <mixpanel/mixpanel.hpp>
 
 #include "./persistence.hpp"
+#include "./event_stamper.hpp"
+#include "./importer.hpp"
+#include "./logging.hpp"
+#include "./merge.hpp"
+#include "./metrics.hpp"
+#include "./sender_thread.hpp"
 #include "./worker.hpp"
 #include "platform_helpers.hpp"
 
@@ -36,12 +44,36 @@ namespace mixpanel
 
     static std::chrono::steady_clock::time_point app_start = std::chrono::steady_clock::now();
 
-    std::shared_ptr<detail::Worker> Mixpanel::worker;
+    SenderPool::SenderPool()
+        :sender_thread(std::make_shared<detail::SenderThread>())
+    {
+    }
+
+    SenderPool::~SenderPool()
+    {
+    }
+
+    Mixpanel::Mixpanel(
+        const std::string& token,
+        const std::string& distinct_id,
+        const std::string& storage_directory,
+        const bool enable_log_queue,
+        const bool opt_out
+    )
+    :Mixpanel(
+              token,
+              distinct_id,
+              storage_directory,
+              SenderPool(), // a sender thread of our own
+              enable_log_queue,
+              opt_out
+              ) {}
 
     Mixpanel::Mixpanel(
         const std::string& token,
         const std::string& distinct_id,
         const std::string& storage_directory,
+        const SenderPool& sender_pool,
         const bool enable_log_queue,
         const bool opt_out
     )
@@ -56,22 +88,25 @@ namespace mixpanel
 #else
         ,min_log_level(LogEntry::LL_WARNING)
 #endif
+        ,log_ring(std::make_shared<LogRing>())
+        ,writing_log(false)
     {
-        if (worker)
-        {
-            throw std::logic_error("Only one Mixpanel instance at a time is supported.");
-        }
-
         if (token.size() < 8)
         {
             throw std::invalid_argument("You must provide a valid Mixpanel token.");
         }
 
-        Persistence::set_storage_directory(storage_directory);
-        super_properties = Persistence::read("super_properties");
+        metrics = std::make_shared<Metrics>();
+        persistence = std::make_shared<Persistence>(Persistence::get_instance_directory(storage_directory, token), metrics);
+        persistence->migrate_from(storage_directory);
+
+        super_properties = persistence->read("super_properties");
+        event_stamper = std::make_shared<EventStamper>(token);
+        update_base_properties();
         automatic_people_properties = collect_automatic_people_properties();
-        timed_events = Persistence::read("timed_events");
-        state = Persistence::read("state");
+        timed_events = persistence->read("timed_events");
+        state = persistence->read("state");
+        opted_out = state["opted_out"].asBool();
 
         // if no distinct_id given by user and we have none stored
         if (distinct_id.empty() && (!state["distinct_id"].isString() || state["distinct_id"].asString().empty()))
@@ -86,11 +121,11 @@ namespace mixpanel
         assert(state["distinct_id"].isString());
         assert(!state["distinct_id"].asString().empty());
 
-        log(LogEntry::LL_DEBUG, "distinct_id is : " + state["distinct_id"].asString());
-        log(LogEntry::LL_DEBUG, "storage directory is : " + storage_directory);
+        MIXPANEL_LOG(*this, DEBUG, "distinct_id is : " + state["distinct_id"].asString());
+        MIXPANEL_LOG(*this, DEBUG, "storage directory is : " + storage_directory);
 
-        Persistence::write("state", state);
-        worker = std::make_shared<Worker>(this);
+        persistence->write("state", state);
+        worker = std::make_shared<Worker>(this, persistence, sender_pool.sender_thread, metrics);
 
         if (opt_out)
         {
@@ -114,11 +149,11 @@ namespace mixpanel
 
     Mixpanel::~Mixpanel()
     {
-        log(LogEntry::LL_DEBUG, "*** destroying Mixpanel instance");
+        MIXPANEL_LOG(*this, DEBUG, "*** destroying Mixpanel instance");
         worker = nullptr;
     }
 
-    void Mixpanel::log(LogEntry::Level level, const std::string& message)
+    void Mixpanel::log(LogEntry::Level level, std::string message)
     {
         assert(level == LogEntry::LL_TRACE      ||
                level == LogEntry::LL_DEBUG      ||
@@ -126,61 +161,45 @@ namespace mixpanel
                level == LogEntry::LL_WARNING    ||
                level == LogEntry::LL_ERROR);
 
-        if (level < min_log_level) return;
+        if (!is_logged(level)) return;
 
-        // we're locking here, so that output to std::clog is also synchronized
-        std::unique_lock<std::mutex> lock(log_queue_mutex);
-        if (enable_log_queue)
-        {
-            if (log_entries.size() > 100)
-            {
-                std::clog << "Warning: log queue overflow. " << std::endl;
-            }
-            else
-            {
-                log_entries.push({level, message});
-            }
-        }
-        else
+        // an overflow is reported by the ring itself
+        log_ring->push(level, std::move(message));
+        if (!enable_log_queue)
         {
-            static const char *level_names[] = {
-                "TRACE", "DEBUG", "INFO", "WARNING", "ERROR", "NONE"
-            };
-            const char *level_name = level_names[level];
-            std::clog << "Mixpanel[" << level_name << "]: " << message << std::endl;
-            #if defined (_MSC_VER) && defined(DEBUG)
-                OutputDebugStringA(("Mixpanel[" + std::string(level_name) + "]: " + message).c_str());
-            #endif
+            write_log();
         }
     }
 
-    void Mixpanel::set_minimum_log_level(LogEntry::Level level)
+    void Mixpanel::write_log()
     {
-        this->min_log_level = level;
+        // the thread that finds nobody writing writes the entries of everybody, the others return right away. It looks
+        // again after it stopped, in case an entry came in just before.
+        do
+        {
+            if (writing_log.exchange(true, std::memory_order_acquire)) return;
+
+            LogEntry entry;
+            while (log_ring->pop(entry))
+            {
+                const auto line = format_log_entry(entry);
+                std::clog << line << std::endl;
+                #if defined (_MSC_VER) && defined(DEBUG)
+                    OutputDebugStringA(line.c_str());
+                #endif
+            }
+            writing_log.store(false, std::memory_order_release);
+        } while (!log_ring->empty());
     }
 
-    bool Mixpanel::get_next_log_entry(LogEntry& entry)
+    void Mixpanel::set_minimum_log_level(LogEntry::Level level)
     {
-        std::unique_lock<std::mutex> lock(log_queue_mutex);
-        if (!log_entries.empty())
-        {
-            entry = log_entries.front();
-            log_entries.pop();
-            return true;
-        }
-        return false;
+        min_log_level.store(level, std::memory_order_relaxed);
     }
 
-
-    static void merge(Value& a, const Value& b, bool allow_overwrite=true)
+    bool Mixpanel::get_next_log_entry(LogEntry& entry)
     {
-        for (const auto& k : b.getMemberNames())
-        {
-            if (allow_overwrite || a[k].isNull())
-            {
-                a[k] = b[k];
-            }
-        }
+        return log_ring->pop(entry);
     }
 
     std::string Mixpanel::get_distinct_id() const
@@ -202,11 +221,17 @@ namespace mixpanel
     }
 
     void Mixpanel::track(const std::string event, const Value& properties)
+    {
+        track(event, properties, get_event_priority(event));
+    }
+
+    void Mixpanel::track(const std::string event, const Value& properties, EventPriority priority)
     {
         if (has_opted_out())
         {
             return;
         }
+        LatencyScope latency(metrics->enqueue_latency);
         Value data;
         data["event"] = event;
 
@@ -226,19 +251,116 @@ namespace mixpanel
         merge(data["properties"], automatic_properties, false);
         data["properties"]["$wifi"] = (network_reachability == NetworkReachability::ReachableViaLocalAreaNetwork);
 
-        worker->enqueue("track", data);
+        worker->enqueue("track", data, priority);
     }
 
-    void Mixpanel::track_charge(double amount, const Value& properties)
+    void Mixpanel::track_as(const std::string& distinct_id, const std::string& event, const Value& properties) throw(std::invalid_argument)
+    {
+        if (has_opted_out())
+        {
+            return;
+        }
+        if (distinct_id.empty()) throw std::invalid_argument("distinct_id cannot be empty");
+        LatencyScope latency(metrics->enqueue_latency);
+
+        // like in track(), these can't be overridden by the properties. The stamper adds them.
+        Value data;
+        data["event"] = event;
+        data["properties"] = properties.isObject() ? properties : Value(Json::objectValue);
+        data["properties"].removeMember("token");
+        data["properties"].removeMember("distinct_id");
+        data["properties"].removeMember("time");
+        data["properties"]["$wifi"] = (network_reachability == NetworkReachability::ReachableViaLocalAreaNetwork);
+
+        Json::FastWriter writer;
+        auto serialized = writer.write(data);
+
+        std::string record;
+        std::string event_name;
+        event_stamper->stamp(serialized.data(), serialized.data() + serialized.size(), distinct_id, utc_now_timestamp(), record, event_name);
+        worker->enqueue_serialized("track", record, get_event_priority(event));
+    }
+
+    Mixpanel::People Mixpanel::people_as(const std::string& distinct_id) throw(std::invalid_argument)
+    {
+        if (distinct_id.empty()) throw std::invalid_argument("distinct_id cannot be empty");
+        return People(this, distinct_id);
+    }
+
+    bool Mixpanel::track_json(const std::string& event)
+    {
+        if (has_opted_out())
+        {
+            return true;
+        }
+        LatencyScope latency(metrics->enqueue_latency);
+
+        std::string data;
+        std::string event_name;
+        if (!event_stamper->stamp(event.data(), event.data() + event.size(), get_distinct_id(), utc_now_timestamp(), data, event_name))
+        {
+            MIXPANEL_LOG(*this, WARNING, "not tracking malformed event: " + event);
+            return false;
+        }
+
+        worker->enqueue_serialized("track", data, get_event_priority(event_name));
+        return true;
+    }
+
+    Mixpanel::ImportStats Mixpanel::import_events(const std::function<bool(std::string& event)>& source, const ImportOptions& options)
+    {
+        Importer importer(*this, options);
+        return importer.run(source);
+    }
+
+    Mixpanel::ImportStats Mixpanel::import_file(const std::string& path, const ImportOptions& options)
+    {
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if (!file)
+        {
+            ImportStats stats;
+            stats.error = "can't open " + path;
+            MIXPANEL_LOG(*this, ERROR, "import: " + stats.error);
+            return stats;
+        }
+
+        return import_events([&file](std::string& event) {
+            return !!std::getline(file, event);
+        }, options);
+    }
+
+    Mixpanel::EventPriority Mixpanel::get_event_priority(const std::string& event_name)
+    {
+        std::lock_guard<std::mutex> lock(event_priorities_mutex);
+        auto it = event_priorities.find(event_name);
+        return it != event_priorities.end() ? it->second : EventPriority::Normal;
+    }
+
+    void Mixpanel::save_super_properties()
+    {
+        persistence->write("super_properties", super_properties);
+        update_base_properties();
+    }
+
+    void Mixpanel::update_base_properties()
+    {
+        // the same precedence as in track()
+        Value base_properties = super_properties;
+        merge(base_properties, automatic_properties, false);
+        event_stamper->set_base_properties(base_properties);
+        std::atomic_store(&super_properties_snapshot, std::make_shared<const Value>(super_properties));
+    }
+
+    void Mixpanel::track_charge(double amount, const Value& properties, const std::string& distinct_id)
     {
         Value data;
         data["$transactions"]["$amount"] = amount;
         data["$transactions"]["$time"] = utc_now();
         merge(data["$transactions"], properties, false);
-        engage(op_append, data);
+        engage(op_append, data, distinct_id);
     }
 
-    void Mixpanel::engage(Op op, const Value& values)
+    void Mixpanel::engage(Op op, const Value& values, const std::string& distinct_id)
     {
         if (has_opted_out())
         {
@@ -246,15 +368,16 @@ namespace mixpanel
         }
         if (op_set > op || op > op_delete)
         {
-            log(LogEntry::LL_ERROR, "error: invalid engage op: " + std::to_string(op));
+            MIXPANEL_LOG(*this, ERROR, "error: invalid engage op: " + std::to_string(op));
             return;
         }
+        LatencyScope latency(metrics->enqueue_latency);
         static std::vector<std::string> op_names = {"$set", "$set_once", "$add", "$append", "$union", "$unset", "$delete"};
         auto op_name = op_names.at(op);
 
         Value data;
         data["$token"] = token;
-        data["$distinct_id"] = get_distinct_id();
+        data["$distinct_id"] = distinct_id.empty() ? get_distinct_id() : distinct_id;
 
         data["$time"] = static_cast<Value::Int64>(Mixpanel::utc_now_timestamp());
         data[op_name] = values;
@@ -262,7 +385,7 @@ namespace mixpanel
         if (op == op_set || op == op_set_once)
         {
             merge(data[op_name], automatic_people_properties, false);
-            merge(data[op_name], super_properties, false);
+            merge(data[op_name], *std::atomic_load(&super_properties_snapshot), false);
         }
 
         worker->enqueue("engage", data);
@@ -280,11 +403,11 @@ namespace mixpanel
         {
             state.removeMember("alias");
             state["distinct_id"] = unique_id;
-            Persistence::write("state", state);
+            persistence->write("state", state);
         }
         else
         {
-            log(LogEntry::LL_WARNING, "WARNING: unique_id matches current distinct_id.");
+            MIXPANEL_LOG(*this, WARNING, "WARNING: unique_id matches current distinct_id.");
         }
     }
 
@@ -299,7 +422,7 @@ namespace mixpanel
         if (alias != get_distinct_id())
         {
             state["alias"] = alias;
-            Persistence::write("state", state);
+            persistence->write("state", state);
 
             Value data;
             data["alias"] = alias;
@@ -307,7 +430,7 @@ namespace mixpanel
         }
         else
         {
-            log(LogEntry::LL_WARNING, "alias matches current distinct_id - skipping api call.");
+            MIXPANEL_LOG(*this, WARNING, "alias matches current distinct_id - skipping api call.");
         }
     }
 
@@ -321,7 +444,7 @@ namespace mixpanel
         assert(!value.isObject());
         assert(!value.isArray());
         super_properties[key] = value;
-        Persistence::write("super_properties", super_properties);
+        save_super_properties();
     }
 
     void Mixpanel::register_properties(const Value& properties)
@@ -340,7 +463,7 @@ namespace mixpanel
             }
         }
 
-        Persistence::write("super_properties", super_properties);
+        save_super_properties();
     }
 
     bool Mixpanel::register_once(const std::string& key, const Value& value)
@@ -377,7 +500,7 @@ namespace mixpanel
     {
         if (!super_properties.removeMember(key).isNull())
         {
-            Persistence::write("super_properties", super_properties);
+            save_super_properties();
             return true;
         }
         return false;
@@ -414,7 +537,7 @@ namespace mixpanel
                 super_properties.removeMember(name);
             }
         }
-        Persistence::write("super_properties", super_properties);
+        save_super_properties();
     }
 
     std::string Mixpanel::utc_iso_format(time_t time)
@@ -442,9 +565,76 @@ namespace mixpanel
         worker->notify();
     }
 
+    void Mixpanel::set_cellular_daily_budget(std::size_t bytes)
+    {
+        worker->set_cellular_daily_budget(bytes);
+    }
+
+    Mixpanel::NetworkUsage Mixpanel::get_network_usage()
+    {
+        return worker->get_network_usage();
+    }
+
     void Mixpanel::set_maximum_queue_size(std::size_t maximum_size)
     {
-        detail::Persistence::set_maximum_queue_size(maximum_size);
+        persistence->set_maximum_queue_size(maximum_size);
+    }
+
+    void Mixpanel::set_overflow_policy(const std::string& queue_name, OverflowPolicy policy)
+    {
+        persistence->set_overflow_policy(queue_name, policy);
+    }
+
+    void Mixpanel::set_event_priority(const std::string& event_name, EventPriority priority)
+    {
+        std::lock_guard<std::mutex> lock(event_priorities_mutex);
+        event_priorities[event_name] = priority;
+    }
+
+    void Mixpanel::set_max_event_age(const std::string& queue_name, Days days)
+    {
+        persistence->set_max_event_age(queue_name, days);
+    }
+
+    Mixpanel::QueueStats Mixpanel::get_queue_stats(const std::string& queue_name)
+    {
+        return persistence->get_queue_stats(queue_name);
+    }
+
+    std::string Mixpanel::get_dead_letters(const std::string& queue_name)
+    {
+        return persistence->read_dead_letters(queue_name);
+    }
+
+    void Mixpanel::clear_dead_letters(const std::string& queue_name)
+    {
+        persistence->clear_dead_letters(queue_name);
+    }
+
+    void Mixpanel::set_memory_budget(std::size_t bytes)
+    {
+        persistence->set_memory_budget(bytes);
+    }
+
+    void Mixpanel::set_multi_process(bool enabled)
+    {
+        persistence->set_multi_process(enabled);
+        worker->notify();
+    }
+
+    void Mixpanel::set_memory_high_water_callback(std::function<void(std::size_t)> callback)
+    {
+        worker->set_memory_high_water_callback(callback);
+    }
+
+    void Mixpanel::set_api_host(const std::string& api_host)
+    {
+        worker->set_api_host(api_host);
+    }
+
+    void Mixpanel::set_transport(std::shared_ptr<Transport> transport)
+    {
+        worker->set_transport(transport);
     }
 
     void Mixpanel::set_flush_interval(unsigned seconds)
@@ -452,15 +642,88 @@ namespace mixpanel
         worker->set_flush_interval(seconds);
     }
 
+    void Mixpanel::set_adaptive_flush(unsigned min_interval, unsigned max_interval, std::size_t flush_bytes)
+    {
+        worker->set_adaptive_flush(min_interval, max_interval, flush_bytes);
+    }
+
+    bool Mixpanel::shutdown(unsigned timeout_ms)
+    {
+        return worker->shutdown(worker->get_clock()->now() + std::chrono::milliseconds(timeout_ms));
+    }
+
     void Mixpanel::flush_queue()
     {
         if (has_opted_out())
         {
             return;
         }
+
         worker->flush_queue();
     }
 
+    std::future<bool> Mixpanel::flush_async(unsigned timeout_ms)
+    {
+        auto promise = std::make_shared<std::promise<bool>>();
+        flush_async(timeout_ms, [promise](bool flushed) {
+            promise->set_value(flushed);
+        });
+        return promise->get_future();
+    }
+
+    void Mixpanel::flush_async(unsigned timeout_ms, std::function<void(bool)> callback)
+    {
+        if (has_opted_out())
+        {
+            callback(false);
+            return;
+        }
+
+        worker->flush_async(worker->get_clock()->now() + std::chrono::milliseconds(timeout_ms), callback);
+    }
+
+    void Mixpanel::set_delivery_callback(std::function<void(const BatchDelivery&)> callback)
+    {
+        worker->set_delivery_callback(callback);
+    }
+
+    void Mixpanel::set_high_priority_flush_delay(unsigned milliseconds)
+    {
+        worker->set_high_priority_flush_delay(milliseconds);
+    }
+
+    void Mixpanel::set_max_requests_in_flight(unsigned count)
+    {
+        worker->set_max_requests_in_flight(count);
+    }
+
+    Mixpanel::EndpointStats Mixpanel::get_endpoint_stats(const std::string& queue_name)
+    {
+        if (queue_name != "track" && queue_name != "track_high" && queue_name != "engage")
+        {
+            return EndpointStats();
+        }
+        return worker->get_endpoint_stats(queue_name);
+    }
+
+    Mixpanel::Stats Mixpanel::get_stats()
+    {
+        return worker->get_stats();
+    }
+
+    void Mixpanel::set_stats_export(unsigned interval_seconds, std::function<void(const Stats&)> callback)
+    {
+        worker->set_stats_export(interval_seconds, callback);
+    }
+
+    void Mixpanel::set_stats_export(unsigned interval_seconds, const std::string& path)
+    {
+        worker->set_stats_export(interval_seconds, [path](const Stats& stats) {
+            std::ofstream file(path, std::ios::app | std::ios::binary);
+            file << Metrics::to_json(stats, utc_now_timestamp());
+        });
+    }
+
     void Mixpanel::clear_send_queues()
     {
         worker->clear_send_queues();
@@ -473,7 +736,7 @@ namespace mixpanel
             identify(uuid);
         }
         state.removeMember("alias");
-        Persistence::write("state", state);
+        persistence->write("state", state);
         clear_super_properties();
         clear_send_queues();
         clear_timed_events();
@@ -490,7 +753,7 @@ namespace mixpanel
         bool result = timed_events.get(event_name, 0) == 0;
 
         timed_events[event_name] = time_since_epoch<double>();
-        Persistence::write("timed_events", timed_events);
+        persistence->write("timed_events", timed_events);
 
         return result;
     }
@@ -513,7 +776,7 @@ namespace mixpanel
         Value value;
         if (timed_events.removeMember(event_name, &value))
         {
-            Persistence::write("timed_events", timed_events);
+            persistence->write("timed_events", timed_events);
             return true;
         }
         return false;
@@ -522,7 +785,7 @@ namespace mixpanel
     void Mixpanel::clear_timed_events()
     {
         timed_events = Value(detail::Json::objectValue);
-        Persistence::write("timed_events", timed_events);
+        persistence->write("timed_events", timed_events);
     }
 
     Value Mixpanel::collect_automatic_properties()
@@ -548,18 +811,19 @@ namespace mixpanel
     void Mixpanel::set_tracked_integration()
     {
         state["tracked_integration"] = true;
-        Persistence::write("state", state);
+        persistence->write("state", state);
     }
 
     bool Mixpanel::has_opted_out()
     {
-        return state["opted_out"].asBool();
+        return opted_out;
     }
 
     void Mixpanel::opt_in_tracking(const std::string distinct_id, const Value& properties)
     {
         state["opted_out"] = false;
-        Persistence::write("state", state);
+        opted_out = false;
+        persistence->write("state", state);
         if (!distinct_id.empty())
         {
             identify(distinct_id);
@@ -587,7 +851,8 @@ namespace mixpanel
         flush_queue();
 
         state["opted_out"] = true;
-        Persistence::write("state", state);
+        opted_out = true;
+        persistence->write("state", state);
     }
 
 } // namespace mixpanel
@@ -1,13 +1,14 @@
 #include <string>
 
 #include <mixpanel/mixpanel.hpp>
+#include "./logging.hpp"
 #include "platform_helpers.hpp"
 
 namespace mixpanel
 {
     using namespace detail;
 
-    Mixpanel::People::People(class Mixpanel *mixpanel) : mixpanel(mixpanel) {}
+    Mixpanel::People::People(class Mixpanel *mixpanel, const std::string& distinct_id) : mixpanel(mixpanel), distinct_id(distinct_id) {}
 
     void Mixpanel::People::set(const std::string& property,  const Value& to)
     {
@@ -23,7 +24,7 @@ namespace mixpanel
             return;
         }
         if (!properties.isObject()) throw std::invalid_argument("properties must be an object");
-        mixpanel->engage(Mixpanel::op_set, properties);
+        mixpanel->engage(Mixpanel::op_set, properties, distinct_id);
     }
 
     void Mixpanel::People::set_once(const std::string& property,  const Value& to)
@@ -40,7 +41,7 @@ namespace mixpanel
             return;
         }
         if (!properties.isObject()) throw std::invalid_argument("properties must be an object");
-        mixpanel->engage(Mixpanel::op_set_once, properties);
+        mixpanel->engage(Mixpanel::op_set_once, properties, distinct_id);
     }
 
     void Mixpanel::People::unset(const std::string& property)
@@ -53,7 +54,7 @@ namespace mixpanel
     void Mixpanel::People::unset_properties(const Value& properties) throw(std::invalid_argument)
     {
         if (!properties.isArray()) throw std::invalid_argument("properties must be a list");
-        mixpanel->engage(Mixpanel::op_unset, properties);
+        mixpanel->engage(Mixpanel::op_unset, properties, distinct_id);
     }
 
 
@@ -72,7 +73,7 @@ namespace mixpanel
             return;
         }
         if (!properties.isObject()) throw std::invalid_argument("properties must be an object");
-        mixpanel->engage(Mixpanel::op_add, properties);
+        mixpanel->engage(Mixpanel::op_add, properties, distinct_id);
     }
 
     void Mixpanel::People::append(const std::string& list_name,  const Value& value)
@@ -89,7 +90,7 @@ namespace mixpanel
             return;
         }
         if (!properties.isObject()) throw std::invalid_argument("properties must be an object");
-        mixpanel->engage(Mixpanel::op_append, properties);
+        mixpanel->engage(Mixpanel::op_append, properties, distinct_id);
     }
 
     void Mixpanel::People::union_(const std::string& list_name,  const Value& values) throw(std::invalid_argument)
@@ -107,17 +108,17 @@ namespace mixpanel
             return;
         }
         if (!properties.isObject()) throw std::invalid_argument("properties must be an object");
-        mixpanel->engage(Mixpanel::op_union, properties);
+        mixpanel->engage(Mixpanel::op_union, properties, distinct_id);
     }
 
     void Mixpanel::People::track_charge(double amount, const Value& properties)
     {
-        mixpanel->track_charge(amount, properties);
+        mixpanel->track_charge(amount, properties, distinct_id);
     }
 
     void Mixpanel::People::delete_user()
     {
-        mixpanel->engage(Mixpanel::op_delete, Value(Json::objectValue));
+        mixpanel->engage(Mixpanel::op_delete, Value(Json::objectValue), distinct_id);
     }
 
     void Mixpanel::People::clear_charges()
@@ -170,7 +171,7 @@ namespace mixpanel
         }
         else
         {
-            mixpanel->log(Mixpanel::LogEntry::LL_INFO, "set_push_id() only works on iOS and Android.");
+            MIXPANEL_LOG(*mixpanel, INFO, "set_push_id() only works on iOS and Android.");
         }
     }
 
@@ -1,25 +1,80 @@
 #include <algorithm>
-#include <fstream>
+#include <ctime>
+#include <limits>
 #include <assert.h>
 #include <string>
 #include <utility>
+#include <vector>
+#include "./file_lock.hpp"
+#include "./io_engine.hpp"
 #include "./persistence.hpp"
 #include "./platform_helpers.hpp"
+#include "./queue_log.hpp"
 
 namespace mixpanel
 {
     namespace detail
     {
-        std::recursive_mutex Persistence::mutex;
-        std::string Persistence::storage_directory = ".";
-        std::atomic<std::size_t> Persistence::maximum_queue_size(5 * 1024 * 1024);
+        const std::size_t Persistence::max_dead_letter_size;
 
-        std::recursive_mutex Persistence::memory_queues_mutex;
-        Persistence::Memory_queues Persistence::memory_queues;
+        Persistence::Persistence(const std::string& storage_directory, std::shared_ptr<Metrics> metrics)
+        : storage_directory(storage_directory)
+        , maximum_queue_size(5 * 1024 * 1024)
+        , metrics(metrics)
+        , io(new MeasuredIOEngine(IOEngine::create(), metrics))
+        , multi_process(false)
+        , queues_lock_depth(0)
+        , memory_queues_size(0)
+        , memory_budget(1024 * 1024)
+        {
+            create_directory(storage_directory);
+        }
+
+        Persistence::~Persistence()
+        {
+            persist_memory_queues();
+
+            // the queues use io, so they must go first
+            queues.clear();
+        }
 
-        void Persistence::set_storage_directory(const std::string& storage_directory)
+        std::string Persistence::get_instance_directory(const std::string& storage_directory, const std::string& token)
         {
-            Persistence::storage_directory = storage_directory;
+            return storage_directory + "/mp_" + token;
+        }
+
+        void Persistence::migrate_from(const std::string& storage_directory)
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            Queues_lock queues_lock(*this);
+
+            for (auto name : {"state", "super_properties", "timed_events", "track", "engage"})
+            {
+                auto legacy_name = storage_directory + "/mp_" + name + ".json";
+                auto new_name = this->storage_directory + "/mp_" + name + ".json";
+                std::string data;
+                if (io->read(legacy_name, 0, std::numeric_limits<std::size_t>::max(), data) && !data.empty() && io->size(new_name) == 0)
+                {
+                    io->write(new_name, data);
+                }
+                io->remove(legacy_name);
+            }
+
+            for (auto name : {"track", "engage"})
+            {
+                QueueLog legacy_queue(*io, storage_directory, name);
+                if (!legacy_queue.empty())
+                {
+                    std::string data;
+                    auto records = legacy_queue.front(legacy_queue.count());
+                    for (const auto& record : records)
+                    {
+                        data += record;
+                    }
+                    get_queue(name)->append(data, records.size());
+                }
+                legacy_queue.clear();
+            }
         }
 
 #ifdef WIN32
@@ -34,15 +89,28 @@ namespace mixpanel
         }
 #endif
 
+        std::shared_ptr<QueueLog> Persistence::get_queue(const std::string& name)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            auto& queue = queues[name];
+            if (!queue)
+            {
+                queue = std::make_shared<QueueLog>(*io, storage_directory, name);
+            }
+            return queue;
+        }
+
         Value Persistence::read(const std::string name)
         {
-            auto full_name = get_full_name(name);
+            std::string data;
+            {
+                std::lock_guard<decltype(mutex)> lock(mutex);
+                io->read(storage_directory + "/mp_" + name + ".json", 0, std::numeric_limits<std::size_t>::max(), data);
+            }
 
-            std::lock_guard<decltype(mutex)> lock(mutex);
             Value o;
-            std::ifstream ifs(full_name.c_str(), std::ios::binary);
             Json::Reader reader;
-            reader.parse(ifs, o, false);
+            reader.parse(data, o, false);
 
             return o;
         }
@@ -54,114 +122,490 @@ namespace mixpanel
                 std::lock_guard<decltype(mutex)> lock(memory_queues_mutex);
                 auto memory_queue = memory_queues.find(name);
                 if (memory_queue != memory_queues.end())
-                    memory_queue_size = memory_queue->second.size() * 128; // 128 is a rough estimate
+                    memory_queue_size = memory_queue->second.data.size();
             }
 
-            // we don't worry about locking here, if occasionally an event slips through, we don't care to much
-            std::ifstream in(get_full_name(name).c_str(), std::ifstream::ate | std::ifstream::binary);
-            if (in.good()) // file exists
+            // the size of the queue log is maintained in memory, so we don't need to lock or touch the disk here.
+            // In multi-process mode, queues must only be opened while they are locked.
+            if (multi_process)
+            {
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                auto queue = queues.find(name);
+                return (queue != queues.end() ? queue->second->size() : 0) + memory_queue_size;
+            }
+            return get_queue(name)->size() + memory_queue_size;
+        }
+
+        std::size_t Persistence::get_queue_count(const std::string& name)
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            std::size_t memory_queue_count = 0;
             {
-                // return file size minus some bytes plus memory queue size
-                return std::max<int>(0, std::size_t(in.tellg())-5) + memory_queue_size;
+                std::lock_guard<decltype(mutex)> memory_queues_lock(memory_queues_mutex);
+                auto memory_queue = memory_queues.find(name);
+                if (memory_queue != memory_queues.end())
+                    memory_queue_count = memory_queue->second.count;
             }
-            else
+
+            if (multi_process)
             {
-                // file does not exist, only return approximated memory queue size
-                return 0 + memory_queue_size;
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                auto queue = queues.find(name);
+                return (queue != queues.end() ? queue->second->count() : 0) + memory_queue_count;
             }
+            return get_queue(name)->count() + memory_queue_count;
         }
 
         void Persistence::write(const std::string& name, const Value& o)
         {
             assert(!o.isNull());
-            auto full_name = get_full_name(name);
 
             Json::FastWriter writer;
             auto data = writer.write(o);
 
             {
                 std::lock_guard<decltype(mutex)> lock(mutex);
-                std::ofstream ofs(full_name.c_str(), std::ios::binary);
-                ofs << data;
+                io->write(storage_directory + "/mp_" + name + ".json", data);
             }
         }
 
-        bool Persistence::enqueue(const std::string& name, const Value& o)
+        bool Persistence::enqueue(const std::string& name, const Value& o, Mixpanel::EventPriority priority)
         {
             assert(!o.isNull());
+
+            // FastWriter terminates each object with '\n', that's exactly the record format of the queue log
+            Json::FastWriter writer;
+            return enqueue_serialized(name, writer.write(o), priority);
+        }
+
+        bool Persistence::enqueue_serialized(const std::string& name, const std::string& json, Mixpanel::EventPriority priority)
+        {
+            assert(!json.empty() && json.back() == '\n');
             if (get_queue_size(name) > maximum_queue_size)
             {
-                return false;
+                // with any other policy, the worker makes room when it writes the events to disk
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                auto policy = overflow_policies.find(name);
+                if (policy == overflow_policies.end() || policy->second == Mixpanel::OverflowPolicy::RejectNew)
+                {
+                    ++queue_stats[name].rejected;
+                    metrics->events_rejected.add();
+                    return false;
+                }
             }
 
+            RecordHeader header;
+            header.priority = static_cast<unsigned>(priority);
+            header.time = std::time(nullptr);
+
+            auto record = header.encode() + json;
+
             // we don't write here to not block the caller (main-thread / app)
-            // instead we're writing out the data in dequeue.
+            // instead we're writing out the data in dequeue or once the memory budget is exceeded.
             std::lock_guard<decltype(mutex)> lock(memory_queues_mutex);
-            memory_queues[name].push_back(o);
+            auto& memory_queue = memory_queues[name];
+            memory_queue.data += record;
+            ++memory_queue.count;
+            memory_queues_size += record.size();
+            metrics->events_enqueued.add();
 
             return true;
         }
 
+        std::size_t Persistence::get_memory_queues_size()
+        {
+            return memory_queues_size;
+        }
+
+        bool Persistence::memory_budget_exceeded()
+        {
+            return memory_queues_size >= memory_budget;
+        }
+
+        void Persistence::migrate_legacy_queue(const std::string& name)
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            Queues_lock queues_lock(*this);
+
+            auto legacy_name = storage_directory + "/mp_" + name + ".json";
+            if (io->size(legacy_name) == 0)
+            {
+                return;
+            }
+
+            auto legacy_queue = read(name);
+            if (legacy_queue.isArray())
+            {
+                Json::FastWriter writer;
+                std::string data;
+                for (const auto& o : legacy_queue)
+                {
+                    data += writer.write(o);
+                }
+                get_queue(name)->append(data, legacy_queue.size());
+            }
+            io->remove(legacy_name);
+        }
+
         void Persistence::persist_memory_queues()
         {
             Memory_queues memory_queues;
 
+            // taken before the swap, so get_queue_count() never sees the records in neither place
+            std::lock_guard<decltype(mutex)> lock(mutex);
             { // swap queues, so that we block as short as possible (essentially double buffering)
-                std::lock_guard<decltype(mutex)> lock(memory_queues_mutex);
-                std::swap(Persistence::memory_queues, memory_queues);
-                assert(Persistence::memory_queues.empty());
+                std::lock_guard<decltype(mutex)> memory_queues_lock(memory_queues_mutex);
+                std::swap(this->memory_queues, memory_queues);
+                assert(this->memory_queues.empty());
             }
 
+            Queues_lock queues_lock(*this);
             for(auto& memory_queue : memory_queues)
             {
-                if (!memory_queue.second.empty())
+                auto queue = get_queue(memory_queue.first);
+                queue->append(memory_queue.second.data, memory_queue.second.count);
+
+                // only after the append, so the records are always found in one of the two places
+                memory_queues_size -= memory_queue.second.data.size();
+                if (!multi_process && !batches_in_flight.count(memory_queue.first))
+                {
+                    enforce_maximum_queue_size(memory_queue.first, *queue);
+                }
+            }
+        }
+
+        void Persistence::sync_queues()
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            Queues_lock queues_lock(*this);
+            std::vector<std::shared_ptr<QueueLog>> open_queues;
+            {
+                std::lock_guard<std::mutex> queues_map_lock(queues_mutex);
+                for (const auto& queue : queues)
+                {
+                    open_queues.push_back(queue.second);
+                }
+            }
+
+            for (const auto& queue : open_queues)
+            {
+                queue->sync();
+            }
+        }
+
+        void Persistence::enforce_maximum_queue_size(const std::string& name, QueueLog& queue)
+        {
+            auto policy = Mixpanel::OverflowPolicy::RejectNew;
+            {
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                auto it = overflow_policies.find(name);
+                if (it != overflow_policies.end())
                 {
-                    auto queue = read(memory_queue.first);
-                    assert(queue.isNull() || queue.isArray());
+                    policy = it->second;
+                }
+            }
 
-                    for(const auto& o : memory_queue.second)
-                        queue.append(o);
+            if (policy == Mixpanel::OverflowPolicy::RejectNew)
+            {
+                return;
+            }
 
-                    write(memory_queue.first, queue);
+            std::size_t evicted = 0;
+            while (queue.size() > maximum_queue_size && !queue.empty())
+            {
+                std::size_t removed = 0;
+                if (policy == Mixpanel::OverflowPolicy::Sample)
+                {
+                    removed = queue.thin_out();
                 }
+                else if (policy == Mixpanel::OverflowPolicy::EvictByPriority)
+                {
+                    removed = queue.evict_lowest_priority();
+                }
+
+                if (removed == 0)
+                {
+                    // drop oldest, or there is nothing left to thin out: drop about as many records as it takes to fit
+                    auto average_size = queue.size() / queue.count() + 1;
+                    removed = std::min(queue.count(), (queue.size() - maximum_queue_size) / average_size + 1);
+                    queue.drop_front(removed);
+                }
+                evicted += removed;
+            }
+
+            if (evicted != 0)
+            {
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                queue_stats[name].evicted += evicted;
             }
         }
 
+        bool Persistence::expire(const std::string& name, QueueLog& queue)
+        {
+            Mixpanel::Days max_event_age = 0;
+            {
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                auto it = max_event_ages.find(name);
+                if (it != max_event_ages.end())
+                {
+                    max_event_age = it->second;
+                }
+            }
+
+            if (max_event_age == 0)
+            {
+                return false;
+            }
+
+            auto cutoff = std::time(nullptr) - static_cast<std::time_t>(max_event_age) * 24 * 60 * 60;
+
+            // whole segments first, then the expired records at the front of the next batch. Only the headers are parsed.
+            auto expired = queue.expire(cutoff);
+            if (expired == 0)
+            {
+                auto records = queue.front(50);
+                RecordHeader header;
+                while (expired != records.size())
+                {
+                    const auto& record = records[expired];
+                    header.parse(record.data(), record.data() + record.size());
+                    if (header.time == 0 || header.time >= cutoff)
+                    {
+                        break;
+                    }
+                    ++expired;
+                }
+
+                if (expired != 0)
+                {
+                    queue.drop_front(expired);
+                }
+            }
+
+            if (expired != 0)
+            {
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                queue_stats[name].expired += expired;
+            }
+            return expired != 0;
+        }
+
         std::pair<Value, std::size_t> Persistence::dequeue(const std::string& name, unsigned int max_items)
         {
-            persist_memory_queues();
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            Queues_lock queues_lock(*this);
+            migrate_legacy_queue(name);
+
+            auto queue = get_queue(name);
+
+            // the worker sends one batch of a queue at a time, the previous one is over
+            batches_in_flight.erase(name);
+
+            bool memory_queue_empty;
+            {
+                std::lock_guard<decltype(mutex)> memory_queues_lock(memory_queues_mutex);
+                auto memory_queue = memory_queues.find(name);
+                memory_queue_empty = (memory_queue == memory_queues.end() || memory_queue->second.data.empty());
+            }
+
+            // if the queue on disk holds a full batch, read it first and persist the new entries afterwards.
+            // Depending on the io engine, the writes then happen while the batch is being sent.
+            if (!memory_queue_empty && queue->count() < max_items)
+            {
+                persist_memory_queues();
+            }
+
+            // in multi-process mode, only the uploader dequeues, see set_multi_process()
+            enforce_maximum_queue_size(name, *queue);
 
-            auto queue = read(name);
-            assert(queue.isNull() || queue.isArray());
+            while (expire(name, *queue))
+            {
+            }
 
             Value ret;
-            for (auto i = 0; i != std::min(max_items, queue.size()); ++i)
+            Json::Reader reader;
+            for (;;)
             {
-                assert(queue[i].isObject());
-                ret.append(queue[i]);
+                // the garbage at the front of the queue is dropped, a batch at a time in case a whole segment is broken
+                std::size_t garbage = 0;
+                auto records = queue->front(max_items);
+                for (std::size_t i = 0; i != records.size(); ++i)
+                {
+                    Value o;
+                    RecordHeader header;
+                    auto end = records[i].data() + records[i].size();
+                    if (!reader.parse(header.parse(records[i].data(), end), end, o, false) || !o.isObject())
+                    {
+                        if (ret.isNull())
+                        {
+                            ++garbage;
+                            continue;
+                        }
+                        // send what we have so far, the broken record ends up at the front of the next batch
+                        break;
+                    }
+                    ret.append(o);
+                }
+
+                if (garbage == 0)
+                {
+                    break;
+                }
+                queue->drop_front(garbage);
+                if (!ret.isNull())
+                {
+                    break;
+                }
             }
+
+            if (!ret.isNull())
+            {
+                batches_in_flight.insert(name);
+            }
+            persist_memory_queues();
+
             assert(ret.isNull() || ret.isArray());
-            return std::make_pair(ret, queue.size());
+            return std::make_pair(ret, queue->count());
         }
 
         void Persistence::drop_front(const std::string& name, size_t count)
         {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            Queues_lock queues_lock(*this);
+            migrate_legacy_queue(name);
             persist_memory_queues();
 
-            auto queue = read(name);
-            assert(queue.isNull() || queue.isArray());
+            auto queue = get_queue(name);
+            queue->drop_front(count);
 
-            Value v;
-            while(!queue.empty() && count-- && queue.removeIndex(0, &v))
+            // the batch is over, the records that were held back can be evicted now
+            if (batches_in_flight.erase(name) && !multi_process)
             {
-                assert(!v.isNull());
+                enforce_maximum_queue_size(name, *queue);
+            }
+        }
+
+        void Persistence::set_multi_process(bool enabled)
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            if (enabled == multi_process)
+            {
+                return;
+            }
+
+            persist_memory_queues();
+            {
+                // the queues are reopened on next use. get_queue_size() may still hold on to one, but only calls size() on it.
+                std::lock_guard<std::mutex> queues_lock(queues_mutex);
+                queues.clear();
+            }
+
+            // the io_uring engine may complete appends after the file lock has been released, when the other processes already
+            // read the queue
+            io.reset(new MeasuredIOEngine(enabled ? std::unique_ptr<IOEngine>(new PortableIOEngine()) : IOEngine::create(), metrics));
+            queues_file_lock.reset(enabled ? new FileLock(storage_directory + "/mp_queues.lock") : nullptr);
+            multi_process = enabled;
+        }
+
+        void Persistence::lock_queues()
+        {
+            if (multi_process && queues_lock_depth++ == 0)
+            {
+                queues_file_lock->lock();
+
+                std::lock_guard<std::mutex> lock(queues_mutex);
+                for (auto& queue : queues)
+                {
+                    queue.second->refresh();
+                }
+            }
+        }
+
+        void Persistence::unlock_queues()
+        {
+            if (multi_process && --queues_lock_depth == 0)
+            {
+                queues_file_lock->unlock();
             }
-            write(name, queue);
         }
 
         void Persistence::set_maximum_queue_size(std::size_t maximum_size)
         {
-            Persistence::maximum_queue_size = maximum_size;
+            this->maximum_queue_size = maximum_size;
+        }
+
+        void Persistence::set_memory_budget(std::size_t memory_budget)
+        {
+            this->memory_budget = memory_budget;
+        }
+
+        void Persistence::set_overflow_policy(const std::string& name, Mixpanel::OverflowPolicy policy)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            overflow_policies[name] = policy;
+        }
+
+        void Persistence::set_max_event_age(const std::string& name, Mixpanel::Days days)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            max_event_ages[name] = days;
+        }
+
+        void Persistence::dead_letter(const std::string& name, const std::vector<std::pair<Value, std::string>>& records)
+        {
+            if (records.empty())
+            {
+                return;
+            }
+
+            Json::FastWriter writer;
+            std::string data;
+            for (const auto& record : records)
+            {
+                Value entry;
+                entry["error"] = record.second;
+                entry["time"] = static_cast<Json::Int64>(std::time(nullptr));
+                entry["record"] = record.first;
+                data += writer.write(entry);
+            }
+
+            std::size_t dropped = 0;
+            {
+                std::lock_guard<decltype(mutex)> lock(mutex);
+                auto path = storage_directory + "/mp_" + name + ".dead";
+                if (io->size(path) + data.size() <= max_dead_letter_size)
+                {
+                    io->append(path, data);
+                }
+                else
+                {
+                    dropped = records.size();
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            queue_stats[name].dead_lettered += records.size();
+            queue_stats[name].dead_letters_dropped += dropped;
+        }
+
+        std::string Persistence::read_dead_letters(const std::string& name)
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            std::string data;
+            io->read(storage_directory + "/mp_" + name + ".dead", 0, std::numeric_limits<std::size_t>::max(), data);
+            return data;
+        }
+
+        void Persistence::clear_dead_letters(const std::string& name)
+        {
+            std::lock_guard<decltype(mutex)> lock(mutex);
+            io->remove(storage_directory + "/mp_" + name + ".dead");
+        }
+
+        Mixpanel::QueueStats Persistence::get_queue_stats(const std::string& name)
+        {
+            std::lock_guard<std::mutex> lock(queues_mutex);
+            return queue_stats[name];
         }
     } // namespace detail
 } // namespace mixpanel
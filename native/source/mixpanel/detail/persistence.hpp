@@ -2,18 +2,36 @@
 #define _PERSISTENCE_HPP_
 
 #include <atomic>
-#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include <mixpanel/mixpanel.hpp>
 #include <mixpanel/value.hpp>
+#include "./metrics.hpp"
 
 class Persistence_TestDropFront_Test;
 class Mixpanel_HugeRequest_Test;
 class Persistence_Corruption_Test;
 class Persistence_MaxQueueSize_Test;
+class Persistence_LegacyQueueMigration_Test;
+class Persistence_MemoryBudget_Test;
+class Persistence_OverflowPolicies_Test;
+class Persistence_OverflowWhileInFlight_Test;
+class Persistence_MaxEventAge_Test;
+class Persistence_DeadLetters_Test;
+class Persistence_MultiProcess_Test;
+class Mixpanel_ConcurrentInstances_Test;
+class Mixpanel_TrackJson_Test;
+class Mixpanel_TrackAs_Test;
+class Mixpanel_Shutdown_Test;
+class MixpanelNetwork_FlushAsync_Test;
+class MixpanelNetwork_CircuitBreaker_Test;
+class MixpanelNetwork_PriorityLanes_Test;
 class GDPR_optInTrackingEvent_Test;
 class GDPR_noTrackCallDuringOrAfterInitWithOptOut_Test;
 class GDPR_optInTrackingForDistinctId_Test;
@@ -28,33 +46,75 @@ class GDPR_outOutTrackingWillClearTrackQueue_Test;
 class GDPR_outOutTrackingWillClearEngageQueue_Test;
 class GDPR_outOutTrackingWillSkipFlushEvent_Test;
 class GDPR_outOutTrackingWillSkipFlushPeople_Test;
+class PersistenceBenchmark;
 
 
 void test_drain_queues();
-void testsuite_wait_for_delivery(const std::string &queue_name, long for_seconds);
 
 
 namespace mixpanel
 {
     namespace detail
     {
+        class FileLock;
+        class IOEngine;
+        class QueueLog;
+
+        // The persistent state of one Mixpanel instance: the send queues and a couple of json files (state, super properties, ...),
+        // all stored in one directory.
         class Persistence
         {
             public:
-                static void set_storage_directory(const std::string& storage_directory);
-                static void set_maximum_queue_size(std::size_t maximum_size);
-
-                static Value read(const std::string name);
-                static void write(const std::string& name, const Value& o);
+                // counts the events it queues and its file I/O into *metrics*
+                explicit Persistence(const std::string& storage_directory, std::shared_ptr<Metrics> metrics=std::make_shared<Metrics>());
+                ~Persistence();
+
+                // every instance stores its data in its own subdirectory of the storage directory
+                static std::string get_instance_directory(const std::string& storage_directory, const std::string& token);
+
+                // moves the data of older versions, which was stored directly in the storage directory, into this instance
+                void migrate_from(const std::string& storage_directory);
+                void set_maximum_queue_size(std::size_t maximum_size);
+                void set_memory_budget(std::size_t memory_budget);
+                void set_overflow_policy(const std::string& name, Mixpanel::OverflowPolicy policy);
+                void set_max_event_age(const std::string& name, Mixpanel::Days days);
+                Mixpanel::QueueStats get_queue_stats(const std::string& name);
+
+                // The records of queue *name* the API refused for good, one {"error":...,"time":...,"record":{...}} per line.
+                // The file (mp_<name>.dead) stops growing at max_dead_letter_size, later records are only counted.
+                std::string read_dead_letters(const std::string& name);
+                void clear_dead_letters(const std::string& name);
+                static const std::size_t max_dead_letter_size = 1024 * 1024;
+
+                // In multi-process mode, the queues are locked against other processes using the same directory on every
+                // access and catch up with what the others have written. Only the uploader evicts records to enforce
+                // the maximum queue size, see batches_in_flight.
+                void set_multi_process(bool enabled);
+                bool is_multi_process() const { return multi_process; }
+
+                Value read(const std::string name);
+                void write(const std::string& name, const Value& o);
             private:
-                friend void ::testsuite_wait_for_delivery(const std::string &queue_name, long for_seconds);
-
                 friend class ::Persistence_TestDropFront_Test;
                 friend class ::Mixpanel_HugeRequest_Test;
                 friend class ::Persistence_Corruption_Test;
                 friend class ::Engage_set_Test;
                 friend class ::Reachability_NotSending_Test;
                 friend class ::Persistence_MaxQueueSize_Test;
+                friend class ::Persistence_LegacyQueueMigration_Test;
+                friend class ::Persistence_MemoryBudget_Test;
+                friend class ::Persistence_OverflowPolicies_Test;
+                friend class ::Persistence_OverflowWhileInFlight_Test;
+                friend class ::Persistence_MaxEventAge_Test;
+                friend class ::Persistence_DeadLetters_Test;
+                friend class ::Persistence_MultiProcess_Test;
+                friend class ::Mixpanel_ConcurrentInstances_Test;
+                friend class ::Mixpanel_TrackJson_Test;
+                friend class ::Mixpanel_TrackAs_Test;
+                friend class ::Mixpanel_Shutdown_Test;
+                friend class ::MixpanelNetwork_FlushAsync_Test;
+                friend class ::MixpanelNetwork_CircuitBreaker_Test;
+                friend class ::MixpanelNetwork_PriorityLanes_Test;
                 friend class ::Bugs_TemporaryFailure_Test;
                 friend class ::Bugs_TemporaryFailure2_Test;
                 friend class ::GDPR_optInTrackingEvent_Test;
@@ -69,31 +129,102 @@ namespace mixpanel
                 friend class ::GDPR_outOutTrackingWillSkipFlushPeople_Test;
 
                 friend void ::test_drain_queues();
+                friend class ::PersistenceBenchmark;
 
                 friend class Worker;
-                static bool enqueue(const std::string& name, const Value& o);
+                bool enqueue(const std::string& name, const Value& o, Mixpanel::EventPriority priority=Mixpanel::EventPriority::Normal);
+
+                // like enqueue(), but takes the json encoded object, terminated by '\n'
+                bool enqueue_serialized(const std::string& name, const std::string& json, Mixpanel::EventPriority priority);
+
+                // return a pair of the read values and the total size of the queue. The records stay in the queue until
+                // drop_front() acknowledges them, the batch is in flight until then.
+                std::pair<Value, std::size_t> dequeue(const std::string& name, unsigned int max_items=50);
 
-                // return a pair of the read values and the total size of the queue
-                static std::pair<Value, std::size_t> dequeue(const std::string& name, unsigned int max_items=50);
-                static void drop_front(const std::string& name, size_t count);
+                // drops *count* records from the front of the queue, also 0 ends the batch in flight
+                void drop_front(const std::string& name, size_t count);
+
+                // appends the records with the reasons they were refused to the dead letter file of queue *name*
+                void dead_letter(const std::string& name, const std::vector<std::pair<Value, std::string>>& records);
 
                 #ifdef WIN32
-                    static std::wstring get_full_name(const std::string& name);
+                    std::wstring get_full_name(const std::string& name);
                 #else
-                    static std::string get_full_name(const std::string& name);
+                    std::string get_full_name(const std::string& name);
                 #endif
-                static std::size_t get_queue_size(const std::string& name);
+                std::size_t get_queue_size(const std::string& name);
 
-                static std::recursive_mutex mutex;
-                static std::string storage_directory;
-                static std::atomic<std::size_t> maximum_queue_size;
+                // the number of records in the queue, in memory and on disk. Waits for a write to disk in progress.
+                std::size_t get_queue_count(const std::string& name);
 
-                // write data in memory_queues to disk and clear memory_queues
-                static void persist_memory_queues();
+                std::recursive_mutex mutex;
+                const std::string storage_directory;
+                std::atomic<std::size_t> maximum_queue_size;
+
+                std::shared_ptr<Metrics> metrics;
+                std::unique_ptr<IOEngine> io;
+
+                // the on-disk part of the queues, opened on first use
+                std::shared_ptr<QueueLog> get_queue(const std::string& name);
+                std::mutex queues_mutex;
+                std::map<std::string, std::shared_ptr<QueueLog>> queues;
 
-                static std::recursive_mutex memory_queues_mutex;
-                typedef std::map<std::string, std::list<Value>> Memory_queues;
-                static Memory_queues memory_queues;
+                // also guarded by queues_mutex
+                std::map<std::string, Mixpanel::OverflowPolicy> overflow_policies;
+                std::map<std::string, Mixpanel::QueueStats> queue_stats;
+                std::map<std::string, Mixpanel::Days> max_event_ages;
+
+                // The queues with a batch between dequeue() and drop_front(). The acknowledgement counts records from the
+                // front, so an eviction in between would make it drop records that were never sent. Their records are only
+                // evicted by the next dequeue() or drop_front(). Guarded by mutex.
+                std::set<std::string> batches_in_flight;
+
+                std::atomic<bool> multi_process;
+                std::unique_ptr<FileLock> queues_file_lock;
+                unsigned queues_lock_depth;
+
+                // Locks the queues against other processes in multi-process mode. Must be called with mutex held, may be nested.
+                void lock_queues();
+                void unlock_queues();
+
+                struct Queues_lock
+                {
+                    explicit Queues_lock(Persistence& persistence) : persistence(persistence) { persistence.lock_queues(); }
+                    ~Queues_lock() { persistence.unlock_queues(); }
+                    Persistence& persistence;
+                };
+
+                // removes expired records from the front of queue, returns true if there were any
+                bool expire(const std::string& name, QueueLog& queue);
+
+                // evicts records from queue according to its overflow policy until it fits into maximum_queue_size
+                void enforce_maximum_queue_size(const std::string& name, QueueLog& queue);
+
+                // older versions stored the queues as a json array in mp_<name>.json. Move those entries into the queue.
+                void migrate_legacy_queue(const std::string& name);
+
+                // write data in memory_queues to disk and clear memory_queues
+                void persist_memory_queues();
+
+                // waits until the queues are on stable storage
+                void sync_queues();
+
+                // size of all memory_queues in bytes
+                std::size_t get_memory_queues_size();
+                bool memory_budget_exceeded();
+
+                // events are serialized when they are enqueued, so we know exactly how much memory they take
+                struct Memory_queue
+                {
+                    std::string data;       // one record per line
+                    std::size_t count;
+                };
+
+                std::recursive_mutex memory_queues_mutex;
+                typedef std::map<std::string, Memory_queue> Memory_queues;
+                Memory_queues memory_queues;
+                std::atomic<std::size_t> memory_queues_size;
+                std::atomic<std::size_t> memory_budget;
         };
     } // namespace detail
 } // namespace mixpanel
@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./io_engine.hpp"
+#include "./queue_log.hpp"
+#include "./workarounds.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        const std::size_t QueueLog::segment_size;
+        const unsigned RecordHeader::priority_classes;
+        const unsigned RecordHeader::normal_priority;
+
+        static const std::size_t max_read_size = 64 * 1024;
+
+        std::string RecordHeader::encode() const
+        {
+            std::string ret = "p" + std::to_string(priority) + " ";
+            if (time != 0)
+            {
+                ret += "t" + std::to_string(static_cast<long long>(time)) + " ";
+            }
+            return ret;
+        }
+
+        const char* RecordHeader::parse(const char* begin, const char* end)
+        {
+            *this = RecordHeader();
+            while (begin != end && *begin != '{')
+            {
+                auto field_end = std::find(begin, end, ' ');
+                if (field_end - begin == 2 && begin[0] == 'p' && begin[1] >= '0' && begin[1] < char('0' + priority_classes))
+                {
+                    priority = begin[1] - '0';
+                }
+                else if (field_end - begin > 1 && begin[0] == 't')
+                {
+                    long long value = 0;
+                    for (auto c = begin + 1; c != field_end && '0' <= *c && *c <= '9'; ++c)
+                    {
+                        value = value * 10 + (*c - '0');
+                    }
+                    time = static_cast<std::time_t>(value);
+                }
+                begin = (field_end == end) ? end : field_end + 1;
+            }
+            return begin;
+        }
+
+        QueueLog::QueueLog(IOEngine& io, const std::string& directory, const std::string& name)
+        : io(io)
+        , prefix(directory + "/mp_" + name)
+        , first_segment(0)
+        , last_segment(0)
+        , head(0)
+        , generation(0)
+        , invalidated_front(0)
+        , thin_cursor(0)
+        , bytes(0)
+        , records(0)
+        {
+            load();
+        }
+
+        std::string QueueLog::segment_path(unsigned segment) const
+        {
+            return prefix + "." + std::to_string(segment) + ".log";
+        }
+
+        std::size_t QueueLog::Segment_info::count() const
+        {
+            std::size_t ret = 0;
+            for (auto n : priorities)
+            {
+                ret += n;
+            }
+            return ret;
+        }
+
+        std::size_t QueueLog::count_records(const std::string& data, std::size_t begin, Segment_info& info)
+        {
+            std::size_t count = 0;
+            std::size_t end;
+            while ((end = data.find('\n', begin)) != std::string::npos)
+            {
+                RecordHeader header;
+                header.parse(data.data() + begin, data.data() + end);
+                ++info.priorities[header.priority];
+                info.newest = std::max(info.newest, header.time);
+                ++count;
+                begin = end + 1;
+            }
+            return count;
+        }
+
+        bool QueueLog::read_index(unsigned& first, unsigned& last, std::size_t& offset, unsigned long& generation)
+        {
+            first = last = 0;
+            offset = 0;
+            generation = 0;
+
+            std::string index;
+            if (!io.read(prefix + ".queue", 0, 256, index))
+            {
+                return false;
+            }
+
+            // older versions did not write the generation
+            std::istringstream iss(index);
+            if (!(iss >> first >> last >> offset) || first > last)
+            {
+                first = last = 0;
+                offset = 0;
+                return false;
+            }
+            iss >> generation;
+            return true;
+        }
+
+        void QueueLog::load()
+        {
+            read_index(first_segment, last_segment, head, generation);
+
+            // we might have crashed after starting a new segment, but before the index was written
+            while (io.size(segment_path(last_segment + 1)) > 0)
+            {
+                ++last_segment;
+            }
+
+            std::size_t total_bytes = 0;
+            std::size_t total_records = 0;
+            for (unsigned segment = first_segment; segment <= last_segment; ++segment)
+            {
+                std::string data;
+                io.read(segment_path(segment), 0, std::numeric_limits<std::size_t>::max(), data);
+
+                if (segment == last_segment)
+                {
+                    // cut off a partially written record
+                    auto end = data.find_last_of('\n');
+                    end = (end == std::string::npos) ? 0 : end + 1;
+                    if (end != data.size())
+                    {
+                        data.resize(end);
+                        io.write(segment_path(segment), data);
+                    }
+                }
+                segments[segment].size = data.size();
+
+                std::size_t begin = 0;
+                if (segment == first_segment)
+                {
+                    head = std::min(head, data.size());
+                    begin = head;
+                }
+
+                total_bytes += data.size() - begin;
+                total_records += count_records(data, begin, segments[segment]);
+            }
+
+            bytes = total_bytes;
+            records = total_records;
+        }
+
+        void QueueLog::reload()
+        {
+            first_segment = last_segment = 0;
+            head = 0;
+            generation = 0;
+            invalidated_front = front_lengths.size();
+            front_lengths.clear();
+            front_priorities.clear();
+            segments.clear();
+            bytes = 0;
+            records = 0;
+            load();
+        }
+
+        void QueueLog::save_index()
+        {
+            io.write(prefix + ".queue", std::to_string(first_segment) + " " + std::to_string(last_segment) + " " + std::to_string(head) +
+                     " " + std::to_string(generation) + "\n");
+        }
+
+        void QueueLog::refresh()
+        {
+            unsigned first, last;
+            std::size_t offset;
+            unsigned long index_generation;
+            read_index(first, last, offset, index_generation);
+
+            if (index_generation != generation || first < first_segment || (first == first_segment && offset < head) || last < last_segment)
+            {
+                // records were removed from the middle or the queue was cleared
+                reload();
+                return;
+            }
+
+            // records appended to the end, possibly to new segments. Appends go first, so the records that have been
+            // appended and dropped since the last refresh are accounted correctly.
+            for (unsigned segment = std::max(last_segment, first); segment <= last; ++segment)
+            {
+                auto& info = segments[segment];
+                std::string data;
+                io.read(segment_path(segment), info.size, std::numeric_limits<std::size_t>::max(), data);
+                auto end = data.find_last_of('\n');
+                data.resize(end == std::string::npos ? 0 : end + 1);
+
+                records += count_records(data, 0, info);
+                bytes += data.size();
+                info.size += data.size();
+            }
+            last_segment = last;
+
+            if (first != first_segment || offset != head)
+            {
+                invalidated_front = front_lengths.size();
+                front_lengths.clear();
+                front_priorities.clear();
+            }
+
+            // segments that have been dropped completely
+            while (first_segment != first)
+            {
+                const auto& info = segments[first_segment];
+                bytes -= std::min<std::size_t>(bytes, info.size - std::min(info.size, head));
+                records -= std::min<std::size_t>(records, info.count());
+                segments.erase(first_segment);
+                ++first_segment;
+                head = 0;
+            }
+
+            // records dropped from the remaining first segment. We only need to read what has been dropped.
+            if (offset != head)
+            {
+                std::string data;
+                io.read(segment_path(first_segment), head, offset - head, data);
+                Segment_info dropped;
+                auto count = count_records(data, 0, dropped);
+                auto& info = segments[first_segment];
+                for (unsigned priority = 0; priority != RecordHeader::priority_classes; ++priority)
+                {
+                    info.priorities[priority] -= std::min(info.priorities[priority], dropped.priorities[priority]);
+                }
+                bytes -= std::min<std::size_t>(bytes, data.size());
+                records -= std::min<std::size_t>(records, count);
+                head = offset;
+            }
+        }
+
+        void QueueLog::append(const std::string& data, std::size_t count)
+        {
+            if (data.empty())
+            {
+                return;
+            }
+
+            io.append(segment_path(last_segment), data);
+            auto& info = segments[last_segment];
+            count_records(data, 0, info);
+            info.size += data.size();
+            bytes += data.size();
+            records += count;
+
+            if (info.size >= segment_size)
+            {
+                ++last_segment;
+                save_index();
+            }
+        }
+
+        std::vector<std::string> QueueLog::front(std::size_t max_records)
+        {
+            std::vector<std::string> ret;
+            front_lengths.clear();
+            front_priorities.clear();
+            invalidated_front = 0;
+
+            unsigned segment = first_segment;
+            std::size_t offset = head;
+            std::string pending;
+
+            // read about as much as we expect to need, based on the average record size
+            std::size_t average_size = records ? bytes / records + 1 : 128;
+            std::size_t read_size = std::min(max_read_size, std::max<std::size_t>(4096, average_size * max_records * 5 / 4));
+
+            while (ret.size() < max_records && segment <= last_segment)
+            {
+                std::string chunk;
+                io.read(segment_path(segment), offset, read_size, chunk);
+                offset += chunk.size();
+                pending += chunk;
+
+                std::size_t pos = 0;
+                std::size_t end;
+                while (ret.size() < max_records && (end = pending.find('\n', pos)) != std::string::npos)
+                {
+                    RecordHeader header;
+                    header.parse(pending.data() + pos, pending.data() + end);
+                    ret.push_back(pending.substr(pos, end + 1 - pos));
+                    front_lengths.push_back(end + 1 - pos);
+                    front_priorities.push_back(header.priority);
+                    pos = end + 1;
+                }
+                pending.erase(0, pos);
+
+                if (chunk.size() < read_size)
+                {
+                    // records never span segments
+                    pending.clear();
+                    ++segment;
+                    offset = 0;
+                }
+            }
+
+            return ret;
+        }
+
+        void QueueLog::drop_front(std::size_t count)
+        {
+            if (invalidated_front != 0 && count <= invalidated_front)
+            {
+                // the records returned by front() are gone already
+                invalidated_front = 0;
+                return;
+            }
+            invalidated_front = 0;
+
+            if (count >= records)
+            {
+                clear();
+                return;
+            }
+
+            if (count > front_lengths.size())
+            {
+                front(count);
+            }
+
+            auto next_segment = [&]()
+            {
+                // also skips segments that have been emptied by an eviction
+                while (head >= segments[first_segment].size && first_segment != last_segment)
+                {
+                    io.remove(segment_path(first_segment));
+                    segments.erase(first_segment);
+                    ++first_segment;
+                    head = 0;
+                }
+            };
+
+            for (std::size_t i = 0; i != count && i != front_lengths.size(); ++i)
+            {
+                next_segment();
+                head += front_lengths[i];
+                bytes -= front_lengths[i];
+                --records;
+                --segments[first_segment].priorities[front_priorities[i]];
+            }
+            next_segment();
+
+            front_lengths.clear();
+            front_priorities.clear();
+            save_index();
+        }
+
+        std::size_t QueueLog::rewrite_segment(unsigned segment, const std::function<bool(const RecordHeader&, std::size_t)>& keep)
+        {
+            const auto path = segment_path(segment);
+            std::string data;
+            io.read(path, (segment == first_segment) ? head : 0, std::numeric_limits<std::size_t>::max(), data);
+
+            std::string kept;
+            kept.reserve(data.size());
+            Segment_info info;
+            std::size_t removed = 0;
+            std::size_t index = 0;
+            std::size_t begin = 0;
+            std::size_t end;
+            while ((end = data.find('\n', begin)) != std::string::npos)
+            {
+                RecordHeader header;
+                header.parse(data.data() + begin, data.data() + end);
+                if (keep(header, index++))
+                {
+                    kept.append(data, begin, end + 1 - begin);
+                    ++info.priorities[header.priority];
+                    info.newest = std::max(info.newest, header.time);
+                }
+                else
+                {
+                    ++removed;
+                }
+                begin = end + 1;
+            }
+
+            if (removed == 0)
+            {
+                return 0;
+            }
+
+            // a crash in the middle of this can lose the segment. We are evicting data from it anyway.
+            io.write(path, kept);
+            bytes -= data.size() - kept.size();
+            records -= removed;
+            info.size = kept.size();
+            segments[segment] = info;
+            if (segment == first_segment)
+            {
+                head = 0;
+            }
+
+            // other QueueLogs on this queue can't catch up with this incrementally
+            ++generation;
+            front_lengths.clear();
+            front_priorities.clear();
+            save_index();
+            return removed;
+        }
+
+        std::size_t QueueLog::thin_out()
+        {
+            if (empty())
+            {
+                return 0;
+            }
+
+            if (first_segment == last_segment)
+            {
+                // all records are in the segment that is appended to. Like a full segment, it is closed and the appends go
+                // to a new one, so it can be rewritten like the others. The engine finishes its appends before that.
+                ++last_segment;
+                save_index();
+            }
+
+            if (thin_cursor < first_segment || thin_cursor >= last_segment)
+            {
+                thin_cursor = first_segment;
+            }
+
+            // keeping the even records is deterministic, and thinning the same segment again halves it again
+            return rewrite_segment(thin_cursor++, [](const RecordHeader&, std::size_t index) {
+                return index % 2 == 0;
+            });
+        }
+
+        std::size_t QueueLog::evict_lowest_priority()
+        {
+            Priority_counts total = {};
+            for (const auto& segment : segments)
+            {
+                for (unsigned priority = 0; priority != RecordHeader::priority_classes; ++priority)
+                {
+                    total[priority] += segment.second.priorities[priority];
+                }
+            }
+
+            unsigned lowest = RecordHeader::priority_classes;
+            unsigned present = 0;
+            for (unsigned priority = 0; priority != RecordHeader::priority_classes; ++priority)
+            {
+                if (total[priority] != 0)
+                {
+                    lowest = std::min(lowest, priority);
+                    ++present;
+                }
+            }
+
+            if (present < 2)
+            {
+                return 0;
+            }
+
+            for (const auto& segment : segments)
+            {
+                if (segment.second.priorities[lowest] != 0)
+                {
+                    return rewrite_segment(segment.first, [lowest](const RecordHeader& header, std::size_t) {
+                        return header.priority != lowest;
+                    });
+                }
+            }
+            return 0;
+        }
+
+        void QueueLog::remove_first_segment()
+        {
+            const auto& info = segments[first_segment];
+            bytes -= std::min<std::size_t>(bytes, info.size - std::min(info.size, head));
+            records -= std::min<std::size_t>(records, info.count());
+
+            io.remove(segment_path(first_segment));
+            segments.erase(first_segment);
+            if (first_segment == last_segment)
+            {
+                ++last_segment;
+            }
+            ++first_segment;
+            head = 0;
+        }
+
+        std::size_t QueueLog::expire(std::time_t cutoff)
+        {
+            std::size_t expired = 0;
+            while (!empty())
+            {
+                auto newest = segments[first_segment].newest;
+                if (newest == 0 || newest >= cutoff)
+                {
+                    break;
+                }
+
+                auto before = count();
+                remove_first_segment();
+                expired += before - count();
+            }
+
+            if (expired != 0)
+            {
+                front_lengths.clear();
+                front_priorities.clear();
+                save_index();
+            }
+            return expired;
+        }
+
+        void QueueLog::sync()
+        {
+            io.sync(segment_path(last_segment));
+            io.sync(prefix + ".queue");
+        }
+
+        void QueueLog::clear()
+        {
+            for (unsigned segment = first_segment; segment <= last_segment; ++segment)
+            {
+                io.remove(segment_path(segment));
+            }
+
+            // the index stays, so other QueueLogs on this queue see the new generation
+            first_segment = last_segment = 0;
+            head = 0;
+            ++generation;
+            save_index();
+            front_lengths.clear();
+            front_priorities.clear();
+            segments.clear();
+            thin_cursor = 0;
+            bytes = 0;
+            records = 0;
+        }
+    } // namespace detail
+} // namespace mixpanel
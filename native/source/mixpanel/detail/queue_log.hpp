@@ -0,0 +1,156 @@
+#ifndef _MIXPANEL_QUEUE_LOG_HPP_
+#define _MIXPANEL_QUEUE_LOG_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        class IOEngine;
+
+        // Records start with a header of space separated fields, followed by the json encoded event:
+        //
+        //   p2 t1500000000 {"event":"purchase",...}\n
+        //
+        // p<n>  priority class of the event, 0 (low) to 2 (high)
+        // t<n>  unix time at which the event was queued
+        //
+        // Unknown fields are skipped. Records without a header (written by older versions) have normal priority
+        // and no time, so they never expire.
+        struct RecordHeader
+        {
+            RecordHeader() : priority(normal_priority), time(0) {}
+
+            unsigned priority;
+            std::time_t time;
+
+            static const unsigned priority_classes = 3;
+            static const unsigned normal_priority = 1;
+
+            std::string encode() const;
+
+            // parses the header of the record in [begin, end) and returns the start of the json body
+            const char* parse(const char* begin, const char* end);
+        };
+
+        // A persistent fifo of records. Each record is a single line terminated by '\n'.
+        //
+        // Records are appended to numbered segment files (mp_<name>.<n>.log). A small index file
+        // (mp_<name>.queue) stores the first and last segment and the read offset into the first segment.
+        // Appending never rewrites existing data and dropping records from the front only moves the read
+        // offset, or removes the segment once it has been read completely.
+        //
+        // Not thread safe, except for size() and count().
+        //
+        // Several QueueLogs, also in different processes, can share a queue if every access is made while holding a
+        // FileLock on it and starts with refresh(). The index then also holds a generation, which changes whenever
+        // records are removed from anywhere but the front, so the other QueueLogs know they have to start over.
+        class QueueLog
+        {
+            public:
+                QueueLog(IOEngine& io, const std::string& directory, const std::string& name);
+
+                // append one or more records. data must consist of complete lines.
+                void append(const std::string& data, std::size_t count);
+
+                // returns up to max_records records from the front of the queue (including the '\n')
+                std::vector<std::string> front(std::size_t max_records);
+
+                void drop_front(std::size_t count);
+                void clear();
+
+                // waits until the records appended so far and the index are on stable storage
+                void sync();
+
+                // The eviction strategies below rewrite a single segment, so their cost is bounded by the segment size
+                // and each call frees a fraction of a segment. They return the number of removed records.
+
+                // removes every other record of one segment. Successive calls go round robin over all segments
+                // but the one that is currently appended to, so the backlog is thinned out evenly. If that one holds all
+                // records, it is closed first and the appends go to a new segment.
+                std::size_t thin_out();
+
+                // removes the records of the lowest priority class in the queue from the oldest segment that
+                // contains any. Does nothing if all records have the same priority.
+                std::size_t evict_lowest_priority();
+
+                // removes the segments at the front whose newest record was queued before *cutoff*, without reading them.
+                // Returns the number of removed records. Expired records in a segment that also holds newer ones stay.
+                std::size_t expire(std::time_t cutoff);
+
+                // catches up with the changes other QueueLogs made to the queue. Appends and drops from the front are
+                // accounted incrementally, anything else reloads the queue. If the records returned by the last front()
+                // were dropped in the meantime, the next drop_front() of at most that many records does nothing.
+                void refresh();
+
+                // total size of all records in bytes
+                std::size_t size() const { return bytes; }
+                std::size_t count() const { return records; }
+                bool empty() const { return records == 0; }
+
+                // new segments are started, once the last one has grown beyond this size
+                static const std::size_t segment_size = 256 * 1024;
+            private:
+                void load();
+                void reload();
+                bool read_index(unsigned& first, unsigned& last, std::size_t& offset, unsigned long& generation);
+                void save_index();
+                std::string segment_path(unsigned segment) const;
+
+                typedef std::array<std::size_t, RecordHeader::priority_classes> Priority_counts;
+
+                struct Segment_info
+                {
+                    Segment_info() : priorities(), newest(0), size(0) {}
+
+                    std::size_t count() const;
+
+                    Priority_counts priorities;     // number of records per priority class
+                    std::time_t newest;             // time of the newest record, 0 if none of them has a time
+                    std::size_t size;               // size of the segment file, including the records before head
+                };
+
+                // adds the records in data, starting at offset begin, to info. returns the number of records.
+                static std::size_t count_records(const std::string& data, std::size_t begin, Segment_info& info);
+
+                // removes the first segment, including the records that have not been read yet
+                void remove_first_segment();
+
+                // replaces the remaining records of segment with the ones keep() returns true for.
+                // keep() gets the header and the index of the record in the segment.
+                std::size_t rewrite_segment(unsigned segment, const std::function<bool(const RecordHeader&, std::size_t)>& keep);
+
+                IOEngine& io;
+                std::string prefix;
+
+                unsigned first_segment;
+                unsigned last_segment;
+                std::size_t head;               // read offset into first_segment
+                unsigned long generation;
+
+                // line lengths of the records returned by the last call to front(), so drop_front() does
+                // not need to read them again
+                std::vector<std::size_t> front_lengths;
+                std::vector<unsigned> front_priorities;
+                std::size_t invalidated_front;  // number of records returned by front(), that another QueueLog dropped
+
+                std::map<unsigned, Segment_info> segments;
+
+                // next segment to thin out
+                unsigned thin_cursor;
+
+                std::atomic<std::size_t> bytes;
+                std::atomic<std::size_t> records;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_QUEUE_LOG_HPP_ */
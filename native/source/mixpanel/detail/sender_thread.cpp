@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <chrono>
+#include "./concurrency_limit.hpp"
+#include "./sender_thread.hpp"
+#include "./worker.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        SenderThread::SenderThread()
+        : woken(false)
+        , should_exit(false)
+        , running(nullptr)
+        // enough to keep the connections of both queues at their default concurrency
+        , connection_pool(2 * ConcurrencyLimit::default_maximum)
+        , max_request_threads(0)
+        , idle_request_threads(0)
+        , request_threads_exit(false)
+        {
+            set_max_requests_in_flight(ConcurrencyLimit::default_maximum);
+            thread = std::thread([this](){
+                main();
+            });
+        }
+
+        SenderThread::~SenderThread()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                should_exit = true;
+            }
+            condition.notify_one();
+
+            if (thread.joinable())
+            {
+                thread.join();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(request_mutex);
+                request_threads_exit = true;
+            }
+            request_condition.notify_all();
+            for (auto& request_thread : request_threads)
+            {
+                request_thread.join();
+            }
+        }
+
+        void SenderThread::add(Worker* worker)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                workers.push_back(worker);
+                woken = true;
+            }
+            condition.notify_one();
+        }
+
+        void SenderThread::remove(Worker* worker)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            workers.erase(std::remove(workers.begin(), workers.end(), worker), workers.end());
+            running_done.wait(lock, [this, worker] { return running != worker; });
+        }
+
+        void SenderThread::wake()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                woken = true;
+            }
+            condition.notify_one();
+        }
+
+        bool SenderThread::post_request(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(request_mutex);
+                // every queued task has an idle thread that is about to pick it up
+                if (requests.size() == idle_request_threads)
+                {
+                    if (request_threads.size() == max_request_threads)
+                    {
+                        return false;
+                    }
+                    ++idle_request_threads;
+                    request_threads.emplace_back([this]() {
+                        request_thread_main();
+                    });
+                }
+                requests.push_back(std::move(task));
+            }
+            request_condition.notify_one();
+            return true;
+        }
+
+        void SenderThread::set_max_requests_in_flight(unsigned count)
+        {
+            // a worker sends the first batch of the track queue on this thread and the engage queue on a request thread,
+            // each queue with up to count - 1 more batches besides
+            std::lock_guard<std::mutex> lock(request_mutex);
+            max_request_threads = std::max<std::size_t>(max_request_threads, 2 * std::max(count, 1u) - 1);
+        }
+
+        void SenderThread::request_thread_main()
+        {
+            std::unique_lock<std::mutex> lock(request_mutex);
+            for (;;)
+            {
+                request_condition.wait(lock, [this] { return !requests.empty() || request_threads_exit; });
+                if (requests.empty())
+                {
+                    return;
+                }
+                auto task = std::move(requests.front());
+                requests.pop_front();
+                --idle_request_threads;
+
+                lock.unlock();
+                task();
+                lock.lock();
+                ++idle_request_threads;
+            }
+        }
+
+        void SenderThread::main()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!should_exit)
+            {
+                woken = false;
+
+                // run every worker that has something to do and find out when the next one wants to run
+                auto now = std::chrono::steady_clock::now();
+                auto next_wakeup = std::chrono::steady_clock::time_point::max();
+                bool ran_any = false;
+                for (std::size_t i = 0; i < workers.size(); ++i)
+                {
+                    auto worker = workers[i];
+                    if (!worker->poll(now, next_wakeup))
+                    {
+                        continue;
+                    }
+
+                    // workers may be added or removed while this one runs
+                    running = worker;
+                    lock.unlock();
+                    worker->run();
+                    lock.lock();
+                    running = nullptr;
+                    running_done.notify_all();
+                    ran_any = true;
+                }
+
+                // a worker that ran may have more to do (or changed its schedule), ask all of them again
+                if (ran_any)
+                {
+                    continue;
+                }
+
+                // with no timer due, the thread sleeps until it is woken
+                if (next_wakeup == std::chrono::steady_clock::time_point::max())
+                {
+                    condition.wait(lock, [this] { return woken || should_exit; });
+                }
+                else
+                {
+                    condition.wait_until(lock, next_wakeup, [this] { return woken || should_exit; });
+                }
+            }
+        }
+    } // namespace detail
+} // namespace mixpanel
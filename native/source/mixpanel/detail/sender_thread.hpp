@@ -0,0 +1,71 @@
+#ifndef _MIXPANEL_SENDER_THREAD_HPP_
+#define _MIXPANEL_SENDER_THREAD_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "./connection_pool.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        class Worker;
+
+        // The thread that runs the send loops of one or more workers, one at a time. Workers that share it also share
+        // its connection pool and its request threads, which send the requests a worker has in flight at the same time.
+        // Each Mixpanel instance gets its own, unless a SenderPool is passed to the constructor.
+        class SenderThread
+        {
+            public:
+                SenderThread();
+                ~SenderThread();
+
+                void add(Worker* worker);
+
+                // after this returns, the worker is not running and won't be run again
+                void remove(Worker* worker);
+
+                // makes the thread ask all workers, if they have something to do
+                void wake();
+
+                ConnectionPool& get_connection_pool() { return connection_pool; }
+
+                // Runs *task* on an idle request thread. The threads are started when they are first needed, and kept until
+                // the sender thread is destroyed. Returns false if all of them are busy, then the caller runs the task itself.
+                bool post_request(std::function<void()> task);
+
+                // makes room for the requests of a worker that sends up to *count* requests per queue at the same time
+                void set_max_requests_in_flight(unsigned count);
+            private:
+                void main();
+                void request_thread_main();
+
+                std::mutex mutex;
+                std::condition_variable condition;
+                bool woken;
+                bool should_exit;
+
+                std::vector<Worker*> workers;
+                Worker* running;
+                std::condition_variable running_done;
+
+                ConnectionPool connection_pool;
+                std::thread thread;
+
+                // guards the request threads and their tasks
+                std::mutex request_mutex;
+                std::condition_variable request_condition;
+                std::deque<std::function<void()>> requests;
+                std::vector<std::thread> request_threads;
+                std::size_t max_request_threads;
+                std::size_t idle_request_threads;
+                bool request_threads_exit;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_SENDER_THREAD_HPP_ */
@@ -0,0 +1,103 @@
+#include <random>
+
+#include "./simulation.hpp"
+#include "./sender_thread.hpp"
+#include "./worker.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        Simulation::Simulation(Mixpanel& mixpanel, unsigned seed)
+        : worker(mixpanel.worker.get())
+        , clock(std::make_shared<VirtualClock>())
+        {
+            // from now on, only run_until() runs the worker
+            worker->sender_thread->remove(worker);
+
+            // the generator outlives the simulation, in case the worker backs off after it
+            auto generator = std::make_shared<std::pair<std::mutex, std::minstd_rand>>();
+            generator->second.seed(seed);
+
+            Worker::Environment environment;
+            environment.clock = clock;
+            environment.random = [generator]() {
+                std::lock_guard<std::mutex> lock(generator->first);
+                return static_cast<unsigned>(generator->second());
+            };
+            environment.transport = std::make_shared<LoopbackTransport>([this](const Transport::Request&, const LoopbackTransport::Batch& batch) {
+                return answer(batch);
+            });
+            worker->set_environment(environment);
+        }
+
+        Simulation::~Simulation()
+        {
+            // like the app exits, the final send goes to the server, too. The worker doesn't send after that.
+            worker->shutdown(clock->now() + Worker::default_shutdown_timeout);
+        }
+
+        void Simulation::set_server(Server server)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->server = server;
+        }
+
+        void Simulation::run_until(time_point end)
+        {
+            for (;;)
+            {
+                auto next_wakeup = time_point::max();
+                if (worker->poll(clock->now(), next_wakeup))
+                {
+                    worker->run();
+                    continue;
+                }
+                if (next_wakeup > end)
+                {
+                    clock->advance_to(end);
+                    return;
+                }
+                clock->advance_to(next_wakeup);
+            }
+        }
+
+        std::vector<Simulation::Request> Simulation::get_requests()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return requests;
+        }
+
+        Transport::Response Simulation::answer(const LoopbackTransport::Batch& batch)
+        {
+            Request request;
+            request.time = clock->now();
+            request.endpoint = batch.endpoint;
+            request.batch = batch.records;
+
+            Server server;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                server = this->server;
+            }
+            auto answer = server ? server(request) : Response();
+
+            auto response = LoopbackTransport::accepted();
+            response.status = answer.status;
+            response.retry_after = answer.retry_after;
+            if (answer.status >= 500)
+            {
+                response.body.clear();
+            }
+            else if (answer.status >= 300)
+            {
+                response.body = "{\"status\":0,\"error\":\"refused by the simulation\"}";
+            }
+
+            request.status = answer.status;
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(request);
+            return response;
+        }
+    } // namespace detail
+} // namespace mixpanel
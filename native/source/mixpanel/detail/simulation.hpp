@@ -0,0 +1,82 @@
+#ifndef _MIXPANEL_SIMULATION_HPP_
+#define _MIXPANEL_SIMULATION_HPP_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/value.hpp>
+#include "./clock.hpp"
+#include "./loopback_transport.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        class Worker;
+
+        // Runs the worker of a Mixpanel instance on a virtual clock against a simulated API, so its flush scheduling, back
+        // offs and handling of the reachability can be played through hours of traffic in milliseconds, e.g. to tune
+        // them against a recorded trace.
+        //
+        // The simulation takes the worker off its sender thread. It only runs in run_until(), which jumps the clock from
+        // one of its timers to the next. The requests go to the server function instead of the network, and the jitter of
+        // the back offs comes from a generator with a fixed seed. Events are tracked and the reachability is changed through
+        // the Mixpanel instance as usual, between the calls to run_until().
+        //
+        // The endpoints are still sent to at the same time, so the order of their requests among each other may vary.
+        // The simulation must not outlive the instance. Destroying it shuts the worker down, like the app exits.
+        class Simulation
+        {
+            public:
+                typedef Clock::time_point time_point;
+
+                struct Request
+                {
+                    time_point time;
+                    std::string endpoint;   // "track" or "engage"
+                    Value batch;
+                    int status;             // of the response
+                };
+
+                struct Response
+                {
+                    Response(int status=200, int retry_after=0) : status(status), retry_after(retry_after) {}
+
+                    int status;
+                    int retry_after;        // seconds, 0 sends no Retry-After header
+                };
+
+                // answers the requests, maybe on several threads at once. By default every request succeeds.
+                typedef std::function<Response(const Request& request)> Server;
+
+                explicit Simulation(Mixpanel& mixpanel, unsigned seed=1);
+                ~Simulation();
+
+                void set_server(Server server);
+
+                VirtualClock& get_clock() { return *clock; }
+                time_point now() const { return clock->now(); }
+
+                // runs the worker until the clock reaches *end*
+                void run_until(time_point end);
+                void run_for(Clock::duration duration) { run_until(now() + duration); }
+
+                // the requests so far, in the order they were answered
+                std::vector<Request> get_requests();
+            private:
+                Transport::Response answer(const LoopbackTransport::Batch& batch);
+
+                Worker* worker;
+                std::shared_ptr<VirtualClock> clock;
+
+                std::mutex mutex;
+                Server server;
+                std::vector<Request> requests;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_SIMULATION_HPP_ */
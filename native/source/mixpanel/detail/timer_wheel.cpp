@@ -0,0 +1,119 @@
+#include <algorithm>
+#include "./timer_wheel.hpp"
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        TimerWheel::TimerWheel(std::chrono::steady_clock::duration resolution, std::size_t slot_count)
+        : resolution(std::max(resolution, std::chrono::steady_clock::duration(1)))
+        , origin(std::chrono::steady_clock::now())
+        , slots(std::max<std::size_t>(slot_count, 1))
+        , current_tick(0)
+        {
+        }
+
+        std::uint64_t TimerWheel::tick_of(time_point t) const
+        {
+            return t <= origin ? 0 : static_cast<std::uint64_t>((t - origin) / resolution);
+        }
+
+        void TimerWheel::schedule(unsigned timer, time_point deadline)
+        {
+            cancel(timer);
+
+            // a deadline that has already passed goes into the current slot, so the next advance() fires it
+            auto tick = std::max(tick_of(deadline), current_tick);
+            slot_of(tick).push_back({timer, deadline, tick});
+            scheduled[timer] = tick;
+        }
+
+        void TimerWheel::cancel(unsigned timer)
+        {
+            auto it = scheduled.find(timer);
+            if (it == scheduled.end())
+            {
+                return;
+            }
+
+            auto& slot = slot_of(it->second);
+            slot.erase(std::remove_if(slot.begin(), slot.end(), [timer](const Entry& entry) { return entry.timer == timer; }), slot.end());
+            scheduled.erase(it);
+        }
+
+        bool TimerWheel::is_scheduled(unsigned timer) const
+        {
+            return scheduled.count(timer) != 0;
+        }
+
+        TimerWheel::time_point TimerWheel::next_deadline() const
+        {
+            if (scheduled.empty())
+            {
+                return time_point::max();
+            }
+
+            // the first slot holding a timer of this round of the wheel has the earliest one
+            for (std::uint64_t tick = current_tick; tick != current_tick + slots.size(); ++tick)
+            {
+                auto next = time_point::max();
+                for (const auto& entry : slots[tick % slots.size()])
+                {
+                    if (entry.tick == tick)
+                    {
+                        next = std::min(next, entry.deadline);
+                    }
+                }
+                if (next != time_point::max())
+                {
+                    return next;
+                }
+            }
+
+            // all timers are further away than one round
+            auto next = time_point::max();
+            for (const auto& slot : slots)
+            {
+                for (const auto& entry : slot)
+                {
+                    next = std::min(next, entry.deadline);
+                }
+            }
+            return next;
+        }
+
+        void TimerWheel::advance(time_point now, const std::function<void(unsigned timer)>& fire)
+        {
+            auto target = std::max(tick_of(now), current_tick);
+
+            // after a long sleep every slot may hold due timers, but each one only has to be looked at once
+            auto first = current_tick;
+            if (target - first >= slots.size())
+            {
+                first = target - slots.size() + 1;
+            }
+
+            std::vector<Entry> due;
+            for (auto tick = first; tick <= target; ++tick)
+            {
+                auto& slot = slot_of(tick);
+                auto not_due = std::partition(slot.begin(), slot.end(), [now](const Entry& entry) { return entry.deadline > now; });
+                for (auto it = not_due; it != slot.end(); ++it)
+                {
+                    due.push_back(*it);
+                    scheduled.erase(it->timer);
+                }
+                slot.erase(not_due, slot.end());
+            }
+
+            // the timers in the current slot that aren't due yet are looked at again next time
+            current_tick = target;
+
+            std::sort(due.begin(), due.end(), [](const Entry& a, const Entry& b) { return a.deadline < b.deadline; });
+            for (const auto& entry : due)
+            {
+                fire(entry.timer);
+            }
+        }
+    } // namespace detail
+} // namespace mixpanel
@@ -0,0 +1,60 @@
+#ifndef _MIXPANEL_TIMER_WHEEL_HPP_
+#define _MIXPANEL_TIMER_WHEEL_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace mixpanel
+{
+    namespace detail
+    {
+        // A hashed timer wheel for the deadlines of a worker: flushes, the end of a back off, lease attempts. Timers are
+        // identified by a number the owner chooses, scheduling a timer again moves it. The slots only sort the deadlines
+        // coarsely, the deadlines themselves are kept exactly, so next_deadline() is exact and no timer fires early.
+        //
+        // Not thread safe, the owner guards it.
+        class TimerWheel
+        {
+            public:
+                typedef std::chrono::steady_clock::time_point time_point;
+
+                explicit TimerWheel(std::chrono::steady_clock::duration resolution=std::chrono::milliseconds(100), std::size_t slot_count=512);
+
+                void schedule(unsigned timer, time_point deadline);
+                void cancel(unsigned timer);
+                bool is_scheduled(unsigned timer) const;
+
+                // the earliest deadline or time_point::max(), if no timer is scheduled
+                time_point next_deadline() const;
+
+                // removes the timers that are due at *now* and calls fire(timer) for each of them, the earliest first.
+                // fire() may schedule timers again.
+                void advance(time_point now, const std::function<void(unsigned timer)>& fire);
+            private:
+                struct Entry
+                {
+                    unsigned timer;
+                    time_point deadline;
+                    std::uint64_t tick;
+                };
+
+                std::uint64_t tick_of(time_point t) const;
+                std::vector<Entry>& slot_of(std::uint64_t tick) { return slots[tick % slots.size()]; }
+
+                const std::chrono::steady_clock::duration resolution;
+                const time_point origin;
+                std::vector<std::vector<Entry>> slots;
+
+                // the ticks before this one have been processed
+                std::uint64_t current_tick;
+
+                // the tick of each scheduled timer
+                std::map<unsigned, std::uint64_t> scheduled;
+        };
+    } // namespace detail
+} // namespace mixpanel
+
+#endif /* _MIXPANEL_TIMER_WHEEL_HPP_ */
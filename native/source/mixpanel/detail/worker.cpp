@@ -1,15 +1,24 @@
 #include <algorithm>
-#include <cmath>
+#include <future>
+#include <limits>
 #include <map>
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <mixpanel/mixpanel.hpp>
 #include <mixpanel/value.hpp>
 
 #include "./worker.hpp"
+#include "../../dependencies/nano/include/nanouri/nanouri.h"
 #include "./base64.hpp"
+#include "./file_lock.hpp"
+#include "./http_transport.hpp"
+#include "./logging.hpp"
 #include "./persistence.hpp"
+#include "./sender_thread.hpp"
 #include "./workarounds.hpp"
 
 namespace mixpanel
@@ -40,67 +49,150 @@ namespace mixpanel
         #endif
 
         #ifdef HAVE_MBEDTLS
-        static const std::string api_host = "https://api.mixpanel.com/";
+        static const std::string default_api_host = "https://api.mixpanel.com/";
         #else
-        static const std::string api_host = "";
+        static const std::string default_api_host = "";
         #endif
 
         static std::string encode(const Value& v);
 
         static const bool verbose = true;
 
-        Worker::Worker(Mixpanel* mixpanel)
+        // runs *function* on a request thread of *sender_thread*, or right away on this one, if they are all busy
+        template <typename Function>
+        static std::future<typename std::result_of<Function()>::type> post_request(SenderThread& sender_thread, Function function)
+        {
+            auto task = std::make_shared<std::packaged_task<typename std::result_of<Function()>::type()>>(std::move(function));
+            auto future = task->get_future();
+            if (!sender_thread.post_request([task]() { (*task)(); }))
+            {
+                (*task)();
+            }
+            return future;
+        }
+
+        const std::chrono::seconds Worker::lease_retry_interval(1);
+        const std::chrono::milliseconds Worker::default_shutdown_timeout(2000);
+        const unsigned Worker::max_batches_per_run;
+        const unsigned Worker::batch_size;
+        const std::string Worker::high_priority_lane = "track_high";
+        const std::vector<std::string> Worker::queue_names = {high_priority_lane, "track", "engage"};
+
+        Worker::Worker(Mixpanel* mixpanel, std::shared_ptr<Persistence> persistence, std::shared_ptr<SenderThread> sender_thread, std::shared_ptr<Metrics> metrics)
         : mixpanel(mixpanel)
-        , thread_should_exit(false)
+        , persistence(persistence)
+        , sender_thread(sender_thread)
+        , clock(Clock::system())
+        , metrics(metrics)
         , new_data(false)
         , should_flush_queue(false)
+        , should_spill(false)
+        , above_high_water(false)
         #if defined(DEBUG)
         , flush_interval(1)
         #else
         , flush_interval(60)
         #endif
+        , adaptive_flush(false)
+        , unflushed_bytes(0)
+        , flush_bytes(0)
+        , high_priority_pending(false)
+        , high_priority_flush_delay(1000)
+        , shut_down(false)
+        , task(Task::None)
+        , spill_requested(false)
+        , send_deferred(false)
+        , api_host(default_api_host)
+        , transport(std::make_shared<HttpTransport>(sender_thread->get_connection_pool()))
+        , stats_interval(0)
+        , stats_due(false)
+        , next_flush_deadline_timer(FlushDeadlineTimer)
         {
             delivery_failure_flag = false;
-            network_requests_allowed_time = time(0);
-            failure_count = 0;
-
-            assert(mixpanel);
-            mixpanel->log(Mixpanel::LogEntry::LL_INFO, "starting mixpanel worker");
-            send_thread = std::thread([this](){
-                main();
-            });
 
-            // notify thread to do one iteration
+            last_flush_interval = flush_interval;
+            if (flush_interval != 0)
             {
-                std::lock_guard<std::mutex> lock(mutex);
-                new_data = true;
+                timers.schedule(FlushTimer, clock->now() + std::chrono::seconds(flush_interval));
             }
-            condition.notify_one();
+            new_data = true;
+
+            assert(mixpanel);
+            MIXPANEL_LOG(*mixpanel, INFO, "starting mixpanel worker");
+            sender_thread->add(this);
         }
 
         Worker::~Worker()
         {
-            mixpanel->log(Mixpanel::LogEntry::LL_INFO, "shutting down mixpanel worker");
+            shutdown(clock->now() + default_shutdown_timeout);
 
+            if (uploader_lease && uploader_lease->owns_lock())
             {
-                std::lock_guard<std::mutex> lock(mutex);
-                thread_should_exit = true;
+                MIXPANEL_LOG(*mixpanel, DEBUG, "releasing the uploader lease");
             }
+        }
 
-            condition.notify_one();
-
-            if (send_thread.joinable())
+        bool Worker::shutdown(std::chrono::steady_clock::time_point deadline)
+        {
+            if (!shut_down.exchange(true))
             {
-                send_thread.join();
+                MIXPANEL_LOG(*mixpanel, INFO, "shutting down mixpanel worker");
+
+                // first of all, nothing gets lost, whatever happens to the sending
+                persistence->persist_memory_queues();
+                persistence->sync_queues();
+
+                // a send in progress and the final send only get the time until the deadline
+                auto final_send = std::async(std::launch::async, [this, deadline]() {
+                    sender_thread->remove(this);
+
+                    // one last attempt to send. Other processes send for us, if we're not the uploader.
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        task = (uploader_lease && !uploader_lease->owns_lock()) ? Task::Spill : Task::Send;
+                        spill_requested = false;
+                    }
+                    run(std::numeric_limits<unsigned>::max(), deadline);
+                });
+
+                // the deadline is on the clock of the worker, which may be a virtual one
+                if (final_send.wait_for(deadline - clock->now()) == std::future_status::timeout)
+                {
+                    MIXPANEL_LOG(*mixpanel, INFO, "shutdown deadline reached, interrupting the requests in flight");
+                    get_transport()->cancel();
+                }
+                final_send.get();
+
+                // the flushes that weren't done by the final send won't be
+                std::map<unsigned, PendingFlush> failed_flushes;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::swap(failed_flushes, pending_flushes);
+                    for (const auto& flush : failed_flushes)
+                    {
+                        timers.cancel(flush.first);
+                    }
+                }
+                for (const auto& flush : failed_flushes)
+                {
+                    flush.second.callback(false);
+                }
             }
+
+            // also the events that were enqueued after an earlier shutdown()
+            persistence->persist_memory_queues();
+            persistence->sync_queues();
+            return get_queues_size() == 0;
         }
 
         std::pair<Worker::Result, Worker::Result> Worker::send_batches()
         {
-            return std::make_pair(
-                send_track_batch(),
-                send_engage_batch()
-            );
+            // the queues are independent and go to different endpoints, so they are sent at the same time
+            auto engage = post_request(*sender_thread, [this]() {
+                return send_engage_batch();
+            });
+            auto track = send_track_batch();
+            return std::make_pair(track, engage.get());
         }
 
         Worker::Result Worker::send_track_batch()
@@ -115,72 +207,437 @@ namespace mixpanel
 
         Worker::Result Worker::send_batch(const std::string& name, bool verbose)
         {
-            auto objs = Persistence::dequeue(name, 50);
-            if (objs.first.empty())
+            auto& concurrency = (get_endpoint(name) == "track") ? track_concurrency : engage_concurrency;
+            auto& health = get_health(name);
+
+            auto state = health.get_state(clock->time());
+            if (state == EndpointHealth::State::Open)
+            {
+                return {true, "", false, persistence->get_queue_size(name) != 0};
+            }
+            if (defer_on_cellular(name))
             {
                 return {true, ""};
             }
 
-            std::map<std::string, std::string> post;
+            // while the endpoint is degraded, a single small batch probes it
+            auto max_records = (state == EndpointHealth::State::HalfOpen) ? EndpointHealth::probe_batch_size : batch_size * concurrency.get();
+            auto objs = persistence->dequeue(name, max_records);
+            if (objs.first.empty())
+            {
+                return {true, ""};
+            }
+            if (state == EndpointHealth::State::HalfOpen)
+            {
+                MIXPANEL_LOG(*mixpanel, INFO, "probing the " + name + " endpoint with " + std::to_string(objs.first.size()) + " records");
+                health.on_probe();
+            }
 
-            post["data"] = encode(objs.first);
+            std::vector<Value> batches;
+            for (Json::ArrayIndex i = 0; i < objs.first.size(); i += batch_size)
+            {
+                Value batch(Json::arrayValue);
+                for (Json::ArrayIndex j = i; j != objs.first.size() && j != i + batch_size; ++j)
+                {
+                    batch.append(objs.first[j]);
+                }
+                batches.push_back(batch);
+            }
 
-            std::string url = api_host + name + "/";
-            if (verbose)
+            // the first batch goes out on this thread, the others at the same time on the request threads
+            std::vector<std::future<Delivery>> pending;
+            for (std::size_t i = 1; i < batches.size(); ++i)
+            {
+                const auto& batch = batches[i];
+                pending.push_back(post_request(*sender_thread, [this, &name, &batch, verbose]() {
+                    return deliver(name, batch, verbose);
+                }));
+            }
+            std::vector<Delivery> deliveries;
+            deliveries.push_back(deliver(name, batches[0], verbose));
+            for (auto& delivery : pending)
             {
-                url += "?verbose=1";
+                deliveries.push_back(delivery.get());
             }
 
-            if (name == "track")
+            // Acknowledgements are ordered: the queue only advances past the batches that were delivered without a gap.
+            // Batches that were delivered after a failed one are sent again with it.
+            std::size_t acknowledged = 0;
+            std::size_t acknowledged_batches = 0;
+            for (; acknowledged_batches != deliveries.size() && deliveries[acknowledged_batches].delivered; ++acknowledged_batches)
             {
-                url += verbose ? "&" : "?";
-                url += "ip=1";
+                acknowledged += batches[acknowledged_batches].size();
             }
 
-            mixpanel->log(Mixpanel::LogEntry::LL_TRACE, "URL: " + url);
-            mixpanel->log(Mixpanel::LogEntry::LL_TRACE, "data: " + objs.first.toStyledString());
+            // the records the API refused are set aside before they leave the queue, so they neither loop nor get lost
+            std::vector<std::pair<Value, std::string>> dead_letters;
+            for (std::size_t i = 0; i != acknowledged_batches; ++i)
+            {
+                for (const auto& rejected : deliveries[i].rejected)
+                {
+                    dead_letters.push_back(std::make_pair(batches[i][rejected.first], rejected.second));
+                }
+            }
+            if (!dead_letters.empty())
+            {
+                MIXPANEL_LOG(*mixpanel, WARNING, "the API refused " + std::to_string(dead_letters.size()) + " " + name + " records, they go to the dead letter file: " + dead_letters.front().second);
+            }
 
-            nanowww::Client client;
-            nanowww::Request request("POST", url, post);
-            nanowww::Response response;
-            if (client.send_request(request, &response))
+            unsigned attempt;
             {
+                std::lock_guard<std::mutex> lock(acknowledgement_mutex);
+                attempt = front_retries[name] + 1;
+                // also when nothing was acknowledged: that ends the batch, so the queue can be evicted from again
+                persistence->dead_letter(name, dead_letters);
+                persistence->drop_front(name, acknowledged);
+                acknowledged_records[name] += acknowledged;
+
+                // the records of the first batch that failed are at the front now
+                if (acknowledged_batches != deliveries.size())
                 {
-                    std::lock_guard<std::mutex> lock(mutex);
-                    // Prevent requests until the back off time has passed
-                    network_requests_allowed_time = parse_www_retry_after(response);
+                    front_retries[name] = (acknowledged_batches == 0) ? attempt : 1;
+                }
+                else
+                {
+                    front_retries[name] = 0;
                 }
+            }
+            if (attempt > 1 && acknowledged_batches == 0)
+            {
+                MIXPANEL_LOG(*mixpanel, INFO, "attempt " + std::to_string(attempt) + " to send the front of the " + name + " queue failed, it stays queued");
+            }
+            report_deliveries(name, batches, deliveries, acknowledged_batches, attempt);
+            metrics->batches_sent.add(deliveries.size());
+            metrics->batches_failed.add(deliveries.size() - acknowledged_batches);
+            if (attempt > 1)
+            {
+                metrics->retries.add();
+            }
 
-                Json::Reader reader;
-                Value parsed_response;
-                if (reader.parse(response.content(), parsed_response, false))
+            // the first server error decides on the back off, any other response resets it
+            const Transport::Response* response = nullptr;
+            unsigned failures = 0;
+            auto slowest = std::chrono::steady_clock::duration::zero();
+            for (const auto& delivery : deliveries)
+            {
+                failures += delivery.delivered ? 0 : 1;
+                if (delivery.response_received)
                 {
-                    bool success = (!verbose && parsed_response.asBool()) || (verbose && parsed_response["status"].asBool());
-                    if (success)
+                    slowest = std::max(slowest, delivery.rtt);
+                    if (!response || (response->status < 500 && delivery.response.status >= 500))
                     {
-                        // delivery succeeded
-                        mixpanel->log(Mixpanel::LogEntry::LL_DEBUG, "delivered " + std::to_string(objs.first.size()) + " objects in " + std::to_string(post["data"].size()) + " bytes. " + std::to_string(objs.second) + " in queue (including the sent entries).");
+                        response = &delivery.response;
                     }
-                    else
+                }
+            }
+            if (response)
+            {
+                // Prevent requests to this endpoint until the back off time has passed
+                parse_www_retry_after(name, *response);
+            }
+            concurrency.update(static_cast<unsigned>(deliveries.size()), failures, slowest);
+
+            state = health.get_state(clock->time());
+            auto remaining = objs.second > acknowledged;
+            Result result = {true, "", remaining && state == EndpointHealth::State::Closed, remaining && state == EndpointHealth::State::Open};
+            for (const auto& delivery : deliveries)
+            {
+                if (!delivery.result.status)
+                {
+                    result.status = false;
+                    result.error = delivery.result.error;
+                    break;
+                }
+            }
+            return result;
+        }
+
+        Worker::Delivery Worker::deliver(const std::string& name, const Value& batch, bool verbose)
+        {
+            auto delivery = post_batch(name, batch, verbose);
+            if (!delivery.rejected_as_a_whole)
+            {
+                return delivery;
+            }
+
+            if (batch.size() == 1)
+            {
+                delivery.rejected.push_back(std::make_pair(0, delivery.result.error));
+                return delivery;
+            }
+
+            // one bad record makes the API refuse the whole batch. Send the halves separately, until the bad ones are found.
+            MIXPANEL_LOG(*mixpanel, INFO, "the API refused a batch of " + std::to_string(batch.size()) + " " + name + " records, sending it in halves");
+            Value halves[2] = {Value(Json::arrayValue), Value(Json::arrayValue)};
+            for (Json::ArrayIndex i = 0; i != batch.size(); ++i)
+            {
+                halves[i < batch.size() / 2 ? 0 : 1].append(batch[i]);
+            }
+
+            Delivery combined;
+            combined.delivered = true;
+            combined.result = {true, ""};
+            combined.bytes = delivery.bytes;
+            combined.rtt = delivery.rtt;
+            combined.response_received = true;
+            combined.response = delivery.response;
+            for (int half = 0; half != 2; ++half)
+            {
+                auto part = deliver(name, halves[half], verbose);
+                combined.bytes += part.bytes;
+                combined.rtt = std::max(combined.rtt, part.rtt);
+                if (part.response_received && (part.response.status >= 500 || combined.response.status < 500))
+                {
+                    combined.response = part.response;
+                }
+                if (!part.delivered)
+                {
+                    // the whole batch is sent again, only delivered batches are acknowledged
+                    combined.delivered = false;
+                    combined.result = part.result;
+                    combined.response_received = part.response_received;
+                    return combined;
+                }
+                for (const auto& rejected : part.rejected)
+                {
+                    combined.rejected.push_back(std::make_pair(rejected.first + (half ? halves[0].size() : 0), rejected.second));
+                }
+                if (!part.result.status && combined.result.status)
+                {
+                    combined.result = part.result;
+                }
+            }
+            return combined;
+        }
+
+        Worker::Delivery Worker::post_batch(const std::string& name, const Value& batch, bool verbose)
+        {
+            Delivery delivery;
+
+            auto data = encode(batch);
+
+            auto endpoint = get_endpoint(name);
+            Transport::Request request;
+            request.url = get_api_host() + endpoint + "/";
+            if (verbose)
+            {
+                request.url += "?verbose=1";
+            }
+
+            if (endpoint == "track")
+            {
+                request.url += verbose ? "&" : "?";
+                request.url += "ip=1";
+            }
+            request.body = "data=" + nu_escape_uri(data);
+
+            MIXPANEL_LOG(*mixpanel, TRACE, "URL: " + request.url);
+            MIXPANEL_LOG(*mixpanel, TRACE, "data: " + batch.toStyledString());
+
+            delivery.bytes = data.size();
+
+            // counted up front, the request uses up data even if it fails
+            if (bandwidth_budget.on_sent(mixpanel->network_reachability, delivery.bytes, clock->time()))
+            {
+                MIXPANEL_LOG(*mixpanel, WARNING, "the cellular data budget of the day is used up, the queues wait for WiFi or the next day");
+            }
+            auto start = clock->now();
+            delivery.response = get_transport()->send(request);
+            metrics->bytes_sent.add(delivery.bytes);
+            metrics->handshakes.add(delivery.response.handshakes);
+            if (delivery.response.status <= 0)
+            {
+                delivery.result = {false, delivery.response.error};
+                return delivery;
+            }
+            delivery.response_received = true;
+            delivery.rtt = clock->now() - start;
+            metrics->round_trip.record(delivery.rtt);
+
+            // 400 and 413 are about the data, anything else (server errors, throttling, ...) is tried again later
+            auto status = delivery.response.status;
+            bool bad_request = (status == 400 || status == 413);
+            if (status >= 300 && !bad_request)
+            {
+                delivery.result = {false, "HTTP status " + std::to_string(status) + ": " + delivery.response.body};
+                return delivery;
+            }
+
+            // only an answer of the API itself says something about the data. A 400 with an error page of a proxy or a
+            // captive portal is tried again later, like a server error, instead of sending the batch to the dead letters.
+            Json::Reader reader;
+            Value parsed_response;
+            bool api_response = reader.parse(delivery.response.body, parsed_response, false) &&
+                                (verbose ? (parsed_response.isObject() && parsed_response.isMember("status")) : parsed_response.isNumeric());
+            if (!api_response)
+            {
+                delivery.result = {false, "failed to parse: " + delivery.response.body};
+                return delivery;
+            }
+
+            bool success = !bad_request && ((!verbose && parsed_response.asBool()) || (verbose && parsed_response.isObject() && parsed_response["status"].asBool()));
+            if (success)
+            {
+                // delivery succeeded
+                MIXPANEL_LOG(*mixpanel, DEBUG, "delivered " + std::to_string(batch.size()) + " objects in " + std::to_string(delivery.bytes) + " bytes.");
+                delivery.delivered = true;
+                delivery.result = {true, ""};
+                return delivery;
+            }
+
+            MIXPANEL_LOG(*mixpanel, WARNING, "API rejected some items");
+            delivery.delivered = true;
+            delivery.result = {false, (verbose && parsed_response.isObject()) ? parsed_response["error"].asString() : "error, enable verbose responses for debugging."};
+
+            // the endpoint may list the records it refused, the others have been accepted
+            const auto& failed_records = parsed_response.isObject() ? parsed_response["failed_records"] : Value::null;
+            if (failed_records.isArray() && !failed_records.empty())
+            {
+                for (const auto& record : failed_records)
+                {
+                    auto index = record["index"].asUInt();
+                    if (index < batch.size())
                     {
-                        mixpanel->log(Mixpanel::LogEntry::LL_WARNING, "API rejected some items");
+                        auto message = record["message"].asString();
+                        delivery.rejected.push_back(std::make_pair(index, message.empty() ? delivery.result.error : message));
                     }
+                }
+                return delivery;
+            }
+
+            delivery.rejected_as_a_whole = true;
+            return delivery;
+        }
 
-                    // Note: the whole batch is dropped if delivery fails - this is the same behavious of the iOS SDK (https://github.com/mixpanel/mixpanel-iphone/blob/d0f7323617641f54796a62c28e0733461c31aecb/Mixpanel/Mixpanel.m#L697)
-                    Persistence::drop_front(name, objs.first.size());
+        void Worker::report_deliveries(const std::string& name, const std::vector<Value>& batches, const std::vector<Delivery>& deliveries, std::size_t acknowledged_batches, unsigned attempt)
+        {
+            std::function<void(const Mixpanel::BatchDelivery&)> callback;
+            {
+                std::lock_guard<std::mutex> lock(callback_mutex);
+                callback = delivery_callback;
+            }
+            if (!callback)
+            {
+                return;
+            }
 
-                    if (verbose)
-                        return {parsed_response["status"].asBool(), parsed_response["error"].asString()};
-                    else
-                        return {parsed_response.asBool(), parsed_response.asBool()?"":"error, enable verbose responses for debugging."};
+            std::lock_guard<std::mutex> lock(delivery_callback_mutex);
+            for (std::size_t i = 0; i != deliveries.size(); ++i)
+            {
+                Mixpanel::BatchDelivery report;
+                report.queue = name;
+                report.events = batches[i].size();
+                report.bytes = deliveries[i].bytes;
+                report.latency = std::chrono::duration_cast<std::chrono::milliseconds>(deliveries[i].rtt);
+                report.delivered = i < acknowledged_batches;
+                report.rejected = report.delivered ? deliveries[i].rejected.size() : 0;
+                report.attempt = (i == 0) ? attempt : 1;
+                report.error = deliveries[i].result.status ? "" : deliveries[i].result.error;
+                if (!report.delivered && report.error.empty())
+                {
+                    report.error = deliveries[i].delivered ? "sent again with an earlier batch that failed" : "failed";
                 }
-                else
+                callback(report);
+            }
+        }
+
+        void Worker::set_high_priority_flush_delay(unsigned milliseconds)
+        {
+            high_priority_flush_delay = milliseconds;
+        }
+
+        void Worker::set_max_requests_in_flight(unsigned count)
+        {
+            track_concurrency.set_maximum(count);
+            engage_concurrency.set_maximum(count);
+            sender_thread->set_max_requests_in_flight(count);
+        }
+
+        void Worker::set_api_host(const std::string& api_host)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->api_host = api_host;
+            if (!api_host.empty() && api_host.back() != '/')
+            {
+                this->api_host += '/';
+            }
+        }
+
+        std::string Worker::get_api_host()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return api_host;
+        }
+
+        void Worker::set_environment(const Environment& environment)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (environment.clock)
+            {
+                clock = environment.clock;
+            }
+            if (environment.random)
+            {
+                track_health.set_random(environment.random);
+                engage_health.set_random(environment.random);
+            }
+            if (environment.transport)
+            {
+                transport = environment.transport;
+            }
+        }
+
+        void Worker::set_transport(std::shared_ptr<Transport> transport)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->transport = transport ? transport : std::make_shared<HttpTransport>(sender_thread->get_connection_pool());
+        }
+
+        std::shared_ptr<Transport> Worker::get_transport()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return transport;
+        }
+
+        void Worker::set_cellular_daily_budget(std::size_t bytes)
+        {
+            bandwidth_budget.set_daily_budget(bytes);
+        }
+
+        Mixpanel::NetworkUsage Worker::get_network_usage()
+        {
+            return bandwidth_budget.get_usage(clock->time());
+        }
+
+        bool Worker::defer_on_cellular(const std::string& name)
+        {
+            if (mixpanel->network_reachability != Mixpanel::NetworkReachability::ReachableViaCarrierDataNetwork)
+            {
+                return false;
+            }
+
+            auto count = persistence->get_queue_count(name);
+            if (count == 0)
+            {
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            bool defer = !bandwidth_budget.allows(clock->time());
+            if (!defer && name != high_priority_lane)
+            {
+                // larger and rarer requests for the bulk queues, so the radio wakes up less often
+                auto& deferrals = cellular_deferrals[name];
+                defer = count < batch_size && ++deferrals < FlushController::cellular_factor;
+                if (!defer)
                 {
-                    return {false, "failed to parse: " + response.content()};
+                    deferrals = 0;
                 }
             }
 
-            return {false, client.errstr()};
+            // moving to WiFi sends it at once
+            send_deferred = send_deferred || defer;
+            return defer;
         }
 
         static std::string encode(const Value& v)
@@ -189,60 +646,172 @@ namespace mixpanel
             return base64_encode(writer.write(v));
         }
 
-        void Worker::enqueue(const std::string& name, const Value& o)
+        void Worker::enqueue(const std::string& name, const Value& o, Mixpanel::EventPriority priority)
+        {
+            MIXPANEL_LOG(*mixpanel, TRACE, "enqueueing " + o.toStyledString() + " into " + name);
+
+            // FastWriter terminates each object with '\n', that's exactly what the persistence expects
+            Json::FastWriter writer;
+            enqueue_serialized(name, writer.write(o), priority);
+        }
+
+        void Worker::enqueue_serialized(const std::string& name, const std::string& json, Mixpanel::EventPriority priority)
         {
-            mixpanel->log(Mixpanel::LogEntry::LL_TRACE, "enqueueing " + o.toStyledString() + " into " + name);
-            if (!Persistence::enqueue(name, o))
+            auto high_priority = (name == "track" && priority == Mixpanel::EventPriority::High);
+            auto& queue_name = high_priority ? high_priority_lane : name;
+            if (!persistence->enqueue_serialized(queue_name, json, priority))
             {
-                mixpanel->log(Mixpanel::LogEntry::LL_WARNING, "event not queued into " + name + ": queue full.");
+                MIXPANEL_LOG(*mixpanel, WARNING, "event not queued into " + queue_name + ": queue full.");
             }
 
-            if (flush_interval == 0) // only notify worker, if in immediate send mode
+            if (persistence->memory_budget_exceeded())
+            {
+                // only report crossing the high water mark, not every event after that
+                if (!above_high_water.exchange(true))
+                {
+                    auto memory_queues_size = persistence->get_memory_queues_size();
+                    MIXPANEL_LOG(*mixpanel, WARNING, "memory buffer exceeds its budget (" + std::to_string(memory_queues_size) + " bytes), writing it to disk.");
+
+                    std::function<void(std::size_t)> callback;
+                    {
+                        std::lock_guard<std::mutex> lock(callback_mutex);
+                        callback = memory_high_water_callback;
+                    }
+                    if (callback)
+                    {
+                        callback(memory_queues_size);
+                    }
+                }
+                spill();
+            }
+
+            if (high_priority)
+            {
+                // the first event arms the timer of the lane, the ones that follow within the delay go with it
+                if (!high_priority_pending.exchange(true))
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        timers.schedule(HighPriorityTimer, clock->now() + std::chrono::milliseconds(high_priority_flush_delay.load()));
+                    }
+                    sender_thread->wake();
+                }
+            }
+            else if (flush_interval == 0) // only notify worker, if in immediate send mode
             {
                 notify();
             }
+            else if (adaptive_flush)
+            {
+                // the worker arms its flush timer for the first event after a flush and flushes early, when the queues
+                // cross the threshold. Other events don't wake it.
+                auto before = unflushed_bytes.fetch_add(json.size());
+                if (before == 0 || (before < flush_bytes && before + json.size() >= flush_bytes))
+                {
+                    sender_thread->wake();
+                }
+            }
         }
 
-        int Worker::parse_www_retry_after(const nanowww::Response& response)
+        static const char* state_name(EndpointHealth::State state)
         {
-            // Check for an HTTP Retry-After header
-            auto retry_after_header = response.get_header("Retry-After");
-            auto retry_after = 0;
-            if (!retry_after_header.empty()) {
-                retry_after = atoi(retry_after_header.c_str());
+            switch (state)
+            {
+                case EndpointHealth::State::Closed: return "closed";
+                case EndpointHealth::State::Open: return "open";
+                case EndpointHealth::State::HalfOpen: return "half open";
             }
+            return "";
+        }
 
+        std::time_t Worker::parse_www_retry_after(const std::string& name, const Transport::Response& response)
+        {
             // Check for a 5XX response code
-            bool failed = (500 <= response.status() && response.status() <= 599);
+            bool failed = (500 <= response.status && response.status <= 599);
             if (failed) {
-                mixpanel->log(Mixpanel::LogEntry::LL_ERROR, "/track HTTP Call Failed - Status Code (" + std::to_string(response.status()) + "): " + response.content());
-                failure_count++;
-            } else {
-                failure_count = 0;
+                MIXPANEL_LOG(*mixpanel, ERROR, "/" + name + " HTTP Call Failed - Status Code (" + std::to_string(response.status) + "): " + response.body);
             }
 
-            // Calculate exponential back off
-            if (failure_count > 1) {
-                retry_after = std::max(retry_after, calculate_back_off_time(failure_count));
+            auto& health = get_health(name);
+            auto now = clock->time();
+            auto before = health.get_state(now);
+            auto allowed_after_time = health.on_response(response.status, response.retry_after, now);
+            auto after = health.get_state(now);
+            if (after != before)
+            {
+                auto message = "circuit of the " + name + " endpoint " + state_name(before) + " -> " + state_name(after);
+                if (after == EndpointHealth::State::Open)
+                {
+                    message += " for " + std::to_string(allowed_after_time - now) + " s";
+                    metrics->back_off_seconds.add(static_cast<std::uint64_t>(allowed_after_time - now));
+                }
+                MIXPANEL_LOG(*mixpanel, INFO, message);
             }
 
-            auto now = time(0);
-            auto allowed_after_time = now + retry_after;
+            MIXPANEL_LOG(*mixpanel, TRACE, "/" + name + " HTTP Response Retry-After: " + std::to_string(response.retry_after));
+            MIXPANEL_LOG(*mixpanel, TRACE, "/" + name + " HTTP Response Body: \n" + response.body);
+            MIXPANEL_LOG(*mixpanel, TRACE, "Network requests allowed after time " + std::to_string(allowed_after_time) +
+                         ". Current time " + std::to_string(now) + ". Delta: " + std::to_string(allowed_after_time - now));
+
+            return allowed_after_time;
+        }
 
-            if (mixpanel->min_log_level >= Mixpanel::LogEntry::LL_TRACE) {
-                mixpanel->log(Mixpanel::LogEntry::LL_TRACE, "/track HTTP Response Headers: \n" + response.headers()->as_string());
-                mixpanel->log(Mixpanel::LogEntry::LL_TRACE, "/track HTTP Response Body: \n" + response.content());
-                mixpanel->log(Mixpanel::LogEntry::LL_TRACE, "Network requests allowed after time " + std::to_string(allowed_after_time) +
-                              ". Current time " + std::to_string(now) + ". Delta: " + std::to_string(allowed_after_time - now));
+        EndpointHealth& Worker::get_health(const std::string& name)
+        {
+            return (get_endpoint(name) == "track") ? track_health : engage_health;
+        }
+
+        std::string Worker::get_endpoint(const std::string& name)
+        {
+            return (name == high_priority_lane) ? "track" : name;
+        }
+
+        std::size_t Worker::get_queues_size()
+        {
+            std::size_t size = 0;
+            for (const auto& name : queue_names)
+            {
+                size += persistence->get_queue_size(name);
             }
+            return size;
+        }
 
-            return allowed_after_time;
+        Mixpanel::EndpointStats Worker::get_endpoint_stats(const std::string& name)
+        {
+            return get_health(name).get_stats(clock->time());
         }
 
-        int Worker::calculate_back_off_time(int failure_count)
+        Mixpanel::Stats Worker::get_stats()
         {
-            int back_off_time = pow(2.0, failure_count - 1) * 60.0 + rand() % 30;
-            return std::min(std::max(60, back_off_time), 600);
+            auto stats = metrics->snapshot();
+            for (const auto& name : queue_names)
+            {
+                stats.queue_bytes += persistence->get_queue_size(name);
+                stats.queue_records += persistence->get_queue_count(name);
+            }
+            stats.memory_buffer_bytes = persistence->get_memory_queues_size();
+            return stats;
+        }
+
+        void Worker::set_stats_export(unsigned interval_seconds, std::function<void(const Mixpanel::Stats&)> callback)
+        {
+            {
+                std::lock_guard<std::mutex> lock(callback_mutex);
+                stats_callback = callback;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats_interval = callback ? interval_seconds : 0;
+                if (stats_interval != 0)
+                {
+                    timers.schedule(StatsTimer, clock->now() + std::chrono::seconds(stats_interval));
+                }
+                else
+                {
+                    timers.cancel(StatsTimer);
+                }
+            }
+            sender_thread->wake();
         }
 
         void Worker::notify()
@@ -251,17 +820,49 @@ namespace mixpanel
                 std::lock_guard<std::mutex> lock(mutex);
                 new_data = true;
             }
-            condition.notify_one();
+            sender_thread->wake();
         }
 
 
+        void Worker::spill()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                should_spill = true;
+            }
+            sender_thread->wake();
+        }
+
+        void Worker::set_memory_high_water_callback(std::function<void(std::size_t)> callback)
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex);
+            memory_high_water_callback = callback;
+        }
+
         void Worker::set_flush_interval(unsigned seconds)
         {
             {
                 std::lock_guard<std::mutex> lock(mutex);
                 flush_interval = seconds;
+                adaptive_flush = false;
+                flush_controller.reset();
             }
-            condition.notify_one();
+            sender_thread->wake();
+        }
+
+        void Worker::set_adaptive_flush(unsigned min_interval, unsigned max_interval, std::size_t flush_bytes)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                flush_controller.reset(new FlushController(std::chrono::seconds(min_interval), std::chrono::seconds(max_interval), flush_bytes));
+                this->flush_bytes = flush_controller->get_flush_bytes();
+                flush_interval = std::max(std::max(min_interval, max_interval), 1u);
+                adaptive_flush = true;
+
+                // the queue may already be over the threshold
+                unflushed_bytes = 0;
+            }
+            sender_thread->wake();
         }
 
         void Worker::flush_queue()
@@ -270,48 +871,424 @@ namespace mixpanel
                 std::lock_guard<std::mutex> lock(mutex);
                 should_flush_queue = true;
             }
-            condition.notify_one();
+            sender_thread->wake();
+        }
+
+        void Worker::flush_async(std::chrono::steady_clock::time_point deadline, std::function<void(bool)> callback)
+        {
+            PendingFlush flush;
+            flush.callback = callback;
+
+            bool empty = true;
+            {
+                std::lock_guard<std::mutex> lock(acknowledgement_mutex);
+                for (const auto& name : queue_names)
+                {
+                    // the records that are evicted in between are neither counted as removed nor in the queue
+                    auto removed = get_removed_records(name);
+                    auto count = persistence->get_queue_count(name);
+                    flush.targets[name] = removed + count;
+                    empty = empty && count == 0;
+                }
+            }
+            if (empty)
+            {
+                callback(true);
+                return;
+            }
+
+            // shutdown() fails the flushes that are pending, once its final send is over. Nothing is sent after that.
+            bool pending = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!shut_down)
+                {
+                    auto timer = next_flush_deadline_timer++;
+                    timers.schedule(timer, deadline);
+                    pending_flushes[timer] = flush;
+                    should_flush_queue = true;
+                    new_data = true;
+                    pending = true;
+                }
+            }
+            if (!pending)
+            {
+                callback(false);
+                return;
+            }
+            sender_thread->wake();
+        }
+
+        void Worker::complete_flushes()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (pending_flushes.empty())
+                {
+                    return;
+                }
+            }
+
+            std::map<std::string, std::uint64_t> removed;
+            std::map<std::string, std::size_t> counts;
+            {
+                std::lock_guard<std::mutex> lock(acknowledgement_mutex);
+                for (const auto& name : queue_names)
+                {
+                    removed[name] = get_removed_records(name);
+                    counts[name] = persistence->get_queue_count(name);
+                }
+            }
+
+            std::vector<std::function<void(bool)>> completed;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto flush = pending_flushes.begin(); flush != pending_flushes.end();)
+                {
+                    bool done = true;
+                    for (const auto& target : flush->second.targets)
+                    {
+                        done = done && (removed[target.first] >= target.second || counts[target.first] == 0);
+                    }
+                    if (done)
+                    {
+                        completed.push_back(flush->second.callback);
+                        timers.cancel(flush->first);
+                        flush = pending_flushes.erase(flush);
+                    }
+                    else
+                    {
+                        ++flush;
+                    }
+                }
+            }
+            for (const auto& callback : completed)
+            {
+                callback(true);
+            }
+        }
+
+        void Worker::set_delivery_callback(std::function<void(const Mixpanel::BatchDelivery&)> callback)
+        {
+            std::lock_guard<std::mutex> lock(callback_mutex);
+            delivery_callback = callback;
+        }
+
+        std::uint64_t Worker::get_removed_records(const std::string& name)
+        {
+            auto stats = persistence->get_queue_stats(name);
+            return acknowledged_records[name] + stats.evicted + stats.expired;
         }
 
         void Worker::clear_send_queues()
         {
-            Persistence::drop_front("track", Persistence::get_queue_size("track"));
-            Persistence::drop_front("engage", Persistence::get_queue_size("engage"));
+            for (const auto& name : queue_names)
+            {
+                persistence->drop_front(name, persistence->get_queue_size(name));
+            }
         }
 
-        void Worker::main()
+        bool Worker::poll(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point& next_wakeup)
         {
             /*
-             * if flush_interval == 0, the main loop sleeps for ten seconds or until new data in enqueued.
-             * if flush_interval > 0, the main loop sleeps for flush_interval, but is not woken up when new
-             *     data arrives. It only tries to send after flush_interval have passed AND new data is in the queue.
-             * But if flush_interval is equal to zero, no sending will be attempted (as in the iOS SDK)
+             * The worker doesn't wake up periodically. The sender thread sleeps until the earliest timer of its workers is due, or
+             * until it is woken.
+             * if flush_interval > 0, the flush timer runs the worker every flush_interval, but not when new data arrives.
+             *     It only tries to send after flush_interval have passed AND new data is in the queue.
+             * if flush_interval == 0, there is no flush timer and the worker only runs when new data is enqueued.
+             *     But no sending will be attempted (as in the iOS SDK)
+             * in adaptive mode, the flush controller decides when to flush. The flush timer is only scheduled while
+             *     something is queued.
+             * A flush that was held back by a back off is tried again, when the back off timer fires. One that was held back
+             * because the network was unreachable is tried again, when the reachability changes.
+             * If the memory buffer exceeds its budget, the worker runs to write it to disk, but does not send.
              * */
-            while (!thread_should_exit)
+            // the queue sizes are kept in memory, this doesn't touch the disk
+            std::size_t queued = 0;
+            if (adaptive_flush)
             {
-                { // wait for ten seconds or for new data
-                    std::unique_lock<std::mutex> lock(mutex);
-                    auto last_flush_interval = flush_interval.load();
-                    condition.wait_for(lock, std::chrono::seconds(flush_interval.load() == 0 ? 10 : flush_interval.load()), [this, last_flush_interval]
+                queued = persistence->get_queue_size("track") + persistence->get_queue_size("engage");
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            bool timer_fired = false;
+            bool high_priority_due = false;
+            timers.advance(now, [this, now, &timer_fired, &high_priority_due](unsigned timer) {
+                if (timer >= FlushDeadlineTimer)
+                {
+                    auto flush = pending_flushes.find(timer);
+                    if (flush != pending_flushes.end())
                     {
-                        return thread_should_exit || ((flush_interval.load() == 0 || should_flush_queue) && new_data) || (last_flush_interval != flush_interval);
-                    });
-                    new_data = false;
-                    should_flush_queue = false;
+                        expired_flushes.push_back(flush->second.callback);
+                        pending_flushes.erase(flush);
+                    }
+                    return;
+                }
+
+                if (timer == HighPriorityTimer)
+                {
+                    high_priority_due = true;
+                    return;
+                }
+
+                if (timer == StatsTimer)
+                {
+                    stats_due = true;
+                    timers.schedule(StatsTimer, now + std::chrono::seconds(stats_interval));
+                    return;
+                }
+
+                // the lease timer only allows the next attempt to get the lease, see is_uploader()
+                timer_fired = timer_fired || timer != LeaseTimer;
+            });
+
+            // processes that don't upload write their events to disk on every flush, so the uploader sends them
+            auto uploader = is_uploader(now);
+
+            bool flush_requested = ((flush_interval == 0 || should_flush_queue || send_deferred) && new_data) || (last_flush_interval != flush_interval);
+            if (flush_controller)
+            {
+                flush_controller->set_cellular(mixpanel->network_reachability == Mixpanel::NetworkReachability::ReachableViaCarrierDataNetwork);
+                flush_bytes = flush_controller->get_flush_bytes();
+
+                auto next_flush = flush_controller->next_flush(queued, unflushed_bytes, now);
+                if (next_flush <= now)
+                {
+                    flush_requested = true;
+                }
+                else if (next_flush != std::chrono::steady_clock::time_point::max())
+                {
+                    timers.schedule(FlushTimer, next_flush);
+                }
+                else
+                {
+                    timers.cancel(FlushTimer);
+                }
+            }
+
+            if (flush_requested || timer_fired)
+            {
+                task = uploader ? Task::Send : Task::Spill;
+                spill_requested = should_spill;
+                should_spill = false;
+                new_data = false;
+                should_flush_queue = false;
+                send_deferred = false;
+
+                last_flush_interval = flush_interval;
+                if (flush_controller)
+                {
+                    // the timer is scheduled again, when the worker is polled after the flush and finds the queues not empty
+                    flush_controller->flushed(unflushed_bytes.exchange(0), now);
+                    timers.cancel(FlushTimer);
                 }
+                else if (flush_interval != 0)
+                {
+                    timers.schedule(FlushTimer, now + std::chrono::seconds(flush_interval.load()));
+                }
+                else
+                {
+                    timers.cancel(FlushTimer);
+                }
+                timers.cancel(BackOffTimer);
+
+                // a flush sends the high priority lane first
+                timers.cancel(HighPriorityTimer);
+                return true;
+            }
+
+            if (high_priority_due)
+            {
+                task = uploader ? Task::SendHighPriority : Task::Spill;
+                return true;
+            }
+
+            if (should_spill)
+            {
+                task = Task::Spill;
+                should_spill = false;
+                return true;
+            }
+
+            next_wakeup = std::min(next_wakeup, timers.next_deadline());
 
-                auto block_time_left = network_requests_allowed_time.load() - time(0);
-                auto network_blocked = (mixpanel->network_reachability == Mixpanel::NetworkReachability::NotReachable || block_time_left > 0);
-                if (flush_interval > 0 && !network_blocked)
+            // run() calls the callbacks of the flushes that have expired, and exports the stats
+            return !expired_flushes.empty() || stats_due;
+        }
+
+        bool Worker::is_uploader(std::chrono::steady_clock::time_point now)
+        {
+            if (!persistence->is_multi_process())
+            {
+                uploader_lease.reset();
+                timers.cancel(LeaseTimer);
+                return true;
+            }
+
+            if (!uploader_lease)
+            {
+                uploader_lease.reset(new FileLock(persistence->storage_directory + "/mp_uploader.lock"));
+            }
+
+            // the operating system releases the lease when the uploader exits, however it exits. There is no way to be told,
+            // so the processes that don't hold it try again every lease_retry_interval.
+            if (!uploader_lease->owns_lock() && !timers.is_scheduled(LeaseTimer))
+            {
+                timers.schedule(LeaseTimer, now + lease_retry_interval);
+                if (uploader_lease->try_lock())
                 {
-                    // here thread_should_exit might be true, but we try to send anyways
-                    auto results = send_batches();
+                    MIXPANEL_LOG(*mixpanel, INFO, "this process is the uploader now");
+                    timers.cancel(LeaseTimer);
 
-                    // Note: the level is INFO here, because a request might fail when offline.
-                    if (!results.first.status) mixpanel->log(Mixpanel::LogEntry::LL_INFO, "error while sending tracking calls: " + results.first.error);
-                    if (!results.second.status) mixpanel->log(Mixpanel::LogEntry::LL_INFO, "error while sending engage calls: " + results.second.error);
+                    // send what the previous uploader left behind right away
+                    should_flush_queue = true;
+                    new_data = true;
+                }
+            }
 
-                    delivery_failure_flag = delivery_failure_flag || !results.first.status || !results.second.status;
+            return uploader_lease->owns_lock();
+        }
+
+        void Worker::hold_back_flush()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (mixpanel->network_reachability == Mixpanel::NetworkReachability::NotReachable)
+            {
+                send_deferred = true;
+                return;
+            }
+
+            // the end of the first back off, an endpoint that isn't backing off is sent on the next flush anyway
+            auto now = clock->time();
+            std::time_t block_time_left = 0;
+            for (auto health : {&track_health, &engage_health})
+            {
+                auto left = health->get_blocked_until() - now;
+                if (left > 0)
+                {
+                    block_time_left = block_time_left ? std::min(block_time_left, left) : left;
+                }
+            }
+            if (block_time_left > 0)
+            {
+                timers.schedule(BackOffTimer, clock->now() + std::chrono::seconds(block_time_left));
+            }
+        }
+
+        void Worker::run(unsigned max_batches, std::chrono::steady_clock::time_point deadline)
+        {
+            Task task;
+            bool spill_requested;
+            bool stats_due;
+            std::vector<std::function<void(bool)>> expired_flushes;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                task = this->task;
+                spill_requested = this->spill_requested;
+                stats_due = this->stats_due;
+                this->task = Task::None;
+                this->stats_due = false;
+                std::swap(expired_flushes, this->expired_flushes);
+            }
+
+            for (const auto& callback : expired_flushes)
+            {
+                callback(false);
+            }
+
+            if (task == Task::Spill)
+            {
+                persistence->persist_memory_queues();
+            }
+            else if (task == Task::Send || task == Task::SendHighPriority)
+            {
+                // the events that come in from now on arm the timer of the lane again
+                high_priority_pending = false;
+
+                // the endpoints back off on their own, see send_batch()
+                auto network_blocked = (mixpanel->network_reachability == Mixpanel::NetworkReachability::NotReachable);
+
+                // a backlog that the network holds back
+                bool held_back = false;
+                if (flush_interval > 0 && !network_blocked && clock->now() < deadline)
+                {
+                    // keep sending while there is a backlog, as long as the requests succeed. Each round sends a batch of
+                    // the high priority lane before the other queues get the connection, but the other queues get a batch
+                    // in every round too, so a steady stream of high priority events doesn't starve them.
+                    bool more = false;
+                    for (unsigned batch = 0; batch != max_batches; ++batch)
+                    {
+                        auto high_priority = send_batch(high_priority_lane, verbose);
+                        if (!high_priority.status) MIXPANEL_LOG(*mixpanel, INFO, "error while sending high priority tracking calls: " + high_priority.error);
+
+                        const Result skipped = {true, "", false, false};
+                        auto results = (task == Task::Send) ? send_batches() : std::make_pair(skipped, skipped);
+
+                        // Note: the level is INFO here, because a request might fail when offline.
+                        if (!results.first.status) MIXPANEL_LOG(*mixpanel, INFO, "error while sending tracking calls: " + results.first.error);
+                        if (!results.second.status) MIXPANEL_LOG(*mixpanel, INFO, "error while sending engage calls: " + results.second.error);
+
+                        delivery_failure_flag = delivery_failure_flag || !high_priority.status || !results.first.status || !results.second.status;
+                        complete_flushes();
+
+                        // a queue keeps going as long as its endpoint is healthy, whatever happens to the other one
+                        auto backlog = (high_priority.status && high_priority.more) || (results.first.status && results.first.more) || (results.second.status && results.second.more);
+                        auto reachable = mixpanel->network_reachability != Mixpanel::NetworkReachability::NotReachable;
+                        more = backlog && reachable;
+                        held_back = high_priority.held_back || results.first.held_back || results.second.held_back || (backlog && !reachable);
+                        if (!more || clock->now() >= deadline)
+                        {
+                            break;
+                        }
+                    }
+
+                    if (more)
+                    {
+                        // give other workers on the sender thread a turn, then continue
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (task == Task::Send)
+                        {
+                            should_flush_queue = true;
+                            new_data = true;
+                        }
+                        else
+                        {
+                            timers.schedule(HighPriorityTimer, clock->now());
+                        }
+                    }
+                }
+                else
+                {
+                    held_back = flush_interval > 0 && get_queues_size() != 0;
+                    if (spill_requested)
+                    {
+                        // the spill request came in together with another wakeup, but nothing was sent (which would have persisted the buffer)
+                        persistence->persist_memory_queues();
+                    }
+                }
+
+                if (held_back)
+                {
+                    hold_back_flush();
+                }
+            }
+
+            above_high_water = persistence->memory_budget_exceeded();
+
+            // the queues may also have been emptied in other ways, e.g. by opting out
+            complete_flushes();
+
+            if (stats_due)
+            {
+                std::function<void(const Mixpanel::Stats&)> callback;
+                {
+                    std::lock_guard<std::mutex> lock(callback_mutex);
+                    callback = stats_callback;
+                }
+                if (callback)
+                {
+                    callback(get_stats());
                 }
             }
         }
@@ -2,70 +2,329 @@
 #define _MIXPANEL_WORKER_HPP_
 
 #include <atomic>
-#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
-#include <thread>
 #include <utility>
+#include <vector>
+#include <mixpanel/mixpanel.hpp>
 #include <mixpanel/value.hpp>
 #include "../../../tests/gtest/include/gtest/gtest_prod.h"
-#include "../../dependencies/nano/include/nanowww/nanowww.h"
+#include "./bandwidth_budget.hpp"
+#include "./clock.hpp"
+#include "./concurrency_limit.hpp"
+#include "./endpoint_health.hpp"
+#include "./flush_controller.hpp"
+#include "./metrics.hpp"
+#include "./timer_wheel.hpp"
 
-class MixpanelNetwork_RetryAfter_Test;
-class MixpanelNetwork_BackOffTime_Test;
-class MixpanelNetwork_FailureRecovery_Test;
+class MixpanelNetwork_IdleWakeups_Test;
+class MixpanelNetwork_FlushAsync_Test;
+class MixpanelNetwork_CircuitBreaker_Test;
+class MixpanelNetwork_PriorityLanes_Test;
+class MixpanelNetwork_CellularBudget_Test;
 
 namespace mixpanel
 {
-    class Mixpanel;
-
     namespace detail
     {
+        class FileLock;
+        class Persistence;
+        class SenderThread;
+        class Simulation;
+
+        // Sends the queues of one Mixpanel instance. The sending happens on a SenderThread, which may be shared with other instances.
         class Worker
         {
             public:
-                explicit Worker(Mixpanel* mixpanel);
+                Worker(Mixpanel* mixpanel, std::shared_ptr<Persistence> persistence, std::shared_ptr<SenderThread> sender_thread, std::shared_ptr<Metrics> metrics);
+
+                // shuts down with the default timeout, unless shutdown() has been called before
                 ~Worker();
 
-                void enqueue(const std::string& name, const Value& o);
+                // Writes the memory buffer to disk and sends the queues until the deadline, see Mixpanel::shutdown(). Returns
+                // true if the queues are empty. The worker doesn't run after this, events enqueued later are only written to
+                // disk by the destructor. Like all deadlines of the worker, it is on the clock of get_clock().
+                bool shutdown(std::chrono::steady_clock::time_point deadline);
+                static const std::chrono::milliseconds default_shutdown_timeout;
+
+                void enqueue(const std::string& name, const Value& o, Mixpanel::EventPriority priority=Mixpanel::EventPriority::Normal);
+
+                // json is the encoded object, terminated by '\n'
+                void enqueue_serialized(const std::string& name, const std::string& json, Mixpanel::EventPriority priority);
                 void notify();
 
                 void set_flush_interval(unsigned seconds);
+                void set_high_priority_flush_delay(unsigned milliseconds);
+                void set_adaptive_flush(unsigned min_interval, unsigned max_interval, std::size_t flush_bytes);
                 void flush_queue();
                 void clear_send_queues();
+
+                // see Mixpanel::flush_async(). *callback* is called on the sender thread, or right away if there is nothing to
+                // wait for.
+                void flush_async(std::chrono::steady_clock::time_point deadline, std::function<void(bool)> callback);
+
+                // called after every batch that was sent, see Mixpanel::set_delivery_callback()
+                void set_delivery_callback(std::function<void(const Mixpanel::BatchDelivery&)> callback);
+
+                // called when the memory buffer crosses the memory budget
+                void set_memory_high_water_callback(std::function<void(std::size_t)> callback);
+
+                // the maximum number of requests in flight per endpoint
+                void set_max_requests_in_flight(unsigned count);
+
+                // see Mixpanel::set_api_host()
+                void set_api_host(const std::string& api_host);
+                std::string get_api_host();
+
+                // see Mixpanel::set_cellular_daily_budget()
+                void set_cellular_daily_budget(std::size_t bytes);
+                Mixpanel::NetworkUsage get_network_usage();
+
+                // High priority events go into a lane of their own, which is flushed shortly after they are tracked and is
+                // sent first. It goes to the track endpoint, like the track queue.
+                static const std::string high_priority_lane;
+
+                // the queues, in the order they get the connection
+                static const std::vector<std::string> queue_names;
+
+                Mixpanel::EndpointStats get_endpoint_stats(const std::string& name);
+
+                // the metrics and the state of the queues, see Mixpanel::get_stats()
+                Mixpanel::Stats get_stats();
+
+                // calls *callback* with get_stats() every interval_seconds, on the sender thread. 0 stops it.
+                void set_stats_export(unsigned interval_seconds, std::function<void(const Mixpanel::Stats&)> callback);
+
+                // sends with *transport*, nullptr switches back to the HttpTransport over the connection pool of the sender thread
+                void set_transport(std::shared_ptr<Transport> transport);
+
+                // What the worker takes from its surroundings. The members that are left empty keep their defaults: the
+                // system clock, rand() for the jitter of the back offs and the transport of set_transport().
+                struct Environment
+                {
+                    std::shared_ptr<Clock> clock;
+                    std::function<unsigned()> random;
+                    std::shared_ptr<Transport> transport;
+                };
+
+                // must be called before the worker is used, see Simulation
+                void set_environment(const Environment& environment);
+                std::shared_ptr<Clock> get_clock() const { return clock; }
             private:
-                FRIEND_TEST(::MixpanelNetwork, RetryAfter);
-                FRIEND_TEST(::MixpanelNetwork, BackOffTime);
-                FRIEND_TEST(::MixpanelNetwork, FailureRecovery);
+                FRIEND_TEST(::MixpanelNetwork, IdleWakeups);
+                FRIEND_TEST(::MixpanelNetwork, FlushAsync);
+                FRIEND_TEST(::MixpanelNetwork, CircuitBreaker);
+                FRIEND_TEST(::MixpanelNetwork, PriorityLanes);
+                FRIEND_TEST(::MixpanelNetwork, CellularBudget);
+
+                friend class SenderThread;
+                friend class Simulation;
+
+                // Called by the sender thread. Returns true if the worker has something to do right now. Otherwise lowers
+                // next_wakeup to its next timer, it isn't lowered at all when nothing is scheduled.
+                bool poll(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point& next_wakeup);
+
+                // does what poll() has decided on. Sends up to max_batches batches per queue, while they have a backlog and
+                // the deadline hasn't passed.
+                void run(unsigned max_batches=max_batches_per_run, std::chrono::steady_clock::time_point deadline=std::chrono::steady_clock::time_point::max());
+                static const unsigned max_batches_per_run = 20;
+
+                // ask the worker to write the memory buffer to disk, without sending anything
+                void spill();
+
+                // In multi-process mode, only the process that holds the uploader lease sends. Tries to get the lease, if
+                // another process held it before. Called with mutex held.
+                bool is_uploader(std::chrono::steady_clock::time_point now);
 
-                void main();
+                // arranges for a flush that the network held back to be tried again, as soon as it can succeed
+                void hold_back_flush();
+
+                // the timers in the timer wheel
+                enum Timer
+                {
+                    FlushTimer,         // every flush_interval, not scheduled if it is 0
+                    BackOffTimer,       // the end of a back off that held back a flush
+                    LeaseTimer,         // the next attempt to get the uploader lease
+                    HighPriorityTimer,  // the flush of the high priority lane, scheduled by its first event
+                    StatsTimer,         // the next export of the stats, see set_stats_export()
+                    FlushDeadlineTimer  // the deadline of the first flush_async(), the later ones count up from here
+                };
+
+                enum class Task
+                {
+                    None,
+                    Spill,      // only write the memory buffer to disk
+                    Send,
+                    SendHighPriority    // only send the high priority lane
+                };
 
                 struct Result
                 {
+                    Result(bool status, const std::string& error, bool more=false, bool held_back=false)
+                    : status(status), error(error), more(more), held_back(held_back) {}
+
                     bool status;
                     std::string error;
+                    bool more;          // the queue holds more records than the ones that have been sent, and its endpoint is healthy
+                    bool held_back;     // the circuit of the endpoint is open, while the queue holds records
                 };
 
+                // sends both endpoints at the same time
                 std::pair<Result, Result> send_batches();
                 Result send_track_batch();
                 Result send_engage_batch();
+
+                // sends as many batches of the queue *name* at once, as its concurrency limit allows
                 Result send_batch(const std::string& name, bool verbose);
+                static const unsigned batch_size = 50;
 
-                int parse_www_retry_after(const nanowww::Response& response);
-                static int calculate_back_off_time(int failure_count);
+                struct Delivery
+                {
+                    Delivery() : result{false, ""}, delivered(false), response_received(false), rtt(0), bytes(0), rejected_as_a_whole(false) {}
+
+                    Result result;
+                    bool delivered;         // the API has seen every record of the batch, it may still have refused some of them
+                    bool response_received;
+                    Transport::Response response;
+                    std::chrono::steady_clock::duration rtt;
+                    std::size_t bytes;      // of the payload
+
+                    // the records the API refused for good: their index in the batch and the reason
+                    std::vector<std::pair<Json::ArrayIndex, std::string>> rejected;
+
+                    // the API refused the batch without saying which of its records were the problem
+                    bool rejected_as_a_whole;
+                };
+
+                // Sends a batch. If the API refuses it as a whole, the batch is halved until the records it refuses are
+                // found, so the others are delivered nonetheless.
+                Delivery deliver(const std::string& name, const Value& batch, bool verbose);
+
+                // sends a batch in a single request
+                Delivery post_batch(const std::string& name, const Value& batch, bool verbose);
+
+                // On carrier data networks, returns true if the queue *name* waits for WiFi or a later flush: once the
+                // budget of the day is used up, and while the bulk queues hold less than a full batch, for up to
+                // FlushController::cellular_factor flushes.
+                bool defer_on_cellular(const std::string& name);
+
+                // the endpoint the queue *name* is sent to
+                static std::string get_endpoint(const std::string& name);
+
+                // the total size of the queues in bytes
+                std::size_t get_queues_size();
+
+                // calls the callbacks of the flushes whose records have all been acknowledged
+                void complete_flushes();
+
+                // reports the batches of one send_batch() to the delivery callback
+                void report_deliveries(const std::string& name, const std::vector<Value>& batches, const std::vector<Delivery>& deliveries, std::size_t acknowledged_batches, unsigned attempt);
+
+                // feeds the response of the endpoint of queue *name* back into its health. Returns the time until which the
+                // endpoint gets no requests.
+                std::time_t parse_www_retry_after(const std::string& name, const Transport::Response& response);
+                EndpointHealth& get_health(const std::string& name);
+
+                std::shared_ptr<Transport> get_transport();
 
                 Mixpanel* mixpanel;
-                std::atomic<bool> thread_should_exit;
+                std::shared_ptr<Persistence> persistence;
+                std::shared_ptr<SenderThread> sender_thread;
+                std::shared_ptr<Clock> clock;
+                std::shared_ptr<Metrics> metrics;
+
                 std::atomic<bool> new_data;
                 std::atomic<bool> should_flush_queue;
-                std::atomic<int> failure_count;
+                std::atomic<bool> should_spill;
+                std::atomic<bool> above_high_water;
                 std::atomic<unsigned> flush_interval;
-                std::atomic<time_t> network_requests_allowed_time;
-                std::thread send_thread;
 
+                // in adaptive mode, flush_interval is the maximum interval and flush_controller decides when to flush
+                std::atomic<bool> adaptive_flush;
+                std::atomic<std::size_t> unflushed_bytes;   // enqueued since the last flush
+                std::atomic<std::size_t> flush_bytes;       // the current threshold of flush_controller
+
+                // the high priority lane holds events that its timer hasn't flushed yet
+                std::atomic<bool> high_priority_pending;
+                std::atomic<unsigned> high_priority_flush_delay;    // milliseconds
+
+                EndpointHealth track_health;
+                EndpointHealth engage_health;
+                BandwidthBudget bandwidth_budget;
+                ConcurrencyLimit track_concurrency;
+                ConcurrencyLimit engage_concurrency;
+
+                std::atomic<bool> shut_down;
+
+                // guards the flags above and the schedule
                 std::mutex mutex;
-                std::condition_variable condition;
+                unsigned last_flush_interval;
+                TimerWheel timers;
+                std::unique_ptr<FlushController> flush_controller;
+                Task task;
+                bool spill_requested;
+
+                // a flush that couldn't send while the network was unreachable, or was deferred on a carrier data network.
+                // It is sent when the reachability changes.
+                bool send_deferred;
+
+                // the flushes in a row that have deferred a queue on a carrier data network
+                std::map<std::string, unsigned> cellular_deferrals;
+
+                std::string api_host;
+                std::shared_ptr<Transport> transport;
+
+                // every stats_interval seconds, run() exports the stats, when stats_due is set. 0 is off.
+                unsigned stats_interval;
+                bool stats_due;
+
+                // A flush_async() in progress. It is done, once as many records in total as the target have left every queue,
+                // or the queue is empty: then all the records it held at the time of the call have been sent, or evicted or
+                // expired, which no flush could have sent.
+                struct PendingFlush
+                {
+                    std::map<std::string, std::uint64_t> targets;
+                    std::function<void(bool)> callback;
+                };
+
+                // keyed by their deadline timers
+                std::map<unsigned, PendingFlush> pending_flushes;
+                unsigned next_flush_deadline_timer;
+
+                // the callbacks of the flushes whose deadline has passed, run() calls them
+                std::vector<std::function<void(bool)>> expired_flushes;
+
+                // also guarded by mutex
+                std::unique_ptr<FileLock> uploader_lease;
+                static const std::chrono::seconds lease_retry_interval;
+
+                // the records each queue has acknowledged since the start. Dropping the records from the queue and counting
+                // them happen together under this mutex, so the counts match the queue sizes.
+                std::mutex acknowledgement_mutex;
+                std::map<std::string, std::uint64_t> acknowledged_records;
+
+                // the records that have left queue *name* since the start: acknowledged, evicted or expired. The targets of
+                // the flushes count these. Called with acknowledgement_mutex held.
+                std::uint64_t get_removed_records(const std::string& name);
+
+                // the failed attempts to send the records at the front of each queue, also guarded by acknowledgement_mutex.
+                // Failures that aren't the fault of the records (server errors, timeouts, ...) leave them in the queue, in
+                // order, so they are sent again until they are delivered.
+                std::map<std::string, unsigned> front_retries;
+
+                std::mutex callback_mutex;
+                std::function<void(std::size_t)> memory_high_water_callback;
+                std::function<void(const Mixpanel::BatchDelivery&)> delivery_callback;
+                std::function<void(const Mixpanel::Stats&)> stats_callback;
+
+                // the queues are sent at the same time, but the delivery callback is called for one batch at a time
+                std::mutex delivery_callback_mutex;
         };
     } // namespace detail
 } // namespace mixpanel
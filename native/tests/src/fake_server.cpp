@@ -0,0 +1,372 @@
+#ifndef WIN32
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_server.hpp"
+
+using namespace mixpanel;
+
+namespace
+{
+    std::string url_decode(const std::string& s)
+    {
+        std::string decoded;
+        for (std::size_t i = 0; i < s.size(); ++i)
+        {
+            if (s[i] == '%' && i + 2 < s.size())
+            {
+                decoded += static_cast<char>(std::strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+                i += 2;
+            }
+            else
+            {
+                decoded += (s[i] == '+') ? ' ' : s[i];
+            }
+        }
+        return decoded;
+    }
+
+    std::string base64_decode(const std::string& s)
+    {
+        static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string decoded;
+        unsigned bits = 0;
+        int bit_count = 0;
+        for (auto c : s)
+        {
+            auto value = alphabet.find(c);
+            if (value == std::string::npos)
+            {
+                continue;
+            }
+            bits = (bits << 6) | static_cast<unsigned>(value);
+            bit_count += 6;
+            if (bit_count >= 8)
+            {
+                bit_count -= 8;
+                decoded += static_cast<char>((bits >> bit_count) & 0xff);
+            }
+        }
+        return decoded;
+    }
+
+    // the value of the form field *name* in an application/x-www-form-urlencoded body
+    std::string form_field(const std::string& body, const std::string& name)
+    {
+        auto start = ("&" + body).find("&" + name + "=");
+        if (start == std::string::npos)
+        {
+            return "";
+        }
+        start += name.size() + 1;
+        auto end = body.find('&', start);
+        return url_decode(body.substr(start, end == std::string::npos ? std::string::npos : end - start));
+    }
+
+    std::string status_text(int status)
+    {
+        switch (status)
+        {
+            case 200: return "OK";
+            case 400: return "Bad Request";
+            case 413: return "Payload Too Large";
+            case 429: return "Too Many Requests";
+            case 500: return "Internal Server Error";
+            case 502: return "Bad Gateway";
+            case 503: return "Service Unavailable";
+            default: return "Error";
+        }
+    }
+
+    std::chrono::nanoseconds thread_cpu_time()
+    {
+        timespec time = {};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+    }
+}
+
+FakeServer::FakeServer()
+: requests(0)
+, max_in_flight(0)
+, bytes_received(0)
+, in_flight(0)
+, stopping(false)
+, cpu_nanoseconds(0)
+, keep_events(true)
+{
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    listen(listener, 64);
+    getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+    port = ntohs(address.sin_port);
+
+    accept_thread = std::thread([this] {
+        int fd;
+        while ((fd = accept(listener, nullptr, nullptr)) != -1 && !stopping)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.push_back(fd);
+            connection_threads.emplace_back(&FakeServer::serve, this, fd);
+        }
+        if (fd != -1) close(fd);
+    });
+}
+
+FakeServer::~FakeServer()
+{
+    stopping = true;
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    accept_thread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto fd : connections) shutdown(fd, SHUT_RDWR);
+    }
+    for (auto& thread : connection_threads) thread.join();
+    for (auto fd : connections) close(fd);
+}
+
+std::string FakeServer::api_host() const
+{
+    return "http://127.0.0.1:" + std::to_string(port) + "/";
+}
+
+void FakeServer::set_faults(const Faults& faults)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->faults = faults;
+}
+
+void FakeServer::add_faults(const Faults& faults, unsigned count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    next.insert(next.end(), count, faults);
+}
+
+void FakeServer::reject_events(std::function<bool(const Value& event)> predicate)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    rejected = predicate;
+}
+
+std::vector<Value> FakeServer::get_events(const std::string& endpoint)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return events[endpoint];
+}
+
+void FakeServer::set_keep_events(bool keep_events)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->keep_events = keep_events;
+}
+
+std::size_t FakeServer::get_event_count(const std::string& endpoint)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return event_counts[endpoint];
+}
+
+bool FakeServer::wait_for_events(const std::string& endpoint, std::size_t count, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    return accepted.wait_for(lock, timeout, [this, &endpoint, count] { return event_counts[endpoint] >= count; });
+}
+
+std::chrono::nanoseconds FakeServer::get_cpu_time() const
+{
+    return std::chrono::nanoseconds(cpu_nanoseconds.load());
+}
+
+void FakeServer::add_cpu_time(std::chrono::nanoseconds& last)
+{
+    auto now = thread_cpu_time();
+    cpu_nanoseconds += (now - last).count();
+    last = now;
+}
+
+FakeServer::Faults FakeServer::next_faults()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (next.empty())
+    {
+        return faults;
+    }
+    auto faults = next.front();
+    next.pop_front();
+    return faults;
+}
+
+void FakeServer::serve(int fd)
+{
+    std::string buffer;
+    char chunk[64 * 1024];
+    Faults faults;
+    bool in_request = false;
+    auto cpu_time = thread_cpu_time();
+    for (;;)
+    {
+        auto header_end = buffer.find("\r\n\r\n");
+        if (header_end != std::string::npos)
+        {
+            if (!in_request)
+            {
+                faults = next_faults();
+                in_request = true;
+            }
+
+            auto header = buffer.substr(0, header_end);
+            auto content_length_pos = header.find("Content-Length: ");
+            std::size_t content_length = content_length_pos == std::string::npos ? 0 : std::strtoul(header.c_str() + content_length_pos + 16, nullptr, 10);
+            if (buffer.size() >= header_end + 4 + content_length)
+            {
+                in_request = false;
+                auto body = buffer.substr(header_end + 4, content_length);
+                buffer.erase(0, header_end + 4 + content_length);
+
+                if (faults.latency.count() != 0)
+                {
+                    std::this_thread::sleep_for(faults.latency);
+                }
+                if (faults.reset)
+                {
+                    // a zero linger time makes close() send a RST
+                    ++requests;
+                    linger reset = {1, 0};
+                    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                    std::lock_guard<std::mutex> lock(mutex);
+                    connections.erase(std::find(connections.begin(), connections.end(), fd));
+                    close(fd);
+                    add_cpu_time(cpu_time);
+                    return;
+                }
+
+                std::string response;
+                if (faults.status != 0)
+                {
+                    ++requests;
+                    Value result;
+                    result["status"] = 0;
+                    result["error"] = status_text(faults.status);
+                    detail::Json::FastWriter writer;
+                    auto content = writer.write(result);
+                    response = "HTTP/1.1 " + std::to_string(faults.status) + " " + status_text(faults.status) + "\r\nContent-Type: application/json\r\n"
+                        + (faults.retry_after != 0 ? "Retry-After: " + std::to_string(faults.retry_after) + "\r\n" : "")
+                        + "Content-Length: " + std::to_string(content.size()) + "\r\n\r\n" + content;
+                }
+                else
+                {
+                    response = handle(header, body);
+                }
+                if (faults.status == 0 && faults.retry_after != 0)
+                {
+                    response.insert(response.find("\r\n") + 2, "Retry-After: " + std::to_string(faults.retry_after) + "\r\n");
+                }
+                auto sent = send(fd, response.data(), response.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(response.size());
+                add_cpu_time(cpu_time);
+                if (!sent) return;
+                continue;
+            }
+        }
+
+        // a bandwidth cap reads a tenth of a second's worth at a time
+        auto size_to_read = sizeof(chunk);
+        if (in_request && faults.bytes_per_second != 0)
+        {
+            size_to_read = std::max<std::size_t>(std::min(size_to_read, faults.bytes_per_second / 10), 1);
+        }
+        auto size = recv(fd, chunk, size_to_read, 0);
+        if (size <= 0)
+        {
+            add_cpu_time(cpu_time);
+            return;
+        }
+        bytes_received += size;
+        buffer.append(chunk, size);
+        if (in_request && faults.bytes_per_second != 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(size * 1000000 / faults.bytes_per_second));
+        }
+    }
+}
+
+std::string FakeServer::handle(const std::string& header, const std::string& body)
+{
+    ++requests;
+    auto now_in_flight = ++in_flight;
+    int expected = max_in_flight;
+    while (now_in_flight > expected && !max_in_flight.compare_exchange_weak(expected, now_in_flight)) {}
+
+    // "POST /track/?verbose=1&ip=1 HTTP/1.1"
+    auto path_start = header.find(' ') + 2;
+    auto endpoint = header.substr(path_start, header.find_first_of("/? ", path_start) - path_start);
+
+    detail::Json::Reader reader;
+    Value batch;
+    reader.parse(base64_decode(form_field(body, "data")), batch, false);
+
+    int status = 200;
+    Value result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Value failed_records(detail::Json::arrayValue);
+        for (detail::Json::ArrayIndex i = 0; i < batch.size(); ++i)
+        {
+            if (rejected && rejected(batch[i]))
+            {
+                Value record;
+                record["index"] = i;
+                record["message"] = "rejected by the test";
+                failed_records.append(record);
+            }
+            else
+            {
+                ++event_counts[endpoint];
+                if (keep_events)
+                {
+                    events[endpoint].push_back(batch[i]);
+                }
+            }
+        }
+
+        if (!batch.isArray())
+        {
+            status = 400;
+            result["status"] = 0;
+            result["error"] = "the data is not a JSON array";
+        }
+        else if (!failed_records.empty())
+        {
+            status = 400;
+            result["status"] = 0;
+            result["error"] = "some data points in the request failed validation";
+            result["failed_records"] = failed_records;
+        }
+        else
+        {
+            result["status"] = 1;
+            result["error"] = Value::null;
+        }
+    }
+    accepted.notify_all();
+    --in_flight;
+
+    detail::Json::FastWriter writer;
+    auto content = writer.write(result);
+    return "HTTP/1.1 " + std::to_string(status) + " " + status_text(status) + "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(content.size()) + "\r\n\r\n" + content;
+}
+
+#endif /* WIN32 */
@@ -0,0 +1,103 @@
+#ifndef MIXPANEL_FAKE_SERVER_HPP
+#define MIXPANEL_FAKE_SERVER_HPP
+
+#ifndef WIN32
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mixpanel/mixpanel.hpp>
+
+// A stand-in for the /track and /engage endpoints on 127.0.0.1, on a port of its own, so the tests that send run
+// offline and fast. Point an instance at it with Mixpanel::set_api_host(server.api_host()).
+//
+// It speaks just enough HTTP/1.1 for the SDK, decodes the batches and keeps the events it accepted. Faults can be
+// injected for all requests or for the next few. Plain HTTP only: the SDK pins the certificate of api.mixpanel.com, and
+// the bundled TLS library is built without server support.
+class FakeServer
+{
+    public:
+        struct Faults
+        {
+            Faults() : latency(0), bytes_per_second(0), status(0), retry_after(0), reset(false) {}
+
+            std::chrono::milliseconds latency;  // before the response
+            std::size_t bytes_per_second;       // the request is read at this rate, 0 is unlimited
+            int status;                         // the HTTP status of the response, 0 accepts the batch
+            int retry_after;                    // seconds in a Retry-After header, 0 sends none
+            bool reset;                         // resets the connection instead of answering
+        };
+
+        FakeServer();
+        ~FakeServer();
+
+        // the URL for Mixpanel::set_api_host()
+        std::string api_host() const;
+
+        // the faults of all requests that follow
+        void set_faults(const Faults& faults);
+
+        // the faults of the next *count* requests, they go before the ones of set_faults()
+        void add_faults(const Faults& faults, unsigned count=1);
+
+        // the events *predicate* holds for are refused one by one, with the failed_records of a 400 response, the others
+        // in their batch are accepted
+        void reject_events(std::function<bool(const mixpanel::Value& event)> predicate);
+
+        // the events the endpoint ("track" or "engage") has accepted, in the order they arrived
+        std::vector<mixpanel::Value> get_events(const std::string& endpoint);
+
+        // whether the accepted events are kept for get_events(), they are counted either way. On by default, load tests
+        // turn it off.
+        void set_keep_events(bool keep_events);
+        std::size_t get_event_count(const std::string& endpoint);
+
+        // the CPU time the server has spent on its connections so far
+        std::chrono::nanoseconds get_cpu_time() const;
+
+        // waits until the endpoint has accepted *count* events in total. Returns false on timeout.
+        bool wait_for_events(const std::string& endpoint, std::size_t count, std::chrono::milliseconds timeout);
+
+        std::atomic<int> requests;
+        std::atomic<int> max_in_flight;
+        std::atomic<std::uint64_t> bytes_received;    // including the HTTP headers
+    private:
+        void serve(int fd);
+
+        // records the events of a request and returns the response
+        std::string handle(const std::string& header, const std::string& body);
+        Faults next_faults();
+
+        void add_cpu_time(std::chrono::nanoseconds& last);
+
+        int listener;
+        int port;
+        std::atomic<int> in_flight;
+        std::atomic<bool> stopping;
+        std::atomic<std::int64_t> cpu_nanoseconds;
+
+        std::mutex mutex;
+        std::condition_variable accepted;
+        Faults faults;
+        std::deque<Faults> next;
+        std::function<bool(const mixpanel::Value&)> rejected;
+        bool keep_events;
+        std::map<std::string, std::vector<mixpanel::Value>> events;
+        std::map<std::string, std::size_t> event_counts;
+        std::vector<int> connections;
+        std::vector<std::thread> connection_threads;
+        std::thread accept_thread;
+};
+
+#endif /* WIN32 */
+
+#endif //MIXPANEL_FAKE_SERVER_HPP
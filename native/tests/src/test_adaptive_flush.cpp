@@ -0,0 +1,206 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <mixpanel/detail/flush_controller.hpp>
+
+using namespace mixpanel::detail;
+
+namespace
+{
+    typedef std::chrono::steady_clock::time_point time_point;
+    const std::size_t event_size = 300;
+
+    struct Outcome
+    {
+        unsigned wakeups;       // flushes that found something to send
+        int max_latency;        // seconds from tracking an event to the flush that sends it
+        double mean_latency;
+    };
+
+    struct Policy
+    {
+        std::function<bool(std::size_t queued, time_point now)> due;
+        std::function<void(std::size_t queued, time_point now)> flushed;
+    };
+
+    // a flush every 60 seconds, like set_flush_interval(60)
+    Policy fixed_timer()
+    {
+        auto last_flush = std::make_shared<time_point>(time_point());
+        return {
+            [last_flush](std::size_t, time_point now) { return now - *last_flush >= std::chrono::seconds(60); },
+            [last_flush](std::size_t, time_point now) { *last_flush = now; }
+        };
+    }
+
+    Policy adaptive(bool cellular=false)
+    {
+        auto controller = std::make_shared<FlushController>(std::chrono::seconds(10), std::chrono::seconds(600), 64 * 1024);
+        controller->set_cellular(cellular);
+        return {
+            [controller](std::size_t queued, time_point now) { return controller->next_flush(queued, queued, now) <= now; },
+            [controller](std::size_t queued, time_point now) { controller->flushed(queued, now); }
+        };
+    }
+
+    // Plays the events against a flush policy, one second at a time. events[i] is the second at which event i is tracked.
+    // Every flush sends the whole queue.
+    Outcome simulate(const std::vector<int>& events, int seconds, Policy policy)
+    {
+        const time_point start;
+        Outcome outcome = {0, 0, 0};
+        std::deque<int> queue;
+        auto next_event = events.begin();
+        for (int second = 0; second != seconds; ++second)
+        {
+            auto now = start + std::chrono::seconds(second);
+            for (; next_event != events.end() && *next_event == second; ++next_event)
+            {
+                queue.push_back(second);
+            }
+
+            if (policy.due(queue.size() * event_size, now))
+            {
+                if (!queue.empty())
+                {
+                    ++outcome.wakeups;
+                }
+                for (auto tracked : queue)
+                {
+                    outcome.max_latency = std::max(outcome.max_latency, second - tracked);
+                    outcome.mean_latency += static_cast<double>(second - tracked) / events.size();
+                }
+                policy.flushed(queue.size() * event_size, now);
+                queue.clear();
+            }
+        }
+        return outcome;
+    }
+
+    void report(const char* scenario, const char* name, const Outcome& outcome)
+    {
+        std::cout << scenario << ", " << name << ": " << outcome.wakeups << " wakeups, latency " << outcome.mean_latency << " s mean, "
+                  << outcome.max_latency << " s max" << std::endl;
+    }
+}
+
+//
+// One event a minute for six hours: the adaptive flush wakes the radio a fraction of the times the fixed timer does,
+// and no event waits longer than the maximum interval.
+//
+TEST(AdaptiveFlush, Trickle)
+{
+    std::vector<int> events;
+    for (int second = 30; second < 6 * 60 * 60; second += 60)
+    {
+        events.push_back(second);
+    }
+
+    auto fixed = simulate(events, 6 * 60 * 60 + 600, fixed_timer());
+    auto adaptive = simulate(events, 6 * 60 * 60 + 600, ::adaptive());
+    report("trickle", "fixed", fixed);
+    report("trickle", "adaptive", adaptive);
+
+    ASSERT_EQ(fixed.wakeups, events.size());
+    ASSERT_LT(adaptive.wakeups * 5, fixed.wakeups);
+    ASSERT_LE(adaptive.max_latency, 600);
+}
+
+//
+// A burst of 10000 events in the middle of light traffic is sent within the minimum interval, not at the next tick of
+// the timer.
+//
+TEST(AdaptiveFlush, Burst)
+{
+    std::vector<int> events;
+    for (int second = 0; second < 1800; second += 30)
+    {
+        events.push_back(second);
+        if (second == 930)
+        {
+            events.insert(events.end(), 10000, second);
+        }
+    }
+
+    auto fixed = simulate(events, 2400, fixed_timer());
+    auto adaptive = simulate(events, 2400, ::adaptive());
+    report("burst", "fixed", fixed);
+    report("burst", "adaptive", adaptive);
+
+    // the burst makes up most of the events, so the mean is about its latency
+    ASSERT_GE(fixed.mean_latency, 29);
+    ASSERT_LE(adaptive.mean_latency, 10);
+    ASSERT_LE(adaptive.max_latency, 600);
+    ASSERT_LT(adaptive.wakeups, fixed.wakeups);
+}
+
+//
+// Steady traffic of an event every two seconds: on a carrier data network, the batches are larger and the radio wakes
+// up less often than on WiFi.
+//
+TEST(AdaptiveFlush, Cellular)
+{
+    std::vector<int> events;
+    for (int second = 0; second < 2 * 60 * 60; second += 2)
+    {
+        events.push_back(second);
+    }
+
+    auto wifi = simulate(events, 2 * 60 * 60 + 600, adaptive(false));
+    auto cellular = simulate(events, 2 * 60 * 60 + 600, adaptive(true));
+    report("steady", "WiFi", wifi);
+    report("steady", "carrier data network", cellular);
+
+    ASSERT_LT(cellular.wakeups, wifi.wakeups);
+    ASSERT_LE(wifi.max_latency, 600);
+    ASSERT_LE(cellular.max_latency, 600);
+}
+
+//
+// The interval stays within its bounds and a queue over the threshold waits for the minimum interval after the last flush.
+//
+TEST(AdaptiveFlush, Bounds)
+{
+    const time_point start;
+    const auto s = [start](int n) { return start + std::chrono::seconds(n); };
+    FlushController controller(std::chrono::seconds(10), std::chrono::seconds(40), 1000);
+
+    ASSERT_EQ(controller.next_flush(0, 0, s(0)), time_point::max());
+    ASSERT_EQ(controller.next_flush(100, 100, s(0)), s(10));
+
+    // light traffic stretches the interval up to the maximum
+    controller.flushed(100, s(10));
+    ASSERT_EQ(controller.get_interval(), std::chrono::seconds(20));
+    controller.flushed(100, s(30));
+    controller.flushed(100, s(70));
+    ASSERT_EQ(controller.get_interval(), std::chrono::seconds(40));
+
+    // the queue was seen at 80 s first
+    ASSERT_EQ(controller.next_flush(100, 100, s(80)), s(120));
+    ASSERT_EQ(controller.next_flush(100, 100, s(90)), s(120));
+
+    // crossing the threshold flushes right away, but not within the minimum interval after the last flush
+    ASSERT_EQ(controller.next_flush(1000, 1000, s(75)), s(80));
+    ASSERT_EQ(controller.next_flush(1000, 1000, s(95)), s(80));
+
+    // a backlog that failed to send doesn't count as traffic
+    controller.flushed(1000, s(95));
+    ASSERT_EQ(controller.get_interval(), std::chrono::seconds(20));
+    ASSERT_EQ(controller.next_flush(5000, 0, s(100)), s(120));
+    controller.flushed(0, s(120));
+    controller.flushed(5000, s(130));
+    controller.flushed(5000, s(140));
+    ASSERT_EQ(controller.get_interval(), std::chrono::seconds(10));
+
+    // carrier data networks raise the minimum interval and the threshold
+    controller.set_cellular(true);
+    ASSERT_EQ(controller.get_flush_bytes(), 4000u);
+    ASSERT_EQ(controller.get_interval(), std::chrono::seconds(40));
+    ASSERT_EQ(controller.next_flush(4000, 4000, s(150)), s(180));
+}
@@ -9,3 +9,11 @@ TEST(Mixpanel, Base64)
     ASSERT_EQ(mixpanel::detail::base64_encode("aaa"), "YWFh");
     ASSERT_EQ(mixpanel::detail::base64_encode("aaaa"), "YWFhYQ==");
 }
+
+TEST(Mixpanel, Base64Decode)
+{
+    for (std::string s : {"", "a", "aa", "aaa", "aaaa", "[{\"event\":\"test\"}]\n"})
+    {
+        ASSERT_EQ(mixpanel::detail::base64_decode(mixpanel::detail::base64_encode(s)), s);
+    }
+}
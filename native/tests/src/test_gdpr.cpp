@@ -1,54 +1,69 @@
 #include <gtest/gtest.h>
 #include <mixpanel/mixpanel.hpp>
 #include <mixpanel/detail/persistence.hpp>
+#include <mixpanel/detail/platform_helpers.hpp>
 #include <thread>
 #include <fstream>
 #include <stdio.h>
 
+#include "fake_server.hpp"
+
 using namespace mixpanel;
 using namespace mixpanel::detail;
 
+// The instances send to the fake server, and every test starts with empty queues, whatever the tests before it have left.
 class GDPR : public ::testing::Test {
 protected:
     virtual void SetUp() {
-
+        Mixpanel mp("123456789");
+        mp.set_api_host(server.api_host());
+        mp.clear_send_queues();
     }
     virtual void TearDown() {
-        mixpanel::Value state = mixpanel::detail::Persistence::read("state");
+        auto storage_directory = PlatformHelpers::get_storage_directory("123456789");
+        Persistence persistence(Persistence::get_instance_directory(storage_directory, "123456789"));
+        mixpanel::Value state = persistence.read("state");
         state["opted_out"] = false;
-        mixpanel::detail::Persistence::write("state", state);
+        persistence.write("state", state);
     }
+
+    FakeServer server;
 };
 
 
 TEST_F(GDPR, optOutFlagAfterInitWithOptOut)
 {
     Mixpanel mp("123456789", false, true);
+    mp.set_api_host(server.api_host());
     ASSERT_TRUE(mp.has_opted_out());
 }
 
 TEST_F(GDPR, optOutFlagByDefault)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     ASSERT_FALSE(mp.has_opted_out());
 }
 
 TEST_F(GDPR, noTrackCallDuringOrAfterInitWithOptOut)
 {
     Mixpanel mp("123456789", false, true);
-    auto queue = Persistence::dequeue("track");
+    mp.set_api_host(server.api_host());
+    auto queue = testsuite_get_persistence(mp)->dequeue("track");
     ASSERT_EQ(queue.first.size(), 0);
 }
 
 TEST_F(GDPR, optOutFlagAfterInitWithOptIn)
 {
     Mixpanel mp("123456789", false, false);
+    mp.set_api_host(server.api_host());
     ASSERT_FALSE(mp.has_opted_out());
 }
 
 TEST_F(GDPR, outOutTracking)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     ASSERT_FALSE(mp.has_opted_out());
 
     mp.opt_out_tracking();
@@ -58,6 +73,7 @@ TEST_F(GDPR, outOutTracking)
 TEST_F(GDPR, optInTracking)
 {
     Mixpanel mp("123456789", false, true);
+    mp.set_api_host(server.api_host());
     ASSERT_TRUE(mp.has_opted_out());
     mp.opt_in_tracking("aDistinctId", mixpanel::Value());
     ASSERT_FALSE(mp.has_opted_out());
@@ -66,62 +82,72 @@ TEST_F(GDPR, optInTracking)
 TEST_F(GDPR, optInTrackingEvent)
 {
     Mixpanel mp("123456789", false, false);
+    mp.set_api_host(server.api_host());
     mp.opt_in_tracking("aDistinctId", mixpanel::Value());
 
-    auto queue = Persistence::dequeue("track");
+    auto queue = testsuite_get_persistence(mp)->dequeue("track");
     ASSERT_EQ(queue.first[0]["event"].asString(), "$opt_in");
 }
 
 TEST_F(GDPR, optInTrackingForDistinctId)
 {
     Mixpanel mp("123456789", false, false);
+    mp.set_api_host(server.api_host());
     mp.opt_in_tracking("aDistinctId", mixpanel::Value());
 
-    auto queue = Persistence::dequeue("track");
+    auto queue = testsuite_get_persistence(mp)->dequeue("track");
     ASSERT_EQ(queue.first[0]["properties"]["distinct_id"].asString(), "aDistinctId");
 }
 
 TEST_F(GDPR, optInTrackingForDistinctIdAndProperties)
 {
     Mixpanel mp("123456789", false, false);
+    mp.set_api_host(server.api_host());
     Value obj;
     obj["zee"] = "bar";
     mp.opt_in_tracking("aDistinctId", obj);
 
-    auto queue = Persistence::dequeue("track");
+    auto queue = testsuite_get_persistence(mp)->dequeue("track");
     ASSERT_EQ(queue.first[0]["properties"]["zee"].asString(), "bar");
 }
 
 TEST_F(GDPR, outOutTrackingWillNoLongerTrack)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.opt_out_tracking();
     ASSERT_TRUE(mp.has_opted_out());
 
     mp.track("test");
-    auto queue = Persistence::dequeue("track");
+    auto queue = testsuite_get_persistence(mp)->dequeue("track");
     ASSERT_EQ(queue.first.size(), 0);
 }
 
 TEST_F(GDPR, outOutTrackingWillNoLongerEngage)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.opt_out_tracking();
     ASSERT_TRUE(mp.has_opted_out());
 
     mp.people.set_first_name("Zee");
-    auto queue = Persistence::dequeue("engage");
-    ASSERT_EQ(queue.first.size(), 0);
+
+    // the queue only holds what opting out sends itself, the deletion of the user and its charges, until they are sent
+    auto queue = testsuite_get_persistence(mp)->dequeue("engage");
+    ASSERT_LE(queue.first.size(), 2u);
+    for (const auto& record : queue.first)
+        ASSERT_FALSE(record["$set"].isMember("$first_name"));
 }
 
 TEST_F(GDPR, outOutTrackingWillSkipIdentify)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.opt_out_tracking();
     ASSERT_TRUE(mp.has_opted_out());
 
     mp.identify("newDistinctId");
-    Value state = mixpanel::detail::Persistence::read("state");
+    Value state = testsuite_get_persistence(mp)->read("state");
 
     ASSERT_NE(state["distinct_id"], "newDistinctId");
 }
@@ -129,11 +155,12 @@ TEST_F(GDPR, outOutTrackingWillSkipIdentify)
 TEST_F(GDPR, outOutTrackingWillSkipAlias)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.opt_out_tracking();
     ASSERT_TRUE(mp.has_opted_out());
 
     mp.alias("testAlias");
-    Value state = mixpanel::detail::Persistence::read("state");
+    Value state = testsuite_get_persistence(mp)->read("state");
 
     ASSERT_NE(state["alias"], "testAlias");
 }
@@ -141,6 +168,7 @@ TEST_F(GDPR, outOutTrackingWillSkipAlias)
 TEST_F(GDPR, outOutTrackingRegisterSuperProperties)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.opt_out_tracking();
     ASSERT_TRUE(mp.has_opted_out());
 
@@ -148,13 +176,14 @@ TEST_F(GDPR, outOutTrackingRegisterSuperProperties)
     obj["testkey"] = "bar";
     mp.register_properties(obj);
 
-    Value superProperties = mixpanel::detail::Persistence::read("super_properties");
+    Value superProperties = testsuite_get_persistence(mp)->read("super_properties");
     ASSERT_NE(superProperties["testkey"], "bar");
 }
 
 TEST_F(GDPR, outOutTrackingRegisterSuperPropertiesOnce)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.opt_out_tracking();
     ASSERT_TRUE(mp.has_opted_out());
 
@@ -162,13 +191,14 @@ TEST_F(GDPR, outOutTrackingRegisterSuperPropertiesOnce)
     obj["testkey"] = "bar";
     mp.register_once_properties(obj);
 
-    Value superProperties = mixpanel::detail::Persistence::read("super_properties");
+    Value superProperties = testsuite_get_persistence(mp)->read("super_properties");
     ASSERT_NE(superProperties["testkey"], "bar");
 }
 
 TEST_F(GDPR, outOutTrackingWillSkipTimeEvent)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.set_flush_interval(1);
 
     mp.clear_timed_events();
@@ -180,27 +210,34 @@ TEST_F(GDPR, outOutTrackingWillSkipTimeEvent)
 TEST_F(GDPR, outOutTrackingWillClearTrackQueue)
 {
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
     mp.set_flush_interval(100);
 
     for(int i = 0; i != 5; ++i)
         mp.track("event");
 
-    auto size = mixpanel::detail::Persistence::get_queue_size("track");
-    ASSERT_EQ(mixpanel::detail::Persistence::get_queue_size("track"), size);
+    auto size = testsuite_get_persistence(mp)->get_queue_size("track");
+    ASSERT_EQ(testsuite_get_persistence(mp)->get_queue_size("track"), size);
 
     mp.opt_out_tracking();
-    ASSERT_EQ(mixpanel::detail::Persistence::get_queue_size("track"), 0);
+    ASSERT_EQ(testsuite_get_persistence(mp)->get_queue_size("track"), 0);
 }
 
 TEST_F(GDPR, outOutTrackingWillClearEngageQueue)
 {
     using namespace mixpanel;
     Mixpanel mp("123456789");
+    mp.set_api_host(server.api_host());
 
     for(int i = 0; i != 5; ++i)
         mp.people.set("$name", "Karl Heinz");
 
-    ASSERT_EQ(mixpanel::detail::Persistence::dequeue("engage").first.size(), 5);
+    ASSERT_EQ(testsuite_get_persistence(mp)->dequeue("engage").first.size(), 5);
     mp.opt_out_tracking();
-    ASSERT_EQ(mixpanel::detail::Persistence::dequeue("engage").first.size(), 0);
+
+    // the queue only holds what opting out sends itself, the deletion of the user and its charges, until they are sent
+    auto queue = testsuite_get_persistence(mp)->dequeue("engage");
+    ASSERT_LE(queue.first.size(), 2u);
+    for (const auto& record : queue.first)
+        ASSERT_FALSE(record["$set"].isMember("$name"));
 }
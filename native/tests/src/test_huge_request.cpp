@@ -1,19 +1,23 @@
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <mixpanel/mixpanel.hpp>
 #include <mixpanel/detail/persistence.hpp>
 #include <mixpanel/detail/workarounds.hpp>
 #include <thread>
 
+#include "fake_server.hpp"
 #include "test_config.hpp"
 
-void testsuite_wait_for_delivery(const std::string &queue_name, long for_seconds);
+void testsuite_wait_for_delivery(mixpanel::Mixpanel& mixpanel, const std::string &queue_name, long for_seconds);
 
 TEST(Mixpanel, HugeRequest)
 {
     using namespace mixpanel;
     using namespace mixpanel::detail;
 
+    FakeServer server;
     mixpanel::Mixpanel mp(mp_token);
+    mp.set_api_host(server.api_host());
     mp.set_flush_interval(1);
     mp.set_minimum_log_level(Mixpanel::LogEntry::LL_TRACE);
 
@@ -26,5 +30,9 @@ TEST(Mixpanel, HugeRequest)
     for(int i=0; i!=55; ++i)
        mp.track("foo", properties);
 
-    testsuite_wait_for_delivery("track", 60);
+    testsuite_wait_for_delivery(mp, "track", 60);
+    // the queue may still hold events of other tests
+    auto events = server.get_events("track");
+    auto delivered = std::count_if(events.begin(), events.end(), [](const Value& event) { return event["event"] == "foo" && event["properties"]["19"] == "361"; });
+    ASSERT_EQ(delivered, 55);
 }
@@ -0,0 +1,288 @@
+#ifndef WIN32
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/base64.hpp>
+#include "test_config.hpp"
+
+using namespace mixpanel;
+
+namespace
+{
+    const int batch_size = 250;
+
+    // A stand-in for the /import endpoint on 127.0.0.1, speaking just enough HTTP/1.1 for the SDK. The first attempt of
+    // every other batch fails with 503, events with a "bad" property are reported as failed records, like the strict mode
+    // of the endpoint does.
+    class ImportServer
+    {
+        public:
+            explicit ImportServer(const std::string& api_secret)
+            : requests(0)
+            , max_in_flight(0)
+            , authorization("Basic " + detail::base64_encode(api_secret + ":"))
+            , in_flight(0)
+            , stopping(false)
+            {
+                listener = socket(AF_INET, SOCK_STREAM, 0);
+                sockaddr_in address = {};
+                address.sin_family = AF_INET;
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                socklen_t length = sizeof(address);
+                bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+                listen(listener, 64);
+                getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+                port = ntohs(address.sin_port);
+
+                accept_thread = std::thread([this] {
+                    int fd;
+                    while ((fd = accept(listener, nullptr, nullptr)) != -1 && !stopping)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        connections.push_back(fd);
+                        connection_threads.emplace_back(&ImportServer::serve, this, fd);
+                    }
+                    if (fd != -1) close(fd);
+                });
+            }
+
+            ~ImportServer()
+            {
+                stopping = true;
+                shutdown(listener, SHUT_RDWR);
+                close(listener);
+                accept_thread.join();
+
+                for (auto fd : connections) shutdown(fd, SHUT_RDWR);
+                for (auto& thread : connection_threads) thread.join();
+                for (auto fd : connections) close(fd);
+            }
+
+            std::string api_host() const { return "http://127.0.0.1:" + std::to_string(port) + "/"; }
+
+            std::map<std::string, int> get_imported()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return imported;
+            }
+
+            std::atomic<int> requests;
+            std::atomic<int> max_in_flight;
+        private:
+            void serve(int fd)
+            {
+                std::string buffer;
+                char chunk[64 * 1024];
+                for (;;)
+                {
+                    auto header_end = buffer.find("\r\n\r\n");
+                    if (header_end != std::string::npos)
+                    {
+                        auto header = buffer.substr(0, header_end);
+                        auto content_length_pos = header.find("Content-Length: ");
+                        std::size_t content_length = content_length_pos == std::string::npos ? 0 : std::strtoul(header.c_str() + content_length_pos + 16, nullptr, 10);
+                        if (buffer.size() >= header_end + 4 + content_length)
+                        {
+                            auto response = handle(header, buffer.substr(header_end + 4, content_length));
+                            buffer.erase(0, header_end + 4 + content_length);
+                            if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(response.size())) return;
+                            continue;
+                        }
+                    }
+
+                    auto size = recv(fd, chunk, sizeof(chunk), 0);
+                    if (size <= 0) return;
+                    buffer.append(chunk, size);
+                }
+            }
+
+            std::string handle(const std::string& header, const std::string& body)
+            {
+                ++requests;
+                auto now_in_flight = ++in_flight;
+                int expected = max_in_flight;
+                while (now_in_flight > expected && !max_in_flight.compare_exchange_weak(expected, now_in_flight)) {}
+
+                // gives the other connections a chance to overlap
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+                detail::Json::Reader reader;
+                Value events;
+                reader.parse(body, events, false);
+                auto first_insert_id = events[0]["properties"]["$insert_id"].asString();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                std::string status = "200 OK";
+                Value result;
+                if (header.find("POST /import?strict=1&project_id=42 ") != 0 || header.find("Authorization: " + authorization + "\r\n") == std::string::npos)
+                {
+                    status = "401 Unauthorized";
+                    result["error"] = "Invalid API secret";
+                }
+                else if (std::atoi(first_insert_id.c_str()) / batch_size % 2 == 0 && failed_once.insert(first_insert_id).second)
+                {
+                    status = "503 Service Unavailable";
+                    result["error"] = "try again";
+                }
+                else
+                {
+                    Value failed_records(detail::Json::arrayValue);
+                    int num_records_imported = 0;
+                    for (detail::Json::ArrayIndex i = 0; i != events.size(); ++i)
+                    {
+                        if (events[i]["properties"]["bad"].asBool())
+                        {
+                            Value record;
+                            record["index"] = i;
+                            record["field"] = "properties.bad";
+                            record["message"] = "bad event";
+                            failed_records.append(record);
+                        }
+                        else
+                        {
+                            ++imported[events[i]["properties"]["$insert_id"].asString()];
+                            ++num_records_imported;
+                        }
+                    }
+
+                    result["num_records_imported"] = num_records_imported;
+                    if (!failed_records.empty())
+                    {
+                        status = "400 Bad Request";
+                        result["failed_records"] = failed_records;
+                    }
+                }
+
+                --in_flight;
+
+                detail::Json::FastWriter writer;
+                auto content = writer.write(result);
+                return "HTTP/1.1 " + status + "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(content.size()) + "\r\n\r\n" + content;
+            }
+
+            const std::string authorization;
+            int listener;
+            int port;
+            std::atomic<int> in_flight;
+            std::atomic<bool> stopping;
+
+            std::mutex mutex;
+            std::map<std::string, int> imported;
+            std::set<std::string> failed_once;
+            std::vector<int> connections;
+            std::vector<std::thread> connection_threads;
+            std::thread accept_thread;
+    };
+}
+
+TEST(Mixpanel, Import)
+{
+    ImportServer server("secret");
+    Mixpanel mp(mp_token);
+
+    const int event_count = 10000;
+    {
+        std::ofstream file("mp_import_test.ndjson");
+        for (int i = 0; i != event_count; ++i)
+        {
+            file << "{\"event\":\"backfill\",\"properties\":{\"time\":" << 1500000000 + i << ",\"distinct_id\":\"user_" << i % 10
+                 << "\",\"$insert_id\":\"" << i << "\"" << (i % 100 == 7 ? ",\"bad\":true" : "") << "}}\r\n";
+            if (i % 1000 == 0) file << "\n";
+        }
+    }
+
+    Mixpanel::ImportOptions options;
+    options.api_secret = "secret";
+    options.project_id = "42";
+    options.api_host = server.api_host();
+    options.max_batch_events = batch_size;
+    options.connections = 4;
+    options.first_retry_delay_ms = 10;
+
+    std::atomic<int> failed_events(0);
+    options.on_failed_event = [&failed_events](const std::string& event, const std::string& error) {
+        ++failed_events;
+        ASSERT_NE(event.find("\"bad\":true"), std::string::npos);
+        ASSERT_EQ(error, "properties.bad: bad event");
+    };
+    int progress_reports = 0;
+    options.on_progress = [&progress_reports](const Mixpanel::ImportStats&) { ++progress_reports; };
+
+    auto stats = mp.import_file("mp_import_test.ndjson", options);
+    std::remove("mp_import_test.ndjson");
+
+    ASSERT_EQ(stats.error, "");
+    ASSERT_TRUE(stats.source_exhausted);
+    ASSERT_EQ(stats.imported, event_count - event_count / 100);
+    ASSERT_EQ(stats.rejected, event_count / 100);
+    ASSERT_EQ(stats.failed, 0);
+    ASSERT_EQ(failed_events, event_count / 100);
+    ASSERT_GE(progress_reports, 1);
+    ASSERT_GT(stats.events_per_second(), 0);
+
+    // only the requests that failed have been repeated
+    ASSERT_EQ(stats.requests, server.requests);
+    ASSERT_EQ(stats.retries, event_count / batch_size / 2);
+    ASSERT_EQ(stats.requests, event_count / batch_size + stats.retries);
+    ASSERT_GT(server.max_in_flight, 1);
+
+    auto imported = server.get_imported();
+    ASSERT_EQ(imported.size(), event_count - event_count / 100);
+    for (const auto& insert_id : imported)
+    {
+        ASSERT_EQ(insert_id.second, 1) << insert_id.first;
+    }
+}
+
+TEST(Mixpanel, ImportUnauthorized)
+{
+    ImportServer server("secret");
+    Mixpanel mp(mp_token);
+
+    Mixpanel::ImportOptions options;
+    options.api_secret = "wrong";
+    options.project_id = "42";
+    options.api_host = server.api_host();
+    options.max_batch_events = 10;
+    options.connections = 2;
+
+    std::atomic<int> reported(0);
+    options.on_failed_event = [&reported](const std::string&, const std::string&) { ++reported; };
+
+    int produced = 0;
+    auto stats = mp.import_events([&produced](std::string& event) {
+        event = "{\"event\":\"backfill\",\"properties\":{\"time\":1500000000,\"$insert_id\":\"" + std::to_string(produced) + "\"}}";
+        return ++produced <= 100000;
+    }, options);
+
+    // the import stops at the first batch that comes back unauthorized. Every event read from the source is reported.
+    ASSERT_NE(stats.error.find("401"), std::string::npos);
+    ASSERT_EQ(stats.imported, 0);
+    ASSERT_LT(produced, 1000);
+    ASSERT_EQ(stats.retries, 0);
+    ASSERT_FALSE(stats.source_exhausted);
+    ASSERT_EQ(stats.failed, std::uint64_t(produced));
+    ASSERT_EQ(reported, produced);
+
+    stats = mp.import_file("does_not_exist.ndjson", options);
+    ASSERT_EQ(stats.error, "can't open does_not_exist.ndjson");
+}
+
+#endif
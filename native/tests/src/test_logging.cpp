@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/logging.hpp>
+#include "test_config.hpp"
+
+using namespace mixpanel;
+
+//
+// A full ring drops the entries and says so, before the entries it kept.
+//
+TEST(Logging, RingOverflow)
+{
+    detail::LogRing ring(4);
+    ASSERT_TRUE(ring.empty());
+    for (int i = 0; i != 6; ++i)
+    {
+        ASSERT_EQ(ring.push(Mixpanel::LogEntry::LL_INFO, std::to_string(i)), i < 4);
+    }
+    ASSERT_FALSE(ring.empty());
+
+    Mixpanel::LogEntry entry;
+    ASSERT_TRUE(ring.pop(entry));
+    ASSERT_EQ(entry.level, Mixpanel::LogEntry::LL_WARNING);
+    ASSERT_EQ(entry.message, "log queue overflow, 2 entries were dropped");
+    for (int i = 0; i != 4; ++i)
+    {
+        ASSERT_TRUE(ring.pop(entry));
+        ASSERT_EQ(entry.level, Mixpanel::LogEntry::LL_INFO);
+        ASSERT_EQ(entry.message, std::to_string(i));
+    }
+    ASSERT_FALSE(ring.pop(entry));
+    ASSERT_TRUE(ring.empty());
+
+    // the slots are used again on the next lap
+    ASSERT_TRUE(ring.push(Mixpanel::LogEntry::LL_ERROR, "again"));
+    ASSERT_TRUE(ring.pop(entry));
+    ASSERT_EQ(entry.message, "again");
+    ASSERT_EQ(detail::format_log_entry(entry), "Mixpanel[ERROR]: again");
+}
+
+//
+// The entries of each thread come out in the order it pushed them.
+//
+TEST(Logging, RingConcurrency)
+{
+    const int threads = 4;
+    const int entries = 10000;
+    detail::LogRing ring(64);
+
+    std::vector<std::thread> producers;
+    for (int t = 0; t != threads; ++t)
+    {
+        producers.emplace_back([&ring, t]() {
+            for (int i = 0; i != entries; ++i)
+            {
+                while (!ring.push(Mixpanel::LogEntry::LL_INFO, std::to_string(t) + " " + std::to_string(i)))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<int> next(threads, 0);
+    int received = 0;
+    Mixpanel::LogEntry entry;
+    while (received != threads * entries)
+    {
+        if (!ring.pop(entry))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        // the overflow warnings don't count
+        if (entry.level == Mixpanel::LogEntry::LL_WARNING) continue;
+
+        auto space = entry.message.find(' ');
+        auto t = std::stoi(entry.message.substr(0, space));
+        ASSERT_EQ(std::stoi(entry.message.substr(space + 1)), next[t]++);
+        ++received;
+    }
+    for (auto& producer : producers)
+    {
+        producer.join();
+    }
+    ASSERT_FALSE(ring.pop(entry) && entry.level != Mixpanel::LogEntry::LL_WARNING);
+}
+
+//
+// With the log queue enabled, the entries at or above the minimum level are queued for get_next_log_entry().
+//
+TEST(Logging, Queue)
+{
+    Mixpanel mp(mp_token, true);
+    mp.identify("logging test");
+    Mixpanel::LogEntry entry;
+    while (mp.get_next_log_entry(entry));
+
+    mp.set_minimum_log_level(Mixpanel::LogEntry::LL_WARNING);
+    mp.alias("logging test");
+    ASSERT_TRUE(mp.get_next_log_entry(entry));
+    ASSERT_EQ(entry.level, Mixpanel::LogEntry::LL_WARNING);
+    ASSERT_EQ(entry.message, "alias matches current distinct_id - skipping api call.");
+    ASSERT_FALSE(mp.get_next_log_entry(entry));
+
+    mp.set_minimum_log_level(Mixpanel::LogEntry::LL_ERROR);
+    mp.alias("logging test");
+    ASSERT_FALSE(mp.get_next_log_entry(entry));
+}
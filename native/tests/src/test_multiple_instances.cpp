@@ -1,6 +1,10 @@
 #include <mixpanel/mixpanel.hpp>
 #include <gtest/gtest.h>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mixpanel/detail/persistence.hpp>
 #include <mixpanel/detail/workarounds.hpp>
 #include "test_config.hpp"
 
@@ -19,8 +23,8 @@ TEST(Mixpanel, MultipleInstances)
     {
         std::shared_ptr<mixpanel::Mixpanel> instance1, instance2, instance3;
         ASSERT_NO_THROW(instance1 = std::make_shared<Mixpanel>("123456789"));
-        ASSERT_THROW(instance2 = std::make_shared<Mixpanel>("123456789"), std::logic_error);
-        ASSERT_THROW(instance3 = std::make_shared<Mixpanel>("123456789"), std::logic_error);
+        ASSERT_NO_THROW(instance2 = std::make_shared<Mixpanel>("987654321"));
+        ASSERT_NO_THROW(instance3 = std::make_shared<Mixpanel>("192837465"));
     }
 
     ASSERT_THROW(Mixpanel(""), std::invalid_argument);
@@ -29,3 +33,59 @@ TEST(Mixpanel, MultipleInstances)
         ASSERT_NO_THROW(Mixpanel("123456789"));
     }
 }
+
+TEST(Mixpanel, ConcurrentInstances)
+{
+    using namespace mixpanel;
+
+    const int instance_count = 4;
+    const int events_per_instance = 100;
+
+    // half of the instances share one sender thread, the others get their own
+    SenderPool sender_pool;
+    std::vector<std::unique_ptr<Mixpanel>> instances;
+    for (int i = 0; i != instance_count; ++i)
+    {
+        auto token = "concurrent_" + std::to_string(i);
+        std::string distinct_id = "user_" + std::to_string(i);
+        if (i % 2)
+            instances.emplace_back(new Mixpanel(token, distinct_id, ".", sender_pool));
+        else
+            instances.emplace_back(new Mixpanel(token, distinct_id, "."));
+
+        instances.back()->on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+        testsuite_get_persistence(*instances.back())->drop_front("track", 1000000);
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i != instance_count; ++i)
+    {
+        threads.emplace_back([&instances, i, events_per_instance]() {
+            for (int j = 0; j != events_per_instance; ++j)
+            {
+                Value properties;
+                properties["instance"] = i;
+                instances[i]->track("event", properties);
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    // every instance has its own queue, in its own subdirectory
+    for (int i = 0; i != instance_count; ++i)
+    {
+        auto persistence = testsuite_get_persistence(*instances[i]);
+        ASSERT_EQ(persistence->storage_directory, "./mp_concurrent_" + std::to_string(i));
+
+        auto queue = persistence->dequeue("track", 1000);
+        ASSERT_EQ(queue.first.size(), events_per_instance);
+        for (const auto& event : queue.first)
+        {
+            ASSERT_EQ(event["properties"]["instance"].asInt(), i);
+            ASSERT_EQ(event["properties"]["token"].asString(), "concurrent_" + std::to_string(i));
+        }
+        persistence->drop_front("track", 1000000);
+    }
+}
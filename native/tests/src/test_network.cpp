@@ -1,26 +1,80 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
 #include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/bandwidth_budget.hpp>
+#include <mixpanel/detail/endpoint_health.hpp>
+#include <mixpanel/detail/loopback_transport.hpp>
+#include <mixpanel/detail/persistence.hpp>
+#include <mixpanel/detail/simulation.hpp>
 #include <mixpanel/detail/worker.hpp>
-#include "../../source/dependencies/nano/include/nanowww/nanowww.h"
+#include <mixpanel/detail/timer_wheel.hpp>
+#include "fake_server.hpp"
 #include "test_config.hpp"
 
 using namespace mixpanel;
 
+namespace
+{
+    using Request = detail::Simulation::Request;
+    using Response = detail::Simulation::Response;
+
+    // sends what earlier tests left in the queues, returns the number of requests that took
+    std::size_t drain(Mixpanel& mp, detail::Simulation& simulation)
+    {
+        mp.flush_async(1000);
+        simulation.run_for(std::chrono::seconds(1));
+        return simulation.get_requests().size();
+    }
+
+    std::size_t delivered_events(const std::vector<Request>& requests, std::size_t start, const std::string& endpoint)
+    {
+        std::size_t count = 0;
+        for (auto request = requests.begin() + start; request != requests.end(); ++request)
+        {
+            count += (request->endpoint == endpoint && request->status == 200) ? request->batch.size() : 0;
+        }
+        return count;
+    }
+}
+
 //
 // Ensure "Retry-After" HTTP header is respected
 //
 TEST(MixpanelNetwork, RetryAfter)
 {
     Mixpanel mp(mp_token);
-    auto worker = Mixpanel::worker;
+    detail::Simulation simulation(mp);
+    auto start = drain(mp, simulation);
 
-    nanowww::Response retry_after_response;
-    retry_after_response.push_header("Retry-After", "51");
+    std::atomic<int> track_requests(0);
+    simulation.set_server([&track_requests](const Request& request) {
+        return (request.endpoint == "track" && track_requests++ == 0) ? Response(429, 51) : Response();
+    });
+    mp.track("retry after");
+    mp.flush_async(1000);
+    simulation.run_for(std::chrono::seconds(50));
 
-    auto retry_after_time = worker->parse_www_retry_after(retry_after_response);
-    auto back_off_duration = retry_after_time - time(0);
-    ASSERT_EQ(back_off_duration, 51);
-    ASSERT_EQ(worker->failure_count, 0);
+    auto requests = simulation.get_requests();
+    ASSERT_EQ(requests.size(), start + 1);
+    ASSERT_EQ(requests[start].status, 429);
+    auto stats = mp.get_endpoint_stats("track");
+    ASSERT_EQ(stats.state, Mixpanel::EndpointStats::State::Open);
+    ASSERT_EQ(stats.consecutive_failures, 0u);
+    ASSERT_EQ(stats.blocked_until, simulation.get_clock().time() + 1);
+
+    // sent again when the time is up, not before
+    simulation.run_for(std::chrono::seconds(2));
+    requests = simulation.get_requests();
+    ASSERT_EQ(requests.size(), start + 2);
+    ASSERT_EQ(requests[start + 1].time - requests[start].time, std::chrono::seconds(51));
+    ASSERT_EQ(requests[start + 1].status, 200);
 }
 
 //
@@ -30,57 +84,667 @@ TEST(MixpanelNetwork, RetryAfter)
 TEST(MixpanelNetwork, BackOffTime)
 {
     Mixpanel mp(mp_token);
-    auto worker = Mixpanel::worker;
+    mp.set_flush_interval(60);
+    detail::Simulation simulation(mp, 42);
+    auto start = drain(mp, simulation);
 
-    nanowww::Response failure_response;
-    failure_response.set_status(503);
+    simulation.set_server([](const Request& request) { return Response(request.endpoint == "track" ? 503 : 200); });
+    mp.track("backing off");
+    mp.flush_async(1000);
+    simulation.run_for(std::chrono::minutes(10));
 
-    // We need 2 consecutive failures to enable exponential back off
-    worker->parse_www_retry_after(failure_response);
-    ASSERT_EQ(worker->failure_count, 1);
-    auto retry_after_time = worker->parse_www_retry_after(failure_response);
-    ASSERT_EQ(worker->failure_count, 2);
+    // The first failure doesn't back off, the next flush probes the endpoint. From the second failure on, it backs off
+    // for 120 s, 240 s, ... plus up to 29 s of jitter, which comes from the seed of the simulation.
+    std::minstd_rand jitter(42);
+    auto requests = simulation.get_requests();
+    ASSERT_EQ(requests.size(), start + 4);
+    ASSERT_EQ(requests[start + 1].time - requests[start].time, std::chrono::seconds(60));
+    ASSERT_EQ(requests[start + 2].time - requests[start + 1].time, std::chrono::seconds(120 + jitter() % 30));
+    ASSERT_EQ(requests[start + 3].time - requests[start + 2].time, std::chrono::seconds(240 + jitter() % 30));
+    ASSERT_EQ(mp.get_endpoint_stats("track").consecutive_failures, 4u);
+}
 
-    auto back_off_duration = retry_after_time - time(0);
-    // Should back off randomly between 120 - 150s
-    ASSERT_GT(back_off_duration, 115);
-    ASSERT_LE(back_off_duration, 150);
+//
+// A single success after a number of failures should reset the back off time.
+//
+TEST(MixpanelNetwork, FailureRecovery)
+{
+    Mixpanel mp(mp_token);
+    mp.set_flush_interval(60);
+    detail::Simulation simulation(mp);
+    auto start = drain(mp, simulation);
 
-    // Test a third failure
-    retry_after_time = worker->parse_www_retry_after(failure_response);
-    ASSERT_EQ(worker->failure_count, 3);
-    back_off_duration = retry_after_time - time(0);
+    std::atomic<int> track_requests(0);
+    simulation.set_server([&track_requests](const Request& request) {
+        return Response((request.endpoint == "track" && track_requests++ < 2) ? 503 : 200);
+    });
+    for (int i = 0; i != 120; ++i)
+    {
+        mp.track("recovering");
+    }
+    mp.flush_async(1000);
+    simulation.run_for(std::chrono::minutes(5));
 
-    // Should back off randomly between 240 - 270s
-    ASSERT_GT(back_off_duration, 235);
-    ASSERT_LE(back_off_duration, 270);
+    // the probe after the back off succeeds, and the backlog is sent right after it
+    auto requests = simulation.get_requests();
+    ASSERT_GT(requests.size(), start + 3);
+    ASSERT_EQ(requests[start + 2].batch.size(), detail::EndpointHealth::probe_batch_size);
+    ASSERT_EQ(requests[start + 2].status, 200);
+    ASSERT_EQ(requests.back().time, requests[start + 2].time);
+    ASSERT_EQ(delivered_events(requests, start, "track"), 120u);
+
+    auto stats = mp.get_endpoint_stats("track");
+    ASSERT_EQ(stats.state, Mixpanel::EndpointStats::State::Closed);
+    ASSERT_EQ(stats.consecutive_failures, 0u);
+    ASSERT_EQ(stats.blocked_until, 0);
 }
 
 //
-// A single success after a number of failures should reset the back off time.
+// Six hours of an event a minute, with the network gone for an hour in the middle, in virtual time: nothing is sent
+// during the outage, the backlog goes out as soon as the network is back, and every event is delivered once.
 //
-TEST(MixpanelNetwork, FailureRecovery)
+TEST(MixpanelNetwork, Simulation)
+{
+    Mixpanel mp(mp_token);
+    mp.set_flush_interval(60);
+    detail::Simulation simulation(mp);
+    auto start = drain(mp, simulation);
+
+    const auto outage_start = simulation.now() + std::chrono::hours(3);
+    const auto outage_end = outage_start + std::chrono::hours(1);
+    for (int minute = 0; minute != 6 * 60; ++minute)
+    {
+        if (simulation.now() == outage_start)
+        {
+            mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+        }
+        if (simulation.now() == outage_end)
+        {
+            mp.on_reachability_changed(Mixpanel::NetworkReachability::ReachableViaLocalAreaNetwork);
+        }
+        Value properties;
+        properties["minute"] = minute;
+        mp.track("minute", properties);
+        simulation.run_for(std::chrono::minutes(1));
+    }
+    simulation.run_for(std::chrono::minutes(1));
+
+    auto requests = simulation.get_requests();
+    bool sent_at_reconnect = false;
+    for (auto request = requests.begin() + start; request != requests.end(); ++request)
+    {
+        ASSERT_FALSE(request->time > outage_start && request->time < outage_end);
+        sent_at_reconnect = sent_at_reconnect || request->time == outage_end;
+    }
+    ASSERT_TRUE(sent_at_reconnect);
+    ASSERT_EQ(delivered_events(requests, start, "track"), 6u * 60u);
+}
+
+//
+// The queues can be sent with a transport of the app's own, here one that answers in the process, to any API host.
+//
+TEST(MixpanelNetwork, Transport)
+{
+    std::mutex mutex;
+    std::set<std::string> urls;
+    std::vector<std::string> events;
+    auto transport = std::make_shared<detail::LoopbackTransport>([&](const Transport::Request& request, const detail::LoopbackTransport::Batch& batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        urls.insert(request.url.substr(0, request.url.find('?')));
+        for (const auto& record : batch.records)
+        {
+            events.push_back(record["event"].asString());
+        }
+        return detail::LoopbackTransport::accepted();
+    });
+
+    Mixpanel mp(mp_token);
+    mp.set_api_host("http://127.0.0.1:8080/relay");
+    mp.set_transport(transport);
+    for (int i = 0; i != 10; ++i)
+    {
+        mp.track("loopback");
+    }
+    mp.people.set("$name", "Tina Tester");
+    ASSERT_TRUE(mp.flush_async(5000).get());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(urls, std::set<std::string>({"http://127.0.0.1:8080/relay/track/", "http://127.0.0.1:8080/relay/engage/"}));
+    ASSERT_EQ(std::count(events.begin(), events.end(), "loopback"), 10);
+    ASSERT_GE(transport->get_record_count(), 11u);
+}
+
+//
+// A 400 whose body isn't an answer of the API, e.g. the error page of a proxy, says nothing about the data. The batch is
+// tried again later instead of being split up and sent to the dead letters.
+//
+TEST(MixpanelNetwork, ProxyErrorPage)
+{
+    Mixpanel mp(mp_token);
+    detail::Simulation simulation(mp);
+    drain(mp, simulation);
+    mp.clear_dead_letters("track");
+
+    std::atomic<int> error_pages(2);
+    std::atomic<unsigned> delivered(0);
+    mp.set_transport(std::make_shared<detail::LoopbackTransport>([&](const Transport::Request&, const detail::LoopbackTransport::Batch& batch) {
+        if (error_pages-- > 0)
+        {
+            Transport::Response response;
+            response.status = 400;
+            response.body = "<html><body><h1>400 Bad Request</h1></body></html>";
+            return response;
+        }
+        delivered += batch.records.size();
+        return detail::LoopbackTransport::accepted();
+    }));
+
+    for (int i = 0; i != 3; ++i)
+    {
+        mp.track("behind a proxy");
+    }
+    mp.flush_async(1000);
+    simulation.run_for(std::chrono::minutes(10));
+
+    ASSERT_EQ(delivered, 3u);
+    ASSERT_EQ(mp.get_dead_letters("track"), "");
+}
+
+//
+// An endpoint that fails opens its circuit and backs off on its own, the other endpoint keeps going. Once the back off
+// has passed, the circuit is half open until a request succeeds.
+//
+TEST(MixpanelNetwork, CircuitBreaker)
+{
+    using State = Mixpanel::EndpointStats::State;
+    const std::time_t t = 1000000;
+
+    detail::EndpointHealth health;
+    ASSERT_EQ(health.get_state(t), State::Closed);
+
+    // a single error only degrades the endpoint, the next request probes it
+    ASSERT_EQ(health.on_response(503, 0, t), t);
+    ASSERT_EQ(health.get_state(t), State::HalfOpen);
+    health.on_probe();
+
+    // from the second one on, it backs off
+    auto blocked_until = health.on_response(503, 0, t + 10);
+    ASSERT_GE(blocked_until, t + 10 + 120);
+    ASSERT_LE(blocked_until, t + 10 + 150);
+    ASSERT_EQ(health.get_state(t + 100), State::Open);
+    ASSERT_EQ(health.get_state(blocked_until), State::HalfOpen);
+    auto stats = health.get_stats(t + 100);
+    ASSERT_EQ(stats.state, State::Open);
+    ASSERT_EQ(stats.consecutive_failures, 2u);
+    ASSERT_EQ(stats.opened, 1u);
+    ASSERT_EQ(stats.probes, 1u);
+    ASSERT_EQ(stats.blocked_until, blocked_until);
+
+    // a successful probe closes the circuit
+    health.on_response(200, 0, blocked_until);
+    ASSERT_EQ(health.get_state(blocked_until), State::Closed);
+    ASSERT_EQ(health.get_stats(blocked_until).blocked_until, 0);
+
+    // Retry-After holds back the requests without counting as an error
+    health.on_response(429, 30, t + 1000);
+    ASSERT_EQ(health.get_state(t + 1029), State::Open);
+    ASSERT_EQ(health.get_state(t + 1030), State::Closed);
+    ASSERT_EQ(health.get_failure_count(), 0);
+
+    // a failing /engage doesn't hold back /track
+    Mixpanel mp(mp_token);
+    auto worker = mp.worker;
+    mp.clear_send_queues();
+    Transport::Response failure_response;
+    failure_response.status = 503;
+    worker->parse_www_retry_after("engage", failure_response);
+    worker->parse_www_retry_after("engage", failure_response);
+    ASSERT_EQ(mp.get_endpoint_stats("engage").state, State::Open);
+    ASSERT_EQ(mp.get_endpoint_stats("track").state, State::Closed);
+
+    // the open endpoint gets no request at all
+    mp.people.set("$name", "Tina Tester");
+    auto result = worker->send_batch("engage", true);
+    ASSERT_TRUE(result.held_back);
+    ASSERT_FALSE(result.more);
+    ASSERT_NE(testsuite_get_persistence(mp)->get_queue_count("engage"), 0u);
+    mp.clear_send_queues();
+}
+
+//
+// High priority events go into a lane of their own, which arms a short flush timer and shares the endpoint of /track.
+//
+TEST(MixpanelNetwork, PriorityLanes)
+{
+    Mixpanel mp(mp_token);
+    auto worker = mp.worker;
+    auto persistence = testsuite_get_persistence(mp);
+    mp.clear_send_queues();
+    mp.set_high_priority_flush_delay(60000);
+
+    mp.track("browse");
+    ASSERT_FALSE(worker->high_priority_pending);
+
+    mp.set_event_priority("purchase", Mixpanel::EventPriority::High);
+    mp.track("purchase");
+    mp.track("signup", Value(), Mixpanel::EventPriority::High);
+    ASSERT_EQ(persistence->get_queue_count("track_high"), 2u);
+    ASSERT_EQ(persistence->get_queue_count("track"), 1u);
+    ASSERT_TRUE(worker->high_priority_pending);
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        ASSERT_TRUE(worker->timers.is_scheduled(detail::Worker::HighPriorityTimer));
+    }
+
+    // the lane backs off together with /track
+    ASSERT_EQ(&worker->get_health("track_high"), &worker->get_health("track"));
+    ASSERT_EQ(detail::Worker::get_endpoint("track_high"), "track");
+
+    mp.clear_send_queues();
+    ASSERT_EQ(persistence->get_queue_count("track_high"), 0u);
+}
+
+//
+// On carrier data networks the bulk queues wait for full batches, and nothing is sent once the daily budget is used up.
+//
+TEST(MixpanelNetwork, CellularBudget)
+{
+    using Reachability = Mixpanel::NetworkReachability;
+    const std::time_t t = std::time_t(20000) * 86400;
+
+    detail::BandwidthBudget budget;
+    budget.set_daily_budget(1000);
+    ASSERT_FALSE(budget.on_sent(Reachability::ReachableViaLocalAreaNetwork, 5000, t));
+    ASSERT_FALSE(budget.on_sent(Reachability::ReachableViaCarrierDataNetwork, 600, t));
+    ASSERT_TRUE(budget.allows(t));
+    ASSERT_TRUE(budget.on_sent(Reachability::ReachableViaCarrierDataNetwork, 500, t + 10));
+    ASSERT_FALSE(budget.allows(t + 20));
+    auto usage = budget.get_usage(t + 20);
+    ASSERT_EQ(usage.local_area_network_bytes, 5000u);
+    ASSERT_EQ(usage.cellular_bytes, 1100u);
+    ASSERT_EQ(usage.cellular_bytes_today, 1100u);
+
+    // the next day starts over
+    ASSERT_TRUE(budget.allows(t + 86400));
+    ASSERT_EQ(budget.get_usage(t + 86400).cellular_bytes_today, 0u);
+    ASSERT_EQ(budget.get_usage(t + 86400).cellular_bytes, 1100u);
+
+    // sending is off, so the flushes below don't touch the network
+    Mixpanel mp(mp_token);
+    auto worker = mp.worker;
+    mp.clear_send_queues();
+    mp.set_flush_interval(0);
+    mp.track("browse");
+    mp.track("purchase", Value(), Mixpanel::EventPriority::High);
+    ASSERT_FALSE(worker->defer_on_cellular("track"));
+
+    // a small bulk queue goes on every fourth flush, high priority events right away
+    mp.on_reachability_changed(Reachability::ReachableViaCarrierDataNetwork);
+    for (unsigned i = 1; i != detail::FlushController::cellular_factor; ++i)
+    {
+        ASSERT_TRUE(worker->defer_on_cellular("track"));
+    }
+    ASSERT_FALSE(worker->defer_on_cellular("track"));
+    ASSERT_FALSE(worker->defer_on_cellular("track_high"));
+
+    // once the budget is used up, nothing goes until the device is on WiFi
+    mp.set_cellular_daily_budget(100);
+    worker->bandwidth_budget.on_sent(Reachability::ReachableViaCarrierDataNetwork, 100, time(0));
+    ASSERT_TRUE(worker->defer_on_cellular("track_high"));
+    ASSERT_EQ(mp.get_network_usage().cellular_daily_budget, 100u);
+
+    mp.on_reachability_changed(Reachability::ReachableViaLocalAreaNetwork);
+    ASSERT_FALSE(worker->defer_on_cellular("track_high"));
+    mp.clear_send_queues();
+}
+
+#ifndef WIN32
+//
+// Against the fake server: a reset connection and a server error are tried again, the events the server refuses one by
+// one go to the dead letter file and the others are delivered once.
+//
+TEST(MixpanelNetwork, FakeServer)
+{
+    FakeServer server;
+    Mixpanel mp(mp_token);
+    mp.clear_send_queues();
+    mp.clear_dead_letters("track");
+    mp.set_api_host(server.api_host());
+    mp.set_flush_interval(1);
+
+    FakeServer::Faults reset;
+    reset.reset = true;
+    server.add_faults(reset);
+    FakeServer::Faults unavailable;
+    unavailable.status = 503;
+    server.add_faults(unavailable);
+    server.reject_events([](const Value& event) { return event["event"] == "poison"; });
+
+    for (int i = 0; i != 20; ++i)
+    {
+        Value properties;
+        properties["i"] = i;
+        mp.track(i == 7 ? "poison" : "event", properties);
+    }
+    ASSERT_TRUE(mp.flush_async(10000).get());
+
+    auto events = server.get_events("track");
+    ASSERT_EQ(events.size(), 19u);
+    std::set<int> delivered;
+    for (const auto& event : events)
+    {
+        delivered.insert(event["properties"]["i"].asInt());
+    }
+    ASSERT_EQ(delivered.size(), 19u);
+    ASSERT_EQ(delivered.count(7), 0u);
+    ASSERT_GE(server.requests, 4);
+    ASSERT_NE(mp.get_dead_letters("track").find("poison"), std::string::npos);
+    mp.clear_dead_letters("track");
+
+    // the latency of the server doesn't get in the way of the other endpoint
+    FakeServer::Faults slow;
+    slow.latency = std::chrono::milliseconds(200);
+    slow.bytes_per_second = 100000;
+    server.set_faults(slow);
+    mp.track("event");
+    mp.people.set("$name", "Tina Tester");
+    ASSERT_TRUE(mp.flush_async(5000).get());
+    ASSERT_TRUE(server.wait_for_events("engage", 1, std::chrono::milliseconds(0)));
+    ASSERT_EQ(server.get_events("engage")[0]["$set"]["$name"], "Tina Tester");
+}
+#endif
+
+//
+// The number of requests in flight grows while the requests succeed and the round trip time stays flat,
+// and shrinks on errors and rising round trip times.
+//
+TEST(MixpanelNetwork, ConcurrencyLimit)
+{
+    using detail::ConcurrencyLimit;
+    const auto rtt = std::chrono::milliseconds(100);
+
+    ConcurrencyLimit limit(4);
+    ASSERT_EQ(limit.get(), 1);
+
+    for (unsigned expected = 2; expected != 5; ++expected)
+    {
+        limit.update(limit.get(), 0, rtt);
+        ASSERT_EQ(limit.get(), expected);
+    }
+    limit.update(4, 0, rtt);
+    ASSERT_EQ(limit.get(), 4);
+
+    // a round that did not use the whole limit says nothing about a larger one
+    limit.set_maximum(8);
+    limit.update(2, 0, rtt);
+    ASSERT_EQ(limit.get(), 4);
+
+    // errors halve the limit
+    limit.update(4, 1, rtt);
+    ASSERT_EQ(limit.get(), 2);
+
+    // requests that queue up somewhere shrink it by one
+    limit.update(2, 0, 3 * rtt);
+    ASSERT_EQ(limit.get(), 1);
+    limit.update(1, 1, rtt);
+    ASSERT_EQ(limit.get(), 1);
+
+    limit.update(1, 0, rtt);
+    limit.update(2, 0, rtt);
+    ASSERT_EQ(limit.get(), 3);
+    limit.set_maximum(2);
+    ASSERT_EQ(limit.get(), 2);
+    limit.set_maximum(0);
+    ASSERT_EQ(limit.get(), 1);
+}
+
+//
+// The requests in flight are sent on the request threads of the sender thread, which are kept from one round to the
+// next: no more threads answer than the limit of requests in flight allows.
+//
+TEST(MixpanelNetwork, RequestThreads)
 {
     Mixpanel mp(mp_token);
-    auto worker = Mixpanel::worker;
+    mp.set_flush_interval(60);
+    mp.set_max_requests_in_flight(3);
+    detail::Simulation simulation(mp);
+    auto start = drain(mp, simulation);
+
+    // thread ids are reused, the thread local storage of a new thread is not
+    std::atomic<unsigned> threads(0);
+    simulation.set_server([&threads](const Request&) {
+        static thread_local bool seen = false;
+        if (!seen)
+        {
+            seen = true;
+            ++threads;
+        }
+        return Response(200);
+    });
+    for (int round = 0; round != 10; ++round)
+    {
+        for (int i = 0; i != 400; ++i)
+        {
+            mp.track("event");
+            mp.people.set("$name", "Tina Tester");
+        }
+        mp.flush_async(1000);
+        simulation.run_for(std::chrono::seconds(1));
+    }
+
+    auto requests = simulation.get_requests();
+    ASSERT_EQ(delivered_events(requests, start, "track"), 4000u);
+    ASSERT_EQ(delivered_events(requests, start, "engage"), 4000u);
+    // the thread of the simulation, and the request threads of the default limit (4) it started with
+    ASSERT_LE(threads.load(), 1u + (2 * 4 - 1));
+}
+
+//
+// Timers fire at their deadline, not before, and next_deadline() is exact even for timers that are many rounds away.
+//
+TEST(MixpanelNetwork, TimerWheel)
+{
+    using detail::TimerWheel;
+    TimerWheel timers(std::chrono::milliseconds(10), 8);
+    const auto start = std::chrono::steady_clock::now();
+    const auto ms = [start](int n) { return start + std::chrono::milliseconds(n); };
+
+    ASSERT_EQ(timers.next_deadline(), TimerWheel::time_point::max());
+
+    timers.schedule(1, ms(35));
+    timers.schedule(2, ms(15));
+    timers.schedule(3, ms(1000));
+    ASSERT_EQ(timers.next_deadline(), ms(15));
+
+    // scheduling a timer again moves it
+    timers.schedule(2, ms(25));
+    ASSERT_EQ(timers.next_deadline(), ms(25));
+
+    std::vector<unsigned> fired;
+    auto fire = [&fired](unsigned timer) { fired.push_back(timer); };
+    timers.advance(ms(24), fire);
+    ASSERT_TRUE(fired.empty());
+
+    timers.advance(ms(40), fire);
+    ASSERT_EQ(fired, std::vector<unsigned>({2, 1}));
+    ASSERT_FALSE(timers.is_scheduled(1));
+    ASSERT_TRUE(timers.is_scheduled(3));
+    ASSERT_EQ(timers.next_deadline(), ms(1000));
+
+    // a timer far beyond one round of the wheel doesn't fire on the way
+    fired.clear();
+    timers.advance(ms(999), fire);
+    ASSERT_TRUE(fired.empty());
+    timers.cancel(3);
+    timers.schedule(4, ms(990));
+    timers.advance(ms(5000), fire);
+    ASSERT_EQ(fired, std::vector<unsigned>({4}));
+    ASSERT_EQ(timers.next_deadline(), TimerWheel::time_point::max());
+}
+
+//
+// An idle worker has no timers, unless it has a flush interval. A flush held back by the network is tried again at the
+// end of the back off or when the reachability changes, not before. An adaptive flush is only scheduled for queued events.
+//
+TEST(MixpanelNetwork, IdleWakeups)
+{
+    Mixpanel mp(mp_token);
+    auto worker = mp.worker;
+    const auto never = std::chrono::steady_clock::time_point::max();
+    auto next_deadline = [&worker]() {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        return worker->timers.next_deadline();
+    };
+    auto wait_for_sender_thread = []() { std::this_thread::sleep_for(std::chrono::milliseconds(200)); };
+
+    mp.set_flush_interval(0);
+    wait_for_sender_thread();
+    ASSERT_EQ(next_deadline(), never);
+
+    mp.set_flush_interval(30);
+    wait_for_sender_thread();
+    ASSERT_GT(next_deadline(), std::chrono::steady_clock::now() + std::chrono::seconds(29));
+    ASSERT_LE(next_deadline(), std::chrono::steady_clock::now() + std::chrono::seconds(30));
+
+    worker->track_health.on_response(503, 300, time(0));
+    mp.track("held back");
+    mp.flush_queue();
+    worker->notify();
+    wait_for_sender_thread();
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        ASSERT_TRUE(worker->timers.is_scheduled(detail::Worker::BackOffTimer));
+        ASSERT_FALSE(worker->send_deferred);
+    }
+
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    mp.flush_queue();
+    wait_for_sender_thread();
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        ASSERT_TRUE(worker->send_deferred);
+        ASSERT_FALSE(worker->timers.is_scheduled(detail::Worker::BackOffTimer));
+    }
+
+    // in adaptive mode, the flush timer only runs while something is queued
+    mp.clear_send_queues();
+    mp.set_adaptive_flush(10, 600, 64 * 1024);
+    wait_for_sender_thread();
+    ASSERT_EQ(next_deadline(), never);
+
+    mp.track("adaptive");
+    wait_for_sender_thread();
+    ASSERT_GT(next_deadline(), std::chrono::steady_clock::now() + std::chrono::seconds(9));
+    ASSERT_LE(next_deadline(), std::chrono::steady_clock::now() + std::chrono::seconds(20));
+
+    mp.clear_send_queues();
+}
+
+//
+// flush_async() completes once the records queued before the call have been acknowledged, records queued later aren't
+// waited for. Offline, it fails at the deadline. The delivery callback gets one report per batch.
+//
+TEST(MixpanelNetwork, FlushAsync)
+{
+    Mixpanel mp(mp_token);
+    auto worker = mp.worker;
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    mp.clear_send_queues();
+
+    // nothing to wait for
+    auto flushed = mp.flush_async(1000);
+    ASSERT_EQ(flushed.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+    ASSERT_TRUE(flushed.get());
+
+    for (int i = 0; i != 3; ++i)
+    {
+        mp.track("before");
+    }
+
+    // the deadline passes while the network is unreachable
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_FALSE(mp.flush_async(300).get());
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(300));
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+
+    std::promise<bool> called_back;
+    mp.flush_async(0, [&called_back](bool flushed) { called_back.set_value(flushed); });
+    ASSERT_FALSE(called_back.get_future().get());
+
+    flushed = mp.flush_async(60000);
+    mp.track("after");
+    mp.track("after");
+    ASSERT_EQ(flushed.wait_for(std::chrono::milliseconds(200)), std::future_status::timeout);
 
-    nanowww::Response failure_response;
-    failure_response.set_status(503);
+    // the worker acknowledges the records like send_batch() does
+    auto acknowledge = [&](std::size_t count) {
+        {
+            std::lock_guard<std::mutex> lock(worker->acknowledgement_mutex);
+            testsuite_get_persistence(mp)->drop_front("track", count);
+            worker->acknowledged_records["track"] += count;
+        }
+        worker->complete_flushes();
+    };
+    acknowledge(2);
+    ASSERT_EQ(flushed.wait_for(std::chrono::seconds(0)), std::future_status::timeout);
+    acknowledge(1);
+    ASSERT_EQ(flushed.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+    ASSERT_TRUE(flushed.get());
+    ASSERT_EQ(testsuite_get_persistence(mp)->get_queue_count("track"), 2u);
 
-    // We need 2 consecutive failures to enable exponential back off
-    worker->parse_www_retry_after(failure_response);
-    ASSERT_EQ(worker->failure_count, 1);
-    worker->parse_www_retry_after(failure_response);
-    ASSERT_EQ(worker->failure_count, 2);
+    // an emptied queue has nothing left to wait for, either
+    flushed = mp.flush_async(60000);
+    mp.clear_send_queues();
+    worker->complete_flushes();
+    ASSERT_TRUE(flushed.get());
 
-    // Followed by 1 success to reset the back off
-    nanowww::Response success_response;
-    success_response.set_status(200);
+    // the records that are evicted to make room for new ones count like the acknowledged ones
+    auto persistence = testsuite_get_persistence(mp);
+    mp.set_overflow_policy("track", Mixpanel::OverflowPolicy::DropOldest);
+    for (int i = 0; i != 3; ++i)
+    {
+        mp.track("event");
+    }
+    flushed = mp.flush_async(60000);
+    persistence->persist_memory_queues();
+    auto record_size = persistence->get_queue_size("track") / 3;
+    mp.set_maximum_queue_size(2 * record_size + record_size / 2);
+    mp.track("event");
+    mp.track("event");
+    persistence->persist_memory_queues();
+    worker->complete_flushes();
+    ASSERT_EQ(persistence->get_queue_count("track"), 2u);
+    ASSERT_EQ(flushed.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+    ASSERT_TRUE(flushed.get());
+    mp.set_overflow_policy("track", Mixpanel::OverflowPolicy::RejectNew);
+    mp.set_maximum_queue_size(5 * 1024 * 1024);
+    mp.clear_send_queues();
 
-    auto retry_after_time = worker->parse_www_retry_after(success_response);
-    ASSERT_EQ(worker->failure_count, 0);
+    std::vector<Mixpanel::BatchDelivery> reports;
+    mp.set_delivery_callback([&reports](const Mixpanel::BatchDelivery& report) { reports.push_back(report); });
+    std::vector<Value> batches(2, Value(detail::Json::arrayValue));
+    batches[0].append("event");
+    batches[0].append("event");
+    batches[1].append("event");
+    std::vector<detail::Worker::Delivery> deliveries(2);
+    deliveries[0].result = {true, ""};
+    deliveries[0].delivered = true;
+    deliveries[0].bytes = 100;
+    deliveries[0].rtt = std::chrono::milliseconds(40);
+    deliveries[1].result = {false, "cancelled"};
+    deliveries[1].bytes = 50;
+    worker->report_deliveries("track", batches, deliveries, 1, 3);
 
-    auto back_off_duration = retry_after_time - time(0);
-    // Back off time should be reset
-    ASSERT_EQ(back_off_duration, 0);
+    ASSERT_EQ(reports.size(), 2u);
+    ASSERT_EQ(reports[0].queue, "track");
+    ASSERT_EQ(reports[0].events, 2u);
+    ASSERT_EQ(reports[0].bytes, 100u);
+    ASSERT_EQ(reports[0].latency, std::chrono::milliseconds(40));
+    ASSERT_TRUE(reports[0].delivered);
+    ASSERT_EQ(reports[0].attempt, 3u);
+    ASSERT_EQ(reports[0].error, "");
+    ASSERT_EQ(reports[1].events, 1u);
+    ASSERT_FALSE(reports[1].delivered);
+    ASSERT_EQ(reports[1].attempt, 1u);
+    ASSERT_EQ(reports[1].error, "cancelled");
 }
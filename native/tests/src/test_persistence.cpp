@@ -1,19 +1,26 @@
 #include <gtest/gtest.h>
 #include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/file_lock.hpp>
 #include <mixpanel/detail/persistence.hpp>
+#include <mixpanel/detail/queue_log.hpp>
 #include <thread>
 #include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "fake_server.hpp"
 
 TEST(Persistence, TestDropFront)
 {
     using namespace mixpanel::detail;
+    Persistence persistence(".");
 
-    Persistence::enqueue("test", 10);
+    persistence.enqueue("test", 10);
 
     for(int i=0; i!=10; ++i)
-        Persistence::drop_front("test", 10000);
+        persistence.drop_front("test", 10000);
 
-    auto queue = Persistence::dequeue("test");
+    auto queue = persistence.dequeue("test");
 
     ASSERT_EQ(queue.first.size(), 0);
 
@@ -21,47 +28,50 @@ TEST(Persistence, TestDropFront)
     obj["key"] = "value";
     for(int i=0; i!=10; ++i)
     {
-        Persistence::enqueue("test", obj);
+        persistence.enqueue("test", obj);
     }
 
-    ASSERT_EQ(Persistence::dequeue("test").first.size(), 10);
+    ASSERT_EQ(persistence.dequeue("test").first.size(), 10);
 
-    Persistence::drop_front("test", 5);
-    ASSERT_EQ(Persistence::dequeue("test").first.size(), 5);
+    persistence.drop_front("test", 5);
+    ASSERT_EQ(persistence.dequeue("test").first.size(), 5);
 
-    Persistence::drop_front("test", 4);
-    ASSERT_EQ(Persistence::dequeue("test").first.size(), 1);
+    persistence.drop_front("test", 4);
+    ASSERT_EQ(persistence.dequeue("test").first.size(), 1);
 
-    Persistence::drop_front("test", 1);
-    ASSERT_EQ(Persistence::dequeue("test").first.size(), 0);
+    persistence.drop_front("test", 1);
+    ASSERT_EQ(persistence.dequeue("test").first.size(), 0);
 
-    Persistence::drop_front("test", 1);
-    ASSERT_EQ(Persistence::dequeue("test").first.size(), 0);
+    persistence.drop_front("test", 1);
+    ASSERT_EQ(persistence.dequeue("test").first.size(), 0);
 
-    Persistence::drop_front("test", 100);
-    ASSERT_EQ(Persistence::dequeue("test").first.size(), 0);
+    persistence.drop_front("test", 100);
+    ASSERT_EQ(persistence.dequeue("test").first.size(), 0);
 
-    ASSERT_TRUE(Persistence::dequeue("test").first.isNull());
-    ASSERT_EQ(Persistence::dequeue("test").first, mixpanel::Value());
+    ASSERT_TRUE(persistence.dequeue("test").first.isNull());
+    ASSERT_EQ(persistence.dequeue("test").first, mixpanel::Value());
 
 }
 
 TEST(Persistence, TestWrite)
 {
     using namespace mixpanel::detail;
+    Persistence persistence(".");
+
     mixpanel::Value obj;
     obj["foo"]="bar";
     obj["baz"]=1234.5678;
     obj["nested"]=22;
 
-    Persistence::write("test2", obj);
-    ASSERT_EQ(Persistence::read("test2"), obj);
+    persistence.write("test2", obj);
+    ASSERT_EQ(persistence.read("test2"), obj);
 }
 
 TEST(Persistence, Corruption)
 {
     using namespace mixpanel::detail;
-    auto file_name = Persistence::get_full_name("test3");
+    Persistence persistence(".");
+    auto file_name = persistence.get_full_name("test3");
 
     {
         std::ofstream ofs(file_name.c_str(), std::ios::binary);
@@ -74,7 +84,27 @@ TEST(Persistence, Corruption)
         ofs.write(garbage.data(), garbage.size());
     }
 
-    ASSERT_NO_THROW(Persistence::read("test3"));
+    ASSERT_NO_THROW(persistence.read("test3"));
+
+    // a queue that starts with a lot of garbage
+    persistence.drop_front("test3", 1000000);
+    for (int i = 0; i != 100000; ++i)
+    {
+        persistence.enqueue_serialized("test3", "{\"i_look_like_json\":\n", mixpanel::Mixpanel::EventPriority::Normal);
+    }
+    persistence.enqueue_serialized("test3", "{\"a\":1}\n", mixpanel::Mixpanel::EventPriority::Normal);
+    persistence.enqueue_serialized("test3", "garbage\n", mixpanel::Mixpanel::EventPriority::Normal);
+    persistence.enqueue_serialized("test3", "{\"a\":2}\n", mixpanel::Mixpanel::EventPriority::Normal);
+
+    auto queue = persistence.dequeue("test3", 50);
+    ASSERT_EQ(queue.first.size(), 1u);
+    ASSERT_EQ(queue.first[0]["a"], 1);
+    ASSERT_EQ(queue.second, 3u);
+    persistence.drop_front("test3", 1);
+    queue = persistence.dequeue("test3", 50);
+    ASSERT_EQ(queue.first.size(), 1u);
+    ASSERT_EQ(queue.first[0]["a"], 2);
+    persistence.drop_front("test3", 1000000);
 }
 
 
@@ -83,13 +113,13 @@ TEST(Persistence, MaxQueueSize)
     using namespace mixpanel;
     using namespace mixpanel::detail;
 
+    FakeServer server;
     mixpanel::Mixpanel mp("012345789");
+    auto persistence = testsuite_get_persistence(mp);
+    mp.set_api_host(server.api_host());
     mp.set_flush_interval(1);
     mp.set_minimum_log_level(Mixpanel::LogEntry::LL_TRACE);
-
-    // drain
-    while(Persistence::get_queue_size("track") > 3)
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    persistence->drop_front("track", 1000000);
 
     mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
 
@@ -98,21 +128,355 @@ TEST(Persistence, MaxQueueSize)
     for(int i=0; i!=5;++i)
        mp.track("event");
 
-    auto size = Persistence::get_queue_size("track");
+    auto size = persistence->get_queue_size("track");
 
     mp.track("event");
 
-    ASSERT_EQ(Persistence::get_queue_size("track"), size);
+    ASSERT_EQ(persistence->get_queue_size("track"), size);
 
     mp.set_maximum_queue_size(1000000000);
 
     mp.track("event");
 
-    ASSERT_GT(Persistence::get_queue_size("track"), size);
+    ASSERT_GT(persistence->get_queue_size("track"), size);
+
+    // the events that were queued are sent
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::ReachableViaLocalAreaNetwork);
+    ASSERT_TRUE(mp.flush_async(5000).get());
+    ASSERT_EQ(persistence->get_queue_size("track"), 0u);
+    ASSERT_FALSE(server.get_events("track").empty());
+}
+
+TEST(Persistence, LegacyQueueMigration)
+{
+    using namespace mixpanel::detail;
+    Persistence persistence(".");
+
+    persistence.drop_front("test4", 1000000);
+
+    {
+        // queues used to be stored as a single json array
+        std::ofstream ofs(persistence.get_full_name("test4").c_str(), std::ios::binary);
+        ofs << "[{\"a\":1},{\"a\":2},{\"a\":3}]";
+    }
+
+    mixpanel::Value obj;
+    obj["a"] = 4;
+    persistence.enqueue("test4", obj);
+
+    auto queue = persistence.dequeue("test4", 10);
+    ASSERT_EQ(queue.second, 4);
+    ASSERT_EQ(queue.first[0]["a"], 1);
+    ASSERT_EQ(queue.first[3]["a"], 4);
+    ASSERT_TRUE(persistence.read("test4").isNull());
+
+    persistence.drop_front("test4", 4);
+    ASSERT_EQ(persistence.get_queue_size("test4"), 0);
+}
+
+TEST(Persistence, MemoryBudget)
+{
+    using namespace mixpanel;
+    using namespace mixpanel::detail;
+
+    mixpanel::Mixpanel mp("012345789");
+    auto persistence = testsuite_get_persistence(mp);
+    // offline first, so the wakeup caused by changing the flush interval doesn't try to send
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    mp.set_flush_interval(1000);
+    persistence->drop_front("track", 1000000);
+
+    std::atomic<int> high_water_calls(0);
+    mp.set_memory_high_water_callback([&high_water_calls](std::size_t) {
+        ++high_water_calls;
+    });
+    mp.set_memory_budget(4096);
+
+    // the memory buffer is accounted in real bytes
+    mp.track("event");
+    auto event_size = persistence->get_memory_queues_size();
+    ASSERT_GT(event_size, 0);
+    ASSERT_EQ(persistence->get_queue_size("track"), event_size);
+
+    for (std::size_t i = 0; i != 4096 / event_size + 1; ++i)
+        mp.track("event");
+
+    // the worker writes the buffer to disk, without waiting for the flush interval
+    auto start = std::chrono::steady_clock::now();
+    while (persistence->get_memory_queues_size() >= 4096 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
+    ASSERT_LT(persistence->get_memory_queues_size(), 4096);
+    ASSERT_GT(persistence->get_queue("track")->count(), 0);
+    ASSERT_GE(high_water_calls, 1);
+
+    mp.set_memory_budget(1024 * 1024);
+    persistence->drop_front("track", 1000000);
     mp.on_reachability_changed(Mixpanel::NetworkReachability::ReachableViaLocalAreaNetwork);
+}
+
+TEST(Persistence, OverflowPolicies)
+{
+    using namespace mixpanel;
+    using namespace mixpanel::detail;
+    Persistence persistence(".");
+
+    const std::string name = "overflow_test";
+
+    // enqueues 100 events, where the odd ones have low priority and sets the maximum queue size to 3/4 of their size
+    auto fill = [&name, &persistence](Mixpanel::OverflowPolicy policy)
+    {
+        persistence.drop_front(name, 1000000);
+        persistence.set_overflow_policy(name, policy);
+        persistence.set_maximum_queue_size(5 * 1024 * 1024);
+        for (int i = 0; i != 100; ++i)
+        {
+            Value o;
+            o["i"] = i;
+            o["padding"] = "0123456789";
+            persistence.enqueue(name, o, (i % 2) ? Mixpanel::EventPriority::Low : Mixpanel::EventPriority::High);
+        }
+        persistence.set_maximum_queue_size(persistence.get_queue_size(name) * 3 / 4);
+    };
+
+    auto queued = [&name, &persistence]()
+    {
+        std::vector<int> ret;
+        for (const auto& o : persistence.dequeue(name, 1000).first)
+        {
+            ret.push_back(o["i"].asInt());
+        }
+        return ret;
+    };
+
+    fill(Mixpanel::OverflowPolicy::RejectNew);
+    Value o;
+    o["i"] = 100;
+    ASSERT_FALSE(persistence.enqueue(name, o));
+    ASSERT_EQ(queued().size(), 100);
+    ASSERT_EQ(persistence.get_queue_stats(name).rejected, 1);
+
+    // the newest events survive
+    fill(Mixpanel::OverflowPolicy::DropOldest);
+    auto events = queued();
+    ASSERT_LT(events.size(), 100);
+    ASSERT_EQ(events.back(), 99);
+    ASSERT_EQ(events.front(), 100 - events.size());
+    ASSERT_EQ(persistence.get_queue_stats(name).evicted, 100 - events.size());
+
+    // every other event survives
+    fill(Mixpanel::OverflowPolicy::Sample);
+    events = queued();
+    ASSERT_EQ(events.size(), 50);
+    for (std::size_t i = 0; i != events.size(); ++i)
+    {
+        ASSERT_EQ(events[i], 2 * i);
+    }
+
+    // the low priority events go first
+    fill(Mixpanel::OverflowPolicy::EvictByPriority);
+    events = queued();
+    ASSERT_EQ(events.size(), 50);
+    for (auto i : events)
+    {
+        ASSERT_EQ(i % 2, 0);
+    }
+
+    persistence.set_overflow_policy(name, Mixpanel::OverflowPolicy::RejectNew);
+    persistence.set_maximum_queue_size(5 * 1024 * 1024);
+    persistence.drop_front(name, 1000000);
+}
+
+//
+// The acknowledgement of a batch drops the records it was dequeued with: events that are enqueued while the batch is in
+// flight don't evict any records of the queue until then, whatever the policy.
+//
+TEST(Persistence, OverflowWhileInFlight)
+{
+    using namespace mixpanel;
+    using namespace mixpanel::detail;
+    Persistence persistence(".");
+
+    const std::string name = "overflow_in_flight_test";
+    const Mixpanel::OverflowPolicy policies[] = {
+        Mixpanel::OverflowPolicy::DropOldest, Mixpanel::OverflowPolicy::Sample, Mixpanel::OverflowPolicy::EvictByPriority
+    };
+    for (auto policy : policies)
+    {
+        persistence.drop_front(name, 1000000);
+        persistence.set_overflow_policy(name, policy);
+        persistence.set_maximum_queue_size(5 * 1024 * 1024);
+
+        auto enqueue = [&name, &persistence](int from, int to)
+        {
+            for (int i = from; i != to; ++i)
+            {
+                Value o;
+                o["i"] = i;
+                o["padding"] = "0123456789";
+                persistence.enqueue(name, o, (i % 2) ? Mixpanel::EventPriority::Low : Mixpanel::EventPriority::High);
+            }
+        };
+        enqueue(0, 40);
+        auto batch = persistence.dequeue(name, 10).first;
+        ASSERT_EQ(batch.size(), 10u);
+        auto evicted = persistence.get_queue_stats(name).evicted;
+
+        // the queue overflows while the batch is in flight, and another queue is written to disk
+        persistence.set_maximum_queue_size(persistence.get_queue_size(name) * 3 / 4);
+        enqueue(40, 50);
+        persistence.dequeue("overflow_in_flight_other", 1);
+        ASSERT_EQ(persistence.get_queue_count(name), 50u);
+        ASSERT_EQ(persistence.get_queue_stats(name).evicted, evicted);
+
+        // the acknowledgement drops the batch, and the policy makes room among the records that haven't been sent
+        persistence.drop_front(name, batch.size());
+        auto queued = persistence.dequeue(name, 1000).first;
+        evicted = persistence.get_queue_stats(name).evicted - evicted;
+        ASSERT_GT(evicted, 0u);
+        ASSERT_EQ(queued.size() + evicted, 40u);
+        ASSERT_LE(persistence.get_queue_size(name), persistence.maximum_queue_size);
+        for (const auto& o : queued)
+        {
+            ASSERT_GE(o["i"].asInt(), 10);
+        }
+        if (policy == Mixpanel::OverflowPolicy::DropOldest)
+        {
+            ASSERT_EQ(queued[0]["i"].asInt(), 50 - static_cast<int>(queued.size()));
+            ASSERT_EQ(queued[queued.size() - 1]["i"].asInt(), 49);
+        }
+        if (policy == Mixpanel::OverflowPolicy::EvictByPriority)
+        {
+            for (const auto& o : queued)
+            {
+                ASSERT_EQ(o["i"].asInt() % 2, 0);
+            }
+        }
+    }
+
+    persistence.set_overflow_policy(name, Mixpanel::OverflowPolicy::RejectNew);
+    persistence.set_maximum_queue_size(5 * 1024 * 1024);
+    persistence.drop_front(name, 1000000);
+}
+
+TEST(Persistence, MaxEventAge)
+{
+    using namespace mixpanel;
+    using namespace mixpanel::detail;
+    Persistence persistence(".");
+
+    const std::string name = "max_event_age_test";
+    persistence.drop_front(name, 1000000);
+    persistence.set_max_event_age(name, 1);
+
+    RecordHeader header;
+    header.time = std::time(nullptr) - 2 * 24 * 60 * 60;
+    std::string data;
+    for (int i = 0; i != 3; ++i)
+        data += header.encode() + "{\"i\":" + std::to_string(i) + "}\n";
+    persistence.get_queue(name)->append(data, 3);
+
+    for (int i = 3; i != 5; ++i)
+    {
+        Value o;
+        o["i"] = i;
+        persistence.enqueue(name, o);
+    }
+
+    auto batch = persistence.dequeue(name);
+    ASSERT_EQ(batch.first.size(), 2);
+    ASSERT_EQ(batch.first[0]["i"].asInt(), 3);
+    ASSERT_EQ(persistence.get_queue_stats(name).expired, 3);
+
+    persistence.set_max_event_age(name, 0);
+    persistence.drop_front(name, 1000000);
+}
+
+TEST(Persistence, DeadLetters)
+{
+    using namespace mixpanel;
+    using namespace mixpanel::detail;
+    Persistence persistence(".");
+
+    const std::string name = "dead_letter_test";
+    persistence.clear_dead_letters(name);
+    ASSERT_EQ(persistence.read_dead_letters(name), "");
+
+    Value bad;
+    bad["event"] = "bad";
+    persistence.dead_letter(name, {std::make_pair(bad, "invalid event"), std::make_pair(bad, "invalid event")});
 
-    // drain
-    while(Persistence::get_queue_size("track") > 3)
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    Json::Reader reader;
+    std::istringstream lines(persistence.read_dead_letters(name));
+    std::string line;
+    int count = 0;
+    while (std::getline(lines, line))
+    {
+        Value entry;
+        ASSERT_TRUE(reader.parse(line, entry, false));
+        ASSERT_EQ(entry["error"].asString(), "invalid event");
+        ASSERT_EQ(entry["record"]["event"].asString(), "bad");
+        ASSERT_GT(entry["time"].asInt64(), 0);
+        ++count;
+    }
+    ASSERT_EQ(count, 2);
+
+    // the file doesn't grow beyond its maximum, the records are counted nonetheless
+    Value huge;
+    huge["event"] = std::string(Persistence::max_dead_letter_size, 'x');
+    persistence.dead_letter(name, {std::make_pair(huge, "too large")});
+    ASSERT_LT(persistence.read_dead_letters(name).size(), Persistence::max_dead_letter_size);
+    ASSERT_EQ(persistence.get_queue_stats(name).dead_lettered, 3u);
+    ASSERT_EQ(persistence.get_queue_stats(name).dead_letters_dropped, 1u);
+
+    persistence.clear_dead_letters(name);
+    ASSERT_EQ(persistence.read_dead_letters(name), "");
+}
+
+TEST(Persistence, MultiProcess)
+{
+    using namespace mixpanel;
+    using namespace mixpanel::detail;
+
+    // two instances on the same directory lock the queues against each other just like two processes do
+    const std::string directory = "./mp_multi_process_test";
+    Persistence producer(directory);
+    Persistence uploader(directory);
+    producer.set_multi_process(true);
+    uploader.set_multi_process(true);
+    uploader.drop_front("track", 1000000);
+
+    Value o;
+    for (int i = 0; i != 10; ++i)
+    {
+        o["i"] = i;
+        producer.enqueue("track", o);
+    }
+    producer.persist_memory_queues();
+
+    auto batch = uploader.dequeue("track", 8);
+    ASSERT_EQ(batch.first.size(), 8);
+    ASSERT_EQ(batch.second, 10);
+
+    // the producer keeps appending while the batch is sent
+    o["i"] = 10;
+    producer.enqueue("track", o);
+    producer.persist_memory_queues();
+    uploader.drop_front("track", batch.first.size());
+
+    batch = uploader.dequeue("track");
+    ASSERT_EQ(batch.first.size(), 3);
+    ASSERT_EQ(batch.first[0]["i"].asInt(), 8);
+    ASSERT_EQ(batch.first[2]["i"].asInt(), 10);
+    producer.drop_front("track", 1);
+    ASSERT_EQ(uploader.dequeue("track").first.size(), 2);
+    uploader.drop_front("track", 1000000);
+
+    // only one process gets the uploader lease, until it releases it
+    FileLock first_lease(directory + "/mp_uploader.lock");
+    FileLock second_lease(directory + "/mp_uploader.lock");
+    ASSERT_TRUE(first_lease.try_lock());
+    ASSERT_FALSE(second_lease.try_lock());
+    first_lease.unlock();
+    ASSERT_TRUE(second_lease.try_lock());
 }
@@ -0,0 +1,307 @@
+#include <gtest/gtest.h>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/io_engine.hpp>
+#include <mixpanel/detail/queue_log.hpp>
+#include <mixpanel/detail/workarounds.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace mixpanel::detail;
+
+static std::string record(int i)
+{
+    return "{\"i\":" + std::to_string(i) + "}\n";
+}
+
+static std::vector<std::unique_ptr<IOEngine>> all_engines()
+{
+    std::vector<std::unique_ptr<IOEngine>> engines;
+    engines.push_back(std::unique_ptr<IOEngine>(new PortableIOEngine()));
+    #if defined(MIXPANEL_USE_IO_URING)
+    if (auto engine = create_io_uring_engine())
+    {
+        engines.push_back(std::move(engine));
+    }
+    #endif
+    return engines;
+}
+
+TEST(QueueLog, IOEngine)
+{
+    for (auto& io : all_engines())
+    {
+        SCOPED_TRACE(io->name());
+        const std::string path = std::string("./mp_io_engine_test_") + io->name();
+        io->remove(path);
+
+        std::string data;
+        ASSERT_FALSE(io->read(path, 0, 100, data));
+        ASSERT_EQ(io->size(path), 0);
+
+        io->append(path, "hello ");
+        io->append(path, std::string(200 * 1024, 'x'));
+        io->append(path, "world");
+        ASSERT_EQ(io->size(path), 6 + 200 * 1024 + 5);
+
+        ASSERT_TRUE(io->read(path, 0, 6, data));
+        ASSERT_EQ(data, "hello ");
+        ASSERT_TRUE(io->read(path, 6 + 200 * 1024, 100, data));
+        ASSERT_EQ(data, "world");
+
+        io->write(path, "replaced");
+        io->sync(path);
+        ASSERT_TRUE(io->read(path, 0, 100, data));
+        ASSERT_EQ(data, "replaced");
+
+        io->remove(path);
+        ASSERT_FALSE(io->read(path, 0, 100, data));
+    }
+}
+
+TEST(QueueLog, AppendFrontDrop)
+{
+    for (auto& io : all_engines())
+    {
+        SCOPED_TRACE(io->name());
+        QueueLog(*io, ".", "queue_log_test").clear();
+
+        QueueLog queue(*io, ".", "queue_log_test");
+        ASSERT_TRUE(queue.empty());
+        ASSERT_EQ(queue.front(50).size(), 0);
+
+        std::string data;
+        for (int i = 0; i != 10; ++i) data += record(i);
+        queue.append(data, 10);
+        ASSERT_EQ(queue.count(), 10);
+        ASSERT_EQ(queue.size(), data.size());
+
+        auto front = queue.front(3);
+        ASSERT_EQ(front.size(), 3);
+        ASSERT_EQ(front[0], record(0));
+        ASSERT_EQ(front[2], record(2));
+
+        queue.drop_front(3);
+        ASSERT_EQ(queue.count(), 7);
+        ASSERT_EQ(queue.front(1)[0], record(3));
+
+        // dropping more than we have read before
+        queue.drop_front(5);
+        ASSERT_EQ(queue.front(50).size(), 2);
+        ASSERT_EQ(queue.front(50)[0], record(8));
+
+        queue.drop_front(100);
+        ASSERT_TRUE(queue.empty());
+        ASSERT_EQ(queue.size(), 0);
+    }
+}
+
+TEST(QueueLog, SegmentsAndReload)
+{
+    for (auto& io : all_engines())
+    {
+        SCOPED_TRACE(io->name());
+        QueueLog(*io, ".", "queue_log_segments").clear();
+
+        const int n = 60000; // enough for a couple of segments
+        {
+            QueueLog queue(*io, ".", "queue_log_segments");
+            for (int i = 0; i != n; i += 100)
+            {
+                std::string data;
+                for (int j = i; j != i + 100; ++j) data += record(j);
+                queue.append(data, 100);
+            }
+            ASSERT_GT(queue.size(), 2 * QueueLog::segment_size);
+
+            queue.drop_front(25000);
+            io->sync("./mp_queue_log_segments.0.log");
+        }
+
+        QueueLog queue(*io, ".", "queue_log_segments");
+        ASSERT_EQ(queue.count(), n - 25000);
+        ASSERT_EQ(queue.front(1)[0], record(25000));
+
+        // the first segment has been read completely, so it must be gone
+        std::string data;
+        ASSERT_FALSE(io->read("./mp_queue_log_segments.0.log", 0, 1, data));
+
+        int expected = 25000;
+        while (!queue.empty())
+        {
+            auto records = queue.front(50);
+            ASSERT_FALSE(records.empty());
+            for (const auto& r : records)
+            {
+                ASSERT_EQ(r, record(expected++));
+            }
+            queue.drop_front(records.size());
+        }
+        ASSERT_EQ(expected, n);
+    }
+}
+
+TEST(QueueLog, TornWrite)
+{
+    PortableIOEngine io;
+    QueueLog(io, ".", "queue_log_torn").clear();
+
+    {
+        QueueLog queue(io, ".", "queue_log_torn");
+        queue.append(record(1) + record(2), 2);
+    }
+
+    // simulate a crash in the middle of an append
+    io.append("./mp_queue_log_torn.0.log", "{\"i\":3");
+
+    QueueLog queue(io, ".", "queue_log_torn");
+    ASSERT_EQ(queue.count(), 2);
+    queue.append(record(4), 1);
+
+    auto records = queue.front(50);
+    ASSERT_EQ(records.size(), 3);
+    ASSERT_EQ(records[2], record(4));
+    queue.clear();
+}
+
+TEST(QueueLog, Eviction)
+{
+    PortableIOEngine io;
+    QueueLog(io, ".", "queue_log_eviction").clear();
+    QueueLog queue(io, ".", "queue_log_eviction");
+
+    // odd records have low priority
+    std::string data;
+    for (int i = 0; i != 10; ++i)
+    {
+        RecordHeader header;
+        header.priority = (i % 2) ? 0 : 2;
+        data += header.encode() + record(i);
+    }
+    queue.append(data, 10);
+    queue.drop_front(1);
+
+    ASSERT_EQ(queue.evict_lowest_priority(), 5);
+    ASSERT_EQ(queue.count(), 4);
+    ASSERT_EQ(queue.evict_lowest_priority(), 0);
+
+    auto records = queue.front(50);
+    ASSERT_EQ(records.size(), 4);
+    RecordHeader header;
+    ASSERT_EQ(std::string(header.parse(records[0].data(), records[0].data() + records[0].size())), record(2));
+    ASSERT_EQ(header.priority, 2);
+
+    // every other record goes
+    ASSERT_EQ(queue.thin_out(), 2);
+    records = queue.front(50);
+    ASSERT_EQ(records.size(), 2);
+    ASSERT_EQ(std::string(header.parse(records[1].data(), records[1].data() + records[1].size())), record(6));
+
+    // records without a header have normal priority
+    ASSERT_EQ(std::string(header.parse(record(1).data(), record(1).data() + record(1).size())), record(1));
+    ASSERT_EQ(header.priority, RecordHeader::normal_priority);
+
+    // the counts survive a reload
+    QueueLog reloaded(io, ".", "queue_log_eviction");
+    ASSERT_EQ(reloaded.count(), 2);
+    ASSERT_EQ(reloaded.size(), queue.size());
+
+    // thinning closed the segment that was appended to, the next record goes to a new one
+    queue.append(record(10), 1);
+    records = queue.front(50);
+    ASSERT_EQ(records.size(), 3);
+    ASSERT_EQ(records[2], record(10));
+    ASSERT_EQ(QueueLog(io, ".", "queue_log_eviction").count(), 3);
+    queue.clear();
+}
+
+TEST(QueueLog, Expire)
+{
+    PortableIOEngine io;
+    QueueLog(io, ".", "queue_log_expire").clear();
+    QueueLog queue(io, ".", "queue_log_expire");
+
+    // a segment full of old records, followed by new ones
+    RecordHeader old_header;
+    old_header.time = 1000;
+    int i = 0;
+    while (queue.size() < QueueLog::segment_size)
+    {
+        std::string data;
+        for (int j = 0; j != 100; ++j) data += old_header.encode() + record(i++);
+        queue.append(data, 100);
+    }
+
+    RecordHeader new_header;
+    new_header.time = 2000;
+    queue.append(new_header.encode() + record(i), 1);
+    ASSERT_EQ(queue.count(), i + 1);
+
+    ASSERT_EQ(queue.expire(1000), 0);
+    ASSERT_EQ(queue.expire(1500), i);
+    ASSERT_EQ(queue.count(), 1);
+    ASSERT_EQ(queue.size(), (new_header.encode() + record(i)).size());
+
+    RecordHeader header;
+    auto records = queue.front(50);
+    ASSERT_EQ(records.size(), 1);
+    header.parse(records[0].data(), records[0].data() + records[0].size());
+    ASSERT_EQ(header.time, 2000);
+
+    // the newest segment expires as well
+    ASSERT_EQ(queue.expire(3000), 1);
+    ASSERT_TRUE(queue.empty());
+    queue.append(record(0), 1);
+    ASSERT_EQ(QueueLog(io, ".", "queue_log_expire").count(), 1);
+    queue.clear();
+}
+
+TEST(QueueLog, SharedQueue)
+{
+    // two QueueLogs on the same queue, like two processes would use it
+    PortableIOEngine io;
+    QueueLog(io, ".", "queue_log_shared").clear();
+    QueueLog producer(io, ".", "queue_log_shared");
+    QueueLog consumer(io, ".", "queue_log_shared");
+
+    // appends, also into new segments
+    int n = 0;
+    while (producer.size() < 2 * QueueLog::segment_size)
+    {
+        std::string data;
+        for (int j = 0; j != 100; ++j) data += record(n++);
+        producer.append(data, 100);
+    }
+    consumer.refresh();
+    ASSERT_EQ(consumer.count(), n);
+    ASSERT_EQ(consumer.size(), producer.size());
+
+    // drops from the front, also of whole segments. The producer appends in between.
+    auto records = consumer.front(n - 50);
+    consumer.drop_front(records.size());
+    producer.refresh();
+    producer.append(record(n++), 1);
+    consumer.refresh();
+    ASSERT_EQ(producer.count(), 51);
+    ASSERT_EQ(consumer.count(), 51);
+    ASSERT_EQ(consumer.size(), producer.size());
+    ASSERT_EQ(consumer.front(1)[0], record(n - 51));
+
+    // eviction can't be followed incrementally
+    producer.refresh();
+    ASSERT_GT(producer.thin_out(), 0);
+    consumer.refresh();
+    ASSERT_EQ(consumer.count(), producer.count());
+    ASSERT_EQ(consumer.size(), producer.size());
+
+    // a batch that has been cleared by the other side while it was sent is not dropped again
+    records = consumer.front(10);
+    producer.refresh();
+    producer.clear();
+    producer.append(record(0), 1);
+    consumer.refresh();
+    consumer.drop_front(records.size());
+    ASSERT_EQ(consumer.count(), 1);
+    ASSERT_EQ(consumer.front(1)[0], record(0));
+    consumer.clear();
+}
@@ -4,9 +4,10 @@
 #include <mixpanel/detail/workarounds.hpp>
 #include <thread>
 
+#include "fake_server.hpp"
 #include "test_config.hpp"
 
-void testsuite_wait_for_delivery(const std::string &queue_name, long for_seconds);
+void testsuite_wait_for_delivery(mixpanel::Mixpanel& mixpanel, const std::string &queue_name, long for_seconds);
 
 namespace mixpanel
 {
@@ -25,13 +26,15 @@ TEST(Mixpanel, SetPushId)
     using namespace mixpanel;
     using namespace mixpanel::detail;
 
+    FakeServer server;
     delivery_failure_flag = false;
     mixpanel::Mixpanel mp(mp_token);
+    mp.set_api_host(server.api_host());
     mp.set_flush_interval(1);
     mp.set_minimum_log_level(Mixpanel::LogEntry::LL_TRACE);
 
     mp.people.set_push_id("this-is-a-fake-test-push-id");
 
-    testsuite_wait_for_delivery("engage", 0);
+    testsuite_wait_for_delivery(mp, "engage", 0);
     ASSERT_FALSE(delivery_failure_flag);
 }
@@ -0,0 +1,103 @@
+#ifndef WIN32
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/connection_pool.hpp>
+#include <mixpanel/detail/persistence.hpp>
+#include <mixpanel/detail/queue_log.hpp>
+#include "test_config.hpp"
+
+using namespace mixpanel;
+
+//
+// The events in memory go to disk right away, the rest is kept for the next launch. Offline, shutdown() returns at once.
+//
+TEST(Mixpanel, Shutdown)
+{
+    {
+        Mixpanel mp(mp_token);
+        auto persistence = testsuite_get_persistence(mp);
+        mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+        persistence->drop_front("track", 1000000);
+
+        for (int i = 0; i != 10; ++i)
+        {
+            mp.track("kept");
+        }
+        ASSERT_GT(persistence->get_memory_queues_size(), 0u);
+
+        auto start = std::chrono::steady_clock::now();
+        ASSERT_FALSE(mp.shutdown(2000));
+        ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+        ASSERT_EQ(persistence->get_memory_queues_size(), 0u);
+        ASSERT_EQ(persistence->get_queue("track")->count(), 10u);
+
+        // tracked after the shutdown, the destructor writes it to disk
+        mp.track("late");
+    }
+
+    Mixpanel mp(mp_token);
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    auto persistence = testsuite_get_persistence(mp);
+    ASSERT_EQ(persistence->get_queue("track")->count(), 11u);
+    persistence->drop_front("track", 1000000);
+}
+
+//
+// A request to a server that never answers is interrupted by the cancellation and no further request goes out.
+//
+TEST(MixpanelNetwork, Cancellation)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    listen(listener, 4);
+    getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length);
+    auto url = "http://127.0.0.1:" + std::to_string(ntohs(address.sin_port)) + "/track/";
+
+    detail::ConnectionPool pool;
+    detail::ConnectionPool::Cancellation cancellation;
+
+    std::atomic<bool> returned(false);
+    bool result = true;
+    std::string error;
+    std::thread request_thread([&]() {
+        nanowww::Request request("POST", url, "data=e30=");
+        nanowww::Response response;
+        result = pool.send_request(request, response, error, &cancellation);
+        returned = true;
+    });
+
+    // the connection is accepted by the kernel, but the request is never read
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ASSERT_FALSE(returned);
+
+    auto start = std::chrono::steady_clock::now();
+    cancellation.cancel();
+    request_thread.join();
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+    ASSERT_FALSE(result);
+    ASSERT_EQ(error.find("cancelled"), 0u) << error;
+
+    nanowww::Request request("POST", url, "data=e30=");
+    nanowww::Response response;
+    ASSERT_FALSE(pool.send_request(request, response, error, &cancellation));
+    ASSERT_EQ(error, "cancelled");
+
+    close(listener);
+}
+
+#endif
@@ -0,0 +1,139 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/metrics.hpp>
+#include <mixpanel/detail/simulation.hpp>
+#include "test_config.hpp"
+
+using namespace mixpanel;
+
+namespace
+{
+    using Request = detail::Simulation::Request;
+    using Response = detail::Simulation::Response;
+
+    // sends what earlier tests left in the queues
+    void drain(Mixpanel& mp, detail::Simulation& simulation)
+    {
+        mp.flush_async(1000);
+        simulation.run_for(std::chrono::seconds(1));
+    }
+}
+
+//
+// The percentiles come from buckets that double in width, they are within a factor of two of the actual values.
+//
+TEST(Stats, Histogram)
+{
+    detail::Histogram histogram;
+    ASSERT_EQ(histogram.snapshot().count, 0u);
+
+    for (std::uint64_t i = 1; i <= 1000; ++i)
+    {
+        histogram.record(i);
+    }
+    histogram.record(std::chrono::milliseconds(10));
+
+    auto stats = histogram.snapshot();
+    ASSERT_EQ(stats.count, 1001u);
+    ASSERT_EQ(stats.max, 10000u);
+    ASSERT_NEAR(stats.mean, (500500.0 + 10000.0) / 1001, 0.001);
+    ASSERT_GE(stats.p50, 250u);
+    ASSERT_LE(stats.p50, 1000u);
+    ASSERT_GE(stats.p99, 495u);
+    ASSERT_LE(stats.p99, 1980u);
+    ASSERT_LE(stats.p50, stats.p90);
+    ASSERT_LE(stats.p90, stats.p99);
+}
+
+//
+// The pipeline counts what it enqueues, sends and writes to disk, and how long it takes.
+//
+TEST(Stats, Pipeline)
+{
+    Mixpanel mp(mp_token);
+    mp.set_flush_interval(60);
+    detail::Simulation simulation(mp);
+    drain(mp, simulation);
+    auto before = mp.get_stats();
+
+    std::atomic<int> track_requests(0);
+    simulation.set_server([&track_requests](const Request& request) {
+        return Response((request.endpoint == "track" && track_requests++ < 2) ? 503 : 200);
+    });
+    for (int i = 0; i != 10; ++i)
+    {
+        mp.track("counted");
+    }
+    mp.people.set("$name", "Tina Tester");
+
+    auto queued = mp.get_stats();
+    ASSERT_EQ(queued.events_enqueued - before.events_enqueued, 11u);
+    ASSERT_EQ(queued.enqueue_latency.count - before.enqueue_latency.count, 11u);
+    ASSERT_EQ(queued.queue_records, 11u);
+    ASSERT_GT(queued.queue_bytes, 0u);
+    ASSERT_GT(queued.memory_buffer_bytes, 0u);
+
+    // two failures back off, the probe after that delivers the events
+    mp.flush_async(1000);
+    simulation.run_for(std::chrono::minutes(5));
+    auto sent = mp.get_stats();
+    ASSERT_EQ(sent.queue_records, 0u);
+    ASSERT_EQ(sent.memory_buffer_bytes, 0u);
+    ASSERT_EQ(sent.batches_failed - before.batches_failed, 2u);
+    ASSERT_GE(sent.batches_sent - before.batches_sent, 4u);
+    ASSERT_GE(sent.retries - before.retries, 2u);
+    ASSERT_GE(sent.back_off_seconds - before.back_off_seconds, 120u);
+    ASSERT_GT(sent.bytes_sent, before.bytes_sent);
+    ASSERT_EQ(sent.round_trip.count - before.round_trip.count, sent.batches_sent - before.batches_sent);
+    ASSERT_GT(sent.persistence_bytes_written, before.persistence_bytes_written);
+    ASSERT_GT(sent.persistence_bytes_read, before.persistence_bytes_read);
+    ASSERT_GT(sent.persistence_write_latency.count, before.persistence_write_latency.count);
+}
+
+//
+// The stats are exported every interval, to a callback or as lines of JSON to a file.
+//
+TEST(Stats, Export)
+{
+    Mixpanel mp(mp_token);
+    detail::Simulation simulation(mp);
+
+    std::vector<Mixpanel::Stats> exported;
+    mp.set_stats_export(60, [&exported](const Mixpanel::Stats& stats) {
+        exported.push_back(stats);
+    });
+    mp.track("exported");
+    simulation.run_for(std::chrono::seconds(150));
+    ASSERT_EQ(exported.size(), 2u);
+    ASSERT_GE(exported.back().events_enqueued, 1u);
+
+    const std::string path = "./mp_stats_export_test.json";
+    std::remove(path.c_str());
+    mp.set_stats_export(30, path);
+    simulation.run_for(std::chrono::seconds(100));
+    mp.set_stats_export(0, path);
+    simulation.run_for(std::chrono::seconds(100));
+    ASSERT_EQ(exported.size(), 2u);
+
+    std::ifstream file(path);
+    std::string line;
+    unsigned lines = 0;
+    for (; std::getline(file, line); ++lines)
+    {
+        Value stats;
+        detail::Json::Reader reader;
+        ASSERT_TRUE(reader.parse(line, stats, false));
+        ASSERT_GE(stats["events_enqueued"].asUInt64(), 1u);
+        ASSERT_TRUE(stats["round_trip_us"].isMember("p99"));
+        ASSERT_NE(stats["time"].asInt64(), 0);
+    }
+    ASSERT_EQ(lines, 3u);
+    file.close();
+    std::remove(path.c_str());
+}
@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/persistence.hpp>
+
+TEST(Mixpanel, TrackAs)
+{
+    using namespace mixpanel;
+
+    Mixpanel mp("track_as_token", std::string("server"), ".");
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    mp.register_("shard", "eu-1");
+
+    auto persistence = testsuite_get_persistence(mp);
+    persistence->drop_front("track", 1000000);
+    persistence->drop_front("engage", 1000000);
+
+    const int thread_count = 4;
+    const int players = 50;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i != thread_count; ++i)
+    {
+        threads.emplace_back([&mp, i, players]() {
+            for (int j = 0; j != players; ++j)
+            {
+                auto player = "player_" + std::to_string(i) + "_" + std::to_string(j);
+                Value properties;
+                properties["level"] = j;
+                properties["distinct_id"] = "ignored";
+                mp.track_as(player, "level up", properties);
+                mp.people_as(player).set("level", j);
+            }
+        });
+    }
+    // super properties can change while other threads track
+    threads.emplace_back([&mp]() {
+        for (int j = 0; j != 20; ++j)
+        {
+            mp.register_("round", j);
+        }
+    });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    // the instance is still the server
+    ASSERT_EQ(persistence->read("state")["distinct_id"].asString(), "server");
+
+    auto events = persistence->dequeue("track", 1000);
+    ASSERT_EQ(events.first.size(), thread_count * players);
+    std::map<std::string, int> seen;
+    for (const auto& event : events.first)
+    {
+        const auto& properties = event["properties"];
+        auto player = properties["distinct_id"].asString();
+        ASSERT_EQ(player.find("player_"), 0);
+        ASSERT_EQ(properties["level"].asInt(), std::stoi(player.substr(player.rfind('_') + 1)));
+        ASSERT_EQ(properties["token"].asString(), "track_as_token");
+        ASSERT_EQ(properties["shard"].asString(), "eu-1");
+        ASSERT_TRUE(properties["time"].isIntegral());
+        ASSERT_TRUE(properties.isMember("$wifi"));
+        ++seen[player];
+    }
+    ASSERT_EQ(seen.size(), thread_count * players);
+
+    auto profile_updates = persistence->dequeue("engage", 1000);
+    ASSERT_EQ(profile_updates.first.size(), thread_count * players);
+    for (const auto& update : profile_updates.first)
+    {
+        auto player = update["$distinct_id"].asString();
+        ASSERT_EQ(seen.count(player), 1);
+        ASSERT_EQ(update["$set"]["level"].asInt(), std::stoi(player.substr(player.rfind('_') + 1)));
+        ASSERT_EQ(update["$set"]["shard"].asString(), "eu-1");
+    }
+
+    ASSERT_THROW(mp.track_as("", "event"), std::invalid_argument);
+    ASSERT_THROW(mp.people_as(""), std::invalid_argument);
+
+    persistence->drop_front("track", 1000000);
+    persistence->drop_front("engage", 1000000);
+    mp.clear_super_properties();
+}
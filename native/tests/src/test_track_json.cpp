@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <mixpanel/mixpanel.hpp>
+#include <mixpanel/detail/persistence.hpp>
+
+TEST(Mixpanel, TrackJson)
+{
+    using namespace mixpanel;
+
+    Mixpanel mp("track_json_token", std::string("track_json_user"), ".");
+    mp.on_reachability_changed(Mixpanel::NetworkReachability::NotReachable);
+    mp.register_("plan", "premium");
+    mp.register_("level", 1);
+
+    auto persistence = testsuite_get_persistence(mp);
+    persistence->drop_front("track", 1000000);
+
+    // the event gets stamped
+    ASSERT_TRUE(mp.track_json("{\"event\":\"purchase\",\"properties\":{\"price\":10}}"));
+    // properties the event already has win
+    ASSERT_TRUE(mp.track_json(" {\"properties\":{\"level\":5,\"time\":1234,\"distinct_id\":\"other\"},\"event\":\"level up\"}\n"));
+    // events without properties get them
+    ASSERT_TRUE(mp.track_json("{\"event\":\"open\"}"));
+    ASSERT_TRUE(mp.track_json("{\"event\":\"close\",\"properties\":{}}"));
+
+    ASSERT_FALSE(mp.track_json(""));
+    ASSERT_FALSE(mp.track_json("[]"));
+    ASSERT_FALSE(mp.track_json("{\"properties\":{}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":1}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":[]}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\""));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\"} trailing"));
+    ASSERT_FALSE(mp.track_json(std::string(100, '[') + std::string(100, ']')));
+
+    // the scalars follow the JSON grammar, so the queue only holds records that parse again
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":{\"a\":foo}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":{\"a\":NaN}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":{\"a\":1.2.3}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":{\"a\":01}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":{\"a\":1.}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\",\"properties\":{\"a\":truely}}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\tb\"}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\\xb\"}"));
+    ASSERT_FALSE(mp.track_json("{\"event\":\"a\\u12\"}"));
+
+    auto queue = persistence->dequeue("track", 100);
+    ASSERT_EQ(queue.first.size(), 4);
+
+    const auto& purchase = queue.first[0];
+    ASSERT_EQ(purchase["event"].asString(), "purchase");
+    ASSERT_EQ(purchase["properties"]["price"].asInt(), 10);
+    ASSERT_EQ(purchase["properties"]["token"].asString(), "track_json_token");
+    ASSERT_EQ(purchase["properties"]["distinct_id"].asString(), "track_json_user");
+    ASSERT_TRUE(purchase["properties"]["time"].isIntegral());
+    ASSERT_EQ(purchase["properties"]["plan"].asString(), "premium");
+    ASSERT_EQ(purchase["properties"]["level"].asInt(), 1);
+    ASSERT_EQ(purchase["properties"]["mp_lib"].asString(), "unity");
+
+    const auto& level_up = queue.first[1];
+    ASSERT_EQ(level_up["event"].asString(), "level up");
+    ASSERT_EQ(level_up["properties"]["level"].asInt(), 5);
+    ASSERT_EQ(level_up["properties"]["time"].asInt(), 1234);
+    ASSERT_EQ(level_up["properties"]["distinct_id"].asString(), "other");
+    ASSERT_EQ(level_up["properties"]["plan"].asString(), "premium");
+
+    for (int i = 2; i != 4; ++i)
+    {
+        ASSERT_EQ(queue.first[i]["properties"]["token"].asString(), "track_json_token");
+        ASSERT_EQ(queue.first[i]["properties"]["plan"].asString(), "premium");
+    }
+
+    // super properties that change later are picked up
+    mp.unregister("plan");
+    ASSERT_TRUE(mp.track_json("{\"event\":\"purchase\"}"));
+    queue = persistence->dequeue("track", 100);
+    ASSERT_EQ(queue.first.size(), 5);
+    ASSERT_FALSE(queue.first[4]["properties"].isMember("plan"));
+
+    ASSERT_TRUE(mp.track_json("{\"event\":\"scalars\",\"properties\":{\"a\":[true,false,null],\"b\":-0.5e+3,\"c\":0,\"d\":\"tab\\t\\u00e9\\\"\"}}"));
+    queue = persistence->dequeue("track", 100);
+    ASSERT_EQ(queue.first.size(), 6);
+    ASSERT_EQ(queue.first[5]["properties"]["b"].asDouble(), -500);
+    ASSERT_EQ(queue.first[5]["properties"]["d"].asString(), "tab\t\xc3\xa9\"");
+
+    persistence->drop_front("track", 1000000);
+    mp.clear_super_properties();
+}